@@ -19,10 +19,136 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              cmb_memdev=<backend_id[optional]>, \
+ *              pmrdev=<backend_id[optional]>, \
+ *              subsys=<subsys_id[optional]>, ana_optimized=<on|off[optional]>, \
+ *              sriov_max_vfs=<N[optional]>, sriov_vq_flexible=<N[optional]>, \
+ *              sriov_vi_flexible=<N[optional]>, \
+ *              sriov_max_vq_per_vf=<N[optional]>, \
+ *              sriov_max_vi_per_vf=<N[optional]>, pf=<id[optional]>, \
+ *              num_queues=<N[optional]>, lbaf=<N[optional]>, \
+ *              pi=<N[optional]>, pil=<on|off[optional]>, \
+ *              zoned=<on|off[optional]>, zone_size=<size[optional]>, \
+ *              max_open_zones=<N[optional]>, max_active_zones=<N[optional]>, \
+ *              nand_channels=<N[optional]>, nand_dies=<N[optional]>, \
+ *              nand_planes=<N[optional]>, nand_pages_per_block=<N[optional]>, \
+ *              nand_page_size=<size[optional]>, nand_op_pct=<N[optional]>, \
+ *              nand_read_lat_us=<N[optional]>, nand_prog_lat_us=<N[optional]>, \
+ *              nand_erase_lat_us=<N[optional]>, nand_xfer_lat_us=<N[optional]>, \
+ *              nand_pe_cycles=<N[optional]>, nand_map_cache=<size[optional]>, \
+ *              streams=<N[optional]>, fdp_nruh=<N[optional]>, \
+ *              plm=<on|off[optional]>, \
+ *              latency_profile=<rules[optional]>, lat_seed=<N[optional]>, \
+ *              wcache_size=<size[optional]>, ra_size=<size[optional]>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
- * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ * offset 0 in BAR2 and supports WDS, RDS, SQS, CQS and LISTS. The CMB is
+ * mapped into the guest as RAM. cmb_memdev backs it with a memory backend
+ * (e.g. memory-backend-file on hugetlbfs) instead; its size, which must be
+ * a power of two, then overrides cmb_size_mb.
+ *
+ * Controllers with the same subsys=<id>, where <id> names a
+ * "-device nvme-subsys,id=<id>[,nqn=<nqn>]", form one NVM subsystem. Only
+ * the first of them takes a drive; the namespaces on it are shared with the
+ * rest, which get their own CNTLID. Each namespace is its own ANA group,
+ * reported optimized or non-optimized on a controller by ana_optimized,
+ * which can be flipped at runtime with qom-set to raise an ANA change event.
+ *
+ * sriov_max_vfs makes a controller in a subsystem a primary controller with
+ * up to that many secondary controllers (VFs), each a "-device nvme,pf=<id>"
+ * naming it. A VF shares the namespaces of the subsystem but has its own
+ * queues and MSI-X vectors, taken from the primary's pools of
+ * sriov_vq_flexible queue and sriov_vi_flexible interrupt resources with
+ * the Virtualization Management command. VFs start offline and without
+ * resources; sriov_max_vq_per_vf and sriov_max_vi_per_vf (default: the whole
+ * pool) bound what one of them can get.
+ *
+ * pmrdev exposes a Persistent Memory Region in BAR2, so it can't be combined
+ * with a CMB. It must be a memory-backend-file with share=on; the file is
+ * msync'ed when the guest disables the PMR, reads PMRSTS, or shuts the
+ * controller down.
+ *
+ * Every namespace offers four LBA formats: 0 with 512 byte and 1 with 4 KiB
+ * LBAs, which is reported as the faster one, and 2 and 3 with the same plus
+ * 8 and 64 bytes of metadata. lbaf picks the one namespaces start out in;
+ * Format NVM switches between them, raising a Namespace Attribute Changed
+ * event, and the choice is kept in a header at the end of the backing
+ * image, where it takes precedence over lbaf and pi when the device comes
+ * up. Metadata is kept after the data in the backing image and transferred
+ * through a separate buffer (MPTR); zoned namespaces have none.
+ *
+ * pi=<1-3> enables end-to-end protection of that type on a format with
+ * metadata, with the protection information in the last 8 bytes of the
+ * metadata, or the first with pil=on. The CRC16 guard and the tags are
+ * generated with PRACT and checked as PRCHK asks on reads and writes.
+ *
+ * With zoned=on every namespace uses the Zoned Namespace command set with
+ * zones of zone_size bytes. Zone state is kept in a metadata region at the
+ * end of the backing image, so the usable capacity is slightly smaller.
+ *
+ * A non-zero nand_channels enables a NAND timing model: I/O is mapped by a
+ * page-level FTL onto channels x dies x planes of flash, and completions are
+ * posted once the modelled reads, programs, erases and garbage collection
+ * have finished. Write amplification and wear are reported in the vendor
+ * log page C0h and in the SMART Percentage Used field. nand_map_cache limits
+ * the L2P table held in device DRAM, and a Host Memory Buffer can hold the
+ * table instead.
+ *
+ * streams=<N> supports the Streams directive with up to N (< 16) open
+ * streams, and fdp_nruh=<N> Flexible Data Placement with N (<= 16) reclaim
+ * unit handles, which needs the NAND model. Either way, writes are steered
+ * by their directive to a placement handle that programs its own open NAND
+ * blocks; host and media bytes written per handle are in vendor log C1h.
+ *
+ * plm=on puts the namespace in NVM Set 1 and supports Predictable Latency
+ * Mode on it (features 13h/14h, log pages 0Ah/0Bh). It needs the NAND
+ * model. During a Deterministic Window garbage collection and write cache
+ * destaging are deferred; the window ends when the host asks for it, or
+ * when its read, write or time budget from log 0Ah runs out.
+ *
+ * latency_profile injects extra latency into I/O completions. It is a list
+ * of rules separated by ';', each "<opcode>[@<nsid>]:<key>=<value>,...",
+ * where opcode is all, read, write, compare, flush, write_zeroes, dsm, copy,
+ * zone_append or a number. See README.md for the keys. It can be changed at runtime with
+ * qom-set; lat_seed seeds the random distributions.
+ *
+ * wcache_size gives the controller a volatile write-back cache of that size.
+ * Writes complete once they are in the cache and are written back in large
+ * sequential runs in the background; Flush, FUA writes and disabling the
+ * Volatile Write Cache feature wait until the cache has been written back. MDTS is set so
+ * that every write fits.
+ *
+ * ra_size enables read-ahead: sequential read streams are detected per
+ * namespace and the data ahead of them is read into a cache of that size.
+ *
+ * I/O commands hold the LBA range they touch until they complete, shared
+ * for reads and exclusive for writes, so overlapping commands take effect in
+ * arrival order while the others run in parallel.
+ *
+ * atomic_size makes writes up to that size atomic (AWUN/AWUPF): they go
+ * through a small journal at the end of the backing image that is replayed
+ * on startup, so a crash can't tear them.
+ *
+ * merge_window_us holds reads and writes that continue each other for that
+ * long, and issues them as a single request built from their SG lists.
+ *
+ * Concurrent Flushes to a namespace share backend flushes: one joins the
+ * flush in flight if no write has completed since it was issued, and waits
+ * for the next one with the others otherwise.
+ *
+ * Copy is done by the block layer with copy_range where the backend can,
+ * and otherwise through a 1 MiB bounce buffer; the data never goes through
+ * guest memory. A Copy writes back the write cache first.
+ *
+ * Compare and a fused Compare and Write are supported. The pair is atomic
+ * against other I/O to its LBAs: it waits for the commands in flight there,
+ * and commands that come after it wait for it to complete.
+ *
+ * Format NVM, Sanitize (Block Erase and Overwrite) and Device Self-test run
+ * as a background job that works through the namespace in 1 MiB chunks at
+ * up to 1 GiB/s, so the admin queue and the I/O queues are never stalled.
+ * I/O is aborted while a Format or Sanitize runs; a self-test shares the
+ * media with it. Progress is in log pages 81h and 06h.
  */
 
 #include "qemu/osdep.h"
@@ -35,10 +161,14 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/hostmem.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file-types.h"
 
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
+#include "qemu/crc32c.h"
 #include "qemu/qemu-print.h"
 #include "monitor/monitor.h"
 #include "trace.h"
@@ -49,6 +179,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <math.h>
 
 static const uint32_t nvme_ced_admin[] = {
     NVME_CED_SET_CSUPP, // 00h: Delete I/O Submission Queue
@@ -59,28 +190,36 @@ static const uint32_t nvme_ced_admin[] = {
     NVME_CED_SET_CSUPP, // 05h: Create I/O Completion Queue
     NVME_CED_SET_CSUPP, // 06h: Identify
     0,                  // 07h:
-    0,                  // 08h: Abort
+    NVME_CED_SET_CSUPP, // 08h: Abort
     NVME_CED_SET_CSUPP, // 09h: Set Features
     NVME_CED_SET_CSUPP, // 0Ah: Get Features
     0,                  // 0Bh:
-    0,                  // 0Ch: Asynchronous Event Request
+    NVME_CED_SET_CSUPP, // 0Ch: Asynchronous Event Request
     0,                  // 0Dh: Namespace Management
     0, 0,               // 0Eh, 0Fh
     0,                  // 10h: Firmware Commit
     0,                  // 11h: Firmware Image Download
-    0, 0, 0,            // 12h, 13h, 14h
+    0, 0,               // 12h, 13h
+    NVME_CED_SET_CSUPP, // 14h: Device Self-test
     0,                  // 15h: Namespace Attachment
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                        // 16h -- 1Fh
+    0, 0, 0,            // 16h, 17h, 18h
+    NVME_CED_SET_CSUPP, // 19h: Directive Send
+    NVME_CED_SET_CSUPP, // 1Ah: Directive Receive
+    0, 0, 0, 0, 0,      // 1Bh -- 1Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 20h -- 2Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 30h -- 3Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 40h -- 4Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 50h -- 5Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 60h -- 6Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 70h -- 7Fh
-    0,                                                   // 80h: Format NVM
+    NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC | NVME_CED_SET_NCC |
+    NVME_CED_SET_CSE_LIMIT_SAME_NS,                      // 80h: Format NVM
     0,                                                   // 81h: Security Send
     0,                                                   // 82h: Security Receive
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,               // 83h -- 8Fh
+    0,                                                   // 83h
+    NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC |
+    NVME_CED_SET_CSE_LIMIT_ALL_NS,                       // 84h: Sanitize
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                     // 85h -- 8Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 90h -- 9Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // A0h -- AFh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // B0h -- BFh
@@ -96,7 +235,7 @@ static const uint32_t nvme_ced_io[] = {
     NVME_CED_SET_CSUPP,                     // 02h: Read
     0,                                      // 03h:
     0,                                      // 04h: Write Uncorrectable
-    0,                                      // 05h: Compare
+    NVME_CED_SET_CSUPP,                     // 05h: Compare
     0, 0,                                   // 06h, 07h:
     NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC, // 08h: Write Zeroes
     NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC, // 09h: Dataset Management
@@ -107,13 +246,20 @@ static const uint32_t nvme_ced_io[] = {
     0,                                      // 11h: Reservation Acquire
     0, 0, 0,                                // 12h, 13h, 14h
     0,                                      // 15h: Reservation Release
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,           // 16h -- 1Fh
+    0, 0, 0,                                // 16h, 17h, 18h
+    NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC, // 19h: Copy
+    0, 0, 0, 0, 0, 0,                       // 1Ah -- 1Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20h -- 2Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 30h -- 3Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 40h -- 4Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 50h -- 5Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60h -- 6Fh
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 70h -- 7Fh
+    0, 0, 0, 0, 0, 0, 0, 0, 0,                      // 70h -- 78h
+    NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC, // 79h: Zone Management Send
+    NVME_CED_SET_CSUPP,                     // 7Ah: Zone Management Receive
+    0, 0,                                   // 7Bh, 7Ch
+    NVME_CED_SET_CSUPP | NVME_CED_SET_LBCC, // 7Dh: Zone Append
+    0, 0,                                   // 7Eh, 7Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 80h -- 8Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 90h -- 9Fh
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // A0h -- AFh
@@ -170,17 +316,60 @@ static void nvme_smart_load(NvmeCtrl *_ctrl)
     } while (0)
 
 static void nvme_process_sq(void *opaque);
+static void nvme_clear_ctrl(NvmeCtrl *n);
+static void nvme_merge_submit(NvmeCtrl *n);
+
+/* whether all of [addr, addr + size) lies within the CMB */
+static inline bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr, uint64_t size)
+{
+    uint64_t cmb_size;
+
+    if (!n->cmbsz || addr < n->cmb_mr->addr) {
+        return false;
+    }
+    cmb_size = memory_region_size(n->cmb_mr);
+    return size <= cmb_size && addr - n->cmb_mr->addr <= cmb_size - size;
+}
+
+static inline void *nvme_addr_to_cmb(NvmeCtrl *n, hwaddr addr)
+{
+    return &n->cmbuf[addr - n->cmb_mr->addr];
+}
+
+/*
+ * The CMB is guest RAM, but the device writes it through a host pointer,
+ * which migration's dirty tracking does not see.
+ */
+static void nvme_cmb_iov_dirty(NvmeCtrl *n, QEMUIOVector *iov)
+{
+    int i;
+
+    for (i = 0; i < iov->niov; i++) {
+        memory_region_set_dirty(n->cmb_mr,
+                                (uint8_t *)iov->iov[i].iov_base - n->cmbuf,
+                                iov->iov[i].iov_len);
+    }
+}
 
 static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= n->ctrl_mem.addr &&
-                addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size))) {
-        memcpy(buf, (void *)&n->cmbuf[addr - n->ctrl_mem.addr], size);
+    if (nvme_addr_is_cmb(n, addr, size)) {
+        memcpy(buf, nvme_addr_to_cmb(n, addr), size);
     } else {
         pci_dma_read(&n->parent_obj, addr, buf, size);
     }
 }
 
+static void nvme_addr_write(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+    if (nvme_addr_is_cmb(n, addr, size)) {
+        memcpy(nvme_addr_to_cmb(n, addr), buf, size);
+        memory_region_set_dirty(n->cmb_mr, addr - n->cmb_mr->addr, size);
+    } else {
+        pci_dma_write(&n->parent_obj, addr, buf, size);
+    }
+}
+
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
     return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
@@ -191,6 +380,21 @@ static int nvme_check_cqid(NvmeCtrl *n, uint16_t cqid)
     return cqid < n->num_queues && n->cq[cqid] != NULL ? 0 : -1;
 }
 
+/*
+ * Queues (admin included) and interrupt vectors the host may use. A VF is
+ * sized for the most its primary can assign, but only gets what it was
+ * assigned.
+ */
+static uint32_t nvme_nr_queues(NvmeCtrl *n)
+{
+    return n->pf ? n->sec.nvq : n->num_queues;
+}
+
+static uint32_t nvme_nr_vectors(NvmeCtrl *n)
+{
+    return n->pf ? n->sec.nvi : n->num_queues;
+}
+
 static void nvme_inc_cq_tail(NvmeCQueue *cq)
 {
     cq->tail++;
@@ -263,15 +467,17 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
     hwaddr trans_len = n->page_size - (prp1 % n->page_size);
     trans_len = MIN(len, trans_len);
     int num_prps = (len >> n->page_bits) + 1;
+    bool cmb = false;
 
     if (unlikely(!prp1)) {
         trace_nvme_err_invalid_prp();
         return NVME_INVALID_FIELD | NVME_DNR;
-    } else if (n->cmbsz && prp1 >= n->ctrl_mem.addr &&
-               prp1 < n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size)) {
+    } else if (nvme_addr_is_cmb(n, prp1, trans_len)) {
+        /* then every page of the transfer has to be in the CMB */
+        cmb = true;
         qsg->nsg = 0;
         qemu_iovec_init(iov, num_prps);
-        qemu_iovec_add(iov, (void *)&n->cmbuf[prp1 - n->ctrl_mem.addr], trans_len);
+        qemu_iovec_add(iov, nvme_addr_to_cmb(n, prp1), trans_len);
     } else {
         pci_dma_sglist_init(qsg, &n->parent_obj, num_prps);
         qemu_sglist_add(qsg, prp1, trans_len);
@@ -313,10 +519,13 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
                 }
 
                 trans_len = MIN(len, n->page_size);
-                if (qsg->nsg){
+                if (!cmb) {
                     qemu_sglist_add(qsg, prp_ent, trans_len);
+                } else if (nvme_addr_is_cmb(n, prp_ent, trans_len)) {
+                    qemu_iovec_add(iov, nvme_addr_to_cmb(n, prp_ent), trans_len);
                 } else {
-                    qemu_iovec_add(iov, (void *)&n->cmbuf[prp_ent - n->ctrl_mem.addr], trans_len);
+                    trace_nvme_err_invalid_prplist_ent(prp_ent);
+                    goto unmap;
                 }
                 len -= trans_len;
                 i++;
@@ -326,17 +535,24 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
                 trace_nvme_err_invalid_prp2_align(prp2);
                 goto unmap;
             }
-            if (qsg->nsg) {
+            if (!cmb) {
                 qemu_sglist_add(qsg, prp2, len);
+            } else if (nvme_addr_is_cmb(n, prp2, len)) {
+                qemu_iovec_add(iov, nvme_addr_to_cmb(n, prp2), len);
             } else {
-                qemu_iovec_add(iov, (void *)&n->cmbuf[prp2 - n->ctrl_mem.addr], trans_len);
+                trace_nvme_err_invalid_prplist_ent(prp2);
+                goto unmap;
             }
         }
     }
     return NVME_SUCCESS;
 
  unmap:
-    qemu_sglist_destroy(qsg);
+    if (cmb) {
+        qemu_iovec_destroy(iov);
+    } else {
+        qemu_sglist_destroy(qsg);
+    }
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
@@ -387,6 +603,7 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
             trace_nvme_err_invalid_dma();
             status = NVME_INVALID_FIELD | NVME_DNR;
         }
+        nvme_cmb_iov_dirty(n, &iov);
         qemu_iovec_destroy(&iov);
     }
     return status;
@@ -413,8 +630,14 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_head = cpu_to_le16(sq->head);
         addr = cq->dma_addr + cq->tail * n->cqe_size;
         nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-            sizeof(req->cqe));
+        if (nvme_addr_is_cmb(n, addr, sizeof(req->cqe))) {
+            memcpy(nvme_addr_to_cmb(n, addr), &req->cqe, sizeof(req->cqe));
+            memory_region_set_dirty(n->cmb_mr, addr - n->cmb_mr->addr,
+                                    sizeof(req->cqe));
+        } else {
+            pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
+                sizeof(req->cqe));
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
@@ -422,964 +645,7452 @@ static void nvme_post_cqes(void *opaque)
     }
 }
 
+static void nvme_lock_release(NvmeRequest *req);
+
+/* data written since a backend flush started isn't covered by it */
+static void nvme_flush_dirty(NvmeCtrl *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        n->namespaces[i].flush_gen++;
+    }
+}
+
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
 {
+    gpointer cid = GUINT_TO_POINTER(req->cmd.cid);
+    NvmeCtrl *n = req->sq->ctrl;
+    uint32_t nsid = le32_to_cpu(req->cmd.nsid);
+    uint8_t opc = req->cmd.opcode;
+
     assert(cq->cqid == req->sq->cqid);
+    req->delayed = false;
+    /* a Flush after this completion must not join an earlier epoch */
+    if (!req->sq->sqid) {
+        nvme_flush_dirty(n);
+    } else if (opc != NVME_CMD_READ && opc != NVME_CMD_COMPARE &&
+               opc != NVME_CMD_FLUSH && opc != NVME_CMD_ZONE_MGMT_RECV &&
+               nsid && nsid <= n->num_namespaces) {
+        n->namespaces[nsid - 1].flush_gen++;
+    }
+    if (req->locked) {
+        nvme_lock_release(req);
+    }
+    g_free(req->md);
+    req->md = NULL;
+    /* a host reusing a CID early may have replaced the entry already */
+    if (g_hash_table_lookup(req->sq->cids, cid) == req) {
+        g_hash_table_remove(req->sq->cids, cid);
+    }
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
     timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
 }
 
-static void nvme_rw_cb(void *opaque, int ret)
+/* xorshift64*, so that runs with the same lat_seed are reproducible */
+static double nvme_lat_uniform(NvmeCtrl *n)
 {
-    NvmeRequest *req = opaque;
-    NvmeSQueue *sq = req->sq;
-    NvmeCtrl *n = sq->ctrl;
-    NvmeCQueue *cq = n->cq[sq->cqid];
+    n->lat_rng ^= n->lat_rng >> 12;
+    n->lat_rng ^= n->lat_rng << 25;
+    n->lat_rng ^= n->lat_rng >> 27;
 
-    if (!ret) {
-        block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
-        req->status = NVME_SUCCESS;
-    } else {
-        block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
-        req->status = NVME_INTERNAL_DEV_ERROR;
-    }
-    if (req->has_sg) {
-        qemu_sglist_destroy(&req->qsg);
-    }
-    nvme_enqueue_req_completion(cq, req);
+    /* 53 random bits, shifted into the open interval (0, 1) */
+    return (((n->lat_rng * 0x2545f4914f6cdd1dULL) >> 11) + 0.5) /
+           (double)(1ULL << 53);
 }
 
-static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+static double nvme_lat_gauss(NvmeCtrl *n)
 {
-    req->has_sg = false;
-    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
-         BLOCK_ACCT_FLUSH);
-    req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
+    double u1 = nvme_lat_uniform(n);
+    double u2 = nvme_lat_uniform(n);
 
-    return NVME_NO_COMPLETE;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
 }
 
-static uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+/* heavy tails reach any value, which must still fit in nanoseconds */
+#define NVME_LAT_MAX_US (10 * 1000 * 1000)
+
+static double nvme_lat_sample_us(NvmeCtrl *n, NvmeLatRule *r)
 {
-    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
-    const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
-    uint64_t slba = le64_to_cpu(rw->slba);
-    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
-    uint64_t offset = slba << data_shift;
-    uint32_t count = nlb << data_shift;
+    double us = r->fixed_us;
 
-    if (unlikely(slba + nlb > ns->id_ns.nsze)) {
-        trace_nvme_err_invalid_lba_range(slba, nlb, ns->id_ns.nsze);
-        return NVME_LBA_RANGE | NVME_DNR;
+    switch (r->dist) {
+    case NVME_LAT_DIST_NORMAL:
+        us += r->mean_us + r->stddev_us * nvme_lat_gauss(n);
+        break;
+    case NVME_LAT_DIST_LOGNORMAL:
+        us += exp(r->mu + r->sigma * nvme_lat_gauss(n));
+        break;
+    case NVME_LAT_DIST_PARETO:
+        us += r->scale_us * pow(nvme_lat_uniform(n), -1.0 / r->alpha);
+        break;
+    default:
+        break;
     }
 
-    req->has_sg = false;
-    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
-                     BLOCK_ACCT_WRITE);
-    req->aiocb = blk_aio_pwrite_zeroes(n->conf.blk, offset, count,
-                                        BDRV_REQ_MAY_UNMAP, nvme_rw_cb, req);
-    return NVME_NO_COMPLETE;
+    return MIN(MAX(us, 0.0), NVME_LAT_MAX_US);
 }
 
-static uint16_t nvme_dsm(NvmeCtrl *_ctrl, NvmeNamespace *_ns, NvmeCmd *_cmd,
-			 NvmeRequest *_req)
+static uint64_t nvme_lat_req_bytes(NvmeCtrl *n, NvmeRequest *req)
 {
-    NvmeDsmCmd *thisCmd = (NvmeDsmCmd *)_cmd;
-    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(_ns->id_ns.flbas);
-    const uint8_t data_shift = _ns->id_ns.lbaf[lba_index].ds;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    uint32_t nsid = le32_to_cpu(rw->nsid);
+    NvmeNamespace *ns;
 
-    uint32_t nr   = le32_to_cpu( thisCmd->nr ) & 0xFF;        // CDW10[07:00]
-    uint64_t attr = le32_to_cpu( thisCmd->attributes ) & 0x7; // CDW11[02:00]
-    uint64_t prp1 = le64_to_cpu( thisCmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( thisCmd->prp2 );
+    if (nsid == 0 || nsid > n->num_namespaces) {
+        return 0;
+    }
+    ns = &n->namespaces[nsid - 1];
 
-    uint16_t ret;
+    switch (rw->opcode) {
+    case NVME_CMD_READ:
+    case NVME_CMD_WRITE:
+    case NVME_CMD_ZONE_APPEND:
+        return (uint64_t)(le16_to_cpu(rw->nlb) + 1) <<
+               ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    default:
+        return 0;
+    }
+}
 
-    NvmeDsmRange *ranges = g_malloc0( sizeof(NvmeDsmRange) * NVME_NUM_MAX_DSM_RANGES );
-    if ( ranges == NULL ) {
-	qemu_printf( "[NVME] [DSM] failed in g_malloc(): %s\n", strerror(errno) );
-        return NVME_INTERNAL_DEV_ERROR | NVME_DNR;
+/*
+ * Push req->expire_ns out according to the first matching profile rule:
+ * transfers are serialized at the rule's bandwidth cap, the sampled latency
+ * is added on top, and completions that would land in a stall window at the
+ * start of each stall period are held until the window ends.
+ */
+static void nvme_lat_apply(NvmeCtrl *n, NvmeRequest *req)
+{
+    uint32_t nsid = le32_to_cpu(req->cmd.nsid);
+    NvmeLatRule *r = NULL;
+    uint64_t bytes;
+    int64_t t;
+    uint32_t i;
+
+    for (i = 0; i < n->nr_lat_rules; i++) {
+        if ((n->lat_rules[i].opcode < 0 ||
+             n->lat_rules[i].opcode == req->cmd.opcode) &&
+            (!n->lat_rules[i].nsid || n->lat_rules[i].nsid == nsid)) {
+            r = &n->lat_rules[i];
+            break;
+        }
+    }
+    if (!r) {
+        return;
     }
 
-    // get LBA ranges
-    ret = nvme_dma_write_prp( _ctrl, (uint8_t *)ranges,
-			     sizeof(NvmeDsmRange) * ( nr + 1 ), prp1, prp2);
+    t = MAX(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), req->expire_ns);
+    bytes = nvme_lat_req_bytes(n, req);
+    if (r->bw_bps && bytes) {
+        t = MAX(t, r->bw_avail_ns) + bytes * NANOSECONDS_PER_SECOND / r->bw_bps;
+        r->bw_avail_ns = t;
+    }
+    t += (int64_t)(nvme_lat_sample_us(n, r) * SCALE_US);
 
-    if (ret != NVME_SUCCESS) {
-	return ret;
+    if (r->stall_period_ms && r->stall_ms) {
+        int64_t period = (int64_t)r->stall_period_ms * SCALE_MS;
+        int64_t stall = (int64_t)r->stall_ms * SCALE_MS;
+
+        if (t % period < stall) {
+            t += stall - t % period;
+        }
     }
 
-    for ( int i = 0; i <= nr; i++ ) {
-	uint32_t nlb    = le32_to_cpu( ranges[ i ].nlb );
-	uint64_t slba   = le64_to_cpu( ranges[ i ].slba );
-	uint64_t offset = slba << data_shift;
-	uint32_t count  =  nlb << data_shift;
+    req->expire_ns = t;
+}
 
-	if ( unlikely( slba + nlb > _ns->id_ns.nsze ) ) {
-	    trace_nvme_err_invalid_lba_range( slba, nlb, _ns->id_ns.nsze );
-	    return NVME_LBA_RANGE | NVME_DNR;
-	}
+static void nvme_delay_timer_cb(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    NvmeRequest *req;
 
-	/**
-	 * NVMe spec implicitly states that a host may specify
-	 * all combinations of attributes
-	 */
-	if ( attr & ( NVME_DSMGMT_IDR | NVME_DSMGMT_IDW ) ) {
-	    // nothing to do
-	}
+    while ((req = QTAILQ_FIRST(&n->delayed_reqs)) && req->expire_ns <= now) {
+        QTAILQ_REMOVE(&n->delayed_reqs, req, delay_entry);
+        nvme_enqueue_req_completion(n->cq[req->sq->cqid], req);
+    }
+    if (req) {
+        timer_mod(n->delay_timer, req->expire_ns);
+    }
+}
 
-	if ( attr & NVME_DSMGMT_AD ) {
-	    _req->has_sg = false;
-	    block_acct_start( blk_get_stats( _ctrl->conf.blk), &_req->acct, 0, BLOCK_ACCT_WRITE );
-	    ret = blk_pwrite_zeroes( _ctrl->conf.blk, offset, count, BDRV_REQ_MAY_UNMAP );
-	    if ( ret == 0 ) {
-		block_acct_done( blk_get_stats( _ctrl->conf.blk ), &_req->acct );
-	    } else {
-		block_acct_failed( blk_get_stats( _ctrl->conf.blk ), &_req->acct );
-		ret = NVME_INTERNAL_DEV_ERROR;
-		break;
-	    }
-	}
+static void nvme_plm_account(NvmeCtrl *n, NvmeRequest *req);
+
+/*
+ * Complete a request, holding it back until req->expire_ns if that lies in
+ * the future. Held requests stay on the SQ's out_req_list and are kept on a
+ * single list sorted by expiry time.
+ */
+static void nvme_complete_req(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeRequest *prev;
+
+    if (n->plm.enabled && req->sq->sqid) {
+        nvme_plm_account(n, req);
+    }
+    if (n->nr_lat_rules && req->sq->sqid) {
+        nvme_lat_apply(n, req);
+    }
+    if (req->expire_ns <= qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) {
+        nvme_enqueue_req_completion(n->cq[req->sq->cqid], req);
+        return;
     }
 
-    g_free( ranges );
-    return ret;
+    req->delayed = true;
+    /* most requests expire in submission order, so search from the tail */
+    QTAILQ_FOREACH_REVERSE(prev, &n->delayed_reqs, delay_entry) {
+        if (prev->expire_ns <= req->expire_ns) {
+            QTAILQ_INSERT_AFTER(&n->delayed_reqs, prev, req, delay_entry);
+            return;
+        }
+    }
+    QTAILQ_INSERT_HEAD(&n->delayed_reqs, req, delay_entry);
+    timer_mod(n->delay_timer, req->expire_ns);
 }
 
-static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
-    NvmeRequest *req)
+/* complete the held requests of a queue right away, e.g. before deleting it */
+static void nvme_flush_delayed_reqs(NvmeCtrl *n, NvmeSQueue *sq)
 {
-    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
-    uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
-    uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
+    NvmeRequest *req, *next;
 
-    uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-    uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
-    uint64_t data_size = (uint64_t)nlb << data_shift;
-    uint64_t data_offset = slba << data_shift;
-    int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
-    enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
+    QTAILQ_FOREACH_SAFE(req, &n->delayed_reqs, delay_entry, next) {
+        if (req->sq == sq) {
+            QTAILQ_REMOVE(&n->delayed_reqs, req, delay_entry);
+            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+        }
+    }
+}
 
-    trace_nvme_rw(is_write ? "write" : "read", nlb, data_size, slba);
+/*
+ * Asynchronous events wait in aer_queue for an outstanding AER. Once an
+ * event of a type has been reported, the type is masked until the host
+ * reads the log page the event pointed to.
+ */
+static void nvme_process_aers(NvmeCtrl *n)
+{
+    NvmeAsyncEvent *event, *next;
+    NvmeRequest *req;
 
-    if (unlikely((slba + nlb) > ns->id_ns.nsze)) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        trace_nvme_err_invalid_lba_range(slba, nlb, ns->id_ns.nsze);
-        return NVME_LBA_RANGE | NVME_DNR;
+    QSIMPLEQ_FOREACH_SAFE(event, &n->aer_queue, entry, next) {
+        if (!n->outstanding_aers) {
+            break;
+        }
+        if (n->aer_mask & (1 << event->result.event_type)) {
+            continue;
+        }
+
+        QSIMPLEQ_REMOVE(&n->aer_queue, event, NvmeAsyncEvent, entry);
+        n->aer_queued--;
+        n->aer_mask |= 1 << event->result.event_type;
+
+        req = n->aer_reqs[--n->outstanding_aers];
+        memcpy(&req->cqe.result, &event->result, sizeof(event->result));
+        req->status = NVME_SUCCESS;
+        nvme_enqueue_req_completion(n->cq[0], req);
+        g_free(event);
     }
+}
 
-    if (nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n)) {
-        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+static void nvme_enqueue_event(NvmeCtrl *n, uint8_t event_type,
+                               uint8_t event_info, uint8_t log_page)
+{
+    NvmeAsyncEvent *event;
+
+    /* a host that never reads its logs can't make us grow without bound */
+    if (n->aer_queued == NVME_MAX_AER_QUEUED) {
+        return;
     }
 
-    dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
-    if (req->qsg.nsg > 0) {
-        req->has_sg = true;
-        req->aiocb = is_write ?
-            dma_blk_write(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
-                          nvme_rw_cb, req) :
-            dma_blk_read(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
-                         nvme_rw_cb, req);
-    } else {
-        req->has_sg = false;
-        req->aiocb = is_write ?
-            blk_aio_pwritev(n->conf.blk, data_offset, &req->iov, 0, nvme_rw_cb,
-                            req) :
-            blk_aio_preadv(n->conf.blk, data_offset, &req->iov, 0, nvme_rw_cb,
-                           req);
+    event = g_new0(NvmeAsyncEvent, 1);
+    event->result.event_type = event_type;
+    event->result.event_info = event_info;
+    event->result.log_page = log_page;
+    QSIMPLEQ_INSERT_TAIL(&n->aer_queue, event, entry);
+    n->aer_queued++;
+
+    nvme_process_aers(n);
+}
+
+static void nvme_clear_events(NvmeCtrl *n, uint8_t event_type)
+{
+    n->aer_mask &= ~(1 << event_type);
+    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
+        nvme_process_aers(n);
     }
+}
 
-    return NVME_NO_COMPLETE;
+/* put an entry at the head of the Error Information log */
+static void nvme_log_error(NvmeCtrl *n, uint16_t sqid, uint16_t cid,
+                           uint16_t status, uint32_t nsid, uint64_t lba)
+{
+    NvmeErrorLog *e = n->error_info;
+    uint64_t count = le64_to_cpu(e->error_count) + 1;
+
+    memmove(&e[1], &e[0], sizeof(*e) * (NVME_NUM_ERROR_LOG - 1));
+    memset(e, 0, sizeof(*e));
+    e->error_count = cpu_to_le64(count);
+    e->sqid = cpu_to_le16(sqid);
+    e->cid = cpu_to_le16(cid);
+    e->status_field = cpu_to_le16(status << 1);
+    e->param_error_location = cpu_to_le16(0xffff);
+    e->lba = cpu_to_le64(lba);
+    e->nsid = cpu_to_le32(nsid);
+
+    if (++n->smart.number_of_error_log_entries[0] == 0) {
+        n->smart.number_of_error_log_entries[1]++;
+    }
 }
 
-static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+/* the composite temperature against the host's thresholds */
+static void nvme_smart_check_temp(NvmeCtrl *n)
 {
-    NvmeNamespace *ns;
-    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint16_t temp = n->smart.temperature[0] | n->smart.temperature[1] << 8;
 
-    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
-        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
-        return NVME_INVALID_NSID | NVME_DNR;
+    if (temp <= n->temp_thresh_hi &&
+        (!n->temp_thresh_low || temp >= n->temp_thresh_low)) {
+        n->smart.critical_warning &= ~NVME_SMART_TEMPERATURE;
+        return;
+    }
+    if (n->smart.critical_warning & NVME_SMART_TEMPERATURE) {
+        return;
     }
 
-    ns = &n->namespaces[nsid - 1];
-    switch (cmd->opcode) {
-    case NVME_CMD_FLUSH:
-        return nvme_flush(n, ns, cmd, req);
-    case NVME_CMD_WRITE_ZEROS:
-        return nvme_write_zeros(n, ns, cmd, req);
-    case NVME_CMD_WRITE:
-    case NVME_CMD_READ:
-        return nvme_rw(n, ns, cmd, req);
-    case NVME_CMD_DSM:
-        return nvme_dsm(n, ns, cmd, req);
-    default:
-        trace_nvme_err_invalid_opc(cmd->opcode);
-        return NVME_INVALID_OPCODE | NVME_DNR;
+    n->smart.critical_warning |= NVME_SMART_TEMPERATURE;
+    if (n->aer_cfg & NVME_SMART_TEMPERATURE) {
+        nvme_enqueue_event(n, NVME_AER_TYPE_SMART,
+                           NVME_AER_INFO_SMART_TEMP_THRESH,
+                           NVME_LOG_SMART_INFO);
     }
 }
 
-static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+static uint16_t nvme_aer(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
-    n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
-    g_free(sq->io_req);
-    if (sq->sqid) {
-        g_free(sq);
+    if (n->outstanding_aers > NVME_AERL) {
+        return NVME_AER_LIMIT_EXCEEDED;
+    }
+
+    n->aer_reqs[n->outstanding_aers++] = req;
+    if (!QSIMPLEQ_EMPTY(&n->aer_queue)) {
+        nvme_process_aers(n);
     }
+    return NVME_NO_COMPLETE;
 }
 
-static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
-{
-    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
-    NvmeRequest *req, *next;
-    NvmeSQueue *sq;
-    NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
+/*
+ * Metadata and end-to-end protection
+ *
+ * The metadata of a namespace sits in the backing image right after its
+ * data, ms bytes per LBA, and moves through a separate buffer at MPTR. It
+ * is stored inverted, so that metadata never written (or deallocated) reads
+ * as all ones: the escape tags, which disable the PI checks on the block.
+ *
+ * The guard is a CRC16 T10-DIF, computed eight bytes at a time from tables
+ * built when the class is initialized.
+ */
+#define NVME_CRC16_T10_POLY 0x8bb7
 
-    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
-        trace_nvme_err_invalid_del_sq(qid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
+static uint16_t nvme_crc16_t10_tbl[8][256];
 
-    trace_nvme_del_sq(qid);
+static void nvme_crc16_t10_init(void)
+{
+    int i, j;
 
-    sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        blk_aio_cancel(req->aiocb);
-    }
-    if (!nvme_check_cqid(n, sq->cqid)) {
-        cq = n->cq[sq->cqid];
-        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i << 8;
 
-        nvme_post_cqes(cq);
-        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-            if (req->sq == sq) {
-                QTAILQ_REMOVE(&cq->req_list, req, entry);
-                QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
-            }
+        for (j = 0; j < 8; j++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ NVME_CRC16_T10_POLY : crc << 1;
         }
+        nvme_crc16_t10_tbl[0][i] = crc;
     }
+    /* table k: the CRC of a byte followed by k zero bytes */
+    for (j = 1; j < 8; j++) {
+        for (i = 0; i < 256; i++) {
+            uint16_t crc = nvme_crc16_t10_tbl[j - 1][i];
 
-    nvme_free_sq(sq, n);
-    return NVME_SUCCESS;
+            nvme_crc16_t10_tbl[j][i] = (crc << 8) ^
+                                       nvme_crc16_t10_tbl[0][crc >> 8];
+        }
+    }
 }
 
-static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
-    uint16_t sqid, uint16_t cqid, uint16_t size)
+static uint16_t nvme_crc16_t10(uint16_t crc, const uint8_t *buf, size_t len)
 {
-    int i;
-    NvmeCQueue *cq;
-
-    sq->ctrl = n;
-    sq->dma_addr = dma_addr;
-    sq->sqid = sqid;
-    sq->size = size;
-    sq->cqid = cqid;
-    sq->head = sq->tail = 0;
-    sq->io_req = g_new(NvmeRequest, sq->size);
-
-    QTAILQ_INIT(&sq->req_list);
-    QTAILQ_INIT(&sq->out_req_list);
-    for (i = 0; i < sq->size; i++) {
-        sq->io_req[i].sq = sq;
-        QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
+    uint16_t (*t)[256] = nvme_crc16_t10_tbl;
+
+    while (len >= 8) {
+        crc = t[7][(crc >> 8) ^ buf[0]] ^ t[6][(crc & 0xff) ^ buf[1]] ^
+              t[5][buf[2]] ^ t[4][buf[3]] ^ t[3][buf[4]] ^ t[2][buf[5]] ^
+              t[1][buf[6]] ^ t[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc << 8) ^ t[0][(crc >> 8) ^ *buf++];
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
 
-    assert(n->cq[cqid]);
-    cq = n->cq[cqid];
-    QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
-    n->sq[sqid] = sq;
+    return crc;
 }
 
-static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
+static inline NvmeLBAF *nvme_ns_lbaf(NvmeNamespace *ns)
 {
-    NvmeSQueue *sq;
-    NvmeCreateSq *c = (NvmeCreateSq *)cmd;
-
-    uint16_t cqid = le16_to_cpu(c->cqid);
-    uint16_t sqid = le16_to_cpu(c->sqid);
-    uint16_t qsize = le16_to_cpu(c->qsize);
-    uint16_t qflags = le16_to_cpu(c->sq_flags);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
+    return &ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)];
+}
 
-    trace_nvme_create_sq(prp1, sqid, cqid, qsize, qflags);
+static inline uint16_t nvme_ns_ms(NvmeNamespace *ns)
+{
+    return le16_to_cpu(nvme_ns_lbaf(ns)->ms);
+}
 
-    if (unlikely(!cqid || nvme_check_cqid(n, cqid))) {
-        trace_nvme_err_invalid_create_sq_cqid(cqid);
-        return NVME_INVALID_CQID | NVME_DNR;
-    }
-    if (unlikely(!sqid || !nvme_check_sqid(n, sqid))) {
-        trace_nvme_err_invalid_create_sq_sqid(sqid);
-        return NVME_INVALID_QID | NVME_DNR;
-    }
-    if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap))) {
-        trace_nvme_err_invalid_create_sq_size(qsize);
-        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
-    }
-    if (unlikely(!prp1 || prp1 & (n->page_size - 1))) {
-        trace_nvme_err_invalid_create_sq_addr(prp1);
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
-    if (unlikely(!(NVME_SQ_FLAGS_PC(qflags)))) {
-        trace_nvme_err_invalid_create_sq_qflags(NVME_SQ_FLAGS_PC(qflags));
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
-    sq = g_malloc0(sizeof(*sq));
-    nvme_init_sq(sq, n, prp1, sqid, cqid, qsize + 1);
-    return NVME_SUCCESS;
+static inline uint8_t nvme_ns_pi(NvmeNamespace *ns)
+{
+    return ns->id_ns.dps & DPS_TYPE_MASK;
 }
 
-static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
+static NvmeDifTuple *nvme_pi_tuple(NvmeNamespace *ns, uint8_t *md)
 {
-    n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
-    msix_vector_unuse(&n->parent_obj, cq->vector);
-    if (cq->cqid) {
-        g_free(cq);
+    if (ns->id_ns.dps & DPS_FIRST_EIGHT) {
+        return (NvmeDifTuple *)md;
     }
+    return (NvmeDifTuple *)(md + nvme_ns_ms(ns) - sizeof(NvmeDifTuple));
 }
 
-static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
+/* the guard covers the data, and the metadata ahead of PI in the last 8 */
+static uint16_t nvme_pi_guard(NvmeNamespace *ns, const uint8_t *data,
+                              uint8_t *md)
 {
-    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
-    NvmeCQueue *cq;
-    uint16_t qid = le16_to_cpu(c->qid);
-
-    if (unlikely(!qid || nvme_check_cqid(n, qid))) {
-        trace_nvme_err_invalid_del_cq_cqid(qid);
-        return NVME_INVALID_CQID | NVME_DNR;
-    }
+    size_t lbasz = 1 << nvme_ns_lbaf(ns)->ds;
+    uint16_t crc = data ? nvme_crc16_t10(0, data, lbasz) : 0;
 
-    cq = n->cq[qid];
-    if (unlikely(!QTAILQ_EMPTY(&cq->sq_list))) {
-        trace_nvme_err_invalid_del_cq_notempty(qid);
-        return NVME_INVALID_QUEUE_DEL;
+    if (!(ns->id_ns.dps & DPS_FIRST_EIGHT)) {
+        crc = nvme_crc16_t10(crc, md, (uint8_t *)nvme_pi_tuple(ns, md) - md);
     }
-    nvme_irq_deassert(n, cq);
-    trace_nvme_del_cq(qid);
-    nvme_free_cq(cq, n);
-    return NVME_SUCCESS;
+    return crc;
 }
 
-static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
-    uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled)
+/* PI for nlb blocks; data is NULL for blocks of zeroes */
+static void nvme_pi_generate(NvmeNamespace *ns, const uint8_t *data,
+                             uint8_t *md, uint32_t nlb, uint32_t reftag,
+                             uint16_t apptag)
 {
-    cq->ctrl = n;
-    cq->cqid = cqid;
-    cq->size = size;
-    cq->dma_addr = dma_addr;
-    cq->phase = 1;
-    cq->irq_enabled = irq_enabled;
-    cq->vector = vector;
-    cq->head = cq->tail = 0;
-    QTAILQ_INIT(&cq->req_list);
-    QTAILQ_INIT(&cq->sq_list);
-    msix_vector_use(&n->parent_obj, cq->vector);
-    n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    size_t lbasz = 1 << nvme_ns_lbaf(ns)->ds;
+    uint16_t ms = nvme_ns_ms(ns);
+    uint32_t i;
+
+    for (i = 0; i < nlb; i++) {
+        NvmeDifTuple *dif = nvme_pi_tuple(ns, md);
+
+        dif->guard = cpu_to_be16(nvme_pi_guard(ns, data, md));
+        dif->apptag = cpu_to_be16(apptag);
+        dif->reftag = cpu_to_be32(reftag);
+        if (nvme_ns_pi(ns) != DPS_TYPE_3) {
+            reftag++;
+        }
+        data = data ? data + lbasz : NULL;
+        md += ms;
+    }
 }
 
-static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
+/* check the PI of nlb blocks as PRCHK in control asks */
+static uint16_t nvme_pi_check(NvmeNamespace *ns, const uint8_t *data,
+                              uint8_t *md, uint32_t nlb, uint16_t control,
+                              uint32_t reftag, uint16_t apptag,
+                              uint16_t appmask)
 {
-    NvmeCQueue *cq;
-    NvmeCreateCq *c = (NvmeCreateCq *)cmd;
-    uint16_t cqid = le16_to_cpu(c->cqid);
-    uint16_t vector = le16_to_cpu(c->irq_vector);
-    uint16_t qsize = le16_to_cpu(c->qsize);
-    uint16_t qflags = le16_to_cpu(c->cq_flags);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
+    size_t lbasz = 1 << nvme_ns_lbaf(ns)->ds;
+    uint16_t ms = nvme_ns_ms(ns);
+    uint32_t i;
 
-    trace_nvme_create_cq(prp1, cqid, vector, qsize, qflags,
-                         NVME_CQ_FLAGS_IEN(qflags) != 0);
+    for (i = 0; i < nlb; i++, md += ms) {
+        NvmeDifTuple *dif = nvme_pi_tuple(ns, md);
+        const uint8_t *blk = data ? data + i * lbasz : NULL;
+        uint32_t ref = reftag;
 
-    if (unlikely(!cqid || !nvme_check_cqid(n, cqid))) {
-        trace_nvme_err_invalid_create_cq_cqid(cqid);
-        return NVME_INVALID_CQID | NVME_DNR;
-    }
-    if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap))) {
-        trace_nvme_err_invalid_create_cq_size(qsize);
-        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
-    }
-    if (unlikely(!prp1)) {
-        trace_nvme_err_invalid_create_cq_addr(prp1);
-        return NVME_INVALID_FIELD | NVME_DNR;
-    }
-    if (unlikely(vector > n->num_queues)) {
-        trace_nvme_err_invalid_create_cq_vector(vector);
-        return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
-    }
-    if (unlikely(!(NVME_CQ_FLAGS_PC(qflags)))) {
-        trace_nvme_err_invalid_create_cq_qflags(NVME_CQ_FLAGS_PC(qflags));
-        return NVME_INVALID_FIELD | NVME_DNR;
+        if (nvme_ns_pi(ns) != DPS_TYPE_3) {
+            reftag++;
+        }
+        /* escape: the block has no PI to check */
+        if (be16_to_cpu(dif->apptag) == 0xffff &&
+            (nvme_ns_pi(ns) != DPS_TYPE_3 ||
+             be32_to_cpu(dif->reftag) == 0xffffffff)) {
+            continue;
+        }
+
+        if ((control & NVME_RW_PRINFO_PRCHK_GUARD) &&
+            be16_to_cpu(dif->guard) != nvme_pi_guard(ns, blk, md)) {
+            return NVME_E2E_GUARD_ERROR;
+        }
+        if ((control & NVME_RW_PRINFO_PRCHK_APP) &&
+            (be16_to_cpu(dif->apptag) & appmask) != (apptag & appmask)) {
+            return NVME_E2E_APP_ERROR;
+        }
+        if ((control & NVME_RW_PRINFO_PRCHK_REF) &&
+            be32_to_cpu(dif->reftag) != ref) {
+            return NVME_E2E_REF_ERROR;
+        }
     }
 
-    cq = g_malloc0(sizeof(*cq));
-    nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
-        NVME_CQ_FLAGS_IEN(qflags));
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_identify_ctrl(NvmeCtrl *n, NvmeIdentify *c)
+/* ms is a multiple of 8, so the metadata is inverted a word at a time */
+static void nvme_md_invert(uint8_t *md, size_t len)
 {
-    uint64_t prp1 = le64_to_cpu(c->prp1);
-    uint64_t prp2 = le64_to_cpu(c->prp2);
+    uint64_t *w = (uint64_t *)md;
+    size_t i;
 
-    trace_nvme_identify_ctrl();
+    for (i = 0; i < len / sizeof(*w); i++) {
+        w[i] = ~w[i];
+    }
+}
 
-    return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
-        prp1, prp2);
+/* writes invert md in place */
+static int nvme_md_rw(NvmeCtrl *n, NvmeNamespace *ns, uint64_t slba,
+                      uint32_t nlb, uint8_t *md, bool is_write)
+{
+    uint16_t ms = nvme_ns_ms(ns);
+    size_t len = (size_t)nlb * ms;
+    int64_t offset = ns->md_offset + slba * ms;
+    int ret;
+
+    if (is_write) {
+        nvme_md_invert(md, len);
+        return blk_pwrite(n->conf.blk, offset, md, len, 0);
+    }
+    ret = blk_pread(n->conf.blk, offset, md, len);
+    nvme_md_invert(md, len);
+    return ret;
 }
 
-static uint16_t nvme_identify_ns(NvmeCtrl *n, NvmeIdentify *c)
+/* blk_pwrite_zeroes() in pieces, for ranges beyond what one request takes */
+static int nvme_pwrite_zeroes(NvmeCtrl *n, uint64_t offset, uint64_t len,
+                              BdrvRequestFlags flags)
 {
-    NvmeNamespace *ns;
-    uint32_t nsid = le32_to_cpu(c->nsid);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
-    uint64_t prp2 = le64_to_cpu(c->prp2);
+    int ret = 0;
 
-    trace_nvme_identify_ns(nsid);
+    while (ret == 0 && len) {
+        int chunk = MIN(len, BDRV_REQUEST_MAX_BYTES);
 
-    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
-        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
-        return NVME_INVALID_NSID | NVME_DNR;
+        ret = blk_pwrite_zeroes(n->conf.blk, offset, chunk, flags);
+        offset += chunk;
+        len -= chunk;
     }
-
-    ns = &n->namespaces[nsid - 1];
-
-    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
-        prp1, prp2);
+    return ret;
 }
 
-static uint16_t nvme_identify_nslist(NvmeCtrl *n, NvmeIdentify *c)
+static void nvme_req_copy(NvmeRequest *req, uint8_t *buf, uint32_t len,
+                          bool to_guest);
+
+/*
+ * Take the metadata of a write from MPTR, or make up the PI with PRACT, and
+ * check it. It is stored by nvme_rw_md_aio() once the data is written.
+ */
+static uint16_t nvme_rw_write_md(NvmeCtrl *n, NvmeNamespace *ns,
+                                 NvmeRequest *req, uint64_t slba, uint32_t nlb)
 {
-    static const int data_len = 4 * KiB;
-    uint32_t min_nsid = le32_to_cpu(c->nsid);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
-    uint64_t prp2 = le64_to_cpu(c->prp2);
-    uint32_t *list;
-    uint16_t ret;
-    int i, j = 0;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    uint16_t control = le16_to_cpu(rw->control);
+    uint16_t ms = nvme_ns_ms(ns);
+    uint8_t ds = nvme_ns_lbaf(ns)->ds;
+    bool pract = nvme_ns_pi(ns) && (control & NVME_RW_PRINFO_PRACT);
+    uint8_t *md = g_malloc0((size_t)nlb * ms);
+    uint8_t *data = NULL;
+    uint16_t status = NVME_SUCCESS;
 
-    trace_nvme_identify_nslist(min_nsid);
+    /* with PRACT and nothing but PI in the metadata, the host sends none */
+    if (!pract || ms > sizeof(NvmeDifTuple)) {
+        nvme_addr_read(n, le64_to_cpu(rw->mptr), md, nlb * ms);
+    }
 
-    list = g_malloc0(data_len);
-    for (i = 0; i < n->num_namespaces; i++) {
-        if (i < min_nsid) {
-            continue;
+    if (nvme_ns_pi(ns) && (pract || (control & NVME_RW_PRINFO_PRCHK_MASK))) {
+        if (pract || (control & NVME_RW_PRINFO_PRCHK_GUARD)) {
+            data = g_malloc((size_t)nlb << ds);
+            nvme_req_copy(req, data, nlb << ds, false);
         }
-        list[j++] = cpu_to_le32(i + 1);
-        if (j == data_len / sizeof(uint32_t)) {
-            break;
+        if (pract) {
+            nvme_pi_generate(ns, data, md, nlb, le32_to_cpu(rw->reftag),
+                             le16_to_cpu(rw->apptag));
+        } else {
+            status = nvme_pi_check(ns, data, md, nlb, control,
+                                   le32_to_cpu(rw->reftag),
+                                   le16_to_cpu(rw->apptag),
+                                   le16_to_cpu(rw->appmask));
         }
     }
-    ret = nvme_dma_read_prp(n, (uint8_t *)list, data_len, prp1, prp2);
-    g_free(list);
-    return ret;
+
+    if (!status) {
+        req->md = md;
+        md = NULL;
+    }
+    g_free(data);
+    g_free(md);
+    return status;
 }
 
-static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+/*
+ * Check the metadata nvme_rw_md_aio() read once the data is in guest
+ * memory, and hand it to the host at MPTR unless PRACT strips the PI.
+ */
+static uint16_t nvme_rw_read_md(NvmeCtrl *n, NvmeRequest *req)
 {
-    NvmeIdentify *c = (NvmeIdentify *)cmd;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    NvmeNamespace *ns = &n->namespaces[le32_to_cpu(rw->nsid) - 1];
+    uint16_t control = le16_to_cpu(rw->control);
+    uint16_t ms = nvme_ns_ms(ns);
+    uint8_t ds = nvme_ns_lbaf(ns)->ds;
+    uint32_t nlb = le16_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    bool pract = nvme_ns_pi(ns) && (control & NVME_RW_PRINFO_PRACT);
+    uint8_t *md = req->md;
+    uint8_t *data = NULL;
+    uint16_t status = NVME_SUCCESS;
 
-    switch (le32_to_cpu(c->cns)) {
-    case 0x00:
-        return nvme_identify_ns(n, c);
-    case 0x01:
-        return nvme_identify_ctrl(n, c);
-    case 0x02:
-        return nvme_identify_nslist(n, c);
-    default:
-        trace_nvme_err_invalid_identify_cns(le32_to_cpu(c->cns));
-        return NVME_INVALID_FIELD | NVME_DNR;
+    if (nvme_ns_pi(ns) && (control & NVME_RW_PRINFO_PRCHK_MASK)) {
+        if (control & NVME_RW_PRINFO_PRCHK_GUARD) {
+            data = g_malloc((size_t)nlb << ds);
+            nvme_req_copy(req, data, nlb << ds, false);
+        }
+        status = nvme_pi_check(ns, data, md, nlb, control,
+                               le32_to_cpu(rw->reftag),
+                               le16_to_cpu(rw->apptag),
+                               le16_to_cpu(rw->appmask));
+        if (status) {
+            nvme_log_error(n, req->sq->sqid, req->cmd.cid, status,
+                           le32_to_cpu(rw->nsid), slba);
+            goto out;
+        }
     }
-}
 
-static inline void nvme_set_timestamp(NvmeCtrl *n, uint64_t ts)
-{
-    trace_nvme_setfeat_timestamp(ts);
+    if (!pract || ms > sizeof(NvmeDifTuple)) {
+        nvme_addr_write(n, le64_to_cpu(rw->mptr), md, nlb * ms);
+    }
 
-    n->host_timestamp = le64_to_cpu(ts);
-    n->timestamp_set_qemu_clock_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+out:
+    g_free(data);
+    return status;
 }
 
-static inline uint64_t nvme_get_timestamp(const NvmeCtrl *n)
+/*
+ * With PRACT the zeroes get PI, otherwise nvme_rw_md_aio() zeroes the
+ * metadata so it reads as deallocated.
+ */
+static void nvme_write_zeros_md(NvmeNamespace *ns, NvmeRwCmd *rw,
+                                NvmeRequest *req, uint32_t nlb)
 {
-    uint64_t current_time = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-    uint64_t elapsed_time = current_time - n->timestamp_set_qemu_clock_ms;
-
-    union nvme_timestamp {
-        struct {
-            uint64_t timestamp:48;
-            uint64_t sync:1;
-            uint64_t origin:3;
-            uint64_t rsvd1:12;
-        };
-        uint64_t all;
-    };
-
-    union nvme_timestamp ts;
-    ts.all = 0;
+    if (nvme_ns_pi(ns) &&
+        (le16_to_cpu(rw->control) & NVME_RW_PRINFO_PRACT)) {
+        req->md = g_malloc0((size_t)nlb * nvme_ns_ms(ns));
+        nvme_pi_generate(ns, NULL, req->md, nlb, le32_to_cpu(rw->reftag),
+                         le16_to_cpu(rw->apptag));
+    }
+}
 
-    /*
-     * If the sum of the Timestamp value set by the host and the elapsed
-     * time exceeds 2^48, the value returned should be reduced modulo 2^48.
-     */
-    ts.timestamp = (n->host_timestamp + elapsed_time) & 0xffffffffffff;
+/*
+ * Compare the metadata nvme_rw_md_aio() read with what the host sent at
+ * MPTR, unless PRACT strips the PI, after checking the stored PI as PRCHK
+ * asks.
+ */
+static uint16_t nvme_compare_md(NvmeCtrl *n, NvmeNamespace *ns,
+                                NvmeRequest *req, const uint8_t *data)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    uint16_t control = le16_to_cpu(rw->control);
+    uint32_t nlb = le16_to_cpu(rw->nlb) + 1;
+    size_t len = (size_t)nlb * nvme_ns_ms(ns);
+    uint8_t *md = req->md;
+    uint8_t *host = NULL;
+    uint16_t status = NVME_SUCCESS;
 
-    /* If the host timestamp is non-zero, set the timestamp origin */
-    ts.origin = n->host_timestamp ? 0x01 : 0x00;
+    if (nvme_ns_pi(ns) && (control & NVME_RW_PRINFO_PRCHK_MASK)) {
+        status = nvme_pi_check(ns, data, md, nlb, control,
+                               le32_to_cpu(rw->reftag),
+                               le16_to_cpu(rw->apptag),
+                               le16_to_cpu(rw->appmask));
+        if (status) {
+            goto out;
+        }
+    }
 
-    trace_nvme_getfeat_timestamp(ts.all);
+    if (!nvme_ns_pi(ns) || !(control & NVME_RW_PRINFO_PRACT)) {
+        host = g_malloc(len);
+        nvme_addr_read(n, le64_to_cpu(rw->mptr), host, len);
+        if (memcmp(host, md, len)) {
+            status = NVME_CMP_FAILURE;
+        }
+    }
 
-    return cpu_to_le64(ts.all);
+out:
+    g_free(host);
+    return status;
 }
 
-static uint16_t nvme_get_feature_timestamp(NvmeCtrl *n, NvmeCmd *cmd)
+/*
+ * A Compare takes two host buffers of its size; without MDTS a guest could
+ * otherwise have 256 MiB allocated twice for every Compare it queues.
+ */
+#define NVME_COMPARE_MAX    (1 * MiB)
+
+/*
+ * Compare the data nvme_rw() read into a bounce buffer with the host's.
+ * memcmp() is vectorised by the C library, so this costs little more than
+ * fetching the host's copy.
+ */
+static uint16_t nvme_compare(NvmeCtrl *n, NvmeRequest *req)
 {
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    uint8_t *data = req->iov.iov[0].iov_base;
+    uint32_t len = req->iov.size;
+    uint8_t *buf = g_malloc(len);
+    uint16_t status;
 
-    uint64_t timestamp = nvme_get_timestamp(n);
+    status = nvme_dma_write_prp(n, buf, len, le64_to_cpu(rw->prp1),
+                                le64_to_cpu(rw->prp2));
+    if (!status && memcmp(buf, data, len)) {
+        status = NVME_CMP_FAILURE;
+    }
 
-    return nvme_dma_read_prp(n, (uint8_t *)&timestamp,
-                                 sizeof(timestamp), prp1, prp2);
+    g_free(buf);
+    return status;
 }
 
-static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static void nvme_ra_invalidate(NvmeCtrl *n, uint64_t offset, uint64_t len);
+static void nvme_fused_next(NvmeCtrl *n, NvmeRequest *req);
+
+static void nvme_rw_md_cb(void *opaque, int ret);
+
+/*
+ * The metadata of a command is read or written once its data is, so that
+ * a failed write leaves the old PI in place. Returns false if there is none.
+ */
+static bool nvme_rw_md_aio(NvmeCtrl *n, NvmeRequest *req)
 {
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t result;
+    if (!req->md_len) {
+        return false;
+    }
 
-    switch (dw10) {
-    case NVME_VOLATILE_WRITE_CACHE:
-        result = blk_enable_write_cache(n->conf.blk);
-        trace_nvme_getfeat_vwcache(result ? "enabled" : "disabled");
-        break;
-    case NVME_NUMBER_OF_QUEUES:
-        result = cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
-        trace_nvme_getfeat_numq(result);
-        break;
-    case NVME_TIMESTAMP:
-        return nvme_get_feature_timestamp(n, cmd);
-        break;
+    switch (req->cmd.opcode) {
+    case NVME_CMD_WRITE_ZEROS:
+        if (!req->md) {
+            /* deallocated metadata reads as all ones, see nvme_md_rw() */
+            req->aiocb = blk_aio_pwrite_zeroes(n->conf.blk, req->md_offset,
+                                               req->md_len, BDRV_REQ_MAY_UNMAP,
+                                               nvme_rw_md_cb, req);
+            return true;
+        }
+        /* fall through */
+    case NVME_CMD_WRITE:
+    case NVME_CMD_ZONE_APPEND:
+        nvme_md_invert(req->md, req->md_len);
+        qemu_iovec_init_buf(&req->md_iov, req->md, req->md_len);
+        req->aiocb = blk_aio_pwritev(n->conf.blk, req->md_offset,
+                                     &req->md_iov, 0, nvme_rw_md_cb, req);
+        return true;
     default:
-        trace_nvme_err_invalid_getfeat(dw10);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        req->md = g_malloc(req->md_len);
+        qemu_iovec_init_buf(&req->md_iov, req->md, req->md_len);
+        req->aiocb = blk_aio_preadv(n->conf.blk, req->md_offset,
+                                    &req->md_iov, 0, nvme_rw_md_cb, req);
+        return true;
     }
+}
 
-    req->cqe.result = result;
-    return NVME_SUCCESS;
+static void nvme_rw_end(NvmeCtrl *n, NvmeRequest *req)
+{
+    if (req->cmd.opcode == NVME_CMD_COMPARE) {
+        g_free(req->iov.iov[0].iov_base);
+        qemu_iovec_destroy(&req->iov);
+    }
+    if (req->has_sg) {
+        qemu_sglist_destroy(&req->qsg);
+    }
+    if (req->fused) {
+        nvme_fused_next(n, req);
+    } else {
+        nvme_complete_req(n, req);
+    }
 }
 
-static uint16_t nvme_set_feature_timestamp(NvmeCtrl *n, NvmeCmd *cmd)
+static inline NvmeZone *nvme_get_zone(NvmeNamespace *ns, uint64_t slba);
+static void nvme_zone_persist(NvmeCtrl *n, NvmeNamespace *ns, NvmeZone *zone);
+
+static void nvme_rw_cb(void *opaque, int ret)
 {
-    uint16_t ret;
-    uint64_t timestamp;
-    uint64_t prp1 = le64_to_cpu(cmd->prp1);
-    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeRequest *req = opaque;
+    NvmeSQueue *sq = req->sq;
+    NvmeCtrl *n = sq->ctrl;
+    uint8_t opc = req->cmd.opcode;
 
-    ret = nvme_dma_write_prp(n, (uint8_t *)&timestamp,
-                                sizeof(timestamp), prp1, prp2);
-    if (ret != NVME_SUCCESS) {
-        return ret;
+    /* the write pointer moved at submission, persist it now it's written */
+    if (sq->sqid && (opc == NVME_CMD_WRITE || opc == NVME_CMD_WRITE_ZEROS ||
+                     opc == NVME_CMD_ZONE_APPEND)) {
+        NvmeNamespace *ns = &n->namespaces[le32_to_cpu(req->cmd.nsid) - 1];
+
+        if (ns->zoned) {
+            nvme_zone_persist(n, ns, nvme_get_zone(ns, req->wc_offset >>
+                                                   nvme_ns_lbaf(ns)->ds));
+        }
     }
 
-    nvme_set_timestamp(n, timestamp);
+    /* read-ahead issued while the write was in flight may have old data */
+    if (n->ra.size && sq->sqid && (req->cmd.opcode == NVME_CMD_WRITE ||
+                                   req->cmd.opcode == NVME_CMD_WRITE_ZEROS ||
+                                   req->cmd.opcode == NVME_CMD_ZONE_APPEND)) {
+        nvme_ra_invalidate(n, req->wc_offset, req->wc_len);
+    }
+    if (!req->has_sg && !ret && n->cmbsz && req->cmd.opcode == NVME_CMD_READ) {
+        nvme_cmb_iov_dirty(n, &req->iov);
+    }
 
-    return NVME_SUCCESS;
+    if (!ret) {
+        block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
+        req->status = NVME_SUCCESS;
+        if (req->cmd.opcode == NVME_CMD_COMPARE) {
+            req->status = nvme_compare(n, req);
+        }
+        if (!req->status && nvme_rw_md_aio(n, req)) {
+            return;
+        }
+    } else {
+        block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+        /* cancelled by an Abort */
+        req->status = ret == -ECANCELED ? NVME_CMD_ABORT_REQ :
+                      ret == -ENOSPC ? NVME_CAP_EXCEEDED :
+                      NVME_INTERNAL_DEV_ERROR;
+        if (ret != -ECANCELED) {
+            NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+
+            nvme_log_error(n, sq->sqid, req->cmd.cid, req->status,
+                           le32_to_cpu(rw->nsid),
+                           req->cmd.opcode == NVME_CMD_FLUSH ? 0 :
+                           le64_to_cpu(rw->slba));
+        }
+    }
+    nvme_rw_end(n, req);
 }
 
-static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static void nvme_rw_md_cb(void *opaque, int ret)
 {
-    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
-    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    NvmeRequest *req = opaque;
+    NvmeCtrl *n = req->sq->ctrl;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    NvmeNamespace *ns = &n->namespaces[le32_to_cpu(rw->nsid) - 1];
+
+    if (ret) {
+        req->status = ret == -ECANCELED ? NVME_CMD_ABORT_REQ :
+                      NVME_INTERNAL_DEV_ERROR;
+        if (ret != -ECANCELED) {
+            nvme_log_error(n, req->sq->sqid, req->cmd.cid, req->status,
+                           le32_to_cpu(rw->nsid), le64_to_cpu(rw->slba));
+        }
+    } else if (req->cmd.opcode == NVME_CMD_READ) {
+        nvme_md_invert(req->md, req->md_len);
+        req->status = nvme_rw_read_md(n, req);
+    } else if (req->cmd.opcode == NVME_CMD_COMPARE) {
+        nvme_md_invert(req->md, req->md_len);
+        req->status = nvme_compare_md(n, ns, req, req->iov.iov[0].iov_base);
+    }
+    nvme_rw_end(n, req);
+}
 
-    switch (dw10) {
-    case NVME_VOLATILE_WRITE_CACHE:
-        blk_set_enable_write_cache(n->conf.blk, dw11 & 1);
-        break;
-    case NVME_NUMBER_OF_QUEUES:
-        trace_nvme_setfeat_numq((dw11 & 0xFFFF) + 1,
-                                ((dw11 >> 16) & 0xFFFF) + 1,
-                                n->num_queues - 1, n->num_queues - 1);
-        req->cqe.result =
-            cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
-        break;
+/* keep at least this many free blocks per plane, reclaiming with GC */
+#define NVME_NAND_GC_LOW 2
 
-    case NVME_TIMESTAMP:
-        return nvme_set_feature_timestamp(n, cmd);
-        break;
+/* free blocks per plane a Deterministic Window can write into without GC */
+#define NVME_PLM_GC_RESERVE 4
+#define NVME_PLM_DTWIN_MS   1000
 
-    default:
-        trace_nvme_err_invalid_setfeat(dw10);
-        return NVME_INVALID_FIELD | NVME_DNR;
+/* the window of NVM Set 1, 0 while Predictable Latency Mode is off */
+static inline uint8_t nvme_plm_window(NvmeCtrl *n)
+{
+    return n->plm.enabled ? n->plm.window : 0;
+}
+
+/* free blocks GC keeps per plane; a DTWIN lives off the PLM reserve */
+static uint32_t nvme_nand_gc_low(NvmeCtrl *n)
+{
+    if (!n->plm.supported ||
+        nvme_plm_window(n) == NVME_PLM_WINDOW_DTWIN) {
+        return NVME_NAND_GC_LOW;
     }
-    return NVME_SUCCESS;
+    return NVME_NAND_GC_LOW + NVME_PLM_GC_RESERVE;
 }
 
-static uint16_t nvme_get_smart(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+static inline uint32_t nvme_nand_plane_chan(NvmeNand *nand, uint32_t p)
 {
-    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
-    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    return p / (nand->dies * nand->planes);
+}
 
-    if ( sizeof(NvmeSmartLog) < ( ( numd + 1 ) << 2 ) ) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+/* schedule one page program or read on a plane, returning its finish time */
+static int64_t nvme_nand_page_op(NvmeNand *nand, uint32_t p, int64_t now,
+                                 bool is_prog)
+{
+    NvmeNandPlane *plane = &nand->plane[p];
+    int64_t *chan = &nand->chan_avail_ns[nvme_nand_plane_chan(nand, p)];
+    int64_t xfer = (int64_t)nand->xfer_lat_us * SCALE_US;
+    int64_t start;
+
+    if (is_prog) {
+        /* data goes over the channel first, then the plane programs it */
+        start = MAX(now, *chan);
+        *chan = start + xfer;
+        start = MAX(*chan, plane->next_avail_ns);
+        plane->next_avail_ns = start + (int64_t)nand->prog_lat_us * SCALE_US;
+        return plane->next_avail_ns;
     }
 
-    return nvme_dma_read_prp(_ctrl, (uint8_t *)&_ctrl->smart, ( numd + 1 ) << 2, prp1, prp2);
+    start = MAX(now, plane->next_avail_ns);
+    plane->next_avail_ns = start + (int64_t)nand->read_lat_us * SCALE_US;
+    start = MAX(plane->next_avail_ns, *chan);
+    *chan = start + xfer;
+    return *chan;
 }
 
-static uint16_t nvme_get_error_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+/*
+ * With a Host Memory Buffer the L2P table lives in guest memory, which the
+ * guest could scribble over, so its entries are only trusted if the reverse
+ * map agrees.
+ */
+static uint32_t nvme_nand_get_l2p(NvmeNand *nand, uint64_t lpn)
 {
-    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
-    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    uint32_t ppn;
 
-    if ( sizeof(NvmeErrorLog) * NVME_NUM_ERROR_LOG < ( ( numd + 1 ) << 2 ) ) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+    if (!nand->l2p_pages) {
+        return nand->l2p[lpn];
     }
+    ppn = le32_to_cpu(nand->l2p_pages[lpn / NVME_NAND_L2P_PER_PAGE]
+                                     [lpn % NVME_NAND_L2P_PER_PAGE]);
+    if (ppn >= nand->nr_ppns || nand->p2l[ppn] != lpn) {
+        return NVME_NAND_UNMAPPED;
+    }
+    return ppn;
+}
 
-    return nvme_dma_read_prp(_ctrl, (uint8_t *)(_ctrl->error_info), ( numd + 1 ) << 2, prp1, prp2);
+static void nvme_nand_set_l2p(NvmeNand *nand, uint64_t lpn, uint32_t ppn)
+{
+    NvmeCtrl *n = container_of(nand, NvmeCtrl, nand);
+    uint32_t val = cpu_to_le32(ppn);
+
+    if (!nand->l2p_pages) {
+        nand->l2p[lpn] = ppn;
+        return;
+    }
+    /* written with DMA rather than through the mapping, so migration sees it */
+    pci_dma_write(&n->parent_obj,
+                  nand->l2p_addrs[lpn / NVME_NAND_L2P_PER_PAGE] +
+                  (lpn % NVME_NAND_L2P_PER_PAGE) * sizeof(val),
+                  &val, sizeof(val));
 }
 
-static uint16_t nvme_get_fw_slot_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+/*
+ * Returns the time at which the L2P entry of lpn is available. Without an
+ * HMB, a device with a mapping cache smaller than the table keeps the rest
+ * of it in flash: a miss reads the table page in, and evicting a dirty page
+ * programs it back. Table pages are spread over the planes and do not take
+ * part in garbage collection.
+ */
+static int64_t nvme_nand_map_load(NvmeNand *nand, uint64_t lpn, int64_t now,
+                                  bool dirty)
 {
-    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
-    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    uint32_t page = lpn / NVME_NAND_L2P_PER_PAGE;
+    NvmeNandMapSlot *slot;
+    uint32_t s;
 
-    if ( sizeof(NvmeFwSlotInfoLog) < ( ( numd + 1 ) << 2 ) ) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+    if (!nand->nr_map_slots || nand->l2p_pages) {
+        return now;
     }
 
-    return nvme_dma_read_prp(_ctrl, (uint8_t *)&(_ctrl->fw_slot_info), ( numd + 1 ) << 2, prp1, prp2);
+    s = nand->map_slot[page];
+    if (s != NVME_NAND_UNMAPPED) {
+        nand->map_cache[s].ref = true;
+        nand->map_cache[s].dirty |= dirty;
+        return now;
+    }
+
+    for (;;) {
+        s = nand->map_hand;
+        nand->map_hand = (nand->map_hand + 1) % nand->nr_map_slots;
+        slot = &nand->map_cache[s];
+        if (!slot->ref) {
+            break;
+        }
+        slot->ref = false;
+    }
+    if (slot->page != NVME_NAND_UNMAPPED) {
+        if (slot->dirty) {
+            nvme_nand_page_op(nand, slot->page % nand->nr_planes, now, true);
+        }
+        nand->map_slot[slot->page] = NVME_NAND_UNMAPPED;
+    }
+    slot->page = page;
+    slot->ref = true;
+    slot->dirty = dirty;
+    nand->map_slot[page] = s;
+    nand->map_cache_misses++;
+
+    return nvme_nand_page_op(nand, page % nand->nr_planes, now, false);
 }
 
-static uint16_t nvme_get_cse_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+static void nvme_nand_invalidate(NvmeNand *nand, uint64_t lpn)
 {
-    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
-    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    uint32_t ppn = nvme_nand_get_l2p(nand, lpn);
 
-    if ( NVME_CED_SZ_BYTE < ( ( numd + 1 ) << 2 ) ) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+    if (ppn != NVME_NAND_UNMAPPED) {
+        nand->blocks[ppn / nand->pages_per_block].valid--;
+        nand->p2l[ppn] = NVME_NAND_UNMAPPED;
+        nvme_nand_set_l2p(nand, lpn, NVME_NAND_UNMAPPED);
     }
+}
 
-    uint8_t *tmp = g_malloc0(NVME_CED_SZ_BYTE);
-    if ( tmp == NULL ) {
-	qemu_printf( "[NVME] [ Get Log Page / CSE ] failed in g_malloc(): %s\n", strerror(errno) );
-        return NVME_INVALID_FIELD | NVME_DNR;
+/* pages a placement handle can still program on the plane */
+static uint64_t nvme_nand_plane_room(NvmeNand *nand, uint32_t p, uint8_t ruh)
+{
+    NvmeNandPlane *plane = &nand->plane[p];
+    uint32_t active = plane->active_blk[ruh];
+    uint64_t room = (uint64_t)plane->nr_free * nand->pages_per_block;
+
+    if (active != NVME_NAND_UNMAPPED) {
+        room += nand->pages_per_block - nand->blocks[active].wp;
     }
-    memset( tmp, 0, NVME_CED_SZ_BYTE ); // clear
-    memcpy( (void *)tmp, (const void *)nvme_ced_admin, NVME_CED_NUM_ADM_CMD << 2 );
-    memcpy( (void *)( tmp + (NVME_CED_NUM_ADM_CMD << 2) ), (const void *)nvme_ced_io, NVME_CED_NUM_IO_CMD << 2 );
+    return room;
+}
 
-    uint16_t ret = nvme_dma_read_prp(_ctrl, (uint8_t *)tmp, ( numd + 1 ) << 2, prp1, prp2);
-    g_free( tmp );
-    return ret;
+static bool nvme_nand_plane_has_room(NvmeNand *nand, uint32_t p, uint8_t ruh)
+{
+    return nvme_nand_plane_room(nand, p, ruh) > 0;
 }
 
-static uint16_t nvme_get_telemetry(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+static bool nvme_nand_block_open(NvmeCtrl *n, NvmeNandPlane *plane,
+                                 uint32_t blk)
 {
-    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
-    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
-    uint8_t  bCreate = ( _cmd->res2 ) & 0x1;
-    unsigned int uiAllocSize = 0;
-    uint8_t  *res = NULL;
+    uint32_t i;
 
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] Command received\n" );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[11: 8] LSP   = 0x%X\n", bCreate );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[   15] RAE   = 0x%X\n", ((_cmd->res2) >> 15) & 0x1 );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[31:16] NUMDL = 0x%04X\n", le16_to_cpu(_cmd->numd) );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW11[15: 0] NUMDU = 0x%08X\n", le32_to_cpu(_cmd->cdw11) & 0x0000FFFF );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW12[31: 0] LPOL  = 0x%08X\n", le32_to_cpu(_cmd->cdw12) );
-    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW13[31: 0] LPOU  = 0x%08X\n", le32_to_cpu(_cmd->cdw13) );
+    for (i = 0; i < n->placement.nr_handles; i++) {
+        if (plane->active_blk[i] == blk) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if ( bCreate )
-    {
-	/**
-	 * Windows sets "Create Telemetry Host-Initiated Data" bit to 1
-	 * ONLY IF calling DeviceIoControl() with IOCTL_STORAGE_GET_DEVICE_INTERNAL_LOG.
-	 *
-	 * In this case, the data layout for Telemetry Header is different from the one of NVMe.
-	 */
-	uiAllocSize = sizeof(DeviceInternalStatusData);
-	qemu_printf( "[NVME] [ Get Log Page / Telemetry ] uiAllocSize = %d\n", uiAllocSize);
-	res = g_malloc0(uiAllocSize);
-	if ( res == NULL ) {
-	    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] failed in g_malloc(): %s\n", strerror(errno) );
-	    return NVME_INVALID_FIELD | NVME_DNR;
-	}
-	memset( res, 0, uiAllocSize ); // clear
+/* each placement handle fills its own open block on the plane */
+static int64_t nvme_nand_program(NvmeNand *nand, uint64_t lpn, uint32_t p,
+                                 uint8_t ruh, int64_t now)
+{
+    NvmeNandPlane *plane = &nand->plane[p];
+    uint32_t *active = &plane->active_blk[ruh];
+    uint32_t ppn;
+
+    if (*active == NVME_NAND_UNMAPPED ||
+        nand->blocks[*active].wp == nand->pages_per_block) {
+        assert(plane->nr_free);
+        *active = plane->free_blks[--plane->nr_free];
+        nand->blocks[*active].ruh = ruh;
+    }
 
-	DeviceInternalStatusData *tmp = (DeviceInternalStatusData *)res;
-//      tmp->T10VendorId        = 0x0000000000000001; // NG
-//      tmp->T10VendorId        = 0x0000000000010000; // NG
-        tmp->T10VendorId        = 0x0000000100000000; // OK
-//      tmp->T10VendorId        = 0x0001000000000000; // NG
-	// other fields are left zero
-    }
-    else
-    {
-	uiAllocSize = sizeof(NvmeTelemetryLogHeader);
-	qemu_printf( "[NVME] [ Get Log Page / Telemetry ] uiAllocSize = %d\n", uiAllocSize);
-	res = g_malloc0(uiAllocSize);
-	if ( res == NULL ) {
-	    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] failed in g_malloc(): %s\n", strerror(errno) );
-	    return NVME_INVALID_FIELD | NVME_DNR;
-	}
-	memset( res, 0, uiAllocSize ); // clear
+    ppn = *active * nand->pages_per_block + nand->blocks[*active].wp++;
+    nand->blocks[*active].valid++;
+    nand->p2l[ppn] = lpn;
+    nvme_nand_set_l2p(nand, lpn, ppn);
+    nand->nand_pages_written++;
+    nand->ruh_pages_written[ruh]++;
 
-	NvmeTelemetryLogHeader *tmp = (NvmeTelemetryLogHeader *)res;
-	tmp->log_id = _cmd->lid; // shall be 07h (Host-Initiated) or 08h (Controller-Initiated)
-	// other fields are left zero
-    }
+    return nvme_nand_page_op(nand, p, now, true);
+}
 
-    uint16_t ret = nvme_dma_read_prp(_ctrl, res, uiAllocSize, prp1, prp2);
+static void nvme_nand_erase(NvmeNand *nand, uint32_t blk, int64_t now)
+{
+    NvmeNandPlane *plane = &nand->plane[blk / nand->blocks_per_plane];
+
+    plane->next_avail_ns = MAX(now, plane->next_avail_ns) +
+                           (int64_t)nand->erase_lat_us * SCALE_US;
+    nand->blocks[blk].wp = 0;
+    nand->blocks[blk].valid = 0;
+    nand->blocks[blk].erase_count++;
+    nand->total_erase_count++;
+    plane->free_blks[plane->nr_free++] = blk;
+}
 
-    g_free( res );
-    return ret;
+static void nvme_nand_update_smart(NvmeCtrl *n)
+{
+    NvmeNand *nand = &n->nand;
+    uint64_t nr_blocks = (uint64_t)nand->nr_planes * nand->blocks_per_plane;
+
+    n->smart.percentage_used = MIN(255, nand->total_erase_count * 100 /
+                                        (nr_blocks * nand->pe_cycles));
 }
 
-static uint16_t nvme_get_log_page(NvmeCtrl *_ctrl, NvmeCmd *_cmd, NvmeRequest *_req)
+/*
+ * Greedy garbage collection: relocate the valid pages of the full block
+ * with the fewest valid pages within the same plane, then erase it. The
+ * relocation reads and programs occupy the plane like host I/O does, and
+ * the pages stay with the placement handle that wrote the block, so only a
+ * block whose pages fit in the room that handle has left can be picked.
+ */
+static void nvme_nand_gc(NvmeCtrl *n, uint32_t p, int64_t now)
 {
-    NvmeGetLogPageCmd *thisCmd = (NvmeGetLogPageCmd *)_cmd;
+    NvmeNand *nand = &n->nand;
+    NvmeNandPlane *plane = &nand->plane[p];
+    uint32_t first = p * nand->blocks_per_plane;
+    uint32_t victim, i, pg;
+
+    while (plane->nr_free < nvme_nand_gc_low(n)) {
+        victim = NVME_NAND_UNMAPPED;
+        for (i = first; i < first + nand->blocks_per_plane; i++) {
+            if (nand->blocks[i].wp < nand->pages_per_block ||
+                nvme_nand_block_open(n, plane, i) ||
+                nand->blocks[i].valid >
+                nvme_nand_plane_room(nand, p, nand->blocks[i].ruh)) {
+                continue;
+            }
+            if (victim == NVME_NAND_UNMAPPED ||
+                nand->blocks[i].valid < nand->blocks[victim].valid) {
+                victim = i;
+            }
+        }
+        if (victim == NVME_NAND_UNMAPPED ||
+            nand->blocks[victim].valid == nand->pages_per_block) {
+            break;
+        }
 
-    switch ( thisCmd->lid ) {
-    case NVME_LOG_ERROR_INFO:
-        return nvme_get_error_info(_ctrl, thisCmd, _req);
-    case NVME_LOG_SMART_INFO:
-        return nvme_get_smart(_ctrl, thisCmd, _req);
-    case NVME_LOG_FW_SLOT_INFO:
-        return nvme_get_fw_slot_info(_ctrl, thisCmd, _req);
-    case NVME_LOG_CSE_INFO:
-        return nvme_get_cse_info(_ctrl, thisCmd, _req);
-    case NVME_LOG_TELEMETRY_HOST:
-	qemu_printf( "[NVME] Get Log Page: Telemetry Host-Initiated\n" );
-        return nvme_get_telemetry(_ctrl, thisCmd, _req);
-    case NVME_LOG_TELEMETRY_CTLR:
-	qemu_printf( "[NVME] Get Log Page: Telemetry Controller-Initiated\n" );
-        return nvme_get_telemetry(_ctrl, thisCmd, _req);
+        for (pg = 0; pg < nand->pages_per_block; pg++) {
+            uint32_t lpn = nand->p2l[victim * nand->pages_per_block + pg];
 
-    default:
-        // REVISIT: need to implement trace event like "trace_nvme_err_invalid_logid(cdw10)"
-        return NVME_INVALID_LOG_ID | NVME_DNR;
+            if (lpn == NVME_NAND_UNMAPPED) {
+                continue;
+            }
+            nvme_nand_page_op(nand, p, now, false);
+            nvme_nand_invalidate(nand, lpn);
+            nvme_nand_program(nand, lpn, p, nand->blocks[victim].ruh, now);
+            nand->gc_pages_moved++;
+        }
+        nvme_nand_erase(nand, victim, now);
+        nand->gc_blocks_erased++;
     }
 
-    return NVME_SUCCESS;
+    nvme_nand_update_smart(n);
 }
 
-static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+/*
+ * Pick the next plane in channel-first stripe order that can take a page.
+ * With every placement handle holding an open block per plane, GC may find
+ * nothing to reclaim anywhere, and then there is no plane.
+ */
+static uint32_t nvme_nand_next_plane(NvmeCtrl *n, uint8_t ruh, int64_t now)
 {
-    switch (cmd->opcode) {
-    case NVME_ADM_CMD_DELETE_SQ:
-        return nvme_del_sq(n, cmd);
-    case NVME_ADM_CMD_CREATE_SQ:
-        return nvme_create_sq(n, cmd);
-    case NVME_ADM_CMD_GET_LOG_PAGE:
-        return nvme_get_log_page(n, cmd, req);
-    case NVME_ADM_CMD_DELETE_CQ:
-        return nvme_del_cq(n, cmd);
-    case NVME_ADM_CMD_CREATE_CQ:
-        return nvme_create_cq(n, cmd);
-    case NVME_ADM_CMD_IDENTIFY:
-        return nvme_identify(n, cmd);
-    case NVME_ADM_CMD_SET_FEATURES:
-        return nvme_set_feature(n, cmd, req);
-    case NVME_ADM_CMD_GET_FEATURES:
-        return nvme_get_feature(n, cmd, req);
-    default:
-        trace_nvme_err_invalid_admin_opc(cmd->opcode);
-        return NVME_INVALID_OPCODE | NVME_DNR;
+    NvmeNand *nand = &n->nand;
+    uint32_t per_chan = nand->dies * nand->planes;
+    uint32_t i, p, cur;
+
+    for (i = 0; i < nand->nr_planes; i++) {
+        cur = nand->next_stripe++;
+        p = (cur % nand->channels) * per_chan +
+            (cur / nand->channels) % per_chan;
+        if (nand->plane[p].nr_free < nvme_nand_gc_low(n)) {
+            if (nvme_plm_window(n) == NVME_PLM_WINDOW_DTWIN) {
+                /* GC can't be put off any longer, so the DTWIN ends */
+                n->plm.excursion = true;
+                timer_mod(n->plm.timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+            }
+            nvme_nand_gc(n, p, now);
+        }
+        if (nvme_nand_plane_has_room(nand, p, ruh)) {
+            return p;
+        }
     }
+
+    return NVME_NAND_UNMAPPED;
 }
 
-static void nvme_process_sq(void *opaque)
+/*
+ * Returns the time at which the flash operations for this I/O complete, or
+ * -ENOSPC if a page of a write had nowhere to go. That page and the ones
+ * after it keep their old mapping, as the write isn't going to be issued.
+ */
+static int64_t nvme_nand_rw(NvmeCtrl *n, uint64_t offset, uint64_t len,
+                            bool is_write, uint8_t ruh)
 {
-    NvmeSQueue *sq = opaque;
-    NvmeCtrl *n = sq->ctrl;
-    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeNand *nand = &n->nand;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t done = now;
+    uint64_t lpn = offset / nand->page_size;
+    uint64_t last = (offset + len - 1) / nand->page_size;
+
+    for (; lpn <= last && lpn < nand->nr_lpns; lpn++) {
+        int64_t start = nvme_nand_map_load(nand, lpn, now, is_write);
+        uint32_t ppn, p;
+
+        if (is_write) {
+            p = nvme_nand_next_plane(n, ruh, start);
+            if (p == NVME_NAND_UNMAPPED) {
+                return -ENOSPC;
+            }
+            nvme_nand_invalidate(nand, lpn);
+            done = MAX(done, nvme_nand_program(nand, lpn, p, ruh, start));
+            nand->host_pages_written++;
+        } else if ((ppn = nvme_nand_get_l2p(nand, lpn)) != NVME_NAND_UNMAPPED) {
+            uint32_t blk = ppn / nand->pages_per_block;
+
+            done = MAX(done, nvme_nand_page_op(nand,
+                                               blk / nand->blocks_per_plane,
+                                               start, false));
+        } else {
+            done = MAX(done, start);
+        }
+    }
 
-    uint16_t status;
-    hwaddr addr;
-    NvmeCmd cmd;
-    NvmeRequest *req;
+    return done;
+}
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
+/* only pages that are completely covered by the range are unmapped */
+static void nvme_nand_trim(NvmeCtrl *n, uint64_t offset, uint64_t len)
+{
+    NvmeNand *nand = &n->nand;
+    uint64_t lpn = DIV_ROUND_UP(offset, nand->page_size);
+    uint64_t end = (offset + len) / nand->page_size;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    for (; lpn < end && lpn < nand->nr_lpns; lpn++) {
+        nvme_nand_map_load(nand, lpn, now, true);
+        nvme_nand_invalidate(nand, lpn);
+    }
+}
 
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
+/* upper bound for HMDLEC, so that the list fits into one 4 KiB page */
+#define NVME_HMB_MAX_DESCRS (4096 / sizeof(NvmeHmbDescr))
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+static void nvme_hmb_unmap(NvmeCtrl *n)
+{
+    NvmeHmb *hmb = &n->hmb;
+    NvmeNand *nand = &n->nand;
+    uint32_t i;
+
+    for (i = 0; hmb->maps && i < hmb->nr_descrs; i++) {
+        if (hmb->maps[i]) {
+            pci_dma_unmap(&n->parent_obj, hmb->maps[i], hmb->map_lens[i],
+                          DMA_DIRECTION_TO_DEVICE, 0);
         }
     }
+    g_free(hmb->maps);
+    g_free(hmb->map_lens);
+    g_free(nand->l2p_pages);
+    g_free(nand->l2p_addrs);
+    hmb->maps = NULL;
+    hmb->map_lens = NULL;
+    nand->l2p_pages = NULL;
+    nand->l2p_addrs = NULL;
 }
 
-static void nvme_clear_ctrl(NvmeCtrl *n)
+/*
+ * Map the buffer described by hmb->descrs once and move the L2P table
+ * into it, freeing the copy in QEMU memory. Entries are read through the
+ * mapping and written with DMA.
+ */
+static int nvme_hmb_map(NvmeCtrl *n)
 {
-    int i;
-
-    blk_drain(n->conf.blk);
-
-    for (i = 0; i < n->num_queues; i++) {
-        if (n->sq[i] != NULL) {
-            nvme_free_sq(n->sq[i], n);
+    NvmeHmb *hmb = &n->hmb;
+    NvmeNand *nand = &n->nand;
+    uint32_t page_size = 1 << (NVME_CC_MPS(n->bar.cc) + 12);
+    uint32_t buf[NVME_NAND_L2P_PER_PAGE];
+    uint32_t i, j, page = 0;
+    dma_addr_t off;
+
+    hmb->maps = g_new0(void *, hmb->nr_descrs);
+    hmb->map_lens = g_new0(dma_addr_t, hmb->nr_descrs);
+    nand->l2p_pages = g_new(uint32_t *, nand->nr_map_pages);
+    nand->l2p_addrs = g_new(dma_addr_t, nand->nr_map_pages);
+
+    for (i = 0; i < hmb->nr_descrs; i++) {
+        dma_addr_t addr = le64_to_cpu(hmb->descrs[i].badd);
+        dma_addr_t len = (dma_addr_t)le32_to_cpu(hmb->descrs[i].bsize) *
+                         page_size;
+
+        hmb->map_lens[i] = len;
+        hmb->maps[i] = pci_dma_map(&n->parent_obj, addr, &hmb->map_lens[i],
+                                   DMA_DIRECTION_TO_DEVICE);
+        if (!hmb->maps[i] || hmb->map_lens[i] < len) {
+            nvme_hmb_unmap(n);
+            return -1;
+        }
+        for (off = 0; off < len && page < nand->nr_map_pages;
+             off += NVME_NAND_MAP_PAGE_SIZE, page++) {
+            nand->l2p_pages[page] = (uint32_t *)((uint8_t *)hmb->maps[i] + off);
+            nand->l2p_addrs[page] = addr + off;
         }
     }
-    for (i = 0; i < n->num_queues; i++) {
-        if (n->cq[i] != NULL) {
-            nvme_free_cq(n->cq[i], n);
+    if (page < nand->nr_map_pages) {
+        nvme_hmb_unmap(n);
+        return -1;
+    }
+
+    for (page = 0; page < nand->nr_map_pages; page++) {
+        uint64_t first = (uint64_t)page * NVME_NAND_L2P_PER_PAGE;
+        uint32_t nr = MIN(NVME_NAND_L2P_PER_PAGE, nand->nr_lpns - first);
+
+        for (j = 0; j < nr; j++) {
+            buf[j] = cpu_to_le32(nand->l2p[first + j]);
         }
+        pci_dma_write(&n->parent_obj, nand->l2p_addrs[page], buf,
+                      nr * sizeof(uint32_t));
     }
+    g_free(nand->l2p);
+    nand->l2p = NULL;
 
-    blk_flush(n->conf.blk);
-    n->bar.cc = 0;
+    return 0;
 }
 
-static int nvme_start_ctrl(NvmeCtrl *n)
+/* stop using the HMB, rebuilding the L2P table from the reverse map */
+static void nvme_hmb_disable(NvmeCtrl *n)
 {
-    uint32_t page_bits = NVME_CC_MPS(n->bar.cc) + 12;
-    uint32_t page_size = 1 << page_bits;
+    NvmeHmb *hmb = &n->hmb;
+    NvmeNand *nand = &n->nand;
+    uint64_t ppn;
 
-    if (unlikely(n->cq[0])) {
-        trace_nvme_err_startfail_cq();
-        return -1;
-    }
-    if (unlikely(n->sq[0])) {
-        trace_nvme_err_startfail_sq();
-        return -1;
-    }
-    if (unlikely(!n->bar.asq)) {
-        trace_nvme_err_startfail_nbarasq();
-        return -1;
-    }
-    if (unlikely(!n->bar.acq)) {
-        trace_nvme_err_startfail_nbaracq();
-        return -1;
-    }
-    if (unlikely(n->bar.asq & (page_size - 1))) {
-        trace_nvme_err_startfail_asq_misaligned(n->bar.asq);
-        return -1;
-    }
-    if (unlikely(n->bar.acq & (page_size - 1))) {
-        trace_nvme_err_startfail_acq_misaligned(n->bar.acq);
-        return -1;
-    }
-    if (unlikely(NVME_CC_MPS(n->bar.cc) <
-                 NVME_CAP_MPSMIN(n->bar.cap))) {
-        trace_nvme_err_startfail_page_too_small(
-                    NVME_CC_MPS(n->bar.cc),
-                    NVME_CAP_MPSMIN(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(NVME_CC_MPS(n->bar.cc) >
-                 NVME_CAP_MPSMAX(n->bar.cap))) {
-        trace_nvme_err_startfail_page_too_large(
-                    NVME_CC_MPS(n->bar.cc),
-                    NVME_CAP_MPSMAX(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(NVME_CC_IOCQES(n->bar.cc) <
-                 NVME_CTRL_CQES_MIN(n->id_ctrl.cqes))) {
-        trace_nvme_err_startfail_cqent_too_small(
-                    NVME_CC_IOCQES(n->bar.cc),
-                    NVME_CTRL_CQES_MIN(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(NVME_CC_IOCQES(n->bar.cc) >
-                 NVME_CTRL_CQES_MAX(n->id_ctrl.cqes))) {
-        trace_nvme_err_startfail_cqent_too_large(
-                    NVME_CC_IOCQES(n->bar.cc),
-                    NVME_CTRL_CQES_MAX(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(NVME_CC_IOSQES(n->bar.cc) <
-                 NVME_CTRL_SQES_MIN(n->id_ctrl.sqes))) {
-        trace_nvme_err_startfail_sqent_too_small(
-                    NVME_CC_IOSQES(n->bar.cc),
-                    NVME_CTRL_SQES_MIN(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(NVME_CC_IOSQES(n->bar.cc) >
-                 NVME_CTRL_SQES_MAX(n->id_ctrl.sqes))) {
-        trace_nvme_err_startfail_sqent_too_large(
-                    NVME_CC_IOSQES(n->bar.cc),
-                    NVME_CTRL_SQES_MAX(n->bar.cap));
-        return -1;
-    }
-    if (unlikely(!NVME_AQA_ASQS(n->bar.aqa))) {
-        trace_nvme_err_startfail_asqent_sz_zero();
-        return -1;
+    if (!hmb->enabled) {
+        return;
     }
-    if (unlikely(!NVME_AQA_ACQS(n->bar.aqa))) {
-        trace_nvme_err_startfail_acqent_sz_zero();
-        return -1;
+
+    nand->l2p = g_new(uint32_t, nand->nr_lpns);
+    memset(nand->l2p, 0xff, nand->nr_lpns * sizeof(uint32_t));
+    for (ppn = 0; ppn < nand->nr_ppns; ppn++) {
+        if (nand->p2l[ppn] != NVME_NAND_UNMAPPED) {
+            nand->l2p[nand->p2l[ppn]] = ppn;
+        }
     }
 
-    n->page_bits = page_bits;
-    n->page_size = page_size;
-    n->max_prp_ents = n->page_size / sizeof(uint64_t);
-    n->cqe_size = 1 << NVME_CC_IOCQES(n->bar.cc);
-    n->sqe_size = 1 << NVME_CC_IOSQES(n->bar.cc);
-    nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
-        NVME_AQA_ACQS(n->bar.aqa) + 1, 1);
-    nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
-        NVME_AQA_ASQS(n->bar.aqa) + 1);
+    nvme_hmb_unmap(n);
+    g_free(hmb->descrs);
+    hmb->descrs = NULL;
+    hmb->nr_descrs = 0;
+    hmb->hsize = 0;
+    hmb->list_addr = 0;
+    hmb->enabled = false;
+}
 
-    nvme_set_timestamp(n, 0ULL);
+/* write-backs in flight at once, and the longest run one may cover */
+#define NVME_WCACHE_MAX_OPS         8
+#define NVME_WCACHE_MAX_RUN_PAGES   256
+/* write everything back after this long without new writes */
+#define NVME_WCACHE_IDLE_MS         100
+
+typedef struct NvmeWCacheOp {
+    NvmeCtrl        *ctrl;
+    QEMUIOVector    iov;
+    uint64_t        offset;
+    uint64_t        seq;        /* oldest data written by this op */
+    uint8_t         ruh;
+    uint32_t        nr_pages;
+    NvmeWCachePage  *pages[NVME_WCACHE_MAX_RUN_PAGES + 1];
+    QTAILQ_ENTRY(NvmeWCacheOp) entry;
+} NvmeWCacheOp;
+
+typedef struct NvmeWCacheRead {
+    NvmeRequest     *req;
+    QEMUIOVector    iov;
+    uint8_t         *buf;
+    uint64_t        offset;
+    uint32_t        len;
+    uint32_t        nr_pages;
+    NvmeWCachePage  **pages;
+} NvmeWCacheRead;
+
+static void nvme_wcache_kick(NvmeCtrl *n);
+static void nvme_wcache_progress(NvmeCtrl *n);
+
+static inline NvmeWCachePage *nvme_wcache_lookup(NvmeCtrl *n, uint64_t index)
+{
+    return g_hash_table_lookup(n->wcache.pages, &index);
+}
 
-    return 0;
+static void nvme_wcache_free_page(gpointer data)
+{
+    NvmeWCachePage *page = data;
+
+    g_free(page->data);
+    g_free(page);
 }
 
-static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
-    unsigned size)
+static void nvme_wcache_drop_page(NvmeCtrl *n, NvmeWCachePage *page)
 {
-    if (unlikely(offset & (sizeof(uint32_t) - 1))) {
-        NVME_GUEST_ERR(nvme_ub_mmiowr_misaligned32,
-                       "MMIO write not 32-bit aligned,"
-                       " offset=0x%"PRIx64"", offset);
-        /* should be ignored, fall through for now */
+    QTAILQ_REMOVE(&n->wcache.lru, page, lru_entry);
+    n->wcache.nr_pages--;
+    g_hash_table_remove(n->wcache.pages, &page->index);
+}
+
+static inline bool nvme_wcache_page_idle(NvmeWCachePage *page)
+{
+    return !page->dirty && !page->wb && !page->refs;
+}
+
+/* the sector mask of a page covered by [offset, offset + len) */
+static uint8_t nvme_wcache_mask(uint64_t index, uint64_t offset, uint64_t len)
+{
+    uint64_t start = MAX(offset, index * NVME_WCACHE_PAGE_SIZE);
+    uint64_t end = MIN(offset + len, (index + 1) * NVME_WCACHE_PAGE_SIZE);
+    uint32_t first = (start % NVME_WCACHE_PAGE_SIZE) >> BDRV_SECTOR_BITS;
+    uint32_t nr = (end - start) >> BDRV_SECTOR_BITS;
+
+    return ((1 << nr) - 1) << first;
+}
+
+static void nvme_wcache_mark_dirty(NvmeCtrl *n, NvmeWCachePage *page,
+                                   uint8_t mask)
+{
+    if (!page->dirty) {
+        page->seq = n->wcache.seq;
+        QTAILQ_INSERT_TAIL(&n->wcache.dirty, page, dirty_entry);
+        n->wcache.nr_dirty++;
     }
+    page->dirty |= mask;
+    page->valid |= mask;
+}
 
-    if (unlikely(size < sizeof(uint32_t))) {
-        NVME_GUEST_ERR(nvme_ub_mmiowr_toosmall,
-                       "MMIO write smaller than 32-bits,"
-                       " offset=0x%"PRIx64", size=%u",
-                       offset, size);
-        /* should be ignored, fall through for now */
+static void nvme_wcache_clear_dirty(NvmeCtrl *n, NvmeWCachePage *page,
+                                    uint8_t mask)
+{
+    if (page->dirty && !(page->dirty &= ~mask)) {
+        QTAILQ_REMOVE(&n->wcache.dirty, page, dirty_entry);
+        n->wcache.nr_dirty--;
     }
+}
 
-    switch (offset) {
-    case 0xc:   /* INTMS */
-        if (unlikely(msix_enabled(&(n->parent_obj)))) {
-            NVME_GUEST_ERR(nvme_ub_mmiowr_intmask_with_msix,
-                           "undefined access to interrupt mask set"
-                           " when MSI-X is enabled");
-            /* should be ignored, fall through for now */
+/* make room for nr more pages by evicting clean pages, oldest first */
+static bool nvme_wcache_reserve(NvmeCtrl *n, uint32_t nr)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeWCachePage *page, *next;
+
+    QTAILQ_FOREACH_SAFE(page, &wc->lru, lru_entry, next) {
+        if (wc->nr_pages + nr <= wc->max_pages) {
+            break;
+        }
+        if (nvme_wcache_page_idle(page)) {
+            nvme_wcache_drop_page(n, page);
+        }
+    }
+
+    return wc->nr_pages + nr <= wc->max_pages;
+}
+
+static void nvme_req_copy(NvmeRequest *req, uint8_t *buf, uint32_t len,
+                          bool to_guest)
+{
+    if (req->qsg.nsg > 0) {
+        if (to_guest) {
+            dma_buf_read(buf, len, &req->qsg);
+        } else {
+            dma_buf_write(buf, len, &req->qsg);
+        }
+    } else if (to_guest) {
+        qemu_iovec_from_buf(&req->iov, 0, buf, len);
+    } else {
+        qemu_iovec_to_buf(&req->iov, 0, buf, len);
+    }
+}
+
+/* copy a write into the cache, failing if there is no room for it */
+static bool nvme_wcache_absorb(NvmeCtrl *n, NvmeRequest *req, uint64_t offset,
+                               uint32_t len)
+{
+    NvmeWCache *wc = &n->wcache;
+    uint64_t first = offset / NVME_WCACHE_PAGE_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_WCACHE_PAGE_SIZE;
+    uint32_t missing = 0;
+    uint64_t i, pos;
+    uint8_t *buf;
+
+    for (i = first; i <= last; i++) {
+        missing += !nvme_wcache_lookup(n, i);
+    }
+    if (!nvme_wcache_reserve(n, missing)) {
+        return false;
+    }
+
+    buf = g_malloc(len);
+    nvme_req_copy(req, buf, len, false);
+
+    wc->seq++;
+    for (i = first, pos = 0; i <= last; i++) {
+        NvmeWCachePage *page = nvme_wcache_lookup(n, i);
+        uint64_t start = MAX(offset, i * NVME_WCACHE_PAGE_SIZE);
+        uint64_t end = MIN(offset + len, (i + 1) * NVME_WCACHE_PAGE_SIZE);
+
+        if (!page) {
+            page = g_new0(NvmeWCachePage, 1);
+            page->index = i;
+            page->data = g_malloc(NVME_WCACHE_PAGE_SIZE);
+            g_hash_table_insert(wc->pages, &page->index, page);
+            wc->nr_pages++;
+        } else {
+            QTAILQ_REMOVE(&wc->lru, page, lru_entry);
+        }
+        QTAILQ_INSERT_TAIL(&wc->lru, page, lru_entry);
+
+        memcpy(page->data + start % NVME_WCACHE_PAGE_SIZE, buf + pos,
+               end - start);
+        nvme_wcache_mark_dirty(n, page, nvme_wcache_mask(i, offset, len));
+        page->ruh = req->ruh;
+        pos += end - start;
+    }
+    g_free(buf);
+
+    wc->idle = false;
+    timer_mod(wc->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+              NVME_WCACHE_IDLE_MS * SCALE_MS);
+    return true;
+}
+
+/*
+ * With the cache disabled, writes go straight to the backend. Any clean
+ * copies of the range are dropped first; if the range is still dirty or in
+ * use, the write has to wait for the cache to let go of it.
+ */
+static bool nvme_wcache_bypass(NvmeCtrl *n, uint64_t offset, uint32_t len)
+{
+    uint64_t first = offset / NVME_WCACHE_PAGE_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_WCACHE_PAGE_SIZE;
+    NvmeWCachePage *page;
+    uint64_t i;
+
+    for (i = first; i <= last; i++) {
+        page = nvme_wcache_lookup(n, i);
+        if (page && !nvme_wcache_page_idle(page)) {
+            return false;
+        }
+    }
+    for (i = first; i <= last; i++) {
+        page = nvme_wcache_lookup(n, i);
+        if (page) {
+            nvme_wcache_drop_page(n, page);
+        }
+    }
+
+    return true;
+}
+
+static void nvme_rw_aio(NvmeCtrl *n, NvmeRequest *req, uint64_t data_offset,
+                        bool is_write)
+{
+    if (req->qsg.nsg > 0) {
+        req->has_sg = true;
+        req->aiocb = is_write ?
+            dma_blk_write(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
+                          nvme_rw_cb, req) :
+            dma_blk_read(n->conf.blk, &req->qsg, data_offset, BDRV_SECTOR_SIZE,
+                         nvme_rw_cb, req);
+    } else {
+        req->has_sg = false;
+        req->aiocb = is_write ?
+            blk_aio_pwritev(n->conf.blk, data_offset, &req->iov, 0, nvme_rw_cb,
+                            req) :
+            blk_aio_preadv(n->conf.blk, data_offset, &req->iov, 0, nvme_rw_cb,
+                           req);
+    }
+}
+
+/* returns false if the write has to keep waiting */
+static bool nvme_wcache_write(NvmeCtrl *n, NvmeRequest *req)
+{
+    if (!n->wcache.enabled) {
+        if (!nvme_wcache_bypass(n, req->wc_offset, req->wc_len)) {
+            return false;
+        }
+        if (n->nand.channels) {
+            req->expire_ns = nvme_nand_rw(n, req->wc_offset, req->wc_len, true,
+                                          req->ruh);
+            if (req->expire_ns < 0) {
+                req->expire_ns = 0;
+                req->has_sg = req->qsg.nsg > 0;
+                nvme_rw_cb(req, -ENOSPC);
+                return true;
+            }
+        }
+        nvme_rw_aio(n, req, req->wc_offset, true);
+        return true;
+    }
+
+    if (!nvme_wcache_absorb(n, req, req->wc_offset, req->wc_len)) {
+        return false;
+    }
+    req->has_sg = req->qsg.nsg > 0;
+    /* FUA: written back and flushed first, like a Flush that came after it */
+    if (le16_to_cpu(((NvmeRwCmd *)&req->cmd)->control) & NVME_RW_FUA) {
+        req->wc_seq = n->wcache.seq;
+        QTAILQ_INSERT_TAIL(&n->wcache.flushes, req, wc_entry);
+        nvme_wcache_kick(n);
+        return true;
+    }
+    nvme_rw_cb(req, 0);
+    return true;
+}
+
+static void nvme_wcache_read_cb(void *opaque, int ret)
+{
+    NvmeWCacheRead *rd = opaque;
+    NvmeRequest *req = rd->req;
+    NvmeCtrl *n = req->sq->ctrl;
+    uint32_t i, s;
+
+    if (!ret) {
+        /* cached sectors are at least as new as what the backend returned */
+        for (i = 0; i < rd->nr_pages; i++) {
+            NvmeWCachePage *page = rd->pages[i];
+            uint8_t mask = page->valid & nvme_wcache_mask(page->index,
+                                                          rd->offset, rd->len);
+
+            for (s = 0; s < NVME_WCACHE_SECTORS; s++) {
+                uint64_t pos = page->index * NVME_WCACHE_PAGE_SIZE +
+                               (s << BDRV_SECTOR_BITS);
+
+                if (mask & (1 << s)) {
+                    memcpy(rd->buf + pos - rd->offset,
+                           page->data + (s << BDRV_SECTOR_BITS),
+                           BDRV_SECTOR_SIZE);
+                }
+            }
+        }
+        nvme_req_copy(req, rd->buf, rd->len, true);
+    }
+
+    for (i = 0; i < rd->nr_pages; i++) {
+        rd->pages[i]->refs--;
+    }
+    g_free(rd->pages);
+    g_free(rd->buf);
+    g_free(rd);
+
+    req->has_sg = req->qsg.nsg > 0;
+    nvme_rw_cb(req, ret);
+
+    /* unpinned pages may be what a waiting write needs */
+    if (!QTAILQ_EMPTY(&n->wcache.waiting)) {
+        nvme_wcache_progress(n);
+    }
+}
+
+/*
+ * Reads that touch the cache are served from it if it holds every sector,
+ * and otherwise read into a bounce buffer that the cached sectors are laid
+ * over. The pages involved are pinned until then.
+ */
+static bool nvme_wcache_read(NvmeCtrl *n, NvmeRequest *req, uint64_t offset,
+                             uint32_t len)
+{
+    uint64_t first = offset / NVME_WCACHE_PAGE_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_WCACHE_PAGE_SIZE;
+    NvmeWCacheRead *rd;
+    NvmeWCachePage *page;
+    bool hit = true;
+    uint64_t i;
+
+    rd = g_new0(NvmeWCacheRead, 1);
+    rd->pages = g_new(NvmeWCachePage *, last - first + 1);
+    for (i = first; i <= last; i++) {
+        page = nvme_wcache_lookup(n, i);
+        if (!page) {
+            hit = false;
+            continue;
+        }
+        if ((page->valid & nvme_wcache_mask(i, offset, len)) !=
+            nvme_wcache_mask(i, offset, len)) {
+            hit = false;
+        }
+        rd->pages[rd->nr_pages++] = page;
+    }
+    if (!rd->nr_pages) {
+        g_free(rd->pages);
+        g_free(rd);
+        return false;
+    }
+
+    rd->req = req;
+    rd->buf = g_malloc(len);
+    rd->offset = offset;
+    rd->len = len;
+    for (i = 0; i < rd->nr_pages; i++) {
+        rd->pages[i]->refs++;
+        QTAILQ_REMOVE(&n->wcache.lru, rd->pages[i], lru_entry);
+        QTAILQ_INSERT_TAIL(&n->wcache.lru, rd->pages[i], lru_entry);
+    }
+
+    if (hit) {
+        nvme_wcache_read_cb(rd, 0);
+        return true;
+    }
+
+    if (n->nand.channels) {
+        req->expire_ns = nvme_nand_rw(n, offset, len, false, 0);
+    }
+    qemu_iovec_init_buf(&rd->iov, rd->buf, len);
+    req->aiocb = blk_aio_preadv(n->conf.blk, offset, &rd->iov, 0,
+                                nvme_wcache_read_cb, rd);
+    return true;
+}
+
+/* called from nvme_rw; returns true if the cache took care of the request */
+static bool nvme_wcache_rw(NvmeCtrl *n, NvmeRequest *req, uint64_t offset,
+                           uint32_t len, bool is_write, uint16_t *status)
+{
+    *status = NVME_NO_COMPLETE;
+
+    if (!is_write) {
+        return nvme_wcache_read(n, req, offset, len);
+    }
+
+    req->wc_offset = offset;
+    req->wc_len = len;
+    if (!QTAILQ_EMPTY(&n->wcache.waiting) || !nvme_wcache_write(n, req)) {
+        QTAILQ_INSERT_TAIL(&n->wcache.waiting, req, wc_entry);
+        nvme_wcache_kick(n);
+    }
+    return true;
+}
+
+/* overwrite cached copies of a range that was zeroed or deallocated */
+static void nvme_wcache_zero(NvmeCtrl *n, uint64_t offset, uint64_t len)
+{
+    uint64_t first = offset / NVME_WCACHE_PAGE_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_WCACHE_PAGE_SIZE;
+    NvmeWCachePage *page;
+    uint64_t i;
+    uint32_t s;
+
+    if (!len) {
+        return;
+    }
+    for (i = first; i <= last; i++) {
+        uint8_t mask;
+
+        page = nvme_wcache_lookup(n, i);
+        if (!page) {
+            continue;
+        }
+        mask = page->valid & nvme_wcache_mask(i, offset, len);
+        for (s = 0; s < NVME_WCACHE_SECTORS; s++) {
+            if (mask & (1 << s)) {
+                memset(page->data + (s << BDRV_SECTOR_BITS), 0,
+                       BDRV_SECTOR_SIZE);
+            }
+        }
+        if (mask) {
+            n->wcache.seq++;
+            nvme_wcache_mark_dirty(n, page, mask);
+        }
+    }
+}
+
+/*
+ * Flush epochs. A Flush only has to cover the writes that completed before
+ * it arrived, so one that comes in while a backend flush is in flight, and
+ * no write has completed since that one started, completes with it. The
+ * others wait together for the next backend flush, which starts as soon as
+ * the one in flight is done.
+ */
+static void nvme_flush_epoch_start(NvmeNamespace *ns);
+
+static void nvme_flush_epoch_cb(void *opaque, int ret)
+{
+    NvmeNamespace *ns = opaque;
+    NvmeRequest *req;
+
+    ns->flush_inflight = false;
+    while ((req = QTAILQ_FIRST(&ns->flush_waiters))) {
+        QTAILQ_REMOVE(&ns->flush_waiters, req, flush_entry);
+        nvme_rw_cb(req, ret);
+    }
+    nvme_flush_epoch_start(ns);
+}
+
+static void nvme_flush_epoch_start(NvmeNamespace *ns)
+{
+    NvmeRequest *req;
+
+    if (ns->flush_inflight || QTAILQ_EMPTY(&ns->flush_next)) {
+        return;
+    }
+    while ((req = QTAILQ_FIRST(&ns->flush_next))) {
+        QTAILQ_REMOVE(&ns->flush_next, req, flush_entry);
+        QTAILQ_INSERT_TAIL(&ns->flush_waiters, req, flush_entry);
+    }
+    ns->flush_started = ns->flush_gen;
+    ns->flush_inflight = true;
+    req = QTAILQ_FIRST(&ns->flush_waiters);
+    blk_aio_flush(req->sq->ctrl->conf.blk, nvme_flush_epoch_cb, ns);
+}
+
+static void nvme_flush_epoch_add(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeNamespace *ns = &n->namespaces[le32_to_cpu(req->cmd.nsid) - 1];
+
+    /* a FUA write out of the write cache is accounted as the write */
+    if (req->cmd.opcode == NVME_CMD_FLUSH) {
+        req->has_sg = false;
+        block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
+                         BLOCK_ACCT_FLUSH);
+    }
+    if (ns->flush_inflight && ns->flush_gen == ns->flush_started) {
+        QTAILQ_INSERT_TAIL(&ns->flush_waiters, req, flush_entry);
+        return;
+    }
+    QTAILQ_INSERT_TAIL(&ns->flush_next, req, flush_entry);
+    nvme_flush_epoch_start(ns);
+}
+
+/*
+ * Fail the Flushes of a queue that wait for an epoch, or only target. One
+ * whose backend flush is in flight just doesn't wait for it.
+ */
+static bool nvme_flush_abort(NvmeCtrl *n, NvmeSQueue *sq, NvmeRequest *target,
+                             uint16_t status)
+{
+    NvmeRequest *req, *next;
+    bool found = false;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+
+        QTAILQ_FOREACH_SAFE(req, &ns->flush_waiters, flush_entry, next) {
+            if (req->sq == sq && (!target || req == target)) {
+                QTAILQ_REMOVE(&ns->flush_waiters, req, flush_entry);
+                block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+                if (req->has_sg) {
+                    qemu_sglist_destroy(&req->qsg);
+                }
+                req->status = status;
+                nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+                found = true;
+            }
+        }
+        /* not accounted for yet, see nvme_flush_epoch_add() */
+        QTAILQ_FOREACH_SAFE(req, &ns->zone_flushes, flush_entry, next) {
+            if (req->sq == sq && (!target || req == target)) {
+                QTAILQ_REMOVE(&ns->zone_flushes, req, flush_entry);
+                req->status = status;
+                nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+                found = true;
+            }
+        }
+        QTAILQ_FOREACH_SAFE(req, &ns->flush_next, flush_entry, next) {
+            if (req->sq == sq && (!target || req == target)) {
+                QTAILQ_REMOVE(&ns->flush_next, req, flush_entry);
+                block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+                if (req->has_sg) {
+                    qemu_sglist_destroy(&req->qsg);
+                }
+                req->status = status;
+                nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+static uint64_t nvme_wcache_oldest(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeWCacheOp *op;
+    uint64_t oldest = UINT64_MAX;
+
+    if (!QTAILQ_EMPTY(&wc->dirty)) {
+        oldest = QTAILQ_FIRST(&wc->dirty)->seq;
+    }
+    QTAILQ_FOREACH(op, &wc->ops, entry) {
+        oldest = MIN(oldest, op->seq);
+    }
+
+    return oldest;
+}
+
+/*
+ * Flushes and FUA writes complete once everything written before them is
+ * written back. A failed write-back fails the next Flush; a FUA write just
+ * fails itself.
+ */
+static void nvme_wcache_check_flushes(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+    uint64_t oldest = nvme_wcache_oldest(n);
+    NvmeRequest *req;
+
+    while ((req = QTAILQ_FIRST(&wc->flushes)) && req->wc_seq < oldest) {
+        QTAILQ_REMOVE(&wc->flushes, req, wc_entry);
+        if (wc->err && req->sq->sqid && req->cmd.opcode != NVME_CMD_FLUSH) {
+            nvme_rw_cb(req, -EIO);
+            continue;
+        }
+        if (wc->err) {
+            wc->err = false;
+            req->status = NVME_INTERNAL_DEV_ERROR;
+            nvme_complete_req(n, req);
+            continue;
+        }
+        /* disabling the cache isn't for one namespace, so has no epoch */
+        if (!req->sq->sqid) {
+            req->has_sg = false;
+            block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
+                             BLOCK_ACCT_FLUSH);
+            req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
+            continue;
+        }
+        nvme_flush_epoch_add(n, req);
+    }
+}
+
+static uint16_t nvme_wcache_flush(NvmeCtrl *n, NvmeRequest *req)
+{
+    req->has_sg = false;
+    req->wc_seq = n->wcache.seq;
+    QTAILQ_INSERT_TAIL(&n->wcache.flushes, req, wc_entry);
+    nvme_wcache_check_flushes(n);
+    nvme_wcache_kick(n);
+
+    return NVME_NO_COMPLETE;
+}
+
+static void nvme_wcache_progress(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeRequest *req;
+
+    nvme_wcache_check_flushes(n);
+    while ((req = QTAILQ_FIRST(&wc->waiting))) {
+        QTAILQ_REMOVE(&wc->waiting, req, wc_entry);
+        if (!nvme_wcache_write(n, req)) {
+            QTAILQ_INSERT_HEAD(&wc->waiting, req, wc_entry);
+            break;
+        }
+    }
+    nvme_wcache_kick(n);
+}
+
+static void nvme_wcache_op_cb(void *opaque, int ret)
+{
+    NvmeWCacheOp *op = opaque;
+    NvmeCtrl *n = op->ctrl;
+    uint32_t i;
+
+    if (ret < 0) {
+        qemu_printf("[NVME] write cache: write-back of %zu bytes at %"PRIu64
+                    " failed: %s\n", op->iov.size, op->offset, strerror(-ret));
+        n->wcache.err = true;
+    }
+
+    for (i = 0; i < op->nr_pages; i++) {
+        op->pages[i]->wb--;
+    }
+    if (n->ra.size) {
+        nvme_ra_invalidate(n, op->offset, op->iov.size);
+    }
+    QTAILQ_REMOVE(&n->wcache.ops, op, entry);
+    n->wcache.nr_ops--;
+    qemu_iovec_destroy(&op->iov);
+    g_free(op);
+    nvme_flush_dirty(n);
+
+    nvme_wcache_progress(n);
+}
+
+static inline bool nvme_wcache_sector_dirty(NvmeWCachePage *page, uint32_t s)
+{
+    return page && !page->wb && (page->dirty & (1 << s));
+}
+
+/*
+ * Write back the run of contiguous dirty sectors that contains the oldest
+ * dirty sector of the given page, so that neighbouring small writes reach
+ * the backend as one large sequential request. A run does not mix pages of
+ * different placement handles.
+ */
+static void nvme_wcache_writeback(NvmeCtrl *n, NvmeWCachePage *page)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeWCacheOp *op = g_new0(NvmeWCacheOp, 1);
+    NvmeWCachePage *prev;
+    uint64_t start = page->index;
+    uint64_t index = page->index;
+    uint32_t s = ctz32(page->dirty);
+
+    /* walk back to the start of the run */
+    while (s || ((prev = nvme_wcache_lookup(n, index - 1)) &&
+                 prev->ruh == page->ruh &&
+                 nvme_wcache_sector_dirty(prev, NVME_WCACHE_SECTORS - 1))) {
+        if (start - index >= NVME_WCACHE_MAX_RUN_PAGES / 2) {
+            break;
+        }
+        if (s) {
+            if (!nvme_wcache_sector_dirty(page, s - 1)) {
+                break;
+            }
+            s--;
+        } else {
+            page = prev;
+            index--;
+            s = NVME_WCACHE_SECTORS - 1;
+        }
+    }
+
+    op->ctrl = n;
+    op->offset = index * NVME_WCACHE_PAGE_SIZE + (s << BDRV_SECTOR_BITS);
+    op->seq = UINT64_MAX;
+    op->ruh = page->ruh;
+    qemu_iovec_init(&op->iov, 4);
+
+    /* and forward to its end */
+    while (nvme_wcache_sector_dirty(page, s) && page->ruh == op->ruh &&
+           op->nr_pages < NVME_WCACHE_MAX_RUN_PAGES) {
+        uint32_t first = s;
+        uint8_t mask;
+
+        while (s < NVME_WCACHE_SECTORS && (page->dirty & (1 << s))) {
+            s++;
+        }
+        mask = ((1 << (s - first)) - 1) << first;
+
+        qemu_iovec_add(&op->iov, page->data + (first << BDRV_SECTOR_BITS),
+                       (s - first) << BDRV_SECTOR_BITS);
+        op->seq = MIN(op->seq, page->seq);
+        op->pages[op->nr_pages++] = page;
+        nvme_wcache_clear_dirty(n, page, mask);
+        page->wb++;
+
+        if (s < NVME_WCACHE_SECTORS) {
+            break;
+        }
+        page = nvme_wcache_lookup(n, ++index);
+        s = 0;
+    }
+
+    QTAILQ_INSERT_TAIL(&wc->ops, op, entry);
+    wc->nr_ops++;
+    /* the write was acknowledged, so a page with no room keeps its old one */
+    if (n->nand.channels) {
+        nvme_nand_rw(n, op->offset, op->iov.size, true, op->ruh);
+    }
+    blk_aio_pwritev(n->conf.blk, op->offset, &op->iov, 0, nvme_wcache_op_cb,
+                    op);
+}
+
+static bool nvme_wcache_need_writeback(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+
+    if (!wc->enabled || !QTAILQ_EMPTY(&wc->waiting) ||
+        !QTAILQ_EMPTY(&wc->flushes)) {
+        return true;
+    }
+
+    /* a DTWIN destages only when it must, the NDWIN after it catches up */
+    switch (nvme_plm_window(n)) {
+    case NVME_PLM_WINDOW_DTWIN:
+        return false;
+    case NVME_PLM_WINDOW_NDWIN:
+        return true;
+    default:
+        return wc->idle || wc->nr_dirty > wc->max_pages / 2;
+    }
+}
+
+static void nvme_wcache_kick(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeWCachePage *page, *next;
+
+    QTAILQ_FOREACH_SAFE(page, &wc->dirty, dirty_entry, next) {
+        if (wc->nr_ops >= NVME_WCACHE_MAX_OPS ||
+            !nvme_wcache_need_writeback(n)) {
+            break;
+        }
+        if (!page->wb) {
+            nvme_wcache_writeback(n, page);
+            /* the run may have cleaned pages after this one */
+            next = QTAILQ_FIRST(&wc->dirty);
+        }
+    }
+}
+
+static void nvme_wcache_timer_cb(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    n->wcache.idle = true;
+    nvme_wcache_progress(n);
+}
+
+/* write back all dirty data synchronously, on shutdown and for migration */
+static void nvme_wcache_writeback_sync(NvmeCtrl *n)
+{
+    NvmeWCache *wc = &n->wcache;
+    NvmeWCachePage *page;
+    uint32_t s, first;
+    int ret;
+
+    nvme_merge_submit(n);
+    blk_drain(n->conf.blk);
+    while ((page = QTAILQ_FIRST(&wc->dirty))) {
+        for (s = 0; s < NVME_WCACHE_SECTORS; s++) {
+            if (!(page->dirty & (1 << s))) {
+                continue;
+            }
+            first = s;
+            while (s < NVME_WCACHE_SECTORS && (page->dirty & (1 << s))) {
+                s++;
+            }
+            ret = blk_pwrite(n->conf.blk,
+                             page->index * NVME_WCACHE_PAGE_SIZE +
+                             (first << BDRV_SECTOR_BITS),
+                             page->data + (first << BDRV_SECTOR_BITS),
+                             (s - first) << BDRV_SECTOR_BITS, 0);
+            if (ret < 0) {
+                wc->err = true;
+            }
+        }
+        nvme_wcache_clear_dirty(n, page, page->dirty);
+    }
+    blk_flush(n->conf.blk);
+}
+
+/*
+ * Fail the requests of a queue that wait for the cache, or only the one
+ * given by target; returns whether any were failed.
+ */
+static bool nvme_wcache_abort(NvmeCtrl *n, NvmeSQueue *sq,
+                              NvmeRequest *target, uint16_t status)
+{
+    NvmeRequest *req, *next;
+    bool found = false;
+
+    QTAILQ_FOREACH_SAFE(req, &n->wcache.waiting, wc_entry, next) {
+        if (req->sq == sq && (!target || req == target)) {
+            QTAILQ_REMOVE(&n->wcache.waiting, req, wc_entry);
+            block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+            if (req->qsg.nsg > 0) {
+                qemu_sglist_destroy(&req->qsg);
+            }
+            req->status = status;
+            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+            found = true;
+        }
+    }
+    QTAILQ_FOREACH_SAFE(req, &n->wcache.flushes, wc_entry, next) {
+        if (req->sq == sq && (!target || req == target)) {
+            QTAILQ_REMOVE(&n->wcache.flushes, req, wc_entry);
+            /* a FUA write waiting for write-back */
+            if (req->has_sg) {
+                qemu_sglist_destroy(&req->qsg);
+            }
+            req->status = status;
+            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* sequential reads before a stream gets read-ahead, and depth limits */
+#define NVME_RA_TRIGGER         2
+#define NVME_RA_INIT_DEPTH      2
+#define NVME_RA_ADAPT_INTERVAL  16
+
+static void nvme_ra_free_seg(gpointer data)
+{
+    NvmeRaSeg *seg = data;
+
+    g_free(seg->data);
+    g_free(seg);
+}
+
+static inline NvmeRaSeg *nvme_ra_lookup(NvmeCtrl *n, uint64_t index)
+{
+    return g_hash_table_lookup(n->ra.segs, &index);
+}
+
+static void nvme_ra_drop_seg(NvmeCtrl *n, NvmeRaSeg *seg)
+{
+    if (!seg->used && seg->stream) {
+        seg->stream->wasted++;
+    }
+    QTAILQ_REMOVE(&n->ra.lru, seg, lru_entry);
+    n->ra.nr_segs--;
+    g_hash_table_remove(n->ra.segs, &seg->index);
+}
+
+/* requests that waited for a segment that turned out unusable */
+static void nvme_ra_resubmit(NvmeCtrl *n, NvmeRaSeg *seg)
+{
+    NvmeRequest *req;
+
+    while ((req = QTAILQ_FIRST(&seg->waiters))) {
+        QTAILQ_REMOVE(&seg->waiters, req, wc_entry);
+        nvme_rw_aio(n, req, req->wc_offset, false);
+    }
+}
+
+static void nvme_ra_invalidate(NvmeCtrl *n, uint64_t offset, uint64_t len)
+{
+    uint64_t first = offset / NVME_RA_SEG_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_RA_SEG_SIZE;
+    NvmeRaSeg *seg;
+    uint64_t i;
+
+    if (!len) {
+        return;
+    }
+    for (i = first; i <= last; i++) {
+        seg = nvme_ra_lookup(n, i);
+        if (!seg) {
+            continue;
+        }
+        if (seg->ready) {
+            nvme_ra_drop_seg(n, seg);
+            continue;
+        }
+        /* still being read; it is freed when the read completes */
+        g_hash_table_steal(n->ra.segs, &seg->index);
+        seg->stale = true;
+        nvme_ra_resubmit(n, seg);
+    }
+}
+
+/* make room for one more segment, evicting the least recently used */
+static bool nvme_ra_reserve(NvmeCtrl *n)
+{
+    NvmeRaSeg *seg;
+
+    while (n->ra.nr_segs >= n->ra.max_segs) {
+        seg = QTAILQ_FIRST(&n->ra.lru);
+        if (!seg) {
+            return false;
+        }
+        nvme_ra_drop_seg(n, seg);
+    }
+
+    return true;
+}
+
+static void nvme_ra_touch(NvmeCtrl *n, NvmeRaSeg *seg, uint8_t af)
+{
+    seg->used = true;
+    QTAILQ_REMOVE(&n->ra.lru, seg, lru_entry);
+    if (af == NVME_RW_DSM_FREQ_ONCE) {
+        /* the host will not read this again, evict it first */
+        QTAILQ_INSERT_HEAD(&n->ra.lru, seg, lru_entry);
+    } else {
+        QTAILQ_INSERT_TAIL(&n->ra.lru, seg, lru_entry);
+    }
+}
+
+static void nvme_ra_serve_one(NvmeCtrl *n, NvmeRequest *req, NvmeRaSeg *seg,
+                              uint64_t offset, uint32_t len)
+{
+    nvme_ra_touch(n, seg, le32_to_cpu(((NvmeRwCmd *)&req->cmd)->dsmgmt) &
+                          NVME_DSM_CATTR_AF_MASK);
+    nvme_req_copy(req, seg->data + offset - seg->index * NVME_RA_SEG_SIZE,
+                  len, true);
+    req->has_sg = req->qsg.nsg > 0;
+    nvme_rw_cb(req, 0);
+}
+
+static void nvme_ra_seg_cb(void *opaque, int ret)
+{
+    NvmeRaSeg *seg = opaque;
+    NvmeCtrl *n = seg->ctrl;
+    NvmeRequest *req;
+
+    if (seg->stale) {
+        n->ra.nr_segs--;
+        nvme_ra_free_seg(seg);
+        return;
+    }
+    if (ret < 0) {
+        g_hash_table_steal(n->ra.segs, &seg->index);
+        n->ra.nr_segs--;
+        nvme_ra_resubmit(n, seg);
+        nvme_ra_free_seg(seg);
+        return;
+    }
+
+    seg->ready = true;
+    QTAILQ_INSERT_TAIL(&n->ra.lru, seg, lru_entry);
+    while ((req = QTAILQ_FIRST(&seg->waiters))) {
+        QTAILQ_REMOVE(&seg->waiters, req, wc_entry);
+        nvme_ra_serve_one(n, req, seg, req->wc_offset, req->wc_len);
+    }
+}
+
+/* start reading [first, last] segments that are not cached yet */
+static void nvme_ra_fetch(NvmeCtrl *n, NvmeRaStream *st, uint64_t first,
+                          uint64_t last)
+{
+    NvmeRaSeg *seg;
+    uint64_t i;
+
+    for (i = first; i <= last; i++) {
+        if (i * NVME_RA_SEG_SIZE >= n->ra.dev_size) {
+            break;
+        }
+        if (nvme_ra_lookup(n, i)) {
+            continue;
+        }
+        if (!nvme_ra_reserve(n)) {
+            break;
+        }
+
+        seg = g_new0(NvmeRaSeg, 1);
+        seg->ctrl = n;
+        seg->index = i;
+        seg->stream = st;
+        seg->len = MIN(NVME_RA_SEG_SIZE, n->ra.dev_size - i * NVME_RA_SEG_SIZE);
+        seg->data = g_malloc(seg->len);
+        QTAILQ_INIT(&seg->waiters);
+        qemu_iovec_init_buf(&seg->iov, seg->data, seg->len);
+        g_hash_table_insert(n->ra.segs, &seg->index, seg);
+        n->ra.nr_segs++;
+
+        blk_aio_preadv(n->conf.blk, i * NVME_RA_SEG_SIZE, &seg->iov, 0,
+                       nvme_ra_seg_cb, seg);
+    }
+}
+
+/* match a read against the streams of its namespace */
+static NvmeRaStream *nvme_ra_track(NvmeCtrl *n, NvmeNamespace *ns,
+                                   uint64_t offset, uint32_t len, bool seq)
+{
+    NvmeRaStream *st = NULL, *victim = &ns->ra_streams[0];
+    int i;
+
+    for (i = 0; i < NVME_RA_STREAMS; i++) {
+        if (ns->ra_streams[i].last_use && ns->ra_streams[i].next == offset) {
+            st = &ns->ra_streams[i];
+            break;
+        }
+        if (ns->ra_streams[i].last_use < victim->last_use) {
+            victim = &ns->ra_streams[i];
+        }
+    }
+    if (!st) {
+        st = victim;
+        memset(st, 0, sizeof(*st));
+        st->depth = MIN(NVME_RA_INIT_DEPTH, n->ra.max_depth);
+    }
+
+    st->next = offset + len;
+    st->last_use = ++n->ra.clock;
+    st->run++;
+
+    return st->run >= NVME_RA_TRIGGER || seq ? st : NULL;
+}
+
+/*
+ * Grow the window while sequential reads still miss, shrink it when
+ * read-ahead data gets evicted before the host reads it.
+ */
+static void nvme_ra_adapt(NvmeCtrl *n, NvmeRaStream *st)
+{
+    if (st->run % NVME_RA_ADAPT_INTERVAL) {
+        return;
+    }
+
+    if (st->wasted) {
+        st->depth = MAX(st->depth / 2, 1);
+    } else if (st->misses > st->hits / 4) {
+        st->depth = MIN(st->depth * 2, n->ra.max_depth);
+    }
+    st->hits = st->misses = st->wasted = 0;
+}
+
+/* returns true if the read is served, or will be, from read-ahead data */
+static bool nvme_ra_serve(NvmeCtrl *n, NvmeRequest *req, uint64_t offset,
+                          uint32_t len)
+{
+    uint64_t first = offset / NVME_RA_SEG_SIZE;
+    uint64_t last = (offset + len - 1) / NVME_RA_SEG_SIZE;
+    NvmeRaSeg *seg = nvme_ra_lookup(n, first);
+    uint8_t *buf;
+    uint64_t i, pos;
+
+    if (first == last) {
+        if (!seg) {
+            return false;
+        }
+        if (!seg->ready) {
+            req->wc_offset = offset;
+            req->wc_len = len;
+            QTAILQ_INSERT_TAIL(&seg->waiters, req, wc_entry);
+            return true;
+        }
+        nvme_ra_serve_one(n, req, seg, offset, len);
+        return true;
+    }
+
+    for (i = first; i <= last; i++) {
+        seg = nvme_ra_lookup(n, i);
+        if (!seg || !seg->ready) {
+            return false;
+        }
+    }
+
+    buf = g_malloc(len);
+    for (i = first, pos = 0; i <= last; i++) {
+        uint64_t start = MAX(offset, i * NVME_RA_SEG_SIZE);
+        uint64_t end = MIN(offset + len, (i + 1) * NVME_RA_SEG_SIZE);
+
+        seg = nvme_ra_lookup(n, i);
+        memcpy(buf + pos, seg->data + start - i * NVME_RA_SEG_SIZE,
+               end - start);
+        nvme_ra_touch(n, seg, le32_to_cpu(((NvmeRwCmd *)&req->cmd)->dsmgmt) &
+                              NVME_DSM_CATTR_AF_MASK);
+        pos += end - start;
+    }
+    nvme_req_copy(req, buf, len, true);
+    g_free(buf);
+
+    req->has_sg = req->qsg.nsg > 0;
+    nvme_rw_cb(req, 0);
+    return true;
+}
+
+/* called from nvme_rw for reads; returns true if read-ahead took it over */
+static bool nvme_ra_read(NvmeCtrl *n, NvmeNamespace *ns, NvmeRequest *req,
+                         uint64_t offset, uint32_t len)
+{
+    uint32_t dsmgmt = le32_to_cpu(((NvmeRwCmd *)&req->cmd)->dsmgmt);
+    uint8_t af = dsmgmt & NVME_DSM_CATTR_AF_MASK;
+    NvmeRaStream *st;
+    bool served;
+
+    st = nvme_ra_track(n, ns, offset, len, dsmgmt & NVME_RW_DSM_SEQ_REQ);
+    served = nvme_ra_serve(n, req, offset, len);
+
+    /* no read-ahead for data the host says it rarely reads */
+    if (!st || af == NVME_RW_DSM_FREQ_RARE || af == NVME_RW_DSM_FREQ_WRITES) {
+        return served;
+    }
+
+    if (served) {
+        st->hits++;
+    } else {
+        st->misses++;
+    }
+    nvme_ra_adapt(n, st);
+
+    if (st->ra_end < offset + len) {
+        st->ra_end = offset + len;
+    }
+    if (st->ra_end < offset + len + (uint64_t)st->depth * NVME_RA_SEG_SIZE) {
+        nvme_ra_fetch(n, st, st->ra_end / NVME_RA_SEG_SIZE,
+                      (offset + len + (uint64_t)st->depth * NVME_RA_SEG_SIZE -
+                       1) / NVME_RA_SEG_SIZE);
+        st->ra_end = offset + len + (uint64_t)st->depth * NVME_RA_SEG_SIZE;
+    }
+
+    return served;
+}
+
+/* Dataset Management sequential read ranges and prefetch hints */
+static void nvme_ra_prefetch(NvmeCtrl *n, uint64_t offset, uint64_t len)
+{
+    len = MIN(len, (uint64_t)n->ra.max_depth * NVME_RA_SEG_SIZE);
+    if (len) {
+        nvme_ra_fetch(n, NULL, offset / NVME_RA_SEG_SIZE,
+                      (offset + len - 1) / NVME_RA_SEG_SIZE);
+    }
+}
+
+/* fail the reads of a queue waiting for read-ahead, or only target */
+static bool nvme_ra_abort(NvmeCtrl *n, NvmeSQueue *sq, NvmeRequest *target,
+                          uint16_t status)
+{
+    GHashTableIter iter;
+    NvmeRaSeg *seg;
+    NvmeRequest *req, *next;
+    bool found = false;
+
+    g_hash_table_iter_init(&iter, n->ra.segs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&seg)) {
+        QTAILQ_FOREACH_SAFE(req, &seg->waiters, wc_entry, next) {
+            if (req->sq == sq && (!target || req == target)) {
+                QTAILQ_REMOVE(&seg->waiters, req, wc_entry);
+                block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+                if (req->qsg.nsg > 0) {
+                    qemu_sglist_destroy(&req->qsg);
+                }
+                req->status = status;
+                nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static void nvme_ra_reset(NvmeCtrl *n)
+{
+    int i;
+
+    g_hash_table_remove_all(n->ra.segs);
+    QTAILQ_INIT(&n->ra.lru);
+    n->ra.nr_segs = 0;
+    for (i = 0; i < n->num_namespaces; i++) {
+        memset(n->namespaces[i].ra_streams, 0,
+               sizeof(n->namespaces[i].ra_streams));
+    }
+}
+
+/* 4 KiB random reads the planes can serve during a whole DTWIN */
+static uint64_t nvme_plm_reads_typical(NvmeNand *nand)
+{
+    return (uint64_t)NVME_PLM_DTWIN_MS * 1000 / MAX(nand->read_lat_us, 1) *
+           nand->nr_planes;
+}
+
+/* NAND pages, the Optimal Write Size, that fit into the PLM reserve */
+static uint64_t nvme_plm_writes_typical(NvmeNand *nand)
+{
+    return (uint64_t)nand->nr_planes * NVME_PLM_GC_RESERVE *
+           nand->pages_per_block;
+}
+
+/*
+ * What a DTWIN has left, or would have if it started now: writes are
+ * striped over all planes, so the plane with the fewest free blocks above
+ * the GC threshold decides how many still fit.
+ */
+static void nvme_plm_estimates(NvmeCtrl *n, uint64_t *re, uint64_t *we,
+                               uint64_t *te)
+{
+    NvmeNand *nand = &n->nand;
+    NvmePlm *plm = &n->plm;
+    uint64_t wt = nvme_plm_writes_typical(nand);
+    uint32_t room = UINT32_MAX;
+    int64_t left;
+    uint32_t p;
+
+    for (p = 0; p < nand->nr_planes; p++) {
+        room = MIN(room, nand->plane[p].nr_free -
+                         MIN(nand->plane[p].nr_free, NVME_NAND_GC_LOW));
+    }
+    *re = nvme_plm_reads_typical(nand);
+    *we = MIN(wt, (uint64_t)room * nand->nr_planes * nand->pages_per_block);
+    *te = NVME_PLM_DTWIN_MS;
+    if (nvme_plm_window(n) != NVME_PLM_WINDOW_DTWIN) {
+        return;
+    }
+
+    left = plm->dtwin_start_ns + NVME_PLM_DTWIN_MS * SCALE_MS -
+           qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    *re -= MIN(plm->reads, *re);
+    *we = MIN(*we, wt - MIN(plm->writes, wt));
+    *te = MAX(left, 0) / SCALE_MS;
+}
+
+/* events the host enabled go to the event aggregate log, with a notice */
+static void nvme_plm_event(NvmeCtrl *n, uint16_t evt)
+{
+    NvmePlm *plm = &n->plm;
+
+    if (!(plm->ee & evt)) {
+        return;
+    }
+    plm->evt |= evt;
+    if (!plm->aggregate) {
+        plm->aggregate = true;
+        if (n->aer_cfg & NVME_AEC_PLM_EVENT) {
+            nvme_enqueue_event(n, NVME_AER_TYPE_NOTICE,
+                               NVME_AER_INFO_NOTICE_PLM_EVENT,
+                               NVME_LOG_PLM_EVENT_AGG);
+        }
+    }
+}
+
+static void nvme_plm_warn(NvmeCtrl *n, uint16_t evt)
+{
+    if (!(n->plm.warned & evt)) {
+        n->plm.warned |= evt;
+        nvme_plm_event(n, evt);
+    }
+}
+
+/* raise the warnings due; returns whether the DTWIN has to end */
+static bool nvme_plm_check(NvmeCtrl *n)
+{
+    NvmePlm *plm = &n->plm;
+    uint64_t re, we, te;
+
+    nvme_plm_estimates(n, &re, &we, &te);
+    if (re <= plm->dtwinrt) {
+        nvme_plm_warn(n, NVME_PLM_EVT_DTWIN_READS);
+    }
+    if (we <= plm->dtwinwt) {
+        nvme_plm_warn(n, NVME_PLM_EVT_DTWIN_WRITES);
+    }
+    if (te <= plm->dtwintt) {
+        nvme_plm_warn(n, NVME_PLM_EVT_DTWIN_TIME);
+    }
+
+    return plm->excursion || !re || !we || !te;
+}
+
+/* the timer ends the DTWIN, or wakes up earlier for the time warning */
+static void nvme_plm_arm(NvmeCtrl *n)
+{
+    NvmePlm *plm = &n->plm;
+    int64_t end = plm->dtwin_start_ns + NVME_PLM_DTWIN_MS * SCALE_MS;
+    int64_t warn = end - (int64_t)MIN(plm->dtwintt, NVME_PLM_DTWIN_MS) *
+                         SCALE_MS;
+
+    if ((plm->ee & NVME_PLM_EVT_DTWIN_TIME) &&
+        !(plm->warned & NVME_PLM_EVT_DTWIN_TIME) &&
+        warn > qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) {
+        end = warn;
+    }
+    timer_mod(plm->timer, end);
+}
+
+static void nvme_plm_set_window(NvmeCtrl *n, uint8_t window)
+{
+    NvmePlm *plm = &n->plm;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t p;
+
+    plm->window = window;
+    plm->excursion = false;
+    if (window == NVME_PLM_WINDOW_DTWIN) {
+        plm->dtwin_start_ns = now;
+        plm->reads = 0;
+        plm->writes = 0;
+        plm->warned = 0;
+        nvme_plm_arm(n);
+        return;
+    }
+
+    /*
+     * Catch up on the garbage collection and destaging put off. The planes
+     * are busy with it for a while, which is what the NDWIN is for.
+     */
+    timer_del(plm->timer);
+    for (p = 0; p < n->nand.nr_planes; p++) {
+        nvme_nand_gc(n, p, now);
+    }
+    if (n->wcache.size) {
+        nvme_wcache_kick(n);
+    }
+}
+
+static void nvme_plm_timer_cb(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    NvmePlm *plm = &n->plm;
+
+    if (nvme_plm_window(n) != NVME_PLM_WINDOW_DTWIN) {
+        return;
+    }
+    if (!nvme_plm_check(n)) {
+        nvme_plm_arm(n);
+        return;
+    }
+
+    nvme_plm_event(n, plm->excursion ? NVME_PLM_EVT_EXCURSION :
+                                       NVME_PLM_EVT_EXCEEDED);
+    nvme_plm_set_window(n, NVME_PLM_WINDOW_NDWIN);
+}
+
+/*
+ * Charge a completed read or write to the DTWIN. Running out of budget only
+ * fires the timer, so the NDWIN work isn't started from a completion path.
+ */
+static void nvme_plm_account(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmePlm *plm = &n->plm;
+    uint64_t bytes = nvme_lat_req_bytes(n, req);
+
+    if (nvme_plm_window(n) != NVME_PLM_WINDOW_DTWIN || !bytes ||
+        req->status != NVME_SUCCESS) {
+        return;
+    }
+
+    if (req->cmd.opcode == NVME_CMD_READ) {
+        plm->reads += DIV_ROUND_UP(bytes, 4 * KiB);
+    } else {
+        plm->writes += DIV_ROUND_UP(bytes, n->nand.page_size);
+    }
+    if (nvme_plm_check(n)) {
+        timer_mod(plm->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+}
+
+/* leave PLM with the deferred work done, as after an NDWIN */
+static void nvme_plm_disable(NvmeCtrl *n)
+{
+    NvmePlm *plm = &n->plm;
+
+    if (plm->enabled) {
+        nvme_plm_set_window(n, NVME_PLM_WINDOW_NDWIN);
+    }
+    plm->enabled = false;
+    plm->window = 0;
+    plm->evt = 0;
+    plm->aggregate = false;
+}
+
+static inline NvmeZone *nvme_get_zone(NvmeNamespace *ns, uint64_t slba)
+{
+    return &ns->zones[slba / ns->zone_size];
+}
+
+static void nvme_zone_to_descr(NvmeNamespace *ns, NvmeZone *zone,
+                               NvmeZoneDescr *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->zt = NVME_ZONE_TYPE_SEQ_WRITE;
+    d->zs = zone->zs << 4;
+    d->zcap = cpu_to_le64(zone->zcap);
+    d->zslba = cpu_to_le64(zone->zslba);
+    d->wp = cpu_to_le64(zone->wp);
+}
+
+/*
+ * Zone descriptors are written back asynchronously when a zone changes
+ * state and when a write to it completes, one write per namespace at a
+ * time. A Flush waits until they are all written, see nvme_flush().
+ */
+typedef struct NvmeZoneSync {
+    NvmeCtrl        *ctrl;
+    NvmeNamespace   *ns;
+    NvmeZoneDescr   *d;
+    QEMUIOVector    iov;
+} NvmeZoneSync;
+
+static void nvme_flush_issue(NvmeCtrl *n, NvmeRequest *req);
+static void nvme_zone_sync(NvmeCtrl *n, NvmeNamespace *ns);
+
+static void nvme_zone_sync_cb(void *opaque, int ret)
+{
+    NvmeZoneSync *zs = opaque;
+    NvmeNamespace *ns = zs->ns;
+
+    if (ret < 0) {
+        qemu_printf("[NVME] [ZNS] failed to persist zone descriptors\n");
+    }
+    ns->zone_sync_inflight = false;
+    /* a backend flush already in flight doesn't cover it */
+    ns->flush_gen++;
+    nvme_zone_sync(zs->ctrl, ns);
+    g_free(zs->d);
+    g_free(zs);
+}
+
+static void nvme_zone_sync(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    uint32_t lo = ns->zone_dirty_lo;
+    uint32_t hi = ns->zone_dirty_hi;
+    NvmeZoneSync *zs;
+    NvmeRequest *req;
+    uint32_t i;
+
+    if (ns->zone_sync_inflight) {
+        return;
+    }
+    if (lo > hi) {
+        while ((req = QTAILQ_FIRST(&ns->zone_flushes))) {
+            QTAILQ_REMOVE(&ns->zone_flushes, req, flush_entry);
+            nvme_flush_issue(req->sq->ctrl, req);
+        }
+        return;
+    }
+
+    zs = g_new(NvmeZoneSync, 1);
+    zs->ctrl = n;
+    zs->ns = ns;
+    zs->d = g_new(NvmeZoneDescr, hi - lo + 1);
+    for (i = lo; i <= hi; i++) {
+        nvme_zone_to_descr(ns, &ns->zones[i], &zs->d[i - lo]);
+    }
+    ns->zone_dirty_lo = UINT32_MAX;
+    ns->zone_dirty_hi = 0;
+    ns->zone_sync_inflight = true;
+    qemu_iovec_init_buf(&zs->iov, zs->d, (hi - lo + 1) * sizeof(*zs->d));
+    blk_aio_pwritev(n->conf.blk, ns->zone_meta_offset +
+                    NVME_ZONE_META_HDR_SIZE + lo * sizeof(NvmeZoneDescr),
+                    &zs->iov, 0, nvme_zone_sync_cb, zs);
+}
+
+static void nvme_zone_persist(NvmeCtrl *n, NvmeNamespace *ns, NvmeZone *zone)
+{
+    uint32_t i = zone - ns->zones;
+
+    ns->zone_dirty_lo = MIN(ns->zone_dirty_lo, i);
+    ns->zone_dirty_hi = MAX(ns->zone_dirty_hi, i);
+    nvme_zone_sync(n, ns);
+}
+
+static void nvme_zone_write_hdr(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    NvmeZoneMetaHdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = cpu_to_le64(NVME_ZONE_META_MAGIC);
+    hdr.num_zones = cpu_to_le32(ns->num_zones);
+    hdr.zone_size = cpu_to_le64(ns->zone_size);
+    hdr.lbads = ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    if (blk_pwrite(n->conf.blk, ns->zone_meta_offset, &hdr,
+                   sizeof(hdr), 0) < 0) {
+        qemu_printf("[NVME] [ZNS] failed to write zone metadata\n");
+    }
+}
+
+static void nvme_zone_persist_all(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    ns->zone_dirty_lo = 0;
+    ns->zone_dirty_hi = ns->num_zones - 1;
+    nvme_zone_sync(n, ns);
+}
+
+/* write all descriptors synchronously, when the namespace comes and goes */
+static void nvme_zone_save_all(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    size_t len = ns->num_zones * sizeof(NvmeZoneDescr);
+    NvmeZoneDescr *d = g_malloc(len);
+    uint32_t i;
+
+    /* an older asynchronous write must not land after this one */
+    if (ns->zone_sync_inflight) {
+        blk_drain(n->conf.blk);
+    }
+    for (i = 0; i < ns->num_zones; i++) {
+        nvme_zone_to_descr(ns, &ns->zones[i], &d[i]);
+    }
+    ns->zone_dirty_lo = UINT32_MAX;
+    ns->zone_dirty_hi = 0;
+    if (blk_pwrite(n->conf.blk, ns->zone_meta_offset + NVME_ZONE_META_HDR_SIZE,
+                   d, len, 0) < 0) {
+        qemu_printf("[NVME] [ZNS] failed to persist zone descriptors\n");
+    }
+    g_free(d);
+}
+
+static void nvme_zone_set_state(NvmeNamespace *ns, NvmeZone *zone,
+                                uint8_t state)
+{
+    switch (zone->zs) {
+    case NVME_ZONE_STATE_IMP_OPEN:
+        QTAILQ_REMOVE(&ns->imp_open_zones, zone, entry);
+        /* fall through */
+    case NVME_ZONE_STATE_EXP_OPEN:
+        ns->nr_open_zones--;
+        /* fall through */
+    case NVME_ZONE_STATE_CLOSED:
+        ns->nr_active_zones--;
+        break;
+    default:
+        break;
+    }
+
+    switch (state) {
+    case NVME_ZONE_STATE_IMP_OPEN:
+        QTAILQ_INSERT_TAIL(&ns->imp_open_zones, zone, entry);
+        /* fall through */
+    case NVME_ZONE_STATE_EXP_OPEN:
+        ns->nr_open_zones++;
+        /* fall through */
+    case NVME_ZONE_STATE_CLOSED:
+        ns->nr_active_zones++;
+        break;
+    default:
+        break;
+    }
+
+    zone->zs = state;
+}
+
+static void nvme_zone_transition(NvmeCtrl *n, NvmeNamespace *ns,
+                                 NvmeZone *zone, uint8_t state)
+{
+    nvme_zone_set_state(ns, zone, state);
+    nvme_zone_persist(n, ns, zone);
+}
+
+/*
+ * Open a zone implicitly or explicitly, honouring the open and active zone
+ * limits. When the open limit is reached, the least recently implicitly
+ * opened zone is closed to make room, as the spec allows.
+ */
+static uint16_t nvme_zone_open(NvmeCtrl *n, NvmeNamespace *ns, NvmeZone *zone,
+                               uint8_t state)
+{
+    NvmeZone *victim;
+
+    if (zone->zs == state) {
+        return NVME_SUCCESS;
+    }
+
+    if (zone->zs == NVME_ZONE_STATE_EMPTY && n->max_active_zones &&
+        ns->nr_active_zones >= n->max_active_zones) {
+        return NVME_ZONE_TOO_MANY_ACTIVE | NVME_DNR;
+    }
+
+    if (zone->zs != NVME_ZONE_STATE_IMP_OPEN && n->max_open_zones &&
+        ns->nr_open_zones >= n->max_open_zones) {
+        victim = QTAILQ_FIRST(&ns->imp_open_zones);
+        if (!victim) {
+            return NVME_ZONE_TOO_MANY_OPEN | NVME_DNR;
+        }
+        nvme_zone_transition(n, ns, victim, NVME_ZONE_STATE_CLOSED);
+    }
+
+    nvme_zone_transition(n, ns, zone, state);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_zone_prep_write(NvmeCtrl *n, NvmeNamespace *ns,
+                                     NvmeZone *zone, uint64_t slba,
+                                     uint32_t nlb)
+{
+    switch (zone->zs) {
+    case NVME_ZONE_STATE_FULL:
+        return NVME_ZONE_FULL | NVME_DNR;
+    case NVME_ZONE_STATE_READ_ONLY:
+        return NVME_ZONE_READ_ONLY | NVME_DNR;
+    case NVME_ZONE_STATE_OFFLINE:
+        return NVME_ZONE_OFFLINE | NVME_DNR;
+    default:
+        break;
+    }
+
+    if (unlikely(slba != zone->wp)) {
+        return NVME_ZONE_INVALID_WRITE | NVME_DNR;
+    }
+    if (unlikely(slba + nlb > zone->zslba + zone->zcap)) {
+        return NVME_ZONE_BOUNDARY_ERROR | NVME_DNR;
+    }
+
+    if (zone->zs == NVME_ZONE_STATE_EMPTY ||
+        zone->zs == NVME_ZONE_STATE_CLOSED) {
+        return nvme_zone_open(n, ns, zone, NVME_ZONE_STATE_IMP_OPEN);
+    }
+    return NVME_SUCCESS;
+}
+
+/*
+ * The write pointer moves when a write is submitted rather than when it
+ * completes, so that back-to-back writes and appends to one zone can be in
+ * flight at the same time.
+ */
+static void nvme_zone_advance_wp(NvmeCtrl *n, NvmeNamespace *ns,
+                                 NvmeZone *zone, uint32_t nlb)
+{
+    zone->wp += nlb;
+    if (zone->wp == zone->zslba + zone->zcap) {
+        nvme_zone_transition(n, ns, zone, NVME_ZONE_STATE_FULL);
+    }
+}
+
+/*
+ * A Zone Send that resets zones completes once all of them are zeroed. It
+ * holds the range lock of the zones, so nothing gets at them meanwhile.
+ */
+typedef struct NvmeZoneReset {
+    NvmeRequest     *req;
+    NvmeNamespace   *ns;
+    uint32_t        pending;    /* zones being zeroed, +1 while issuing */
+    uint16_t        status;
+} NvmeZoneReset;
+
+typedef struct NvmeZoneResetAIO {
+    NvmeZoneReset   *r;
+    NvmeZone        *zone;
+} NvmeZoneResetAIO;
+
+static void nvme_zone_reset_put(NvmeZoneReset *r)
+{
+    if (--r->pending) {
+        return;
+    }
+    r->req->status = r->status;
+    nvme_complete_req(r->req->sq->ctrl, r->req);
+    g_free(r);
+}
+
+static void nvme_zone_reset_cb(void *opaque, int ret)
+{
+    NvmeZoneResetAIO *aio = opaque;
+    NvmeZoneReset *r = aio->r;
+    NvmeZone *zone = aio->zone;
+
+    if (ret < 0) {
+        if (!r->status) {
+            r->status = NVME_INTERNAL_DEV_ERROR;
+        }
+    } else {
+        zone->wp = zone->zslba;
+        nvme_zone_transition(r->req->sq->ctrl, r->ns, zone,
+                             NVME_ZONE_STATE_EMPTY);
+    }
+    g_free(aio);
+    nvme_zone_reset_put(r);
+}
+
+static uint16_t nvme_zone_reset(NvmeCtrl *n, NvmeNamespace *ns, NvmeZone *zone,
+                                NvmeZoneReset *r)
+{
+    const uint8_t data_shift =
+        ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    NvmeZoneResetAIO *aio;
+
+    if (n->wcache.size) {
+        nvme_wcache_zero(n, zone->zslba << data_shift,
+                         ns->zone_size << data_shift);
+    }
+    if (n->ra.size) {
+        nvme_ra_invalidate(n, zone->zslba << data_shift,
+                           ns->zone_size << data_shift);
+    }
+    aio = g_new(NvmeZoneResetAIO, 1);
+    aio->r = r;
+    aio->zone = zone;
+    r->pending++;
+    blk_aio_pwrite_zeroes(n->conf.blk, zone->zslba << data_shift,
+                          ns->zone_size << data_shift, BDRV_REQ_MAY_UNMAP,
+                          nvme_zone_reset_cb, aio);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_zone_action(NvmeCtrl *n, NvmeNamespace *ns,
+                                 NvmeZone *zone, uint8_t zsa,
+                                 NvmeZoneReset *r)
+{
+    switch (zsa) {
+    case NVME_ZONE_ACTION_CLOSE:
+        switch (zone->zs) {
+        case NVME_ZONE_STATE_CLOSED:
+            return NVME_SUCCESS;
+        case NVME_ZONE_STATE_IMP_OPEN:
+        case NVME_ZONE_STATE_EXP_OPEN:
+            nvme_zone_transition(n, ns, zone, zone->wp == zone->zslba ?
+                                 NVME_ZONE_STATE_EMPTY :
+                                 NVME_ZONE_STATE_CLOSED);
+            return NVME_SUCCESS;
+        }
+        break;
+    case NVME_ZONE_ACTION_FINISH:
+        switch (zone->zs) {
+        case NVME_ZONE_STATE_FULL:
+            return NVME_SUCCESS;
+        case NVME_ZONE_STATE_EMPTY:
+        case NVME_ZONE_STATE_IMP_OPEN:
+        case NVME_ZONE_STATE_EXP_OPEN:
+        case NVME_ZONE_STATE_CLOSED:
+            zone->wp = zone->zslba + zone->zcap;
+            nvme_zone_transition(n, ns, zone, NVME_ZONE_STATE_FULL);
+            return NVME_SUCCESS;
+        }
+        break;
+    case NVME_ZONE_ACTION_OPEN:
+        switch (zone->zs) {
+        case NVME_ZONE_STATE_EMPTY:
+        case NVME_ZONE_STATE_IMP_OPEN:
+        case NVME_ZONE_STATE_EXP_OPEN:
+        case NVME_ZONE_STATE_CLOSED:
+            return nvme_zone_open(n, ns, zone, NVME_ZONE_STATE_EXP_OPEN);
+        }
+        break;
+    case NVME_ZONE_ACTION_RESET:
+        switch (zone->zs) {
+        case NVME_ZONE_STATE_EMPTY:
+            return NVME_SUCCESS;
+        case NVME_ZONE_STATE_IMP_OPEN:
+        case NVME_ZONE_STATE_EXP_OPEN:
+        case NVME_ZONE_STATE_CLOSED:
+        case NVME_ZONE_STATE_FULL:
+            return nvme_zone_reset(n, ns, zone, r);
+        }
+        break;
+    case NVME_ZONE_ACTION_OFFLINE:
+        switch (zone->zs) {
+        case NVME_ZONE_STATE_OFFLINE:
+            return NVME_SUCCESS;
+        case NVME_ZONE_STATE_READ_ONLY:
+            nvme_zone_transition(n, ns, zone, NVME_ZONE_STATE_OFFLINE);
+            return NVME_SUCCESS;
+        }
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return NVME_ZONE_INVAL_TRANSITION | NVME_DNR;
+}
+
+/* zones that "Select All" applies to, per Zone Send Action */
+static bool nvme_zone_select_all_applies(NvmeZone *zone, uint8_t zsa)
+{
+    switch (zsa) {
+    case NVME_ZONE_ACTION_CLOSE:
+        return zone->zs == NVME_ZONE_STATE_IMP_OPEN ||
+               zone->zs == NVME_ZONE_STATE_EXP_OPEN;
+    case NVME_ZONE_ACTION_FINISH:
+        return zone->zs == NVME_ZONE_STATE_IMP_OPEN ||
+               zone->zs == NVME_ZONE_STATE_EXP_OPEN ||
+               zone->zs == NVME_ZONE_STATE_CLOSED;
+    case NVME_ZONE_ACTION_OPEN:
+        return zone->zs == NVME_ZONE_STATE_CLOSED;
+    case NVME_ZONE_ACTION_RESET:
+        return zone->zs == NVME_ZONE_STATE_IMP_OPEN ||
+               zone->zs == NVME_ZONE_STATE_EXP_OPEN ||
+               zone->zs == NVME_ZONE_STATE_CLOSED ||
+               zone->zs == NVME_ZONE_STATE_FULL;
+    case NVME_ZONE_ACTION_OFFLINE:
+        return zone->zs == NVME_ZONE_STATE_READ_ONLY;
+    default:
+        return false;
+    }
+}
+
+static uint16_t nvme_zone_mgmt_send(NvmeCtrl *n, NvmeNamespace *ns,
+                                    NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeZoneSendCmd *c = (NvmeZoneSendCmd *)cmd;
+    uint64_t slba = le64_to_cpu(c->slba);
+    uint16_t status = NVME_SUCCESS;
+    NvmeZoneReset *r;
+    uint32_t i;
+
+    if (unlikely(!ns->zoned)) {
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+
+    if (!NVME_ZONE_SEND_SELECT_ALL(c->zsflags) &&
+        unlikely(slba >= ns->id_ns.nsze || slba % ns->zone_size)) {
+        trace_nvme_err_invalid_lba_range(slba, 0, ns->id_ns.nsze);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    r = g_new0(NvmeZoneReset, 1);
+    r->req = req;
+    r->ns = ns;
+    r->pending = 1;
+    if (NVME_ZONE_SEND_SELECT_ALL(c->zsflags)) {
+        for (i = 0; i < ns->num_zones && status == NVME_SUCCESS; i++) {
+            if (nvme_zone_select_all_applies(&ns->zones[i], c->zsa)) {
+                status = nvme_zone_action(n, ns, &ns->zones[i], c->zsa, r);
+            }
+        }
+    } else {
+        status = nvme_zone_action(n, ns, nvme_get_zone(ns, slba), c->zsa, r);
+    }
+
+    /* nothing to zero, so done already */
+    if (r->pending == 1) {
+        g_free(r);
+        return status;
+    }
+    if (!r->status) {
+        r->status = status;
+    }
+    nvme_zone_reset_put(r);
+    return NVME_NO_COMPLETE;
+}
+
+static bool nvme_zone_matches_filter(NvmeZone *zone, uint8_t zrasf)
+{
+    switch (zrasf) {
+    case NVME_ZONE_REPORT_ALL:
+        return true;
+    case NVME_ZONE_REPORT_EMPTY:
+        return zone->zs == NVME_ZONE_STATE_EMPTY;
+    case NVME_ZONE_REPORT_IMP_OPEN:
+        return zone->zs == NVME_ZONE_STATE_IMP_OPEN;
+    case NVME_ZONE_REPORT_EXP_OPEN:
+        return zone->zs == NVME_ZONE_STATE_EXP_OPEN;
+    case NVME_ZONE_REPORT_CLOSED:
+        return zone->zs == NVME_ZONE_STATE_CLOSED;
+    case NVME_ZONE_REPORT_FULL:
+        return zone->zs == NVME_ZONE_STATE_FULL;
+    case NVME_ZONE_REPORT_READ_ONLY:
+        return zone->zs == NVME_ZONE_STATE_READ_ONLY;
+    case NVME_ZONE_REPORT_OFFLINE:
+        return zone->zs == NVME_ZONE_STATE_OFFLINE;
+    default:
+        return false;
+    }
+}
+
+static uint16_t nvme_zone_mgmt_recv(NvmeCtrl *n, NvmeNamespace *ns,
+                                    NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeZoneRecvCmd *c = (NvmeZoneRecvCmd *)cmd;
+    uint64_t slba = le64_to_cpu(c->slba);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    uint64_t data_len = ((uint64_t)le32_to_cpu(c->numd) + 1) << 2;
+    NvmeZoneReportHdr *hdr;
+    NvmeZoneDescr *d;
+    uint64_t max_zones, nr_zones = 0;
+    uint32_t i, len;
+    uint16_t ret;
+
+    if (unlikely(!ns->zoned)) {
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+    if (unlikely(c->zra != NVME_ZONE_REPORT ||
+                 c->zrasf > NVME_ZONE_REPORT_OFFLINE ||
+                 data_len < sizeof(NvmeZoneReportHdr))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(slba >= ns->id_ns.nsze)) {
+        trace_nvme_err_invalid_lba_range(slba, 0, ns->id_ns.nsze);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    /* never transfer more than the whole zone table */
+    len = MIN(data_len, sizeof(NvmeZoneReportHdr) +
+                        (uint64_t)ns->num_zones * sizeof(NvmeZoneDescr));
+    max_zones = (len - sizeof(NvmeZoneReportHdr)) / sizeof(NvmeZoneDescr);
+
+    hdr = g_malloc0(len);
+    d = (NvmeZoneDescr *)(hdr + 1);
+    for (i = slba / ns->zone_size; i < ns->num_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+
+        if (!nvme_zone_matches_filter(zone, c->zrasf)) {
+            continue;
+        }
+        if (nr_zones < max_zones) {
+            nvme_zone_to_descr(ns, zone, &d[nr_zones]);
+        } else if (c->pr & 0x1) {
+            break;
+        }
+        nr_zones++;
+    }
+    hdr->nr_zones = cpu_to_le64(nr_zones);
+
+    ret = nvme_dma_read_prp(n, (uint8_t *)hdr, len, prp1, prp2);
+    g_free(hdr);
+    return ret;
+}
+
+static void nvme_flush_issue(NvmeCtrl *n, NvmeRequest *req)
+{
+    if (n->wcache.size) {
+        nvme_wcache_flush(n, req);
+        return;
+    }
+    nvme_flush_epoch_add(n, req);
+}
+
+static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    /* zone descriptors still being written back go first */
+    if (ns->zoned && (ns->zone_sync_inflight ||
+                      ns->zone_dirty_lo <= ns->zone_dirty_hi)) {
+        QTAILQ_INSERT_TAIL(&ns->zone_flushes, req, flush_entry);
+        nvme_zone_sync(n, ns);
+        return NVME_NO_COMPLETE;
+    }
+
+    nvme_flush_issue(n, req);
+
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint32_t nlb  = le16_to_cpu(rw->nlb) + 1;
+    uint64_t offset = slba << data_shift;
+    uint32_t count = nlb << data_shift;
+    NvmeZone *zone = NULL;
+    uint16_t status;
+
+    if (unlikely(slba + nlb > ns->id_ns.nsze)) {
+        trace_nvme_err_invalid_lba_range(slba, nlb, ns->id_ns.nsze);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    if (ns->zoned) {
+        zone = nvme_get_zone(ns, slba);
+        status = nvme_zone_prep_write(n, ns, zone, slba, nlb);
+        if (status) {
+            return status;
+        }
+        nvme_zone_advance_wp(n, ns, zone, nlb);
+    }
+
+    if (nvme_ns_ms(ns)) {
+        req->md_offset = ns->md_offset + slba * nvme_ns_ms(ns);
+        req->md_len = (size_t)nlb * nvme_ns_ms(ns);
+        nvme_write_zeros_md(ns, rw, req, nlb);
+    }
+
+    if (n->nand.channels) {
+        nvme_nand_trim(n, offset, count);
+    }
+    if (n->wcache.size) {
+        nvme_wcache_zero(n, offset, count);
+    }
+    req->wc_offset = offset;
+    req->wc_len = count;
+    if (n->ra.size) {
+        nvme_ra_invalidate(n, offset, count);
+    }
+
+    req->has_sg = false;
+    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
+                     BLOCK_ACCT_WRITE);
+    req->aiocb = blk_aio_pwrite_zeroes(n->conf.blk, offset, count,
+                                        BDRV_REQ_MAY_UNMAP, nvme_rw_cb, req);
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t nvme_dsm(NvmeCtrl *_ctrl, NvmeNamespace *_ns, NvmeCmd *_cmd,
+			 NvmeRequest *_req)
+{
+    NvmeDsmCmd *thisCmd = (NvmeDsmCmd *)_cmd;
+    const uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(_ns->id_ns.flbas);
+    const uint8_t data_shift = _ns->id_ns.lbaf[lba_index].ds;
+
+    uint32_t nr   = le32_to_cpu( thisCmd->nr ) & 0xFF;        // CDW10[07:00]
+    uint64_t attr = le32_to_cpu( thisCmd->attributes ) & 0x7; // CDW11[02:00]
+    uint64_t prp1 = le64_to_cpu( thisCmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( thisCmd->prp2 );
+
+    uint16_t ret;
+
+    NvmeDsmRange *ranges = g_malloc0( sizeof(NvmeDsmRange) * NVME_NUM_MAX_DSM_RANGES );
+    if ( ranges == NULL ) {
+	qemu_printf( "[NVME] [DSM] failed in g_malloc(): %s\n", strerror(errno) );
+        return NVME_INTERNAL_DEV_ERROR | NVME_DNR;
+    }
+
+    // get LBA ranges
+    ret = nvme_dma_write_prp( _ctrl, (uint8_t *)ranges,
+			     sizeof(NvmeDsmRange) * ( nr + 1 ), prp1, prp2);
+
+    if (ret != NVME_SUCCESS) {
+	return ret;
+    }
+
+    for ( int i = 0; i <= nr; i++ ) {
+	uint32_t nlb    = le32_to_cpu( ranges[ i ].nlb );
+	uint64_t slba   = le64_to_cpu( ranges[ i ].slba );
+	uint64_t offset = slba << data_shift;
+	uint64_t count  = (uint64_t)nlb << data_shift;
+
+	if ( unlikely( slba + nlb > _ns->id_ns.nsze ) ) {
+	    trace_nvme_err_invalid_lba_range( slba, nlb, _ns->id_ns.nsze );
+	    return NVME_LBA_RANGE | NVME_DNR;
+	}
+
+	/**
+	 * NVMe spec implicitly states that a host may specify
+	 * all combinations of attributes
+	 */
+	if ( attr & NVME_DSMGMT_IDR ) {
+	    uint32_t cattr = le32_to_cpu( ranges[ i ].cattr );
+
+	    // sequential read ranges and prefetch hints start read-ahead
+	    if ( _ctrl->ra.size &&
+		 ( ( cattr & NVME_DSM_CATTR_SR ) ||
+		   ( cattr & NVME_DSM_CATTR_AF_MASK ) == NVME_RW_DSM_FREQ_PREFETCH ) ) {
+		nvme_ra_prefetch( _ctrl, offset, count );
+	    }
+	}
+
+	if ( attr & NVME_DSMGMT_AD ) {
+	    if ( _ctrl->nand.channels ) {
+		nvme_nand_trim( _ctrl, offset, count );
+	    }
+	    if ( _ctrl->wcache.size ) {
+		nvme_wcache_zero( _ctrl, offset, count );
+	    }
+	    if ( _ctrl->ra.size ) {
+		nvme_ra_invalidate( _ctrl, offset, count );
+	    }
+	    _req->has_sg = false;
+	    block_acct_start( blk_get_stats( _ctrl->conf.blk), &_req->acct, 0, BLOCK_ACCT_WRITE );
+	    ret = nvme_pwrite_zeroes( _ctrl, offset, count, BDRV_REQ_MAY_UNMAP );
+	    // deallocated metadata reads as all ones, see nvme_md_rw()
+	    if ( ret == 0 && nvme_ns_ms( _ns ) ) {
+		ret = nvme_pwrite_zeroes( _ctrl, _ns->md_offset + slba * nvme_ns_ms( _ns ),
+					  (uint64_t)nlb * nvme_ns_ms( _ns ), BDRV_REQ_MAY_UNMAP );
+	    }
+	    if ( ret == 0 ) {
+		block_acct_done( blk_get_stats( _ctrl->conf.blk ), &_req->acct );
+	    } else {
+		block_acct_failed( blk_get_stats( _ctrl->conf.blk ), &_req->acct );
+		ret = NVME_INTERNAL_DEV_ERROR;
+		break;
+	    }
+	}
+    }
+
+    g_free( ranges );
+    return ret;
+}
+
+/* open streams of a namespace, or with nsid 0 those in the shared pool */
+static uint16_t nvme_streams_open(NvmePlacement *pl, uint32_t nsid)
+{
+    uint16_t i, nr = 0;
+
+    for (i = 1; i <= pl->streams; i++) {
+        uint32_t id = pl->stream_nsid[i];
+
+        if (id && (nsid ? id == nsid : !pl->ns[id - 1].nsa)) {
+            nr++;
+        }
+    }
+    return nr;
+}
+
+static void nvme_streams_close(NvmePlacement *pl, uint32_t nsid, uint16_t sid)
+{
+    uint16_t i;
+
+    for (i = 1; i <= pl->streams; i++) {
+        if (pl->stream_nsid[i] == nsid && (!sid || pl->stream_id[i] == sid)) {
+            pl->stream_nsid[i] = 0;
+            pl->stream_id[i] = 0;
+        }
+    }
+}
+
+/* close every stream of the namespace and give back its resources */
+static void nvme_streams_release(NvmePlacement *pl, uint32_t nsid)
+{
+    NvmeNsStreams *st = &pl->ns[nsid - 1];
+
+    nvme_streams_close(pl, nsid, 0);
+    pl->nr_allocated -= st->nsa;
+    st->nsa = 0;
+}
+
+/*
+ * Pick the placement handle of a write from its directive. Handle 0 takes
+ * writes without one. A stream is opened by its first write and keeps its
+ * handle until released; a namespace with allocated resources can have NSA
+ * streams open, the others share the streams that are not allocated.
+ */
+static uint16_t nvme_placement_handle(NvmeCtrl *n, NvmeRwCmd *rw, uint8_t *ruh)
+{
+    NvmePlacement *pl = &n->placement;
+    uint32_t nsid = le32_to_cpu(rw->nsid);
+    uint16_t dspec = NVME_RW_DSPEC(le32_to_cpu(rw->dsmgmt));
+    uint16_t i, slot = 0;
+
+    *ruh = 0;
+    switch (NVME_RW_DTYPE(le16_to_cpu(rw->control))) {
+    case NVME_DIRECTIVE_IDENTIFY:
+        /* no directive */
+        return NVME_SUCCESS;
+    case NVME_DIRECTIVE_DATA_PLACEMENT:
+        /* a single reclaim group, so the placement identifier is the handle */
+        if (unlikely(dspec >= pl->fdp_nruh)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        *ruh = dspec;
+        return NVME_SUCCESS;
+    case NVME_DIRECTIVE_STREAMS:
+        if (unlikely(!pl->streams || !pl->ns[nsid - 1].enabled)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    if (!dspec) {
+        return NVME_SUCCESS;
+    }
+    for (i = 1; i <= pl->streams; i++) {
+        if (pl->stream_nsid[i] == nsid && pl->stream_id[i] == dspec) {
+            *ruh = i;
+            return NVME_SUCCESS;
+        }
+        if (!pl->stream_nsid[i] && !slot) {
+            slot = i;
+        }
+    }
+
+    if (pl->ns[nsid - 1].nsa ?
+        nvme_streams_open(pl, nsid) >= pl->ns[nsid - 1].nsa :
+        nvme_streams_open(pl, 0) >= pl->streams - pl->nr_allocated) {
+        return NVME_INVALID_FIELD;
+    }
+    assert(slot);
+    pl->stream_nsid[slot] = nsid;
+    pl->stream_id[slot] = dspec;
+    *ruh = slot;
+    return NVME_SUCCESS;
+}
+
+/* a merged request is at most this large, and has at most IOV_MAX segments */
+#define NVME_MERGE_MAX_SIZE     (1 * MiB)
+
+typedef struct NvmeMergedIO {
+    QEMUSGList  qsg;
+    QTAILQ_HEAD(, NvmeRequest) reqs;
+} NvmeMergedIO;
+
+static void nvme_merge_cb(void *opaque, int ret)
+{
+    NvmeMergedIO *io = opaque;
+    NvmeRequest *req, *next;
+
+    qemu_sglist_destroy(&io->qsg);
+    QTAILQ_FOREACH_SAFE(req, &io->reqs, merge_entry, next) {
+        QTAILQ_REMOVE(&io->reqs, req, merge_entry);
+        req->merged = false;
+        nvme_rw_cb(req, ret);
+    }
+    g_free(io);
+}
+
+/* issue the requests in the merge window, as one if there are several */
+static void nvme_merge_submit(NvmeCtrl *n)
+{
+    NvmeMerge *m = &n->merge;
+    NvmeMergedIO *io;
+    NvmeRequest *req;
+    BlockAIOCB *aiocb;
+    int i;
+
+    if (!m->nr_reqs) {
+        return;
+    }
+    timer_del(m->timer);
+
+    if (m->nr_reqs == 1) {
+        req = QTAILQ_FIRST(&m->reqs);
+        QTAILQ_REMOVE(&m->reqs, req, merge_entry);
+        m->nr_reqs = 0;
+        req->merged = false;
+        nvme_rw_aio(n, req, m->offset, m->is_write);
+        return;
+    }
+
+    io = g_new0(NvmeMergedIO, 1);
+    QTAILQ_INIT(&io->reqs);
+    pci_dma_sglist_init(&io->qsg, &n->parent_obj, m->nsg);
+    while (!QTAILQ_EMPTY(&m->reqs)) {
+        req = QTAILQ_FIRST(&m->reqs);
+        QTAILQ_REMOVE(&m->reqs, req, merge_entry);
+        QTAILQ_INSERT_TAIL(&io->reqs, req, merge_entry);
+        for (i = 0; i < req->qsg.nsg; i++) {
+            qemu_sglist_add(&io->qsg, req->qsg.sg[i].base, req->qsg.sg[i].len);
+        }
+        req->has_sg = true;
+    }
+    m->nr_reqs = 0;
+
+    aiocb = m->is_write ?
+        dma_blk_write(n->conf.blk, &io->qsg, m->offset, BDRV_SECTOR_SIZE,
+                      nvme_merge_cb, io) :
+        dma_blk_read(n->conf.blk, &io->qsg, m->offset, BDRV_SECTOR_SIZE,
+                     nvme_merge_cb, io);
+    QTAILQ_FOREACH(req, &io->reqs, merge_entry) {
+        req->aiocb = aiocb;
+    }
+}
+
+static void nvme_merge_timer_cb(void *opaque)
+{
+    nvme_merge_submit(opaque);
+}
+
+/*
+ * Put a read or write into the merge window. It joins the requests there
+ * if it is of the same kind on the same namespace and starts where they
+ * end; otherwise they are issued, and it opens a new window.
+ */
+static void nvme_merge_add(NvmeCtrl *n, NvmeRequest *req, uint64_t offset,
+                           bool is_write)
+{
+    NvmeMerge *m = &n->merge;
+    uint32_t nsid = le32_to_cpu(req->cmd.nsid);
+
+    if (m->nr_reqs &&
+        (m->nsid != nsid || m->is_write != is_write ||
+         m->offset + m->len != offset ||
+         m->len + req->qsg.size > NVME_MERGE_MAX_SIZE ||
+         m->nsg + req->qsg.nsg > IOV_MAX)) {
+        nvme_merge_submit(n);
+    }
+
+    if (!m->nr_reqs) {
+        m->nsid = nsid;
+        m->is_write = is_write;
+        m->offset = offset;
+        m->len = 0;
+        m->nsg = 0;
+        timer_mod(m->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t)m->window_us * SCALE_US);
+    }
+    QTAILQ_INSERT_TAIL(&m->reqs, req, merge_entry);
+    m->nr_reqs++;
+    m->len += req->qsg.size;
+    m->nsg += req->qsg.nsg;
+    req->merged = true;
+}
+
+/* writes up to this size can be made atomic */
+#define NVME_ATOMIC_MAX_SIZE    (1 * MiB)
+
+static inline uint64_t nvme_journal_slot(NvmeCtrl *n, NvmeNamespace *ns,
+                                         int slot)
+{
+    return ns->journal_offset +
+           slot * (NVME_JOURNAL_HDR_SIZE + n->atomic_size);
+}
+
+static uint32_t nvme_journal_crc(const uint8_t *data, uint32_t len)
+{
+    return crc32c(0xffffffff, data, len) ^ 0xffffffff;
+}
+
+/*
+ * Write the data of an atomic write to a free journal slot, then in place,
+ * then invalidate the slot; each step is FUA, so a crash leaves either the
+ * old data or a slot that replays the new.
+ */
+static void coroutine_fn nvme_journal_co(void *opaque)
+{
+    NvmeRequest *req = opaque;
+    NvmeCtrl *n = req->sq->ctrl;
+    NvmeNamespace *ns = &n->namespaces[le32_to_cpu(req->cmd.nsid) - 1];
+    uint32_t len = req->wc_len;
+    NvmeJournalHdr *hdr;
+    uint8_t *buf, *data;
+    int slot, ret;
+
+    while (ns->journal_busy == (1 << NVME_JOURNAL_SLOTS) - 1) {
+        qemu_co_queue_wait(&ns->journal_waiters, NULL);
+    }
+    slot = ctz32(~ns->journal_busy);
+    ns->journal_busy |= 1 << slot;
+
+    buf = blk_blockalign(n->conf.blk, NVME_JOURNAL_HDR_SIZE + len);
+    data = buf + NVME_JOURNAL_HDR_SIZE;
+    memset(buf, 0, NVME_JOURNAL_HDR_SIZE);
+    nvme_req_copy(req, data, len, false);
+
+    hdr = (NvmeJournalHdr *)buf;
+    hdr->magic = cpu_to_le64(NVME_JOURNAL_MAGIC);
+    hdr->offset = cpu_to_le64(req->wc_offset);
+    hdr->len = cpu_to_le32(len);
+    hdr->crc = cpu_to_le32(nvme_journal_crc(data, len));
+
+    ret = blk_co_pwrite(n->conf.blk, nvme_journal_slot(n, ns, slot),
+                        NVME_JOURNAL_HDR_SIZE + len, buf, BDRV_REQ_FUA);
+    if (ret >= 0) {
+        ret = blk_co_pwrite(n->conf.blk, req->wc_offset, len, data,
+                            BDRV_REQ_FUA);
+    }
+    if (ret >= 0) {
+        memset(buf, 0, NVME_JOURNAL_HDR_SIZE);
+        ret = blk_co_pwrite(n->conf.blk, nvme_journal_slot(n, ns, slot),
+                            NVME_JOURNAL_HDR_SIZE, buf, BDRV_REQ_FUA);
+    }
+    qemu_vfree(buf);
+
+    ns->journal_busy &= ~(1 << slot);
+    qemu_co_queue_next(&ns->journal_waiters);
+
+    req->has_sg = req->qsg.nsg > 0;
+    nvme_rw_cb(req, ret < 0 ? ret : 0);
+    blk_dec_in_flight(n->conf.blk);
+}
+
+/* whether a write has to go through the journal to be atomic */
+static bool nvme_journal_needed(NvmeCtrl *n, NvmeNamespace *ns,
+                                uint64_t data_size)
+{
+    return n->atomic_size && !nvme_ns_ms(ns) &&
+           data_size > BDRV_SECTOR_SIZE && data_size <= n->atomic_size;
+}
+
+static void nvme_journal_write(NvmeCtrl *n, NvmeRequest *req)
+{
+    req->journaled = true;
+    blk_inc_in_flight(n->conf.blk);
+    qemu_coroutine_enter(qemu_coroutine_create(nvme_journal_co, req));
+}
+
+/*
+ * Write again what a crash left in the journal of a namespace. A slot is
+ * valid only if all of its data made it, or the CRC wouldn't match, and
+ * then the write may not have reached its place.
+ */
+static void nvme_journal_replay(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    uint8_t *buf = blk_blockalign(n->conf.blk,
+                                  NVME_JOURNAL_HDR_SIZE + n->atomic_size);
+    uint8_t *data = buf + NVME_JOURNAL_HDR_SIZE;
+    NvmeJournalHdr *hdr = (NvmeJournalHdr *)buf;
+    uint32_t replayed = 0;
+    int slot;
+
+    for (slot = 0; slot < NVME_JOURNAL_SLOTS; slot++) {
+        uint64_t offset = nvme_journal_slot(n, ns, slot);
+        uint32_t len;
+
+        if (blk_pread(n->conf.blk, offset, buf, NVME_JOURNAL_HDR_SIZE) < 0 ||
+            le64_to_cpu(hdr->magic) != NVME_JOURNAL_MAGIC) {
+            continue;
+        }
+        len = le32_to_cpu(hdr->len);
+        if (len <= n->atomic_size &&
+            le64_to_cpu(hdr->offset) + len <=
+            n->num_namespaces * n->ns_size &&
+            blk_pread(n->conf.blk, offset + NVME_JOURNAL_HDR_SIZE, data,
+                      len) >= 0 &&
+            nvme_journal_crc(data, len) == le32_to_cpu(hdr->crc)) {
+            if (blk_pwrite(n->conf.blk, le64_to_cpu(hdr->offset), data, len,
+                           0) < 0) {
+                qemu_printf("[NVME] [JOURNAL] failed to replay a write\n");
+                continue;
+            }
+            replayed++;
+        }
+        memset(buf, 0, NVME_JOURNAL_HDR_SIZE);
+        blk_pwrite(n->conf.blk, offset, buf, NVME_JOURNAL_HDR_SIZE, 0);
+    }
+    blk_flush(n->conf.blk);
+    qemu_vfree(buf);
+
+    if (replayed) {
+        qemu_printf("[NVME] [JOURNAL] replayed %u interrupted writes\n",
+                    replayed);
+    }
+}
+
+static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
+    uint64_t slba = le64_to_cpu(rw->slba);
+    uint64_t prp1 = le64_to_cpu(rw->prp1);
+    uint64_t prp2 = le64_to_cpu(rw->prp2);
+
+    uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
+    uint64_t data_size = (uint64_t)nlb << data_shift;
+    uint64_t data_offset;
+    int is_append = rw->opcode == NVME_CMD_ZONE_APPEND ? 1 : 0;
+    int is_write = rw->opcode == NVME_CMD_WRITE || is_append ? 1 : 0;
+    int is_compare = rw->opcode == NVME_CMD_COMPARE ? 1 : 0;
+    enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
+    NvmeZone *zone = NULL;
+    uint16_t status;
+
+    trace_nvme_rw(is_write ? "write" : "read", nlb, data_size, slba);
+
+    if (unlikely((slba + nlb) > ns->id_ns.nsze)) {
+        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        trace_nvme_err_invalid_lba_range(slba, nlb, ns->id_ns.nsze);
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    if (unlikely(n->wcache.size && data_size > n->wcache.max_xfer)) {
+        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(is_compare && data_size > NVME_COMPARE_MAX)) {
+        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    req->ruh = 0;
+    if (is_write) {
+        status = nvme_placement_handle(n, rw, &req->ruh);
+        if (status) {
+            block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+            return status;
+        }
+    }
+
+    if (is_append) {
+        if (unlikely(!ns->zoned)) {
+            return NVME_INVALID_OPCODE | NVME_DNR;
+        }
+        zone = nvme_get_zone(ns, slba);
+        if (unlikely(slba != zone->zslba)) {
+            block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        /* the device picks the LBA and returns it in CQE dwords 0 and 1 */
+        slba = zone->wp;
+        req->cqe.result = cpu_to_le32(slba & 0xffffffff);
+        req->cqe.rsvd = cpu_to_le32(slba >> 32);
+    } else if (is_write && ns->zoned) {
+        zone = nvme_get_zone(ns, slba);
+    }
+
+    if (is_compare) {
+        /* read into a bounce buffer, see nvme_compare() */
+        req->qsg.nsg = 0;
+        qemu_iovec_init(&req->iov, 1);
+        qemu_iovec_add(&req->iov, g_malloc(data_size), data_size);
+    } else if (nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n)) {
+        block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    /* the metadata is read or written once the data is, see nvme_rw_cb() */
+    if (nvme_ns_ms(ns)) {
+        req->md_offset = ns->md_offset + slba * nvme_ns_ms(ns);
+        req->md_len = (size_t)nlb * nvme_ns_ms(ns);
+    }
+    if (is_write && nvme_ns_ms(ns)) {
+        status = nvme_rw_write_md(n, ns, req, slba, nlb);
+        if (status) {
+            block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+            if (req->qsg.nsg > 0) {
+                qemu_sglist_destroy(&req->qsg);
+            } else {
+                qemu_iovec_destroy(&req->iov);
+            }
+            return status;
+        }
+    }
+
+    /* last, so that a command failing above doesn't open the zone */
+    if (zone) {
+        status = nvme_zone_prep_write(n, ns, zone, slba, nlb);
+        if (status) {
+            block_acct_invalid(blk_get_stats(n->conf.blk), acct);
+            if (req->qsg.nsg > 0) {
+                qemu_sglist_destroy(&req->qsg);
+            } else {
+                qemu_iovec_destroy(&req->iov);
+            }
+            return status;
+        }
+        nvme_zone_advance_wp(n, ns, zone, nlb);
+    }
+
+    data_offset = slba << data_shift;
+    if (is_compare) {
+        block_acct_start(blk_get_stats(n->conf.blk), &req->acct, data_size,
+                         acct);
+    } else {
+        dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
+    }
+
+    if (is_write) {
+        req->wc_offset = data_offset;
+        req->wc_len = data_size;
+        n->placement.host_bytes[req->ruh] += data_size;
+        if (n->ra.size) {
+            nvme_ra_invalidate(n, data_offset, data_size);
+        }
+    }
+
+    if (n->wcache.size &&
+        nvme_wcache_rw(n, req, data_offset, data_size, is_write, &status)) {
+        return status;
+    }
+
+    /* an aborted read-ahead wait would skip nvme_rw_cb(), which Compare needs */
+    if (n->ra.size && !is_write && !is_compare &&
+        nvme_ra_read(n, ns, req, data_offset, data_size)) {
+        return NVME_NO_COMPLETE;
+    }
+
+    if (n->nand.channels) {
+        req->expire_ns = nvme_nand_rw(n, data_offset, data_size, is_write,
+                                      req->ruh);
+        /* failed like a write the backend refused, see nvme_rw_cb() */
+        if (req->expire_ns < 0) {
+            req->expire_ns = 0;
+            req->has_sg = req->qsg.nsg > 0;
+            nvme_rw_cb(req, -ENOSPC);
+            return NVME_NO_COMPLETE;
+        }
+    }
+    if (is_write && nvme_journal_needed(n, ns, data_size)) {
+        nvme_journal_write(n, req);
+    } else if (n->merge.window_us && req->qsg.nsg > 0) {
+        nvme_merge_add(n, req, data_offset, is_write);
+    } else {
+        nvme_rw_aio(n, req, data_offset, is_write);
+    }
+
+    return NVME_NO_COMPLETE;
+}
+
+/* source ranges of a Copy, and the LBAs it takes per range and in all */
+#define NVME_COPY_MSRC      128
+#define NVME_COPY_MSSRL     0xffff
+#define NVME_COPY_MCL       0xffff
+/* a Copy moves this much at a time */
+#define NVME_COPY_CHUNK     (1 * MiB)
+
+typedef struct NvmeCopy {
+    NvmeCtrl            *ctrl;
+    NvmeNamespace       *ns;
+    NvmeRequest         *req;
+    uint32_t            nr;
+    uint32_t            nlb;        /* in all ranges */
+    uint64_t            dlba;       /* where the next chunk goes */
+    uint32_t            dreftag;
+    uint8_t             *buf;
+    uint8_t             *md;
+    NvmeCopySourceRange ranges[NVME_COPY_MSRC];
+} NvmeCopy;
+
+/*
+ * Copy nlb blocks of a source range to c->dlba. The backend copies the
+ * data itself where it can; it goes through c->buf if it can't, or if the
+ * guard is to be generated or checked.
+ */
+static uint16_t coroutine_fn nvme_copy_chunk(NvmeCopy *c,
+                                             NvmeCopySourceRange *r,
+                                             uint64_t slba, uint32_t nlb,
+                                             uint32_t reftag)
+{
+    NvmeCtrl *n = c->ctrl;
+    NvmeNamespace *ns = c->ns;
+    NvmeCopyCmd *copy = (NvmeCopyCmd *)&c->req->cmd;
+    uint8_t ds = nvme_ns_lbaf(ns)->ds;
+    uint16_t prinfor = 0, prinfow = 0;
+    int64_t src = slba << ds;
+    int64_t dst = c->dlba << ds;
+    uint32_t len = nlb << ds;
+    uint8_t *data = NULL;
+    uint16_t status;
+    int ret;
+
+    if (nvme_ns_pi(ns)) {
+        prinfor = NVME_COPY_PRINFOR(copy->format) & NVME_RW_PRINFO_PRCHK_MASK;
+        prinfow = le16_to_cpu(copy->control) &
+                  (NVME_RW_PRINFO_PRACT | NVME_RW_PRINFO_PRCHK_MASK);
+    }
+
+    if (nvme_ns_ms(ns) && nvme_md_rw(n, ns, slba, nlb, c->md, false) < 0) {
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+
+    if (n->copy_bounce || ((prinfor | prinfow) &
+                           (NVME_RW_PRINFO_PRACT | NVME_RW_PRINFO_PRCHK_GUARD))) {
+        data = c->buf;
+        if (blk_co_pread(n->conf.blk, src, len, data, 0) < 0) {
+            return NVME_INTERNAL_DEV_ERROR;
+        }
+    }
+
+    if (prinfor) {
+        status = nvme_pi_check(ns, data, c->md, nlb, prinfor, reftag,
+                               le16_to_cpu(r->apptag),
+                               le16_to_cpu(r->appmask));
+        if (status) {
+            return status;
+        }
+    }
+    if (prinfow & NVME_RW_PRINFO_PRACT) {
+        nvme_pi_generate(ns, data, c->md, nlb, c->dreftag,
+                         le16_to_cpu(copy->apptag));
+    } else if (prinfow) {
+        status = nvme_pi_check(ns, data, c->md, nlb, prinfow, c->dreftag,
+                               le16_to_cpu(copy->apptag),
+                               le16_to_cpu(copy->appmask));
+        if (status) {
+            return status;
+        }
+    }
+
+    ret = data ? 0 : blk_co_copy_range(n->conf.blk, src, n->conf.blk, dst,
+                                       len, 0, 0);
+    if (ret < 0) {
+        /* copy_file_range() also refuses e.g. overlapping ranges */
+        if (ret == -ENOTSUP) {
+            n->copy_bounce = true;
+        }
+        data = c->buf;
+        if (blk_co_pread(n->conf.blk, src, len, data, 0) < 0) {
+            return NVME_INTERNAL_DEV_ERROR;
+        }
+    }
+    if (data && blk_co_pwrite(n->conf.blk, dst, len, data, 0) < 0) {
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+
+    if (nvme_ns_ms(ns) && nvme_md_rw(n, ns, c->dlba, nlb, c->md, true) < 0) {
+        return NVME_INTERNAL_DEV_ERROR;
+    }
+    return NVME_SUCCESS;
+}
+
+static void coroutine_fn nvme_copy_co(void *opaque)
+{
+    NvmeCopy *c = opaque;
+    NvmeCtrl *n = c->ctrl;
+    NvmeRequest *req = c->req;
+    NvmeCopyCmd *copy = (NvmeCopyCmd *)&req->cmd;
+    uint8_t ds = nvme_ns_lbaf(c->ns)->ds;
+    uint64_t sdlba = le64_to_cpu(copy->sdlba);
+    uint16_t status = NVME_SUCCESS;
+    uint32_t i;
+
+    c->dlba = sdlba;
+    c->dreftag = le32_to_cpu(copy->reftag);
+    c->buf = g_malloc(NVME_COPY_CHUNK);
+    c->md = g_malloc((NVME_COPY_CHUNK >> ds) * nvme_ns_ms(c->ns));
+
+    for (i = 0; i < c->nr && !status; i++) {
+        NvmeCopySourceRange *r = &c->ranges[i];
+        uint64_t slba = le64_to_cpu(r->slba);
+        uint32_t nlb = le16_to_cpu(r->nlb) + 1;
+        uint32_t reftag = le32_to_cpu(r->reftag);
+
+        while (nlb && !status) {
+            uint32_t cnt = MIN(nlb, NVME_COPY_CHUNK >> ds);
+
+            status = nvme_copy_chunk(c, r, slba, cnt, reftag);
+            slba += cnt;
+            nlb -= cnt;
+            c->dlba += cnt;
+            if (nvme_ns_pi(c->ns) != DPS_TYPE_3) {
+                reftag += cnt;
+                c->dreftag += cnt;
+            }
+        }
+    }
+    if (!status && (le16_to_cpu(copy->control) & NVME_RW_FUA) &&
+        blk_co_flush(n->conf.blk) < 0) {
+        status = NVME_INTERNAL_DEV_ERROR;
+    }
+
+    if (status) {
+        block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
+        nvme_log_error(n, req->sq->sqid, req->cmd.cid, status,
+                       le32_to_cpu(copy->nsid), sdlba);
+    } else {
+        block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
+    }
+    /* read-ahead issued while the copy was running may have old data */
+    if (n->ra.size) {
+        nvme_ra_invalidate(n, sdlba << ds, (uint64_t)c->nlb << ds);
+    }
+    if (c->ns->zoned) {
+        nvme_zone_persist(n, c->ns, nvme_get_zone(c->ns, sdlba));
+    }
+
+    req->status = status;
+    g_free(c->buf);
+    g_free(c->md);
+    g_free(c);
+    nvme_complete_req(n, req);
+    blk_dec_in_flight(n->conf.blk);
+}
+
+/*
+ * Copy runs in a coroutine, which holds the BlockBackend in flight until
+ * it is done so that draining it waits for the whole copy. The data never
+ * passes through guest memory.
+ */
+static uint16_t nvme_copy(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    NvmeCopyCmd *copy = (NvmeCopyCmd *)cmd;
+    uint64_t sdlba = le64_to_cpu(copy->sdlba);
+    uint64_t prp1 = le64_to_cpu(copy->prp1);
+    uint64_t prp2 = le64_to_cpu(copy->prp2);
+    uint32_t nr = copy->nr + 1;
+    uint8_t ds = nvme_ns_lbaf(ns)->ds;
+    NvmeZone *zone;
+    NvmeCopy *c;
+    uint64_t nlb = 0;
+    uint16_t status;
+    uint32_t i;
+
+    if (unlikely(NVME_COPY_DESFMT(copy->format))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(nr > NVME_COPY_MSRC)) {
+        return NVME_CMD_SIZE_LIMIT | NVME_DNR;
+    }
+
+    c = g_new0(NvmeCopy, 1);
+    status = nvme_dma_write_prp(n, (uint8_t *)c->ranges,
+                                nr * sizeof(NvmeCopySourceRange), prp1, prp2);
+    if (status) {
+        goto fail;
+    }
+    for (i = 0; i < nr; i++) {
+        uint64_t slba = le64_to_cpu(c->ranges[i].slba);
+        uint32_t rnlb = le16_to_cpu(c->ranges[i].nlb) + 1;
+
+        if (unlikely(rnlb > NVME_COPY_MSSRL)) {
+            status = NVME_CMD_SIZE_LIMIT | NVME_DNR;
+            goto fail;
+        }
+        if (unlikely(slba + rnlb > ns->id_ns.nsze)) {
+            trace_nvme_err_invalid_lba_range(slba, rnlb, ns->id_ns.nsze);
+            status = NVME_LBA_RANGE | NVME_DNR;
+            goto fail;
+        }
+        nlb += rnlb;
+    }
+    if (unlikely(nlb > NVME_COPY_MCL)) {
+        status = NVME_CMD_SIZE_LIMIT | NVME_DNR;
+        goto fail;
+    }
+    if (unlikely(sdlba + nlb > ns->id_ns.nsze)) {
+        trace_nvme_err_invalid_lba_range(sdlba, nlb, ns->id_ns.nsze);
+        status = NVME_LBA_RANGE | NVME_DNR;
+        goto fail;
+    }
+
+    status = nvme_placement_handle(n, (NvmeRwCmd *)cmd, &req->ruh);
+    if (status) {
+        goto fail;
+    }
+    if (ns->zoned) {
+        zone = nvme_get_zone(ns, sdlba);
+        status = nvme_zone_prep_write(n, ns, zone, sdlba, nlb);
+        if (status) {
+            goto fail;
+        }
+        nvme_zone_advance_wp(n, ns, zone, nlb);
+    }
+
+    /* the copy reads and writes the backend, beneath the write cache */
+    if (n->wcache.size) {
+        if (!QTAILQ_EMPTY(&n->wcache.dirty)) {
+            nvme_wcache_writeback_sync(n);
+        }
+        if (!nvme_wcache_bypass(n, sdlba << ds, nlb << ds)) {
+            nvme_merge_submit(n);
+            blk_drain(n->conf.blk);
+            nvme_wcache_bypass(n, sdlba << ds, nlb << ds);
+        }
+    }
+    if (n->ra.size) {
+        nvme_ra_invalidate(n, sdlba << ds, nlb << ds);
+    }
+    if (n->nand.channels) {
+        int64_t done = nvme_nand_rw(n, sdlba << ds, nlb << ds, true, req->ruh);
+
+        if (done < 0) {
+            /* the write pointer has moved, as for a failed write */
+            if (ns->zoned) {
+                nvme_zone_persist(n, ns, zone);
+            }
+            status = NVME_CAP_EXCEEDED;
+            goto fail;
+        }
+        for (i = 0; i < nr; i++) {
+            req->expire_ns = MAX(req->expire_ns,
+                nvme_nand_rw(n, le64_to_cpu(c->ranges[i].slba) << ds,
+                             (le16_to_cpu(c->ranges[i].nlb) + 1) << ds,
+                             false, 0));
+        }
+        req->expire_ns = MAX(req->expire_ns, done);
+    }
+
+    c->ctrl = n;
+    c->ns = ns;
+    c->req = req;
+    c->nr = nr;
+    c->nlb = nlb;
+    req->has_sg = false;
+    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, nlb << ds,
+                     BLOCK_ACCT_WRITE);
+    blk_inc_in_flight(n->conf.blk);
+    qemu_coroutine_enter(qemu_coroutine_create(nvme_copy_co, c));
+    return NVME_NO_COMPLETE;
+
+fail:
+    g_free(c);
+    return status;
+}
+
+static uint16_t nvme_io_dispatch(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    switch (cmd->opcode) {
+    case NVME_CMD_FLUSH:
+        return nvme_flush(n, ns, cmd, req);
+    case NVME_CMD_WRITE_ZEROS:
+        return nvme_write_zeros(n, ns, cmd, req);
+    case NVME_CMD_WRITE:
+    case NVME_CMD_READ:
+    case NVME_CMD_COMPARE:
+    case NVME_CMD_ZONE_APPEND:
+        return nvme_rw(n, ns, cmd, req);
+    case NVME_CMD_DSM:
+        return nvme_dsm(n, ns, cmd, req);
+    case NVME_CMD_COPY:
+        return nvme_copy(n, ns, cmd, req);
+    case NVME_CMD_ZONE_MGMT_SEND:
+        return nvme_zone_mgmt_send(n, ns, cmd, req);
+    case NVME_CMD_ZONE_MGMT_RECV:
+        return nvme_zone_mgmt_recv(n, ns, cmd, req);
+    default:
+        trace_nvme_err_invalid_opc(cmd->opcode);
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void nvme_io_start(NvmeCtrl *n, NvmeNamespace *ns, NvmeRequest *req)
+{
+    uint16_t status;
+
+    /* the Write of a fused pair holds the range, and its Compare goes first */
+    if (req->fused) {
+        req = req->fused;
+    }
+
+    status = nvme_io_dispatch(n, ns, &req->cmd, req);
+    if (status == NVME_NO_COMPLETE) {
+        return;
+    }
+    req->status = status;
+    if (req->fused) {
+        nvme_fused_next(n, req);
+    } else {
+        nvme_complete_req(n, req);
+    }
+}
+
+/* complete a fused Compare, and go on with its Write if it matched */
+static void nvme_fused_next(NvmeCtrl *n, NvmeRequest *req)
+{
+    NvmeRequest *write = req->fused;
+    uint16_t status = req->status;
+
+    req->fused = NULL;
+    write->fused = NULL;
+    nvme_complete_req(n, req);
+
+    if (status) {
+        write->status = NVME_CMD_ABORT_FAILED_FUSE;
+        nvme_complete_req(n, write);
+        return;
+    }
+    nvme_io_start(n, &n->namespaces[le32_to_cpu(write->cmd.nsid) - 1], write);
+}
+
+/*
+ * Commands hold the LBA range they touch on their namespace until their
+ * completion is queued, so that overlapping commands execute in the order
+ * they arrived. Reads and Compares share a range; writes, a fused Compare
+ * and Write, and everything else that changes the media hold theirs
+ * exclusively. A command that conflicts with a holder, or with a command
+ * that arrived before it and is still waiting, waits too.
+ */
+static void nvme_lock_range(NvmeNamespace *ns, NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    NvmeZoneSendCmd *zs = (NvmeZoneSendCmd *)&req->cmd;
+
+    req->lock_slba = le64_to_cpu(rw->slba);
+    req->lock_excl = true;
+    switch (rw->opcode) {
+    case NVME_CMD_READ:
+    case NVME_CMD_COMPARE:
+        req->lock_excl = false;
+        /* fall through */
+    case NVME_CMD_WRITE:
+    case NVME_CMD_WRITE_ZEROS:
+        req->lock_nlb = le16_to_cpu(rw->nlb) + 1;
+        break;
+    case NVME_CMD_ZONE_APPEND:
+        /* the LBA is picked later, anywhere in the zone */
+        req->lock_nlb = ns->zoned ? ns->zone_size : 1;
+        break;
+    case NVME_CMD_ZONE_MGMT_SEND:
+        if (!NVME_ZONE_SEND_SELECT_ALL(zs->zsflags)) {
+            req->lock_nlb = ns->zoned ? ns->zone_size : 1;
+            break;
+        }
+        /* fall through */
+    case NVME_CMD_DSM:
+    case NVME_CMD_COPY:
+        /* the ranges are in host memory, and these are rare enough */
+        req->lock_slba = 0;
+        req->lock_nlb = ns->id_ns.nsze;
+        break;
+    default:
+        req->lock_nlb = 0;
+        break;
+    }
+
+    /* out of range, so it fails without touching the media */
+    if (req->lock_slba >= ns->id_ns.nsze) {
+        req->lock_nlb = 0;
+    }
+}
+
+static inline bool nvme_lock_conflict(NvmeRequest *a, NvmeRequest *b)
+{
+    return (a->lock_excl || b->lock_excl) &&
+           a->lock_slba < b->lock_slba + b->lock_nlb &&
+           b->lock_slba < a->lock_slba + a->lock_nlb;
+}
+
+/*
+ * The held ranges of a namespace are kept in an interval treap: a binary
+ * search tree on the start LBA that is a heap on a pseudo-random priority,
+ * where every node also knows the greatest end LBA in its subtree, and
+ * the greatest end of the exclusive ranges in it for shared lookups.
+ */
+static inline bool nvme_lock_before(NvmeRequest *a, NvmeRequest *b)
+{
+    return a->lock_slba < b->lock_slba ||
+           (a->lock_slba == b->lock_slba && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void nvme_lock_update(NvmeRequest *r)
+{
+    NvmeRequest *c[2] = { r->lock_left, r->lock_right };
+    uint64_t end = r->lock_slba + r->lock_nlb;
+    int i;
+
+    r->lock_max = end;
+    r->lock_max_excl = r->lock_excl ? end : 0;
+    for (i = 0; i < 2; i++) {
+        if (c[i]) {
+            r->lock_max = MAX(r->lock_max, c[i]->lock_max);
+            r->lock_max_excl = MAX(r->lock_max_excl, c[i]->lock_max_excl);
+        }
+    }
+}
+
+static NvmeRequest *nvme_lock_insert(NvmeRequest *root, NvmeRequest *req)
+{
+    NvmeRequest *child;
+
+    if (!root) {
+        req->lock_left = req->lock_right = NULL;
+        nvme_lock_update(req);
+        return req;
+    }
+
+    if (nvme_lock_before(req, root)) {
+        root->lock_left = nvme_lock_insert(root->lock_left, req);
+        if (root->lock_left->lock_prio > root->lock_prio) {
+            child = root->lock_left;
+            root->lock_left = child->lock_right;
+            child->lock_right = root;
+            nvme_lock_update(root);
+            root = child;
+        }
+    } else {
+        root->lock_right = nvme_lock_insert(root->lock_right, req);
+        if (root->lock_right->lock_prio > root->lock_prio) {
+            child = root->lock_right;
+            root->lock_right = child->lock_left;
+            child->lock_left = root;
+            nvme_lock_update(root);
+            root = child;
+        }
+    }
+    nvme_lock_update(root);
+    return root;
+}
+
+static NvmeRequest *nvme_lock_merge(NvmeRequest *a, NvmeRequest *b)
+{
+    if (!a || !b) {
+        return a ? a : b;
+    }
+    if (a->lock_prio > b->lock_prio) {
+        a->lock_right = nvme_lock_merge(a->lock_right, b);
+        nvme_lock_update(a);
+        return a;
+    }
+    b->lock_left = nvme_lock_merge(a, b->lock_left);
+    nvme_lock_update(b);
+    return b;
+}
+
+static NvmeRequest *nvme_lock_remove(NvmeRequest *root, NvmeRequest *req)
+{
+    if (root == req) {
+        return nvme_lock_merge(req->lock_left, req->lock_right);
+    }
+    if (nvme_lock_before(req, root)) {
+        root->lock_left = nvme_lock_remove(root->lock_left, req);
+    } else {
+        root->lock_right = nvme_lock_remove(root->lock_right, req);
+    }
+    nvme_lock_update(root);
+    return root;
+}
+
+/* whether a range held in the subtree conflicts with req */
+static bool nvme_lock_busy(NvmeRequest *r, NvmeRequest *req)
+{
+    uint64_t end = req->lock_slba + req->lock_nlb;
+
+    while (r) {
+        /* nothing in here ends past the start of req */
+        if ((req->lock_excl ? r->lock_max : r->lock_max_excl) <=
+            req->lock_slba) {
+            return false;
+        }
+        if (nvme_lock_busy(r->lock_left, req)) {
+            return true;
+        }
+        /* the right subtree starts even later */
+        if (r->lock_slba >= end) {
+            return false;
+        }
+        if (nvme_lock_conflict(r, req)) {
+            return true;
+        }
+        r = r->lock_right;
+    }
+    return false;
+}
+
+/* whether req may have its range, given the holders and earlier waiters */
+static bool nvme_lock_free(NvmeNamespace *ns, NvmeRequest *req)
+{
+    NvmeRequest *r;
+
+    if (nvme_lock_busy(ns->lock_root, req)) {
+        return false;
+    }
+    QTAILQ_FOREACH(r, &ns->lock_waiting, lock_entry) {
+        if (r == req) {
+            break;
+        }
+        if (nvme_lock_conflict(r, req)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void nvme_lock_hold(NvmeNamespace *ns, NvmeRequest *req)
+{
+    /* Fibonacci hashing of a counter is random enough to balance a treap */
+    req->lock_prio = ++ns->lock_seq * 2654435761u;
+    ns->lock_root = nvme_lock_insert(ns->lock_root, req);
+    req->locked = true;
+}
+
+/* returns false if req has to wait; nvme_lock_kick() starts it later */
+static bool nvme_lock_acquire(NvmeNamespace *ns, NvmeRequest *req)
+{
+    if (!req->lock_nlb) {
+        return true;
+    }
+    if (!nvme_lock_free(ns, req)) {
+        QTAILQ_INSERT_TAIL(&ns->lock_waiting, req, lock_entry);
+        return false;
+    }
+    nvme_lock_hold(ns, req);
+    return true;
+}
+
+/* start the waiters that are free to go, which may complete at once */
+static void nvme_lock_kick(NvmeNamespace *ns)
+{
+    NvmeRequest *req;
+
+again:
+    QTAILQ_FOREACH(req, &ns->lock_waiting, lock_entry) {
+        if (nvme_lock_free(ns, req)) {
+            QTAILQ_REMOVE(&ns->lock_waiting, req, lock_entry);
+            nvme_lock_hold(ns, req);
+            nvme_io_start(req->sq->ctrl, ns, req);
+            goto again;
+        }
+    }
+}
+
+static void nvme_lock_release(NvmeRequest *req)
+{
+    NvmeCtrl *n = req->sq->ctrl;
+    NvmeNamespace *ns = &n->namespaces[le32_to_cpu(req->cmd.nsid) - 1];
+
+    ns->lock_root = nvme_lock_remove(ns->lock_root, req);
+    req->locked = false;
+    nvme_lock_kick(ns);
+}
+
+/*
+ * Fail the commands of a queue that wait for an LBA range or for the second
+ * half of a fused command, or only target; returns whether any were failed.
+ */
+static bool nvme_lock_abort(NvmeCtrl *n, NvmeSQueue *sq, NvmeRequest *target,
+                            uint16_t status)
+{
+    NvmeRequest *req, *next;
+    bool found = false;
+    uint32_t i;
+
+    if (sq->fused && (!target || sq->fused == target)) {
+        req = sq->fused;
+        sq->fused = NULL;
+        req->status = status;
+        nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+        found = true;
+    }
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+        bool removed = false;
+
+        QTAILQ_FOREACH_SAFE(req, &ns->lock_waiting, lock_entry, next) {
+            if (req->sq != sq ||
+                (target && req != target && req->fused != target)) {
+                continue;
+            }
+            QTAILQ_REMOVE(&ns->lock_waiting, req, lock_entry);
+            if (req->fused) {
+                req->fused->fused = NULL;
+                req->fused->status = status;
+                nvme_enqueue_req_completion(n->cq[sq->cqid], req->fused);
+                req->fused = NULL;
+            }
+            req->status = status;
+            nvme_enqueue_req_completion(n->cq[sq->cqid], req);
+            removed = found = true;
+        }
+        if (removed) {
+            nvme_lock_kick(ns);
+        }
+    }
+
+    return found;
+}
+
+/* put the ranges of a subtree that don't belong to n back into the treap */
+static void nvme_lock_reset_tree(NvmeCtrl *n, NvmeNamespace *ns,
+                                 NvmeRequest *r)
+{
+    NvmeRequest *left, *right;
+
+    if (!r) {
+        return;
+    }
+    left = r->lock_left;
+    right = r->lock_right;
+    if (r->sq->ctrl == n) {
+        r->locked = false;
+    } else {
+        ns->lock_root = nvme_lock_insert(ns->lock_root, r);
+    }
+    nvme_lock_reset_tree(n, ns, left);
+    nvme_lock_reset_tree(n, ns, right);
+}
+
+/* forget the ranges of a controller's commands, which go with its queues */
+static void nvme_lock_reset(NvmeCtrl *n)
+{
+    NvmeRequest *req, *next, *root;
+    uint32_t i;
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+
+        QTAILQ_FOREACH_SAFE(req, &ns->lock_waiting, lock_entry, next) {
+            if (req->sq->ctrl == n) {
+                QTAILQ_REMOVE(&ns->lock_waiting, req, lock_entry);
+            }
+        }
+        root = ns->lock_root;
+        ns->lock_root = NULL;
+        nvme_lock_reset_tree(n, ns, root);
+        nvme_lock_kick(ns);
+    }
+}
+
+/*
+ * A Compare with the first fused flag is held until the command after it on
+ * the same queue, which must be a Write of the same LBAs. The pair then
+ * runs under an exclusive lock of the range, which the Write holds.
+ */
+static uint16_t nvme_fused(NvmeCtrl *n, NvmeNamespace *ns, NvmeRequest *cmp,
+    NvmeRequest *req)
+{
+    NvmeRwCmd *w = (NvmeRwCmd *)&req->cmd;
+    NvmeRwCmd *c;
+
+    switch (NVME_CMD_FUSE(req->cmd.fuse)) {
+    case NVME_FUSE_FIRST:
+        if (unlikely(req->cmd.opcode != NVME_CMD_COMPARE)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        req->sq->fused = req;
+        return NVME_NO_COMPLETE;
+    case NVME_FUSE_SECOND:
+        if (unlikely(!cmp)) {
+            return NVME_CMD_ABORT_MISSING_FUSE;
+        }
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    c = (NvmeRwCmd *)&cmp->cmd;
+    if (unlikely(req->cmd.opcode != NVME_CMD_WRITE || c->nsid != w->nsid ||
+                 c->slba != w->slba || c->nlb != w->nlb)) {
+        cmp->status = NVME_INVALID_FIELD | NVME_DNR;
+        nvme_complete_req(n, cmp);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    cmp->fused = req;
+    req->fused = cmp;
+    nvme_lock_range(ns, req);
+    if (nvme_lock_acquire(ns, req)) {
+        nvme_io_start(n, ns, req);
+    }
+    return NVME_NO_COMPLETE;
+}
+
+/*
+ * Format NVM and Sanitize run on one controller but own the media of the
+ * whole subsystem until they are done, as does a failed sanitize until it
+ * is exited. Returns the controller whose job that is, if any.
+ */
+static NvmeCtrl *nvme_media_owner(NvmeCtrl *n)
+{
+    int i;
+
+    for (i = 0; i < (n->subsys ? NVME_SUBSYS_MAX_CTRLS : 1); i++) {
+        NvmeCtrl *c = n->subsys ? n->subsys->ctrls[i] : n;
+
+        if (c && (c->bg.type == NVME_BG_FORMAT ||
+                  c->bg.type == NVME_BG_SANITIZE || c->bg.sanitize_failed)) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeNamespace *ns;
+    NvmeRequest *cmp = req->sq->fused;
+    NvmeCtrl *owner = nvme_media_owner(n);
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint16_t status = NVME_SUCCESS;
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        status = NVME_INVALID_NSID | NVME_DNR;
+    } else if (unlikely(owner && owner->bg.type == NVME_BG_SANITIZE)) {
+        status = NVME_SANITIZE_IN_PROGRESS;
+    } else if (unlikely(owner && owner->bg.sanitize_failed)) {
+        status = NVME_SANITIZE_FAILED | NVME_DNR;
+    } else if (unlikely(owner)) {
+        status = NVME_FORMAT_IN_PROGRESS;
+    }
+
+    req->sq->fused = NULL;
+    if (unlikely(cmp) &&
+        (status || NVME_CMD_FUSE(cmd->fuse) != NVME_FUSE_SECOND)) {
+        cmp->status = NVME_CMD_ABORT_MISSING_FUSE;
+        nvme_complete_req(n, cmp);
+        cmp = NULL;
+    }
+    if (status) {
+        return status;
+    }
+
+    if (cmd->opcode == NVME_CMD_WRITE || cmd->opcode == NVME_CMD_WRITE_ZEROS ||
+        cmd->opcode == NVME_CMD_ZONE_APPEND || cmd->opcode == NVME_CMD_COPY) {
+        /* user data written since the last sanitize */
+        n->sanitize_log.sstat &= ~cpu_to_le16(NVME_SSTAT_GDE);
+    }
+
+    ns = &n->namespaces[nsid - 1];
+    if (unlikely(NVME_CMD_FUSE(cmd->fuse))) {
+        return nvme_fused(n, ns, cmp, req);
+    }
+
+    nvme_lock_range(ns, req);
+    if (!nvme_lock_acquire(ns, req)) {
+        return NVME_NO_COMPLETE;
+    }
+    return nvme_io_dispatch(n, ns, cmd, req);
+}
+
+static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    n->sq[sq->sqid] = NULL;
+    timer_del(sq->timer);
+    timer_free(sq->timer);
+    g_hash_table_destroy(sq->cids);
+    g_free(sq->io_req);
+    if (sq->sqid) {
+        g_free(sq);
+    }
+}
+
+static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeRequest *req, *next;
+    NvmeSQueue *sq;
+    NvmeCQueue *cq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_sqid(n, qid))) {
+        trace_nvme_err_invalid_del_sq(qid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+
+    trace_nvme_del_sq(qid);
+
+    sq = n->sq[qid];
+    nvme_lock_abort(n, sq, NULL, NVME_CMD_ABORT_SQ_DEL);
+    nvme_flush_abort(n, sq, NULL, NVME_CMD_ABORT_SQ_DEL);
+    nvme_wcache_abort(n, sq, NULL, NVME_CMD_ABORT_SQ_DEL);
+    if (n->ra.size) {
+        nvme_ra_abort(n, sq, NULL, NVME_CMD_ABORT_SQ_DEL);
+    }
+    /*
+     * A Copy, a zone reset, a journaled write or a merged request can't be
+     * cancelled, so wait for it; requests in the merge window are issued
+     * first.
+     */
+    nvme_merge_submit(n);
+    QTAILQ_FOREACH(req, &sq->out_req_list, entry) {
+        if (req->cmd.opcode == NVME_CMD_COPY ||
+            req->cmd.opcode == NVME_CMD_ZONE_MGMT_SEND || req->journaled ||
+            req->merged) {
+            blk_drain(n->conf.blk);
+            break;
+        }
+    }
+    /*
+     * Cancel what is still on the backend. A request that completes may be
+     * held back by the NAND or latency model, so it stays on out_req_list
+     * until the held completions are posted below.
+     */
+    for (;;) {
+        QTAILQ_FOREACH(req, &sq->out_req_list, entry) {
+            if (!req->delayed) {
+                break;
+            }
+        }
+        if (!req) {
+            break;
+        }
+        assert(req->aiocb);
+        blk_aio_cancel(req->aiocb);
+    }
+    nvme_flush_delayed_reqs(n, sq);
+    if (!nvme_check_cqid(n, sq->cqid)) {
+        cq = n->cq[sq->cqid];
+        QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+
+        nvme_post_cqes(cq);
+        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+            if (req->sq == sq) {
+                QTAILQ_REMOVE(&cq->req_list, req, entry);
+                QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+            }
+        }
+    }
+
+    nvme_free_sq(sq, n);
+    return NVME_SUCCESS;
+}
+
+/*
+ * Abort the command with the given CID. One that waits for a cache, an LBA
+ * range or a flush epoch, or whose completion is being held back, completes
+ * right away with Command Abort Requested; one that is on the backend is
+ * cancelled, and completes with that status if the cancellation takes effect
+ * before the I/O finishes.
+ * Bit 0 of the result is cleared only if the command was aborted for sure.
+ */
+static uint16_t nvme_abort(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint16_t sqid = dw10 & 0xffff;
+    uint16_t cid = dw10 >> 16;
+    NvmeRequest *r, *held;
+    NvmeSQueue *sq;
+
+    req->cqe.result = cpu_to_le32(1);
+
+    if (unlikely(nvme_check_sqid(n, sqid))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    sq = n->sq[sqid];
+
+    r = g_hash_table_lookup(sq->cids, GUINT_TO_POINTER(cid));
+    if (!r || r == req) {
+        return NVME_SUCCESS;
+    }
+
+    QTAILQ_FOREACH(held, &n->delayed_reqs, delay_entry) {
+        if (held == r) {
+            QTAILQ_REMOVE(&n->delayed_reqs, r, delay_entry);
+            r->status = NVME_CMD_ABORT_REQ;
+            nvme_enqueue_req_completion(n->cq[sq->cqid], r);
+            req->cqe.result = 0;
+            return NVME_SUCCESS;
+        }
+    }
+
+    if (nvme_lock_abort(n, sq, r, NVME_CMD_ABORT_REQ) ||
+        nvme_flush_abort(n, sq, r, NVME_CMD_ABORT_REQ) ||
+        nvme_wcache_abort(n, sq, r, NVME_CMD_ABORT_REQ) ||
+        (n->ra.size && nvme_ra_abort(n, sq, r, NVME_CMD_ABORT_REQ))) {
+        req->cqe.result = 0;
+    } else if (r->aiocb && !r->merged) {
+        /* cancelling a merged request would fail its neighbours too */
+        blk_aio_cancel_async(r->aiocb);
+    }
+
+    return NVME_SUCCESS;
+}
+
+static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
+    uint16_t sqid, uint16_t cqid, uint16_t size)
+{
+    int i;
+    NvmeCQueue *cq;
+
+    sq->ctrl = n;
+    sq->dma_addr = dma_addr;
+    sq->sqid = sqid;
+    sq->size = size;
+    sq->cqid = cqid;
+    sq->head = sq->tail = 0;
+    sq->io_req = g_new(NvmeRequest, sq->size);
+
+    QTAILQ_INIT(&sq->req_list);
+    QTAILQ_INIT(&sq->out_req_list);
+    QTAILQ_INIT(&sq->replay_list);
+    sq->cids = g_hash_table_new(NULL, NULL);
+    for (i = 0; i < sq->size; i++) {
+        sq->io_req[i].sq = sq;
+        QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
+    }
+    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+
+    assert(n->cq[cqid]);
+    cq = n->cq[cqid];
+    QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
+    n->sq[sqid] = sq;
+}
+
+static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeSQueue *sq;
+    NvmeCreateSq *c = (NvmeCreateSq *)cmd;
+
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t sqid = le16_to_cpu(c->sqid);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->sq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    trace_nvme_create_sq(prp1, sqid, cqid, qsize, qflags);
+
+    if (unlikely(!cqid || nvme_check_cqid(n, cqid))) {
+        trace_nvme_err_invalid_create_sq_cqid(cqid);
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (unlikely(!sqid || sqid >= nvme_nr_queues(n) ||
+                 !nvme_check_sqid(n, sqid))) {
+        trace_nvme_err_invalid_create_sq_sqid(sqid);
+        return NVME_INVALID_QID | NVME_DNR;
+    }
+    if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap))) {
+        trace_nvme_err_invalid_create_sq_size(qsize);
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (unlikely(!prp1 || prp1 & (n->page_size - 1))) {
+        trace_nvme_err_invalid_create_sq_addr(prp1);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(!(NVME_SQ_FLAGS_PC(qflags)))) {
+        trace_nvme_err_invalid_create_sq_qflags(NVME_SQ_FLAGS_PC(qflags));
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    sq = g_malloc0(sizeof(*sq));
+    nvme_init_sq(sq, n, prp1, sqid, cqid, qsize + 1);
+    return NVME_SUCCESS;
+}
+
+static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    n->cq[cq->cqid] = NULL;
+    timer_del(cq->timer);
+    timer_free(cq->timer);
+    msix_vector_unuse(&n->parent_obj, cq->vector);
+    if (cq->cqid) {
+        g_free(cq);
+    }
+}
+
+static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
+    NvmeCQueue *cq;
+    uint16_t qid = le16_to_cpu(c->qid);
+
+    if (unlikely(!qid || nvme_check_cqid(n, qid))) {
+        trace_nvme_err_invalid_del_cq_cqid(qid);
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+
+    cq = n->cq[qid];
+    if (unlikely(!QTAILQ_EMPTY(&cq->sq_list))) {
+        trace_nvme_err_invalid_del_cq_notempty(qid);
+        return NVME_INVALID_QUEUE_DEL;
+    }
+    nvme_irq_deassert(n, cq);
+    trace_nvme_del_cq(qid);
+    nvme_free_cq(cq, n);
+    return NVME_SUCCESS;
+}
+
+static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
+    uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled)
+{
+    cq->ctrl = n;
+    cq->cqid = cqid;
+    cq->size = size;
+    cq->dma_addr = dma_addr;
+    cq->phase = 1;
+    cq->irq_enabled = irq_enabled;
+    cq->vector = vector;
+    cq->head = cq->tail = 0;
+    QTAILQ_INIT(&cq->req_list);
+    QTAILQ_INIT(&cq->sq_list);
+    msix_vector_use(&n->parent_obj, cq->vector);
+    n->cq[cqid] = cq;
+    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+}
+
+static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeCQueue *cq;
+    NvmeCreateCq *c = (NvmeCreateCq *)cmd;
+    uint16_t cqid = le16_to_cpu(c->cqid);
+    uint16_t vector = le16_to_cpu(c->irq_vector);
+    uint16_t qsize = le16_to_cpu(c->qsize);
+    uint16_t qflags = le16_to_cpu(c->cq_flags);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+
+    trace_nvme_create_cq(prp1, cqid, vector, qsize, qflags,
+                         NVME_CQ_FLAGS_IEN(qflags) != 0);
+
+    if (unlikely(!cqid || cqid >= nvme_nr_queues(n) ||
+                 !nvme_check_cqid(n, cqid))) {
+        trace_nvme_err_invalid_create_cq_cqid(cqid);
+        return NVME_INVALID_CQID | NVME_DNR;
+    }
+    if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap))) {
+        trace_nvme_err_invalid_create_cq_size(qsize);
+        return NVME_MAX_QSIZE_EXCEEDED | NVME_DNR;
+    }
+    if (unlikely(!prp1)) {
+        trace_nvme_err_invalid_create_cq_addr(prp1);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    /* a queue in the CMB has to lie entirely within it */
+    if (unlikely(nvme_addr_is_cmb(n, prp1, 1) &&
+                 !nvme_addr_is_cmb(n, prp1, (qsize + 1) * n->cqe_size))) {
+        trace_nvme_err_invalid_create_cq_addr(prp1);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(vector >= nvme_nr_vectors(n))) {
+        trace_nvme_err_invalid_create_cq_vector(vector);
+        return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
+    }
+    if (unlikely(!(NVME_CQ_FLAGS_PC(qflags)))) {
+        trace_nvme_err_invalid_create_cq_qflags(NVME_CQ_FLAGS_PC(qflags));
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    cq = g_malloc0(sizeof(*cq));
+    nvme_init_cq(cq, n, prp1, cqid, vector, qsize + 1,
+        NVME_CQ_FLAGS_IEN(qflags));
+    return NVME_SUCCESS;
+}
+
+/* the VF with this CNTLID, if it is a secondary controller of n */
+static NvmeCtrl *nvme_sriov_sec_ctrl(NvmeCtrl *n, uint16_t cntlid)
+{
+    NvmeCtrl *sn;
+
+    if (!n->subsys || cntlid >= NVME_SUBSYS_MAX_CTRLS) {
+        return NULL;
+    }
+    sn = n->subsys->ctrls[cntlid];
+    return sn && sn->pf == n && sn->sec.vfn ? sn : NULL;
+}
+
+static uint16_t *nvme_sec_res(NvmeCtrl *sn, uint8_t rt)
+{
+    return rt == NVME_VIRT_RES_QUEUE ? &sn->sec.nvq : &sn->sec.nvi;
+}
+
+/* flexible resources of type rt currently assigned to the VFs of n */
+static uint32_t nvme_sriov_assigned(NvmeCtrl *n, uint8_t rt)
+{
+    uint32_t total = 0;
+    int i;
+
+    for (i = 0; i < n->sriov.max_vfs; i++) {
+        if (n->sriov.vfs[i]) {
+            total += *nvme_sec_res(n->sriov.vfs[i], rt);
+        }
+    }
+    return total;
+}
+
+/*
+ * Virtualization Management. Resources only move while a secondary
+ * controller is offline, and taking it offline resets it, so a VF never
+ * has queues or vectors beyond what it was assigned.
+ */
+static uint16_t nvme_virt_mngmt(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint8_t act = dw10 & 0xf;
+    uint8_t rt = (dw10 >> 8) & 0x7;
+    uint16_t cntlid = dw10 >> 16;
+    uint16_t nr = dw11 & 0xffff;
+    NvmeSriov *s = &n->sriov;
+    uint32_t pool, max;
+    uint16_t *res;
+    NvmeCtrl *sn;
+
+    if (!s->max_vfs) {
+        trace_nvme_err_invalid_admin_opc(cmd->opcode);
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+
+    if (act == NVME_VIRT_MNGMT_ACTION_PRM_ALLOC) {
+        /* all of the primary's own queues and vectors are private */
+        if (cntlid != n->cntlid || rt > NVME_VIRT_RES_INTERRUPT) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        return nr ? NVME_INVALID_NUM_RESOURCES | NVME_DNR : NVME_SUCCESS;
+    }
+
+    sn = nvme_sriov_sec_ctrl(n, cntlid);
+    if (!sn) {
+        return NVME_INVALID_CTRL_ID | NVME_DNR;
+    }
+
+    switch (act) {
+    case NVME_VIRT_MNGMT_ACTION_SEC_OFFLINE:
+        if (sn->sec.online) {
+            sn->sec.online = false;
+            if (NVME_CC_EN(sn->bar.cc)) {
+                nvme_clear_ctrl(sn);
+                sn->bar.csts &= ~NVME_CSTS_READY;
+            }
+        }
+        break;
+    case NVME_VIRT_MNGMT_ACTION_SEC_ASSIGN:
+        if (rt > NVME_VIRT_RES_INTERRUPT) {
+            return NVME_INVALID_RESOURCE_ID | NVME_DNR;
+        }
+        if (sn->sec.online) {
+            return NVME_INVALID_SEC_CTRL_STATE | NVME_DNR;
+        }
+        res = nvme_sec_res(sn, rt);
+        if (rt == NVME_VIRT_RES_QUEUE) {
+            pool = s->vq_flexible;
+            max = s->max_vq_per_vf;
+        } else {
+            pool = s->vi_flexible;
+            max = s->max_vi_per_vf;
+        }
+        /* what the VF holds now goes back to the pool first */
+        if (nr > max || nr > pool - (nvme_sriov_assigned(n, rt) - *res)) {
+            return NVME_INVALID_NUM_RESOURCES | NVME_DNR;
+        }
+        *res = nr;
+        req->cqe.result = cpu_to_le32(nr);
+        break;
+    case NVME_VIRT_MNGMT_ACTION_SEC_ONLINE:
+        /* an admin queue pair, an I/O queue pair and a vector at least */
+        if (sn->sec.nvq < 2 || !sn->sec.nvi) {
+            return NVME_INVALID_SEC_CTRL_STATE | NVME_DNR;
+        }
+        sn->sec.online = true;
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_identify_ctrl(NvmeCtrl *n, NvmeIdentify *c)
+{
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+
+    trace_nvme_identify_ctrl();
+
+    return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
+        prp1, prp2);
+}
+
+static uint16_t nvme_identify_ns(NvmeCtrl *n, NvmeIdentify *c)
+{
+    NvmeNamespace *ns;
+    uint32_t nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+
+    trace_nvme_identify_ns(nsid);
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    ns = &n->namespaces[nsid - 1];
+
+    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
+        prp1, prp2);
+}
+
+static uint16_t nvme_identify_nslist(NvmeCtrl *n, NvmeIdentify *c)
+{
+    static const int data_len = 4 * KiB;
+    uint32_t min_nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    uint32_t *list;
+    uint16_t ret;
+    int i, j = 0;
+
+    trace_nvme_identify_nslist(min_nsid);
+
+    list = g_malloc0(data_len);
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (i < min_nsid) {
+            continue;
+        }
+        list[j++] = cpu_to_le32(i + 1);
+        if (j == data_len / sizeof(uint32_t)) {
+            break;
+        }
+    }
+    ret = nvme_dma_read_prp(n, (uint8_t *)list, data_len, prp1, prp2);
+    g_free(list);
+    return ret;
+}
+
+static uint16_t nvme_identify_ns_descr_list(NvmeCtrl *n, NvmeIdentify *c)
+{
+    static const int data_len = 4 * KiB;
+    uint32_t nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    NvmeIdNsDescr *descr;
+    uint8_t *list;
+    uint16_t ret;
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    list = g_malloc0(data_len);
+
+    /* only the Command Set Identifier is reported */
+    descr = (NvmeIdNsDescr *)list;
+    descr->nidt = NVME_NIDT_CSI;
+    descr->nidl = 1;
+    list[sizeof(*descr)] = n->namespaces[nsid - 1].zoned ?
+        NVME_CSI_ZONED : NVME_CSI_NVM;
+
+    ret = nvme_dma_read_prp(n, list, data_len, prp1, prp2);
+    g_free(list);
+    return ret;
+}
+
+static uint16_t nvme_identify_cs_ns(NvmeCtrl *n, NvmeIdentify *c)
+{
+    NvmeNamespace *ns;
+    uint32_t nsid = le32_to_cpu(c->nsid);
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    ns = &n->namespaces[nsid - 1];
+    if (c->csi != NVME_CSI_ZONED || !ns->zoned) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns_zoned,
+                             sizeof(ns->id_ns_zoned), prp1, prp2);
+}
+
+static uint16_t nvme_identify_cs_ctrl(NvmeCtrl *n, NvmeIdentify *c)
+{
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+
+    if (c->csi != NVME_CSI_ZONED || !n->zoned) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl_zoned,
+                             sizeof(n->id_ctrl_zoned), prp1, prp2);
+}
+
+static uint16_t nvme_identify_pri_ctrl_cap(NvmeCtrl *n, NvmeIdentify *c)
+{
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    NvmeSriov *s = &n->sriov;
+    NvmePriCtrlCap *cap;
+    uint16_t ret;
+
+    if (!s->max_vfs) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    cap = g_malloc0(sizeof(*cap));
+    cap->cntlid = cpu_to_le16(n->cntlid);
+    cap->crt = NVME_CRT_VQ | NVME_CRT_VI;
+
+    cap->vqfrt = cpu_to_le32(s->vq_flexible);
+    cap->vqrfa = cpu_to_le32(nvme_sriov_assigned(n, NVME_VIRT_RES_QUEUE));
+    cap->vqprt = cpu_to_le16(n->num_queues);
+    cap->vqfrsm = cpu_to_le16(s->max_vq_per_vf);
+    cap->vqgran = cpu_to_le16(1);
+
+    cap->vifrt = cpu_to_le32(s->vi_flexible);
+    cap->virfa = cpu_to_le32(nvme_sriov_assigned(n, NVME_VIRT_RES_INTERRUPT));
+    cap->viprt = cpu_to_le16(n->num_queues);
+    cap->vifrsm = cpu_to_le16(s->max_vi_per_vf);
+    cap->vigran = cpu_to_le16(1);
+
+    ret = nvme_dma_read_prp(n, (uint8_t *)cap, sizeof(*cap), prp1, prp2);
+    g_free(cap);
+    return ret;
+}
+
+static uint16_t nvme_identify_sec_ctrl_list(NvmeCtrl *n, NvmeIdentify *c)
+{
+    uint16_t min_id = le32_to_cpu(c->cns) >> 16;
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    NvmeSecCtrlList *list;
+    NvmeSecCtrlEntry *e;
+    NvmeCtrl *sn;
+    uint16_t ret;
+    int i;
+
+    if (!n->sriov.max_vfs) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    list = g_malloc0(sizeof(*list));
+    for (i = min_id; i < NVME_SUBSYS_MAX_CTRLS &&
+         list->numcntl < ARRAY_SIZE(list->sec); i++) {
+        sn = nvme_sriov_sec_ctrl(n, i);
+        if (!sn) {
+            continue;
+        }
+        e = &list->sec[list->numcntl++];
+        e->scid = cpu_to_le16(i);
+        e->pcid = cpu_to_le16(n->cntlid);
+        e->scs = sn->sec.online;
+        e->vfn = cpu_to_le16(sn->sec.vfn);
+        e->nvq = cpu_to_le16(sn->sec.nvq);
+        e->nvi = cpu_to_le16(sn->sec.nvi);
+    }
+
+    ret = nvme_dma_read_prp(n, (uint8_t *)list, sizeof(*list), prp1, prp2);
+    g_free(list);
+    return ret;
+}
+
+/* NVM Set 1 takes all of the NAND and holds the only namespace */
+static uint16_t nvme_identify_nvm_set_list(NvmeCtrl *n, NvmeIdentify *c)
+{
+    uint64_t prp1 = le64_to_cpu(c->prp1);
+    uint64_t prp2 = le64_to_cpu(c->prp2);
+    NvmeNvmSetList *list;
+    NvmeNvmSetAttr *e;
+    uint16_t ret;
+
+    if (!n->plm.supported) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    list = g_malloc0(sizeof(*list));
+    if (le16_to_cpu(c->nvmsetid) <= 1) {
+        e = &list->entry[list->nid++];
+        e->nvmsetid = cpu_to_le16(1);
+        e->endgid = cpu_to_le16(1);
+        e->rr4kt = cpu_to_le32(n->nand.read_lat_us * 10);
+        e->ows = cpu_to_le32(n->nand.page_size);
+        e->tnvmsetcap[0] = cpu_to_le64(n->ns_size);
+    }
+
+    ret = nvme_dma_read_prp(n, (uint8_t *)list, sizeof(*list), prp1, prp2);
+    g_free(list);
+    return ret;
+}
+
+static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeIdentify *c = (NvmeIdentify *)cmd;
+
+    switch (le32_to_cpu(c->cns) & 0xff) {
+    case NVME_ID_CNS_NS:
+        return nvme_identify_ns(n, c);
+    case NVME_ID_CNS_CTRL:
+        return nvme_identify_ctrl(n, c);
+    case NVME_ID_CNS_NS_ACTIVE_LIST:
+        return nvme_identify_nslist(n, c);
+    case NVME_ID_CNS_NS_DESCR_LIST:
+        return nvme_identify_ns_descr_list(n, c);
+    case NVME_ID_CNS_NVM_SET_LIST:
+        return nvme_identify_nvm_set_list(n, c);
+    case NVME_ID_CNS_CS_NS:
+        return nvme_identify_cs_ns(n, c);
+    case NVME_ID_CNS_CS_CTRL:
+        return nvme_identify_cs_ctrl(n, c);
+    case NVME_ID_CNS_PRIMARY_CTRL_CAP:
+        return nvme_identify_pri_ctrl_cap(n, c);
+    case NVME_ID_CNS_SECONDARY_CTRL_LIST:
+        return nvme_identify_sec_ctrl_list(n, c);
+    default:
+        trace_nvme_err_invalid_identify_cns(le32_to_cpu(c->cns));
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
+static inline void nvme_set_timestamp(NvmeCtrl *n, uint64_t ts)
+{
+    trace_nvme_setfeat_timestamp(ts);
+
+    n->host_timestamp = le64_to_cpu(ts);
+    n->timestamp_set_qemu_clock_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+}
+
+static inline uint64_t nvme_get_timestamp(const NvmeCtrl *n)
+{
+    uint64_t current_time = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+    uint64_t elapsed_time = current_time - n->timestamp_set_qemu_clock_ms;
+
+    union nvme_timestamp {
+        struct {
+            uint64_t timestamp:48;
+            uint64_t sync:1;
+            uint64_t origin:3;
+            uint64_t rsvd1:12;
+        };
+        uint64_t all;
+    };
+
+    union nvme_timestamp ts;
+    ts.all = 0;
+
+    /*
+     * If the sum of the Timestamp value set by the host and the elapsed
+     * time exceeds 2^48, the value returned should be reduced modulo 2^48.
+     */
+    ts.timestamp = (n->host_timestamp + elapsed_time) & 0xffffffffffff;
+
+    /* If the host timestamp is non-zero, set the timestamp origin */
+    ts.origin = n->host_timestamp ? 0x01 : 0x00;
+
+    trace_nvme_getfeat_timestamp(ts.all);
+
+    return cpu_to_le64(ts.all);
+}
+
+static uint16_t nvme_get_feature_timestamp(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    uint64_t timestamp = nvme_get_timestamp(n);
+
+    return nvme_dma_read_prp(n, (uint8_t *)&timestamp,
+                                 sizeof(timestamp), prp1, prp2);
+}
+
+static uint16_t nvme_get_feature_hmb(NvmeCtrl *n, NvmeCmd *cmd,
+                                     NvmeRequest *req)
+{
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmeHmb *hmb = &n->hmb;
+    NvmeHmbAttr attr = {};
+
+    if (!n->id_ctrl.hmpre) {
+        trace_nvme_err_invalid_getfeat(NVME_HOST_MEMORY_BUFFER);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    attr.hsize = cpu_to_le32(hmb->hsize);
+    attr.hmdlal = cpu_to_le32(hmb->list_addr & 0xffffffff);
+    attr.hmdlau = cpu_to_le32(hmb->list_addr >> 32);
+    attr.hmdlec = cpu_to_le32(hmb->nr_descrs);
+    req->cqe.result = cpu_to_le32(hmb->enabled ? NVME_HMB_EHM : 0);
+
+    return nvme_dma_read_prp(n, (uint8_t *)&attr, sizeof(attr), prp1, prp2);
+}
+
+static uint16_t nvme_get_feature_plm_config(NvmeCtrl *n, NvmeCmd *cmd,
+                                            NvmeRequest *req)
+{
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    NvmePlm *plm = &n->plm;
+    NvmePlmConfig cfg = {};
+
+    if (!plm->supported || NVME_PLM_NVMSETID(le32_to_cpu(cmd->cdw11)) != 1) {
+        trace_nvme_err_invalid_getfeat(NVME_PLM_CONFIG);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    cfg.ee = cpu_to_le16(plm->ee);
+    cfg.dtwinrt = cpu_to_le64(plm->dtwinrt);
+    cfg.dtwinwt = cpu_to_le64(plm->dtwinwt);
+    cfg.dtwintt = cpu_to_le64(plm->dtwintt);
+    req->cqe.result = cpu_to_le32(plm->enabled);
+
+    return nvme_dma_read_prp(n, (uint8_t *)&cfg, sizeof(cfg), prp1, prp2);
+}
+
+static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11;
+    uint32_t result;
+
+    switch (dw10) {
+    case NVME_VOLATILE_WRITE_CACHE:
+        result = n->wcache.size ? n->wcache.enabled :
+                                  blk_enable_write_cache(n->conf.blk);
+        trace_nvme_getfeat_vwcache(result ? "enabled" : "disabled");
+        break;
+    case NVME_NUMBER_OF_QUEUES:
+        result = cpu_to_le32((nvme_nr_queues(n) - 2) |
+                             ((nvme_nr_queues(n) - 2) << 16));
+        trace_nvme_getfeat_numq(result);
+        break;
+    case NVME_TIMESTAMP:
+        return nvme_get_feature_timestamp(n, cmd);
+        break;
+    case NVME_HOST_MEMORY_BUFFER:
+        return nvme_get_feature_hmb(n, cmd, req);
+    case NVME_PLM_CONFIG:
+        return nvme_get_feature_plm_config(n, cmd, req);
+    case NVME_PLM_WINDOW:
+        if (!n->plm.supported ||
+            NVME_PLM_NVMSETID(le32_to_cpu(cmd->cdw11)) != 1) {
+            trace_nvme_err_invalid_getfeat(dw10);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(nvme_plm_window(n));
+        break;
+    case NVME_TEMPERATURE_THRESHOLD:
+        dw11 = le32_to_cpu(cmd->cdw11);
+        if (NVME_TEMP_TMPSEL(dw11)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        switch (NVME_TEMP_THSEL(dw11)) {
+        case NVME_TEMP_THSEL_OVER:
+            result = cpu_to_le32(n->temp_thresh_hi);
+            break;
+        case NVME_TEMP_THSEL_UNDER:
+            result = cpu_to_le32(n->temp_thresh_low);
+            break;
+        default:
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        break;
+    case NVME_ASYNCHRONOUS_EVENT_CONF:
+        result = cpu_to_le32(n->aer_cfg);
+        break;
+    case NVME_FDP_MODE:
+        /* endurance group 1 runs FDP configuration 0 from realize on */
+        if (!n->placement.fdp_nruh ||
+            (le32_to_cpu(cmd->cdw11) & 0xffff) != 1) {
+            trace_nvme_err_invalid_getfeat(dw10);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(1);
+        break;
+    default:
+        trace_nvme_err_invalid_getfeat(dw10);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    req->cqe.result = result;
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_set_feature_timestamp(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint16_t ret;
+    uint64_t timestamp;
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+
+    ret = nvme_dma_write_prp(n, (uint8_t *)&timestamp,
+                                sizeof(timestamp), prp1, prp2);
+    if (ret != NVME_SUCCESS) {
+        return ret;
+    }
+
+    nvme_set_timestamp(n, timestamp);
+
+    return NVME_SUCCESS;
+}
+
+/*
+ * The buffer holds nothing the device can't rebuild, so Memory Return is
+ * accepted but the contents are always rewritten.
+ */
+static uint16_t nvme_set_feature_hmb(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    NvmeHmb *hmb = &n->hmb;
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t hsize = le32_to_cpu(cmd->cdw12);
+    uint64_t list_addr = le32_to_cpu(cmd->cdw13) |
+                         (uint64_t)le32_to_cpu(cmd->cdw14) << 32;
+    uint32_t nr_descrs = le32_to_cpu(cmd->cdw15);
+    uint64_t total = 0;
+    uint32_t i;
+
+    if (!n->id_ctrl.hmpre) {
+        trace_nvme_err_invalid_setfeat(NVME_HOST_MEMORY_BUFFER);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!(dw11 & NVME_HMB_EHM)) {
+        nvme_hmb_disable(n);
+        return NVME_SUCCESS;
+    }
+    if (hmb->enabled) {
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+    }
+    if (unlikely((uint64_t)hsize * n->page_size <
+                 (uint64_t)le32_to_cpu(n->id_ctrl.hmmin) * 4 * KiB ||
+                 !nr_descrs || nr_descrs > NVME_HMB_MAX_DESCRS ||
+                 (list_addr & 0xf))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    hmb->descrs = g_new(NvmeHmbDescr, nr_descrs);
+    pci_dma_read(&n->parent_obj, list_addr, hmb->descrs,
+                 nr_descrs * sizeof(NvmeHmbDescr));
+    for (i = 0; i < nr_descrs; i++) {
+        if (!hmb->descrs[i].bsize ||
+            (le64_to_cpu(hmb->descrs[i].badd) & (n->page_size - 1))) {
+            goto invalid;
+        }
+        total += le32_to_cpu(hmb->descrs[i].bsize);
+    }
+    if (total != hsize) {
+        goto invalid;
+    }
+
+    hmb->nr_descrs = nr_descrs;
+    if (nvme_hmb_map(n)) {
+        goto invalid;
+    }
+    hmb->hsize = hsize;
+    hmb->list_addr = list_addr;
+    hmb->enabled = true;
+    return NVME_SUCCESS;
+
+invalid:
+    g_free(hmb->descrs);
+    hmb->descrs = NULL;
+    hmb->nr_descrs = 0;
+    return NVME_INVALID_FIELD | NVME_DNR;
+}
+
+static uint16_t nvme_set_feature_plm_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    uint32_t dw12 = le32_to_cpu(cmd->cdw12);
+    NvmePlm *plm = &n->plm;
+    NvmePlmConfig cfg;
+    uint16_t ret;
+
+    if (!plm->supported || NVME_PLM_NVMSETID(le32_to_cpu(cmd->cdw11)) != 1) {
+        trace_nvme_err_invalid_setfeat(NVME_PLM_CONFIG);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    ret = nvme_dma_write_prp(n, (uint8_t *)&cfg, sizeof(cfg), prp1, prp2);
+    if (ret != NVME_SUCCESS) {
+        return ret;
+    }
+    plm->ee = le16_to_cpu(cfg.ee) & (NVME_PLM_EVT_DTWIN_READS |
+                                     NVME_PLM_EVT_DTWIN_WRITES |
+                                     NVME_PLM_EVT_DTWIN_TIME |
+                                     NVME_PLM_EVT_EXCEEDED |
+                                     NVME_PLM_EVT_EXCURSION);
+    plm->dtwinrt = le64_to_cpu(cfg.dtwinrt);
+    plm->dtwinwt = le64_to_cpu(cfg.dtwinwt);
+    plm->dtwintt = le64_to_cpu(cfg.dtwintt);
+
+    if (!NVME_PLM_LPE(dw12)) {
+        nvme_plm_disable(n);
+    } else if (!plm->enabled) {
+        /* the set starts out in a Non-Deterministic Window */
+        plm->enabled = true;
+        nvme_plm_set_window(n, NVME_PLM_WINDOW_NDWIN);
+    } else if (plm->window == NVME_PLM_WINDOW_DTWIN) {
+        /* the time warning may be due at a different time now */
+        nvme_plm_arm(n);
+    }
+    return NVME_SUCCESS;
+}
+
+/*
+ * The host may ask for a DTWIN before the minimum NDWIN time is up; the
+ * DTWIN then starts with whatever reserve GC has won back so far.
+ */
+static uint16_t nvme_set_feature_plm_window(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint8_t wss = NVME_PLM_WSS(le32_to_cpu(cmd->cdw12));
+    NvmePlm *plm = &n->plm;
+
+    if (!plm->supported || NVME_PLM_NVMSETID(le32_to_cpu(cmd->cdw11)) != 1 ||
+        (wss != NVME_PLM_WINDOW_DTWIN && wss != NVME_PLM_WINDOW_NDWIN)) {
+        trace_nvme_err_invalid_setfeat(NVME_PLM_WINDOW);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (!plm->enabled) {
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+    }
+
+    if (wss != plm->window) {
+        nvme_plm_set_window(n, wss);
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+
+    switch (dw10) {
+    case NVME_VOLATILE_WRITE_CACHE:
+        blk_set_enable_write_cache(n->conf.blk, dw11 & 1);
+        if (n->wcache.size) {
+            n->wcache.enabled = dw11 & 1;
+            if (!n->wcache.enabled) {
+                /* complete once the cache has been drained */
+                return nvme_wcache_flush(n, req);
+            }
+        }
+        break;
+    case NVME_NUMBER_OF_QUEUES:
+        trace_nvme_setfeat_numq((dw11 & 0xFFFF) + 1,
+                                ((dw11 >> 16) & 0xFFFF) + 1,
+                                nvme_nr_queues(n) - 1, nvme_nr_queues(n) - 1);
+        req->cqe.result = cpu_to_le32((nvme_nr_queues(n) - 2) |
+                                      ((nvme_nr_queues(n) - 2) << 16));
+        break;
+
+    case NVME_TIMESTAMP:
+        return nvme_set_feature_timestamp(n, cmd);
+        break;
+
+    case NVME_HOST_MEMORY_BUFFER:
+        return nvme_set_feature_hmb(n, cmd);
+
+    case NVME_PLM_CONFIG:
+        return nvme_set_feature_plm_config(n, cmd);
+
+    case NVME_PLM_WINDOW:
+        return nvme_set_feature_plm_window(n, cmd);
+
+    case NVME_TEMPERATURE_THRESHOLD:
+        /* only the composite temperature is reported */
+        if (NVME_TEMP_TMPSEL(dw11)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        switch (NVME_TEMP_THSEL(dw11)) {
+        case NVME_TEMP_THSEL_OVER:
+            n->temp_thresh_hi = NVME_TEMP_TMPTH(dw11);
+            break;
+        case NVME_TEMP_THSEL_UNDER:
+            n->temp_thresh_low = NVME_TEMP_TMPTH(dw11);
+            break;
+        default:
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        nvme_smart_check_temp(n);
+        break;
+
+    case NVME_ASYNCHRONOUS_EVENT_CONF:
+        n->aer_cfg = dw11 & (NVME_AEC_SMART_MASK | NVME_AEC_NS_ATTR |
+                             (n->subsys ? NVME_AEC_ANA_CHANGE : 0) |
+                             (n->plm.supported ? NVME_AEC_PLM_EVENT : 0));
+        break;
+
+    default:
+        trace_nvme_err_invalid_setfeat(dw10);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_get_smart(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+
+    if ( sizeof(NvmeSmartLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&_ctrl->smart, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+static uint16_t nvme_get_nand_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmeNand *nand = &_ctrl->nand;
+    NvmeNandLog log = {};
+    uint32_t i, j;
+
+    if ( !nand->channels ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+    if ( sizeof(NvmeNandLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    log.host_pages_written = cpu_to_le64( nand->host_pages_written );
+    log.nand_pages_written = cpu_to_le64( nand->nand_pages_written );
+    log.gc_pages_moved     = cpu_to_le64( nand->gc_pages_moved );
+    log.gc_blocks_erased   = cpu_to_le64( nand->gc_blocks_erased );
+    log.total_erase_count  = cpu_to_le64( nand->total_erase_count );
+    log.map_cache_misses   = cpu_to_le64( nand->map_cache_misses );
+    if ( nand->host_pages_written ) {
+        log.waf_milli = cpu_to_le32( nand->nand_pages_written * 1000 /
+                                     nand->host_pages_written );
+    }
+
+    for ( i = 0; i < nand->nr_planes; i++ ) {
+        uint64_t free_blocks = le64_to_cpu( log.free_blocks );
+
+        log.free_blocks = cpu_to_le64( free_blocks + nand->plane[i].nr_free );
+        for ( j = 0; j < nand->blocks_per_plane; j++ ) {
+            uint32_t ec = nand->blocks[i * nand->blocks_per_plane + j].erase_count;
+
+            if ( ec > le32_to_cpu( log.max_erase_count ) ) {
+                log.max_erase_count = cpu_to_le32( ec );
+            }
+        }
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&log, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+// Host and media bytes written per placement handle, to compare their WAF
+static uint16_t nvme_get_placement_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmePlacement *pl = &_ctrl->placement;
+    NvmeNand *nand = &_ctrl->nand;
+    NvmePlacementLog log = {};
+    uint32_t i;
+
+    if ( pl->nr_handles < 2 ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+    if ( sizeof(NvmePlacementLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    for ( i = 0; i < pl->nr_handles; i++ ) {
+        log.handle[i].host_bytes_written  = cpu_to_le64( pl->host_bytes[i] );
+        log.handle[i].media_bytes_written = cpu_to_le64( nand->ruh_pages_written[i] *
+                                                         nand->page_size );
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&log, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+// The FDP logs are per endurance group, and there is only endurance group 1
+static uint16_t nvme_fdp_check_endgid(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd)
+{
+    if ( !_ctrl->placement.fdp_nruh ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+    if ( ( le32_to_cpu( _cmd->cdw11 ) >> 16 ) != 1 ) { // LSI: Endurance Group Identifier
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    return NVME_SUCCESS;
+}
+
+// One configuration: a single reclaim group, whose reclaim units take a block on every plane
+static uint16_t nvme_get_fdp_confs(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint32_t len = ( ( le16_to_cpu( _cmd->numd ) & 0x0FFF ) + 1 ) << 2;
+    NvmePlacement *pl = &_ctrl->placement;
+    NvmeNand *nand = &_ctrl->nand;
+    size_t dsze = sizeof(NvmeFdpDescrHdr) + pl->fdp_nruh * sizeof(NvmeRuhDescr);
+    size_t size = sizeof(NvmeFdpConfsHdr) + dsze;
+    NvmeFdpConfsHdr *hdr;
+    NvmeFdpDescrHdr *descr;
+    NvmeRuhDescr *ruhd;
+    uint8_t *buf;
+    uint32_t i;
+    uint16_t ret;
+
+    ret = nvme_fdp_check_endgid(_ctrl, _cmd);
+    if ( ret ) {
+        return ret;
+    }
+
+    buf = g_malloc0( MAX( size, len ) );
+    hdr = (NvmeFdpConfsHdr *)buf;
+    hdr->numfdpc = 0; // 0's based
+    hdr->sze = cpu_to_le32( size );
+
+    descr = (NvmeFdpDescrHdr *)( buf + sizeof(NvmeFdpConfsHdr) );
+    descr->dsze = cpu_to_le16( dsze );
+    descr->fdpa = NVME_FDPA_VALID | ( _ctrl->wcache.size ? NVME_FDPA_VWC : 0 );
+    descr->nrg = cpu_to_le32( 1 );
+    descr->nruh = cpu_to_le16( pl->fdp_nruh );
+    descr->maxpids = cpu_to_le16( pl->fdp_nruh - 1 ); // 0's based
+    descr->nnss = cpu_to_le32( _ctrl->num_namespaces );
+    descr->runs = cpu_to_le64( (uint64_t)nand->nr_planes * nand->pages_per_block * nand->page_size );
+    descr->erutl = 0; // no time limit
+
+    // garbage collection keeps the data of a handle apart from the others
+    ruhd = (NvmeRuhDescr *)( buf + sizeof(NvmeFdpConfsHdr) + sizeof(NvmeFdpDescrHdr) );
+    for ( i = 0; i < pl->fdp_nruh; i++ ) {
+        ruhd[i].ruht = NVME_RUHT_PERSISTENTLY_ISOLATED;
+    }
+
+    ret = nvme_dma_read_prp(_ctrl, buf, len, prp1, prp2);
+    g_free( buf );
+    return ret;
+}
+
+static uint16_t nvme_get_fdp_ruh_usage(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint32_t len = ( ( le16_to_cpu( _cmd->numd ) & 0x0FFF ) + 1 ) << 2;
+    NvmePlacement *pl = &_ctrl->placement;
+    size_t size = sizeof(NvmeRuhuLogHdr) + pl->fdp_nruh * sizeof(NvmeRuhuDescr);
+    NvmeRuhuDescr *ruhu;
+    uint8_t *buf;
+    uint32_t i;
+    uint16_t ret;
+
+    ret = nvme_fdp_check_endgid(_ctrl, _cmd);
+    if ( ret ) {
+        return ret;
+    }
+
+    buf = g_malloc0( MAX( size, len ) );
+    ( (NvmeRuhuLogHdr *)buf )->nruh = cpu_to_le16( pl->fdp_nruh );
+    ruhu = (NvmeRuhuDescr *)( buf + sizeof(NvmeRuhuLogHdr) );
+    for ( i = 0; i < pl->fdp_nruh; i++ ) {
+        ruhu[i].ruha = pl->host_bytes[i] ? NVME_RUHA_HOST : NVME_RUHA_UNUSED;
+    }
+
+    ret = nvme_dma_read_prp(_ctrl, buf, len, prp1, prp2);
+    g_free( buf );
+    return ret;
+}
+
+static uint16_t nvme_get_fdp_stats(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmePlacement *pl = &_ctrl->placement;
+    NvmeNand *nand = &_ctrl->nand;
+    NvmeFdpStatsLog log = {};
+    uint64_t hbmw = 0;
+    uint32_t i;
+    uint16_t ret;
+
+    ret = nvme_fdp_check_endgid(_ctrl, _cmd);
+    if ( ret ) {
+        return ret;
+    }
+    if ( sizeof(NvmeFdpStatsLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    for ( i = 0; i < pl->nr_handles; i++ ) {
+        hbmw += pl->host_bytes[i];
+    }
+    log.hbmw[0] = cpu_to_le64( hbmw );
+    log.mbmw[0] = cpu_to_le64( nand->nand_pages_written * nand->page_size );
+    log.mbe[0]  = cpu_to_le64( nand->total_erase_count * nand->pages_per_block *
+                               nand->page_size );
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&log, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+/*
+ * Format NVM, Sanitize and Device Self-test run as a background job. Each
+ * step of the job handles one chunk and the next step is timed so that the
+ * job moves at NVME_BG_RATE, or as fast as the NAND model allows, whichever
+ * is slower. Host I/O keeps being served in between.
+ */
+#define NVME_BG_CHUNK           (1 * MiB)
+#define NVME_BG_DISCARD_CHUNK   (1 * GiB)
+#define NVME_BG_RATE            (1 * GiB)   /* bytes per second */
+#define NVME_DST_SHORT_BYTES    (256 * MiB) /* read by a short self-test */
+
+/* self-test segments */
+#define NVME_DST_SEG_MAP        1
+#define NVME_DST_SEG_MEDIA      2
+
+/* data and metadata */
+static uint64_t nvme_ns_bytes(NvmeNamespace *ns)
+{
+    return ns->id_ns.nsze * ((1 << nvme_ns_lbaf(ns)->ds) + nvme_ns_ms(ns));
+}
+
+/* the Data Protection Type Settings namespaces start out with */
+static uint8_t nvme_dps(NvmeCtrl *n)
+{
+    return n->pi | (n->pi && n->pil ? DPS_FIRST_EIGHT : 0);
+}
+
+static uint64_t nvme_fmt_offset(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    return n->num_namespaces * (n->ns_size + n->journal_size) +
+           (ns - n->namespaces) * NVME_FMT_HDR_SIZE;
+}
+
+static void nvme_fmt_save(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    NvmeFmtHdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = cpu_to_le64(NVME_FMT_MAGIC);
+    hdr.flbas = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
+    hdr.dps = ns->id_ns.dps;
+    if (blk_pwrite(n->conf.blk, nvme_fmt_offset(n, ns), &hdr,
+                   sizeof(hdr), 0) < 0) {
+        qemu_printf("[NVME] failed to save the LBA format\n");
+    }
+}
+
+/*
+ * Switch a namespace to another LBA format. Its size in LBAs, where its
+ * metadata starts and the zone geometry follow; the data is left alone,
+ * Format zeroes it afterwards.
+ */
+static void nvme_ns_set_lbaf(NvmeCtrl *n, NvmeNamespace *ns, uint8_t lbaf)
+{
+    NvmeIdNs *id_ns = &ns->id_ns;
+    uint8_t ds = id_ns->lbaf[lbaf].ds;
+    uint16_t ms = le16_to_cpu(id_ns->lbaf[lbaf].ms);
+    uint64_t nsze;
+    uint32_t i;
+
+    id_ns->flbas = (id_ns->flbas & ~0xf) | lbaf;
+    if (n->atomic_size) {
+        /* metadata is written apart from the data, so it isn't journaled */
+        id_ns->nsfeat |= NVME_ID_NS_NSFEAT_NSABP;
+        id_ns->nawun = cpu_to_le16((n->atomic_size >> ds) - 1);
+        id_ns->nawupf = ms ? 0 : id_ns->nawun;
+    }
+    if (!ns->zoned) {
+        nsze = n->ns_size / ((1 << ds) + ms);
+        ns->md_offset = nsze << ds;
+        id_ns->ncap = id_ns->nuse = id_ns->nsze = cpu_to_le64(nsze);
+        return;
+    }
+
+    ns->zone_size = n->zone_size_bs >> ds;
+    for (i = 0; i < ns->num_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+
+        zone->zslba = (uint64_t)i * ns->zone_size;
+        zone->zcap = ns->zone_size;
+        zone->wp = zone->zslba;
+    }
+    id_ns->ncap = id_ns->nuse = id_ns->nsze =
+        cpu_to_le64((uint64_t)ns->num_zones * ns->zone_size);
+}
+
+/*
+ * Bring a namespace up in the format it was last formatted with, if that
+ * is one Format NVM would take now, else in lbaf and pi.
+ */
+static void nvme_fmt_load(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    NvmeIdNs *id_ns = &ns->id_ns;
+    uint8_t lbaf = n->lbaf;
+    uint8_t dps = nvme_dps(n);
+    NvmeFmtHdr hdr;
+
+    if (blk_pread(n->conf.blk, nvme_fmt_offset(n, ns), &hdr,
+                  sizeof(hdr)) >= 0 &&
+        le64_to_cpu(hdr.magic) == NVME_FMT_MAGIC &&
+        hdr.flbas <= id_ns->nlbaf &&
+        (hdr.dps & DPS_TYPE_MASK) <= DPS_TYPE_3) {
+        uint16_t ms = le16_to_cpu(id_ns->lbaf[hdr.flbas].ms);
+        uint8_t ds = id_ns->lbaf[hdr.flbas].ds;
+
+        if ((!(hdr.dps & DPS_TYPE_MASK) || ms >= sizeof(NvmeDifTuple)) &&
+            (!n->zoned || (!ms && !(n->zone_size_bs & ((1 << ds) - 1))))) {
+            lbaf = hdr.flbas;
+            dps = hdr.dps;
+        }
+    }
+    nvme_ns_set_lbaf(n, ns, lbaf);
+    id_ns->dps = dps;
+}
+
+/* Namespace Attribute Changed, on every controller the namespace is shared by */
+static void nvme_ns_attr_changed(NvmeCtrl *n)
+{
+    int i;
+
+    for (i = 0; i < (n->subsys ? NVME_SUBSYS_MAX_CTRLS : 1); i++) {
+        NvmeCtrl *c = n->subsys ? n->subsys->ctrls[i] : n;
+
+        if (!c) {
+            continue;
+        }
+        c->ns_changed = true;
+        if (c->aer_cfg & NVME_AEC_NS_ATTR) {
+            nvme_enqueue_event(c, NVME_AER_TYPE_NOTICE,
+                               NVME_AER_INFO_NOTICE_NS_ATTR,
+                               NVME_LOG_CHANGED_NSLIST);
+        }
+    }
+}
+
+/* seconds one pass over the namespace takes */
+static uint32_t nvme_bg_pass_secs(NvmeCtrl *n)
+{
+    return MAX(DIV_ROUND_UP(nvme_ns_bytes(&n->namespaces[0]), NVME_BG_RATE),
+               1);
+}
+
+/* odd passes write the inverted pattern if the host asked for it */
+static void nvme_bg_fill(NvmeCtrl *n)
+{
+    NvmeBgJob *job = &n->bg;
+    uint32_t pattern = job->pattern;
+    uint32_t i;
+
+    if (NVME_SANITIZE_OIPBP(job->cdw10) && job->pass % 2) {
+        pattern = ~pattern;
+    }
+    for (i = 0; i < NVME_BG_CHUNK / sizeof(pattern); i++) {
+        ((uint32_t *)job->buf)[i] = cpu_to_le32(pattern);
+    }
+}
+
+/*
+ * Cached data must neither be returned after an erase nor be written back
+ * over it, by any controller sharing the namespace. In-flight I/O is waited
+ * for, including writes still held in a merge window; I/O that comes in
+ * later is aborted while the job runs, see nvme_media_owner().
+ */
+static void nvme_bg_drop_caches(NvmeCtrl *n)
+{
+    NvmeWCachePage *page, *next;
+    int i;
+
+    for (i = 0; i < (n->subsys ? NVME_SUBSYS_MAX_CTRLS : 1); i++) {
+        NvmeCtrl *c = n->subsys ? n->subsys->ctrls[i] : n;
+
+        if (c) {
+            nvme_merge_submit(c);
+        }
+    }
+    blk_drain(n->conf.blk);
+    for (i = 0; i < (n->subsys ? NVME_SUBSYS_MAX_CTRLS : 1); i++) {
+        NvmeCtrl *c = n->subsys ? n->subsys->ctrls[i] : n;
+
+        if (!c) {
+            continue;
+        }
+        if (c->wcache.size) {
+            nvme_wcache_writeback_sync(c);
+            QTAILQ_FOREACH_SAFE(page, &c->wcache.lru, lru_entry, next) {
+                if (nvme_wcache_page_idle(page)) {
+                    nvme_wcache_drop_page(c, page);
+                }
+            }
+        }
+        if (c->ra.size) {
+            nvme_ra_reset(c);
+        }
+    }
+}
+
+/* every mapped LPN must be what its physical page maps back to */
+static int nvme_bg_map_check(NvmeCtrl *n, uint64_t lpn, uint64_t nr)
+{
+    NvmeNand *nand = &n->nand;
+    uint32_t ppn;
+
+    for (; nr--; lpn++) {
+        ppn = nvme_nand_get_l2p(nand, lpn);
+        if (ppn != NVME_NAND_UNMAPPED &&
+            (ppn >= nand->nr_ppns || nand->p2l[ppn] != lpn)) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/* move on to the next phase of the job, false once there is none */
+static bool nvme_bg_next_phase(NvmeCtrl *n)
+{
+    NvmeBgJob *job = &n->bg;
+
+    job->pos = 0;
+    switch (job->phase) {
+    case NVME_BG_OVERWRITE:
+        if (++job->pass < job->passes) {
+            nvme_bg_fill(n);
+            return true;
+        }
+        if (NVME_SANITIZE_NDAS(job->cdw10)) {
+            return false;
+        }
+        job->phase = NVME_BG_DISCARD;
+        return true;
+    case NVME_BG_MAP_CHECK:
+        if (!job->nsid) {
+            return false;
+        }
+        job->phase = NVME_BG_VERIFY;
+        job->end = nvme_ns_bytes(&n->namespaces[0]);
+        if (NVME_DST_STC(job->cdw10) == NVME_DST_SHORT) {
+            job->end = MIN(job->end, NVME_DST_SHORT_BYTES);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Sanitize Progress and Current Device Self-Test Completion */
+static void nvme_bg_progress(NvmeCtrl *n)
+{
+    NvmeBgJob *job = &n->bg;
+    uint64_t done = job->end ? job->pos * 100 / job->end : 100;
+
+    if (job->type == NVME_BG_SANITIZE) {
+        done = ((uint64_t)job->pass * job->end + job->pos) * 0x10000 /
+               ((uint64_t)job->passes * MAX(job->end, 1));
+        n->sanitize_log.sprog = cpu_to_le16(MIN(done, 0xfffe));
+    } else if (job->type == NVME_BG_SELF_TEST) {
+        if (job->nsid) {
+            done = job->phase == NVME_BG_MAP_CHECK ? done / 2 : 50 + done / 2;
+        }
+        n->self_test_log.cstc = MIN(done, 99);
+    }
+}
+
+/* put the result of the self-test that just ended at the head of log 06h */
+static void nvme_dst_record(NvmeCtrl *n, uint8_t result)
+{
+    NvmeBgJob *job = &n->bg;
+    NvmeSelfTestLog *log = &n->self_test_log;
+    NvmeSelfTestResult *r = log->result;
+    NvmeNamespace *ns = &n->namespaces[0];
+
+    memmove(&r[1], &r[0], sizeof(*r) * (NVME_DST_NUM_RESULTS - 1));
+    memset(r, 0, sizeof(*r));
+    r->dsts = NVME_DST_STC(job->cdw10) << 4 | result;
+    r->poh = n->smart.power_on_hours[0];
+    if (result == NVME_DST_RES_SEG_FAIL) {
+        r->seg = job->phase == NVME_BG_MAP_CHECK ? NVME_DST_SEG_MAP :
+                                                   NVME_DST_SEG_MEDIA;
+    }
+    if (result == NVME_DST_RES_SEG_FAIL && job->phase == NVME_BG_VERIFY) {
+        r->vdi = NVME_DST_VDI_NSID | NVME_DST_VDI_FLBA | NVME_DST_VDI_SCT |
+                 NVME_DST_VDI_SC;
+        r->nsid = cpu_to_le32(job->nsid);
+        r->flba = cpu_to_le64(job->pos >>
+            ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+        r->sct = NVME_UNRECOVERED_READ >> 8;
+        r->sc = NVME_UNRECOVERED_READ & 0xff;
+    }
+    log->csto = 0;
+    log->cstc = 0;
+}
+
+/* Format and Sanitize leave every zone empty, offline ones aside */
+static void nvme_bg_reset_zones(NvmeCtrl *n)
+{
+    NvmeNamespace *ns = &n->namespaces[0];
+    uint32_t i;
+
+    if (!ns->zoned) {
+        return;
+    }
+    for (i = 0; i < ns->num_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+
+        if (zone->zs != NVME_ZONE_STATE_OFFLINE) {
+            zone->wp = zone->zslba;
+            nvme_zone_set_state(ns, zone, NVME_ZONE_STATE_EMPTY);
+        }
+    }
+    nvme_zone_write_hdr(n, ns);
+    nvme_zone_persist_all(n, ns);
+}
+
+static void nvme_bg_end(NvmeCtrl *n)
+{
+    NvmeBgJob *job = &n->bg;
+
+    job->type = NVME_BG_NONE;
+    job->req = NULL;
+    g_free(job->buf);
+    job->buf = NULL;
+}
+
+static void nvme_bg_finish(NvmeCtrl *n, int ret)
+{
+    NvmeBgJob *job = &n->bg;
+    NvmeSanitizeLog *log = &n->sanitize_log;
+    uint16_t sstat;
+
+    switch (job->type) {
+    case NVME_BG_FORMAT:
+        nvme_bg_reset_zones(n);
+        if (job->lbaf_changed) {
+            nvme_fmt_save(n, &n->namespaces[0]);
+            nvme_ns_attr_changed(n);
+        }
+        if (job->req) {
+            job->req->status = ret < 0 ? NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+            nvme_complete_req(n, job->req);
+        }
+        break;
+    case NVME_BG_SANITIZE:
+        nvme_bg_reset_zones(n);
+        if (ret < 0) {
+            sstat = NVME_SSTAT_FAILED;
+        } else {
+            sstat = NVME_SSTAT_DONE | NVME_SSTAT_GDE;
+            if (NVME_SANITIZE_SANACT(job->cdw10) == NVME_SANACT_OVERWRITE) {
+                sstat |= job->passes << NVME_SSTAT_OWPASS_SHIFT;
+            }
+        }
+        job->sanitize_failed = ret < 0;
+        log->sprog = cpu_to_le16(0xffff);
+        log->sstat = cpu_to_le16(sstat);
+        nvme_enqueue_event(n, NVME_AER_TYPE_IO_SPECIFIC,
+                           NVME_AER_INFO_IO_SANITIZE_COMPLETED,
+                           NVME_LOG_SANITIZE);
+        break;
+    case NVME_BG_SELF_TEST:
+        nvme_dst_record(n, ret < 0 ? NVME_DST_RES_SEG_FAIL : NVME_DST_RES_OK);
+        break;
+    }
+    nvme_bg_end(n);
+}
+
+static void nvme_bg_cb(void *opaque, int ret)
+{
+    NvmeCtrl *n = opaque;
+    NvmeBgJob *job = &n->bg;
+
+    job->aiocb = NULL;
+    if (ret < 0) {
+        nvme_bg_finish(n, ret);
+        return;
+    }
+    job->pos += job->len;
+    nvme_bg_progress(n);
+    timer_mod(job->timer, job->next_ns);
+}
+
+static void nvme_bg_step(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    NvmeBgJob *job = &n->bg;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t done = now;
+    int flags = 0;
+
+    while (job->pos == job->end) {
+        if (!nvme_bg_next_phase(n)) {
+            nvme_bg_finish(n, 0);
+            return;
+        }
+    }
+
+    job->len = MIN(job->end - job->pos, NVME_BG_CHUNK);
+    switch (job->phase) {
+    case NVME_BG_DISCARD:
+        /* deallocation is cheap and not rate-limited */
+        job->len = MIN(job->end - job->pos, NVME_BG_DISCARD_CHUNK);
+        job->next_ns = now;
+        if (n->nand.channels) {
+            nvme_nand_trim(n, job->pos, job->len);
+        }
+        job->aiocb = blk_aio_pdiscard(n->conf.blk, job->pos, job->len,
+                                      nvme_bg_cb, n);
+        return;
+    case NVME_BG_ZERO:
+        if (job->type != NVME_BG_SANITIZE || !NVME_SANITIZE_NDAS(job->cdw10)) {
+            flags = BDRV_REQ_MAY_UNMAP;
+        }
+        if (n->nand.channels) {
+            nvme_nand_trim(n, job->pos, job->len);
+        }
+        job->aiocb = blk_aio_pwrite_zeroes(n->conf.blk, job->pos, job->len,
+                                           flags, nvme_bg_cb, n);
+        break;
+    case NVME_BG_OVERWRITE:
+        if (n->nand.channels) {
+            done = nvme_nand_rw(n, job->pos, job->len, true, 0);
+        }
+        qemu_iovec_init_buf(&job->iov, job->buf, job->len);
+        job->aiocb = blk_aio_pwritev(n->conf.blk, job->pos, &job->iov, 0,
+                                     nvme_bg_cb, n);
+        break;
+    case NVME_BG_VERIFY:
+        if (n->nand.channels) {
+            done = nvme_nand_rw(n, job->pos, job->len, false, 0);
+        }
+        qemu_iovec_init_buf(&job->iov, job->buf, job->len);
+        job->aiocb = blk_aio_preadv(n->conf.blk, job->pos, &job->iov, 0,
+                                    nvme_bg_cb, n);
+        break;
+    case NVME_BG_MAP_CHECK:
+        /* as many LPNs as a chunk holds, paced like reading it */
+        job->len = MIN(job->end - job->pos, NVME_BG_CHUNK / n->nand.page_size);
+        job->next_ns = now + NVME_BG_CHUNK * NANOSECONDS_PER_SECOND /
+                             NVME_BG_RATE;
+        nvme_bg_cb(n, nvme_bg_map_check(n, job->pos, job->len));
+        return;
+    }
+    job->next_ns = MAX(done, now + job->len * NANOSECONDS_PER_SECOND /
+                                   NVME_BG_RATE);
+}
+
+static void nvme_bg_start(NvmeCtrl *n, uint8_t type, uint8_t phase,
+                          uint64_t end)
+{
+    NvmeBgJob *job = &n->bg;
+
+    job->type = type;
+    job->phase = phase;
+    job->pos = 0;
+    job->end = end;
+    nvme_bg_progress(n);
+    timer_mod(job->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
+static void nvme_dst_abort(NvmeCtrl *n, uint8_t result)
+{
+    NvmeBgJob *job = &n->bg;
+
+    if (job->aiocb) {
+        /* let the chunk in flight finish, it may end the test */
+        nvme_merge_submit(n);
+        blk_drain(n->conf.blk);
+    }
+    if (job->type != NVME_BG_SELF_TEST) {
+        return;
+    }
+    timer_del(job->timer);
+    nvme_dst_record(n, result);
+    nvme_bg_end(n);
+}
+
+/* a test reading the namespace can't go on while another job changes it */
+static void nvme_dst_abort_all(NvmeCtrl *n, uint8_t result)
+{
+    int i;
+
+    for (i = 0; i < (n->subsys ? NVME_SUBSYS_MAX_CTRLS : 1); i++) {
+        NvmeCtrl *c = n->subsys ? n->subsys->ctrls[i] : n;
+
+        if (c && c->bg.type == NVME_BG_SELF_TEST) {
+            nvme_dst_abort(c, result);
+        }
+    }
+}
+
+static uint16_t nvme_format(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeNamespace *ns = &n->namespaces[0];
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint8_t lbaf = NVME_FORMAT_LBAF(dw10);
+    uint8_t pi = NVME_FORMAT_PI(dw10);
+    uint8_t dps = pi | (pi && NVME_FORMAT_PIL(dw10) ? DPS_FIRST_EIGHT : 0);
+    uint16_t ms;
+
+    if (unlikely(nsid != NVME_NSID_BROADCAST &&
+                 (nsid == 0 || nsid > n->num_namespaces))) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+    /* metadata only goes in a separate buffer */
+    if (lbaf > ns->id_ns.nlbaf || NVME_FORMAT_MSET(dw10)) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+    ms = le16_to_cpu(ns->id_ns.lbaf[lbaf].ms);
+    if (pi > DPS_TYPE_3 || (pi && ms < sizeof(NvmeDifTuple))) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+    /* zones must stay a whole number of LBAs, and have no metadata */
+    if (ns->zoned &&
+        (ms || n->zone_size_bs & ((1 << ns->id_ns.lbaf[lbaf].ds) - 1))) {
+        return NVME_INVALID_FORMAT | NVME_DNR;
+    }
+    if (NVME_FORMAT_SES(dw10) > NVME_FORMAT_SES_USER_DATA) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (nvme_media_owner(n)) {
+        return NVME_FORMAT_IN_PROGRESS;
+    }
+    nvme_dst_abort_all(n, NVME_DST_RES_ABORT_FORMAT);
+
+    /* user data is erased whatever SES says */
+    nvme_bg_drop_caches(n);
+    n->bg.lbaf_changed = lbaf != NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas) ||
+                         dps != ns->id_ns.dps;
+    if (n->bg.lbaf_changed) {
+        nvme_ns_set_lbaf(n, ns, lbaf);
+        ns->id_ns.dps = dps;
+    }
+    n->bg.cdw10 = dw10;
+    n->bg.req = req;
+    nvme_bg_start(n, NVME_BG_FORMAT, NVME_BG_ZERO, nvme_ns_bytes(ns));
+    return NVME_NO_COMPLETE;
+}
+
+/* completes right away; log 81h and an event report how it went */
+static uint16_t nvme_sanitize(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeBgJob *job = &n->bg;
+    NvmeSanitizeLog *log = &n->sanitize_log;
+    NvmeCtrl *owner = nvme_media_owner(n);
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint8_t sanact = NVME_SANITIZE_SANACT(dw10);
+
+    switch (sanact) {
+    case NVME_SANACT_EXIT_FAILURE:
+        /* the failed sanitize may have been started on another controller */
+        if (!owner || !owner->bg.sanitize_failed) {
+            return NVME_SUCCESS;
+        }
+        if (!NVME_SANITIZE_AUSE(le32_to_cpu(owner->sanitize_log.scdw10))) {
+            return NVME_SANITIZE_FAILED | NVME_DNR;
+        }
+        owner->bg.sanitize_failed = false;
+        return NVME_SUCCESS;
+    case NVME_SANACT_BLOCK_ERASE:
+    case NVME_SANACT_OVERWRITE:
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (owner && owner->bg.type == NVME_BG_FORMAT) {
+        return NVME_FORMAT_IN_PROGRESS;
+    }
+    /* this sanitize decides whether the subsystem is in failure mode */
+    if (owner) {
+        owner->bg.sanitize_failed = false;
+    }
+    nvme_dst_abort_all(n, NVME_DST_RES_ABORT_SANITIZE);
+
+    nvme_bg_drop_caches(n);
+    job->cdw10 = dw10;
+    job->pattern = le32_to_cpu(cmd->cdw11);
+    job->pass = 0;
+    job->passes = 1;
+    log->sprog = 0;
+    log->sstat = cpu_to_le16(NVME_SSTAT_IN_PROGRESS);
+    log->scdw10 = cpu_to_le32(dw10);
+    if (sanact == NVME_SANACT_OVERWRITE) {
+        job->passes = NVME_SANITIZE_OWPASS(dw10) ?: 16;
+        job->buf = g_malloc(NVME_BG_CHUNK);
+        nvme_bg_fill(n);
+        nvme_bg_start(n, NVME_BG_SANITIZE, NVME_BG_OVERWRITE,
+                      nvme_ns_bytes(&n->namespaces[0]));
+    } else {
+        nvme_bg_start(n, NVME_BG_SANITIZE, NVME_BG_ZERO,
+                      nvme_ns_bytes(&n->namespaces[0]));
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_dev_self_test(NvmeCtrl *n, NvmeCmd *cmd,
+                                   NvmeRequest *req)
+{
+    NvmeBgJob *job = &n->bg;
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+
+    switch (NVME_DST_STC(dw10)) {
+    case NVME_DST_ABORT:
+        if (job->type == NVME_BG_SELF_TEST) {
+            nvme_dst_abort(n, NVME_DST_RES_ABORT_CMD);
+        }
+        return NVME_SUCCESS;
+    case NVME_DST_SHORT:
+    case NVME_DST_EXTENDED:
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (unlikely(nsid != NVME_NSID_BROADCAST && nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+    if (job->type == NVME_BG_SELF_TEST) {
+        return NVME_DST_IN_PROGRESS | NVME_DNR;
+    }
+    if (nvme_media_owner(n)) {
+        return NVME_FORMAT_IN_PROGRESS;
+    }
+
+    /* with NSID 0 only the controller is tested, i.e. the NAND mapping */
+    job->cdw10 = dw10;
+    job->nsid = nsid ? 1 : 0;
+    job->buf = job->nsid ? g_malloc(NVME_BG_CHUNK) : NULL;
+    n->self_test_log.csto = NVME_DST_STC(dw10);
+    nvme_bg_start(n, NVME_BG_SELF_TEST, NVME_BG_MAP_CHECK,
+                  n->nand.channels ? n->nand.nr_lpns : 0);
+    return NVME_SUCCESS;
+}
+
+/* admin commands that a sanitize in progress, or one that failed, holds off */
+static bool nvme_sanitize_blocks(NvmeCtrl *owner, uint8_t opcode)
+{
+    switch (opcode) {
+    case NVME_ADM_CMD_SANITIZE:
+        return owner->bg.type == NVME_BG_SANITIZE;
+    case NVME_ADM_CMD_FORMAT_NVM:
+    case NVME_ADM_CMD_DEV_SELF_TEST:
+    case NVME_ADM_CMD_DIRECTIVE_SEND:
+    case NVME_ADM_CMD_DIRECTIVE_RECV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint16_t nvme_get_error_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+
+    if ( sizeof(NvmeErrorLog) * NVME_NUM_ERROR_LOG < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)(_ctrl->error_info), ( numd + 1 ) << 2, prp1, prp2);
+}
+
+static uint16_t nvme_get_fw_slot_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+
+    if ( sizeof(NvmeFwSlotInfoLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&(_ctrl->fw_slot_info), ( numd + 1 ) << 2, prp1, prp2);
+}
+
+static uint16_t nvme_get_cse_info(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+
+    if ( NVME_CED_SZ_BYTE < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    uint8_t *tmp = g_malloc0(NVME_CED_SZ_BYTE);
+    if ( tmp == NULL ) {
+	qemu_printf( "[NVME] [ Get Log Page / CSE ] failed in g_malloc(): %s\n", strerror(errno) );
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    memset( tmp, 0, NVME_CED_SZ_BYTE ); // clear
+    memcpy( (void *)tmp, (const void *)nvme_ced_admin, NVME_CED_NUM_ADM_CMD << 2 );
+    memcpy( (void *)( tmp + (NVME_CED_NUM_ADM_CMD << 2) ), (const void *)nvme_ced_io, NVME_CED_NUM_IO_CMD << 2 );
+    if ( _ctrl->sriov.max_vfs ) {
+        ( (uint32_t *)tmp )[NVME_ADM_CMD_VIRT_MNGMT] = NVME_CED_SET_CSUPP; // primary controllers only
+    }
+
+    uint16_t ret = nvme_dma_read_prp(_ctrl, (uint8_t *)tmp, ( numd + 1 ) << 2, prp1, prp2);
+    g_free( tmp );
+    return ret;
+}
+
+static uint16_t nvme_get_telemetry(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint8_t  bCreate = ( _cmd->res2 ) & 0x1;
+    unsigned int uiAllocSize = 0;
+    uint8_t  *res = NULL;
+
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] Command received\n" );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[11: 8] LSP   = 0x%X\n", bCreate );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[   15] RAE   = 0x%X\n", ((_cmd->res2) >> 15) & 0x1 );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW10[31:16] NUMDL = 0x%04X\n", le16_to_cpu(_cmd->numd) );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW11[15: 0] NUMDU = 0x%08X\n", le32_to_cpu(_cmd->cdw11) & 0x0000FFFF );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW12[31: 0] LPOL  = 0x%08X\n", le32_to_cpu(_cmd->cdw12) );
+    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] CDW13[31: 0] LPOU  = 0x%08X\n", le32_to_cpu(_cmd->cdw13) );
+
+    if ( bCreate )
+    {
+	/**
+	 * Windows sets "Create Telemetry Host-Initiated Data" bit to 1
+	 * ONLY IF calling DeviceIoControl() with IOCTL_STORAGE_GET_DEVICE_INTERNAL_LOG.
+	 *
+	 * In this case, the data layout for Telemetry Header is different from the one of NVMe.
+	 */
+	uiAllocSize = sizeof(DeviceInternalStatusData);
+	qemu_printf( "[NVME] [ Get Log Page / Telemetry ] uiAllocSize = %d\n", uiAllocSize);
+	res = g_malloc0(uiAllocSize);
+	if ( res == NULL ) {
+	    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] failed in g_malloc(): %s\n", strerror(errno) );
+	    return NVME_INVALID_FIELD | NVME_DNR;
+	}
+	memset( res, 0, uiAllocSize ); // clear
+
+	DeviceInternalStatusData *tmp = (DeviceInternalStatusData *)res;
+//      tmp->T10VendorId        = 0x0000000000000001; // NG
+//      tmp->T10VendorId        = 0x0000000000010000; // NG
+        tmp->T10VendorId        = 0x0000000100000000; // OK
+//      tmp->T10VendorId        = 0x0001000000000000; // NG
+	// other fields are left zero
+    }
+    else
+    {
+	uiAllocSize = sizeof(NvmeTelemetryLogHeader);
+	qemu_printf( "[NVME] [ Get Log Page / Telemetry ] uiAllocSize = %d\n", uiAllocSize);
+	res = g_malloc0(uiAllocSize);
+	if ( res == NULL ) {
+	    qemu_printf( "[NVME] [ Get Log Page / Telemetry ] failed in g_malloc(): %s\n", strerror(errno) );
+	    return NVME_INVALID_FIELD | NVME_DNR;
+	}
+	memset( res, 0, uiAllocSize ); // clear
+
+	NvmeTelemetryLogHeader *tmp = (NvmeTelemetryLogHeader *)res;
+	tmp->log_id = _cmd->lid; // shall be 07h (Host-Initiated) or 08h (Controller-Initiated)
+	// other fields are left zero
+    }
+
+    uint16_t ret = nvme_dma_read_prp(_ctrl, res, uiAllocSize, prp1, prp2);
+
+    g_free( res );
+    return ret;
+}
+
+// One ANA group per namespace, in the state set by this controller's ana_optimized
+// Changed Namespace List; reading it empties the list
+static uint16_t nvme_get_changed_nslist(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmeChangedNsList *list;
+    uint16_t ret;
+
+    if ( sizeof(NvmeChangedNsList) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    list = g_malloc0( sizeof(NvmeChangedNsList) );
+    if ( _ctrl->ns_changed ) {
+        list->nsid[0] = cpu_to_le32( 1 );
+    }
+    ret = nvme_dma_read_prp(_ctrl, (uint8_t *)list, ( numd + 1 ) << 2, prp1, prp2);
+    if ( ret == NVME_SUCCESS ) {
+        _ctrl->ns_changed = false;
+    }
+    g_free( list );
+    return ret;
+}
+
+static uint16_t nvme_get_ana_log(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint32_t len = ( ( le16_to_cpu( _cmd->numd ) & 0x0FFF ) + 1 ) << 2;
+    bool rgo = _cmd->res2 & 0x1; // LSP bit 0: Return Groups Only
+    size_t size = sizeof(NvmeAnaLogHdr) + _ctrl->num_namespaces *
+                  ( sizeof(NvmeAnaGroupDescr) + ( rgo ? 0 : sizeof(uint32_t) ) );
+    NvmeAnaLogHdr *hdr;
+    uint8_t *buf, *ptr;
+    uint32_t i;
+    uint16_t ret;
+
+    if ( !_ctrl->subsys ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+
+    // anything past the groups reads as zero
+    buf = g_malloc0( MAX( size, len ) );
+    hdr = (NvmeAnaLogHdr *)buf;
+    hdr->chgcnt = cpu_to_le64( _ctrl->ana_chgcnt );
+    hdr->ngrps = cpu_to_le16( _ctrl->num_namespaces );
+
+    ptr = buf + sizeof(NvmeAnaLogHdr);
+    for ( i = 0; i < _ctrl->num_namespaces; i++ ) {
+        NvmeAnaGroupDescr *desc = (NvmeAnaGroupDescr *)ptr;
+
+        desc->grpid = cpu_to_le32( i + 1 );
+        desc->chgcnt = cpu_to_le64( _ctrl->ana_chgcnt );
+        desc->state = _ctrl->ana_optimized ? NVME_ANA_OPTIMIZED : NVME_ANA_NON_OPTIMIZED;
+        ptr += sizeof(NvmeAnaGroupDescr);
+        if ( !rgo ) {
+            desc->nnsids = cpu_to_le32( 1 );
+            desc->nsids[0] = cpu_to_le32( i + 1 );
+            ptr += sizeof(uint32_t);
+        }
+    }
+
+    ret = nvme_dma_read_prp(_ctrl, buf, len, prp1, prp2);
+    g_free( buf );
+    return ret;
+}
+
+// Predictable Latency Per NVM Set, LSI selects the set; reading it clears the Event Type
+static uint16_t nvme_get_plm_log(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmePlm *plm = &_ctrl->plm;
+    NvmeNand *nand = &_ctrl->nand;
+    NvmePlmLog log = {};
+    uint64_t re, we, te;
+
+    if ( !plm->supported ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+    if ( ( le32_to_cpu( _cmd->cdw11 ) >> 16 ) != 1 || // LSI: NVM Set Identifier
+         sizeof(NvmePlmLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    nvme_plm_estimates(_ctrl, &re, &we, &te);
+    log.status  = nvme_plm_window(_ctrl);
+    log.evt     = cpu_to_le16( plm->evt );
+    log.dtwinrt = cpu_to_le64( nvme_plm_reads_typical( nand ) );
+    log.dtwinwt = cpu_to_le64( nvme_plm_writes_typical( nand ) );
+    log.dtwintm = cpu_to_le64( NVME_PLM_DTWIN_MS );
+
+    // refilling the reserve takes longest when every page of the victims has to move
+    log.ndwintmh = cpu_to_le64( DIV_ROUND_UP( NVME_PLM_GC_RESERVE *
+        ( (uint64_t)nand->pages_per_block * ( nand->read_lat_us + nand->prog_lat_us ) +
+          nand->erase_lat_us ), 1000 ) );
+    log.ndwintml = cpu_to_le64( DIV_ROUND_UP( NVME_PLM_GC_RESERVE *
+                                              (uint64_t)nand->erase_lat_us, 1000 ) );
+
+    log.dtwinre = cpu_to_le64( re );
+    log.dtwinwe = cpu_to_le64( we );
+    log.dtwinte = cpu_to_le64( te );
+    plm->evt = 0;
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&log, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+// Predictable Latency Event Aggregate: the NVM Sets with events, here only set 1
+static uint16_t nvme_get_plm_event_agg(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint32_t len = ( ( le16_to_cpu( _cmd->numd ) & 0x0FFF ) + 1 ) << 2;
+    bool rae = _cmd->res2 & 0x80;
+    uint8_t *buf;
+    uint16_t ret;
+
+    if ( !_ctrl->plm.supported ) {
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+
+    // number of entries, then one NVM Set Identifier each
+    buf = g_malloc0( MAX( len, sizeof(uint64_t) + sizeof(uint16_t) ) );
+    if ( _ctrl->plm.aggregate ) {
+        *(uint64_t *)buf = cpu_to_le64( 1 );
+        *(uint16_t *)( buf + sizeof(uint64_t) ) = cpu_to_le16( 1 );
+    }
+    if ( !rae ) {
+        _ctrl->plm.aggregate = false;
+    }
+
+    ret = nvme_dma_read_prp(_ctrl, buf, len, prp1, prp2);
+    g_free( buf );
+    return ret;
+}
+
+// Device Self-test: the test running, if any, and the last 20 results
+static uint16_t nvme_get_self_test_log(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+
+    if ( sizeof(NvmeSelfTestLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&_ctrl->self_test_log, ( numd + 1 ) << 2,
+                             prp1, prp2);
+}
+
+// Sanitize Status; the estimates are what a job takes at the background rate
+static uint16_t nvme_get_sanitize_log(NvmeCtrl *_ctrl, NvmeGetLogPageCmd *_cmd, NvmeRequest *_req)
+{
+    uint64_t prp1 = le64_to_cpu( _cmd->prp1 );
+    uint64_t prp2 = le64_to_cpu( _cmd->prp2 );
+    uint16_t numd = le16_to_cpu( _cmd->numd ) & 0x0FFF;
+    NvmeSanitizeLog log = _ctrl->sanitize_log;
+    uint32_t secs = nvme_bg_pass_secs( _ctrl );
+    uint32_t passes = NVME_SANITIZE_OWPASS( le32_to_cpu( log.scdw10 ) ) ?: 16;
+
+    if ( sizeof(NvmeSanitizeLog) < ( ( numd + 1 ) << 2 ) ) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    log.eto    = cpu_to_le32( secs * passes );
+    log.etbe   = cpu_to_le32( secs );
+    log.etce   = cpu_to_le32( 0xFFFFFFFF ); // Crypto Erase is not supported
+    log.etond  = log.eto;
+    log.etbend = log.etbe;
+    log.etcend = log.etce;
+
+    return nvme_dma_read_prp(_ctrl, (uint8_t *)&log, ( numd + 1 ) << 2, prp1, prp2);
+}
+
+static uint16_t nvme_get_log_page(NvmeCtrl *_ctrl, NvmeCmd *_cmd, NvmeRequest *_req)
+{
+    NvmeGetLogPageCmd *thisCmd = (NvmeGetLogPageCmd *)_cmd;
+    bool rae = thisCmd->res2 & 0x80; // Retain Asynchronous Event
+
+    switch ( thisCmd->lid ) {
+    case NVME_LOG_ERROR_INFO:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_ERROR);
+        }
+        return nvme_get_error_info(_ctrl, thisCmd, _req);
+    case NVME_LOG_SMART_INFO:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_SMART);
+        }
+        return nvme_get_smart(_ctrl, thisCmd, _req);
+    case NVME_LOG_FW_SLOT_INFO:
+        return nvme_get_fw_slot_info(_ctrl, thisCmd, _req);
+    case NVME_LOG_CHANGED_NSLIST:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_NOTICE);
+        }
+        return nvme_get_changed_nslist(_ctrl, thisCmd, _req);
+    case NVME_LOG_CSE_INFO:
+        return nvme_get_cse_info(_ctrl, thisCmd, _req);
+    case NVME_LOG_SELF_TEST:
+        return nvme_get_self_test_log(_ctrl, thisCmd, _req);
+    case NVME_LOG_TELEMETRY_HOST:
+	qemu_printf( "[NVME] Get Log Page: Telemetry Host-Initiated\n" );
+        return nvme_get_telemetry(_ctrl, thisCmd, _req);
+    case NVME_LOG_TELEMETRY_CTLR:
+	qemu_printf( "[NVME] Get Log Page: Telemetry Controller-Initiated\n" );
+        return nvme_get_telemetry(_ctrl, thisCmd, _req);
+    case NVME_LOG_PLM_PER_SET:
+        return nvme_get_plm_log(_ctrl, thisCmd, _req);
+    case NVME_LOG_PLM_EVENT_AGG:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_NOTICE);
+        }
+        return nvme_get_plm_event_agg(_ctrl, thisCmd, _req);
+    case NVME_LOG_ANA:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_NOTICE);
+        }
+        return nvme_get_ana_log(_ctrl, thisCmd, _req);
+    case NVME_LOG_FDP_CONFS:
+        return nvme_get_fdp_confs(_ctrl, thisCmd, _req);
+    case NVME_LOG_FDP_RUH_USAGE:
+        return nvme_get_fdp_ruh_usage(_ctrl, thisCmd, _req);
+    case NVME_LOG_FDP_STATS:
+        return nvme_get_fdp_stats(_ctrl, thisCmd, _req);
+    case NVME_LOG_SANITIZE:
+        if ( !rae ) {
+            nvme_clear_events(_ctrl, NVME_AER_TYPE_IO_SPECIFIC);
+        }
+        return nvme_get_sanitize_log(_ctrl, thisCmd, _req);
+    case NVME_LOG_VENDOR_NAND:
+        return nvme_get_nand_info(_ctrl, thisCmd, _req);
+    case NVME_LOG_VENDOR_PLACEMENT:
+        return nvme_get_placement_info(_ctrl, thisCmd, _req);
+
+    default:
+        // REVISIT: need to implement trace event like "trace_nvme_err_invalid_logid(cdw10)"
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_dir_identify(NvmeCtrl *n, uint32_t nsid, uint32_t len,
+                                  uint64_t prp1, uint64_t prp2)
+{
+    NvmePlacement *pl = &n->placement;
+    NvmeDirectiveIdentify *id;
+    uint16_t ret;
+
+    id = g_malloc0(sizeof(*id));
+    id->supported[0] = id->enabled[0] = 1 << NVME_DIRECTIVE_IDENTIFY;
+    if (pl->streams) {
+        id->supported[0] |= 1 << NVME_DIRECTIVE_STREAMS;
+        if (pl->ns[nsid - 1].enabled) {
+            id->enabled[0] |= 1 << NVME_DIRECTIVE_STREAMS;
+        }
+    }
+    if (pl->fdp_nruh) {
+        /* enabled together with FDP, which is set up by the fdp_nruh property */
+        id->supported[0] |= 1 << NVME_DIRECTIVE_DATA_PLACEMENT;
+        id->enabled[0] |= 1 << NVME_DIRECTIVE_DATA_PLACEMENT;
+        id->persistent[0] |= 1 << NVME_DIRECTIVE_DATA_PLACEMENT;
+    }
+
+    ret = nvme_dma_read_prp(n, (uint8_t *)id, MIN(len, sizeof(*id)), prp1,
+                            prp2);
+    g_free(id);
+    return ret;
+}
+
+/* streams are written in NAND pages and best kept apart by erase block */
+static uint16_t nvme_streams_params(NvmeCtrl *n, uint32_t nsid, uint32_t len,
+                                    uint64_t prp1, uint64_t prp2)
+{
+    NvmePlacement *pl = &n->placement;
+    NvmeNamespace *ns = &n->namespaces[nsid - 1];
+    uint8_t ds = ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    NvmeStreamsParams sp = {};
+
+    sp.msl = cpu_to_le16(pl->streams);
+    sp.nssa = cpu_to_le16(pl->streams - pl->nr_allocated);
+    sp.nsso = cpu_to_le16(nvme_streams_open(pl, 0));
+    sp.sws = cpu_to_le32(n->nand.channels ? n->nand.page_size >> ds : 1);
+    sp.sgs = cpu_to_le16(n->nand.channels ?
+                         MIN(n->nand.pages_per_block, UINT16_MAX) : 1);
+    sp.nsa = cpu_to_le16(pl->ns[nsid - 1].nsa);
+    sp.nso = cpu_to_le16(nvme_streams_open(pl, nsid));
+
+    return nvme_dma_read_prp(n, (uint8_t *)&sp, MIN(len, sizeof(sp)), prp1,
+                             prp2);
+}
+
+static uint16_t nvme_streams_status(NvmeCtrl *n, uint32_t nsid, uint32_t len,
+                                    uint64_t prp1, uint64_t prp2)
+{
+    NvmePlacement *pl = &n->placement;
+    uint16_t buf[NVME_PLACEMENT_HANDLES + 1] = {};
+    uint16_t i, nr = 0;
+
+    for (i = 1; i <= pl->streams; i++) {
+        if (pl->stream_nsid[i] == nsid) {
+            buf[1 + nr++] = cpu_to_le16(pl->stream_id[i]);
+        }
+    }
+    buf[0] = cpu_to_le16(nr);
+
+    return nvme_dma_read_prp(n, (uint8_t *)buf, MIN(len, sizeof(buf)), prp1,
+                             prp2);
+}
+
+/*
+ * Allocate Resources. The streams a namespace has open from the shared pool
+ * count against what it gets; it has to release its resources before it
+ * can ask again.
+ */
+static uint16_t nvme_streams_alloc(NvmeCtrl *n, uint32_t nsid, uint16_t nsr,
+                                   NvmeRequest *req)
+{
+    NvmePlacement *pl = &n->placement;
+    NvmeNsStreams *st = &pl->ns[nsid - 1];
+    uint16_t avail, nsa;
+
+    if (st->nsa) {
+        return NVME_STREAM_RSC_ALLOC_FAIL | NVME_DNR;
+    }
+
+    avail = pl->streams - pl->nr_allocated -
+            (nvme_streams_open(pl, 0) - nvme_streams_open(pl, nsid));
+    nsa = MIN(nsr, avail);
+    if (!nsa || nsa < nvme_streams_open(pl, nsid)) {
+        return NVME_STREAM_RSC_ALLOC_FAIL | NVME_DNR;
+    }
+
+    st->nsa = nsa;
+    pl->nr_allocated += nsa;
+    req->cqe.result = cpu_to_le32(nsa);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_dir_recv(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmePlacement *pl = &n->placement;
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t dw12 = le32_to_cpu(cmd->cdw12);
+    uint64_t prp1 = le64_to_cpu(cmd->prp1);
+    uint64_t prp2 = le64_to_cpu(cmd->prp2);
+    uint32_t len = (MIN(dw10, 0xffff) + 1) << 2;   /* larger than needed */
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    switch (NVME_DIR_DTYPE(dw11)) {
+    case NVME_DIRECTIVE_IDENTIFY:
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_RCV_ID_OP_PARAM) {
+            return nvme_dir_identify(n, nsid, len, prp1, prp2);
+        }
+        break;
+    case NVME_DIRECTIVE_STREAMS:
+        if (!pl->streams) {
+            break;
+        }
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_RCV_ST_OP_PARAM) {
+            return nvme_streams_params(n, nsid, len, prp1, prp2);
+        }
+        if (!pl->ns[nsid - 1].enabled) {
+            break;
+        }
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_RCV_ST_OP_STATUS) {
+            return nvme_streams_status(n, nsid, len, prp1, prp2);
+        }
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_RCV_ST_OP_RESOURCE) {
+            return nvme_streams_alloc(n, nsid, dw12 & 0xffff, req);
+        }
+        break;
+    }
+
+    return NVME_INVALID_FIELD | NVME_DNR;
+}
+
+static uint16_t nvme_dir_send(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmePlacement *pl = &n->placement;
+    uint32_t nsid = le32_to_cpu(cmd->nsid);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t dw12 = le32_to_cpu(cmd->cdw12);
+
+    if (unlikely(nsid == 0 || nsid > n->num_namespaces)) {
+        trace_nvme_err_invalid_ns(nsid, n->num_namespaces);
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+    if (!pl->streams) {
+        /* Data Placement can't be toggled, so Streams is all there is */
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    switch (NVME_DIR_DTYPE(dw11)) {
+    case NVME_DIRECTIVE_IDENTIFY:
+        if (NVME_DIR_DOPER(dw11) != NVME_DIR_SND_ID_OP_ENABLE ||
+            NVME_DIR_TDTYPE(dw12) != NVME_DIRECTIVE_STREAMS) {
+            break;
+        }
+        pl->ns[nsid - 1].enabled = NVME_DIR_ENDIR(dw12);
+        if (!pl->ns[nsid - 1].enabled) {
+            nvme_streams_release(pl, nsid);
+        }
+        return NVME_SUCCESS;
+    case NVME_DIRECTIVE_STREAMS:
+        if (!pl->ns[nsid - 1].enabled) {
+            break;
+        }
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_SND_ST_OP_REL_ID) {
+            nvme_streams_close(pl, nsid, NVME_DIR_DSPEC(dw11));
+            return NVME_SUCCESS;
+        }
+        if (NVME_DIR_DOPER(dw11) == NVME_DIR_SND_ST_OP_REL_RSC) {
+            nvme_streams_release(pl, nsid);
+            return NVME_SUCCESS;
+        }
+        break;
+    }
+
+    return NVME_INVALID_FIELD | NVME_DNR;
+}
+
+static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    NvmeCtrl *owner = nvme_media_owner(n);
+
+    /* a sanitize holds off these commands on every controller it covers */
+    if (unlikely(owner && owner->bg.type != NVME_BG_FORMAT &&
+                 nvme_sanitize_blocks(owner, cmd->opcode))) {
+        return owner->bg.type == NVME_BG_SANITIZE ?
+               NVME_SANITIZE_IN_PROGRESS : NVME_SANITIZE_FAILED | NVME_DNR;
+    }
+
+    switch (cmd->opcode) {
+    case NVME_ADM_CMD_DELETE_SQ:
+        return nvme_del_sq(n, cmd);
+    case NVME_ADM_CMD_CREATE_SQ:
+        return nvme_create_sq(n, cmd);
+    case NVME_ADM_CMD_GET_LOG_PAGE:
+        return nvme_get_log_page(n, cmd, req);
+    case NVME_ADM_CMD_DELETE_CQ:
+        return nvme_del_cq(n, cmd);
+    case NVME_ADM_CMD_CREATE_CQ:
+        return nvme_create_cq(n, cmd);
+    case NVME_ADM_CMD_IDENTIFY:
+        return nvme_identify(n, cmd);
+    case NVME_ADM_CMD_SET_FEATURES:
+        return nvme_set_feature(n, cmd, req);
+    case NVME_ADM_CMD_GET_FEATURES:
+        return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_ABORT:
+        return nvme_abort(n, cmd, req);
+    case NVME_ADM_CMD_ASYNC_EV_REQ:
+        return nvme_aer(n, cmd, req);
+    case NVME_ADM_CMD_VIRT_MNGMT:
+        return nvme_virt_mngmt(n, cmd, req);
+    case NVME_ADM_CMD_DIRECTIVE_SEND:
+        return nvme_dir_send(n, cmd, req);
+    case NVME_ADM_CMD_DIRECTIVE_RECV:
+        return nvme_dir_recv(n, cmd, req);
+    case NVME_ADM_CMD_FORMAT_NVM:
+        return nvme_format(n, cmd, req);
+    case NVME_ADM_CMD_SANITIZE:
+        return nvme_sanitize(n, cmd, req);
+    case NVME_ADM_CMD_DEV_SELF_TEST:
+        return nvme_dev_self_test(n, cmd, req);
+    default:
+        trace_nvme_err_invalid_admin_opc(cmd->opcode);
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void nvme_exec_req(NvmeSQueue *sq, NvmeRequest *req)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint16_t status;
+
+    memset(&req->cqe, 0, sizeof(req->cqe));
+    req->cqe.cid = req->cmd.cid;
+    req->aiocb = NULL;
+    req->expire_ns = 0;
+    req->delayed = false;
+    req->fused = NULL;
+    req->locked = false;
+    req->journaled = false;
+    req->merged = false;
+    req->md = NULL;
+    req->md_len = 0;
+    g_hash_table_insert(sq->cids, GUINT_TO_POINTER(req->cmd.cid), req);
+
+    status = sq->sqid ? nvme_io_cmd(n, &req->cmd, req) :
+        nvme_admin_cmd(n, &req->cmd, req);
+    if (status != NVME_NO_COMPLETE) {
+        req->status = status;
+        nvme_complete_req(n, req);
+    }
+}
+
+static void nvme_process_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    hwaddr addr;
+    NvmeRequest *req;
+
+    /* commands that were in flight on the migration source go first */
+    while (!QTAILQ_EMPTY(&sq->replay_list)) {
+        req = QTAILQ_FIRST(&sq->replay_list);
+        QTAILQ_REMOVE(&sq->replay_list, req, entry);
+        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+        nvme_exec_req(sq, req);
+    }
+
+    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+        req = QTAILQ_FIRST(&sq->req_list);
+        QTAILQ_REMOVE(&sq->req_list, req, entry);
+        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+
+        addr = sq->dma_addr + sq->head * n->sqe_size;
+        nvme_addr_read(n, addr, (void *)&req->cmd, sizeof(req->cmd));
+        nvme_inc_sq_head(sq);
+
+        nvme_exec_req(sq, req);
+    }
+}
+
+static void nvme_clear_ctrl(NvmeCtrl *n)
+{
+    NvmeAsyncEvent *event;
+    int i;
+
+    nvme_merge_submit(n);
+    blk_drain(n->conf.blk);
+
+    /* a reset aborts a short self-test, other jobs run on without a command */
+    n->bg.req = NULL;
+    if (n->bg.type == NVME_BG_SELF_TEST &&
+        NVME_DST_STC(n->bg.cdw10) == NVME_DST_SHORT) {
+        nvme_dst_abort(n, NVME_DST_RES_ABORT_RESET);
+    }
+
+    /* the host may reclaim the buffer after a reset */
+    nvme_hmb_disable(n);
+
+    /* held completions are dropped together with their queues */
+    timer_del(n->delay_timer);
+    QTAILQ_INIT(&n->delayed_reqs);
+
+    if (n->wcache.size) {
+        QTAILQ_INIT(&n->wcache.waiting);
+        QTAILQ_INIT(&n->wcache.flushes);
+        nvme_wcache_writeback_sync(n);
+    }
+    if (n->ra.size) {
+        nvme_ra_reset(n);
+    }
+    nvme_lock_reset(n);
+
+    for (i = 0; i < n->num_namespaces; i++) {
+        if (n->namespaces[i].zoned) {
+            nvme_zone_save_all(n, &n->namespaces[i]);
+        }
+    }
+
+    /* outstanding AERs go away with the admin queue */
+    while ((event = QSIMPLEQ_FIRST(&n->aer_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&n->aer_queue, entry);
+        g_free(event);
+    }
+    n->aer_queued = 0;
+    n->outstanding_aers = 0;
+    n->aer_mask = 0;
+
+    /* Predictable Latency Mode is off again after a reset */
+    if (n->plm.supported) {
+        nvme_plm_disable(n);
+        n->plm.ee = 0;
+        n->plm.dtwinrt = 0;
+        n->plm.dtwinwt = 0;
+        n->plm.dtwintt = 0;
+    }
+
+    /* directives other than Data Placement do not persist */
+    for (i = 0; n->placement.streams && i < n->num_namespaces; i++) {
+        nvme_streams_release(&n->placement, i + 1);
+        n->placement.ns[i].enabled = false;
+    }
+
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_free_sq(n->sq[i], n);
+        }
+    }
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->cq[i] != NULL) {
+            nvme_free_cq(n->cq[i], n);
+        }
+    }
+
+    blk_flush(n->conf.blk);
+    n->bar.cc = 0;
+}
+
+static void nvme_init_ctrl_params(NvmeCtrl *n)
+{
+    n->page_bits = NVME_CC_MPS(n->bar.cc) + 12;
+    n->page_size = 1 << n->page_bits;
+    n->max_prp_ents = n->page_size / sizeof(uint64_t);
+    n->cqe_size = 1 << NVME_CC_IOCQES(n->bar.cc);
+    n->sqe_size = 1 << NVME_CC_IOSQES(n->bar.cc);
+}
+
+static int nvme_start_ctrl(NvmeCtrl *n)
+{
+    uint32_t page_bits = NVME_CC_MPS(n->bar.cc) + 12;
+    uint32_t page_size = 1 << page_bits;
+
+    if (unlikely(n->pf && !n->sec.online)) {
+        return -1;
+    }
+    if (unlikely(n->cq[0])) {
+        trace_nvme_err_startfail_cq();
+        return -1;
+    }
+    if (unlikely(n->sq[0])) {
+        trace_nvme_err_startfail_sq();
+        return -1;
+    }
+    if (unlikely(!n->bar.asq)) {
+        trace_nvme_err_startfail_nbarasq();
+        return -1;
+    }
+    if (unlikely(!n->bar.acq)) {
+        trace_nvme_err_startfail_nbaracq();
+        return -1;
+    }
+    if (unlikely(n->bar.asq & (page_size - 1))) {
+        trace_nvme_err_startfail_asq_misaligned(n->bar.asq);
+        return -1;
+    }
+    if (unlikely(n->bar.acq & (page_size - 1))) {
+        trace_nvme_err_startfail_acq_misaligned(n->bar.acq);
+        return -1;
+    }
+    if (unlikely(NVME_CC_MPS(n->bar.cc) <
+                 NVME_CAP_MPSMIN(n->bar.cap))) {
+        trace_nvme_err_startfail_page_too_small(
+                    NVME_CC_MPS(n->bar.cc),
+                    NVME_CAP_MPSMIN(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(NVME_CC_MPS(n->bar.cc) >
+                 NVME_CAP_MPSMAX(n->bar.cap))) {
+        trace_nvme_err_startfail_page_too_large(
+                    NVME_CC_MPS(n->bar.cc),
+                    NVME_CAP_MPSMAX(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(NVME_CC_IOCQES(n->bar.cc) <
+                 NVME_CTRL_CQES_MIN(n->id_ctrl.cqes))) {
+        trace_nvme_err_startfail_cqent_too_small(
+                    NVME_CC_IOCQES(n->bar.cc),
+                    NVME_CTRL_CQES_MIN(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(NVME_CC_IOCQES(n->bar.cc) >
+                 NVME_CTRL_CQES_MAX(n->id_ctrl.cqes))) {
+        trace_nvme_err_startfail_cqent_too_large(
+                    NVME_CC_IOCQES(n->bar.cc),
+                    NVME_CTRL_CQES_MAX(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(NVME_CC_IOSQES(n->bar.cc) <
+                 NVME_CTRL_SQES_MIN(n->id_ctrl.sqes))) {
+        trace_nvme_err_startfail_sqent_too_small(
+                    NVME_CC_IOSQES(n->bar.cc),
+                    NVME_CTRL_SQES_MIN(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(NVME_CC_IOSQES(n->bar.cc) >
+                 NVME_CTRL_SQES_MAX(n->id_ctrl.sqes))) {
+        trace_nvme_err_startfail_sqent_too_large(
+                    NVME_CC_IOSQES(n->bar.cc),
+                    NVME_CTRL_SQES_MAX(n->bar.cap));
+        return -1;
+    }
+    if (unlikely(!NVME_AQA_ASQS(n->bar.aqa))) {
+        trace_nvme_err_startfail_asqent_sz_zero();
+        return -1;
+    }
+    if (unlikely(!NVME_AQA_ACQS(n->bar.aqa))) {
+        trace_nvme_err_startfail_acqent_sz_zero();
+        return -1;
+    }
+
+    nvme_init_ctrl_params(n);
+    nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
+        NVME_AQA_ACQS(n->bar.aqa) + 1, 1);
+    nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
+        NVME_AQA_ASQS(n->bar.aqa) + 1);
+
+    nvme_set_timestamp(n, 0ULL);
+
+    return 0;
+}
+
+/* the PMR is a shared file mapping, so persisting it is an msync */
+static void nvme_pmr_flush(NvmeCtrl *n)
+{
+    MemoryRegion *mr = host_memory_backend_get_memory(n->pmrdev);
+
+    memory_region_msync(mr, 0, memory_region_size(mr));
+}
+
+static void nvme_pmr_set_enabled(NvmeCtrl *n, bool enable)
+{
+    MemoryRegion *mr = host_memory_backend_get_memory(n->pmrdev);
+
+    if (!enable && NVME_PMRCTL_EN(n->bar.pmrctl)) {
+        nvme_pmr_flush(n);
+    }
+    memory_region_set_enabled(mr, enable);
+    n->bar.pmrctl = enable;
+    n->bar.pmrsts = 0;
+    NVME_PMRSTS_SET_NRDY(n->bar.pmrsts, !enable);
+}
+
+static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
+    unsigned size)
+{
+    if (unlikely(offset & (sizeof(uint32_t) - 1))) {
+        NVME_GUEST_ERR(nvme_ub_mmiowr_misaligned32,
+                       "MMIO write not 32-bit aligned,"
+                       " offset=0x%"PRIx64"", offset);
+        /* should be ignored, fall through for now */
+    }
+
+    if (unlikely(size < sizeof(uint32_t))) {
+        NVME_GUEST_ERR(nvme_ub_mmiowr_toosmall,
+                       "MMIO write smaller than 32-bits,"
+                       " offset=0x%"PRIx64", size=%u",
+                       offset, size);
+        /* should be ignored, fall through for now */
+    }
+
+    switch (offset) {
+    case 0xc:   /* INTMS */
+        if (unlikely(msix_enabled(&(n->parent_obj)))) {
+            NVME_GUEST_ERR(nvme_ub_mmiowr_intmask_with_msix,
+                           "undefined access to interrupt mask set"
+                           " when MSI-X is enabled");
+            /* should be ignored, fall through for now */
         }
         n->bar.intms |= data & 0xffffffff;
         n->bar.intmc = n->bar.intms;
@@ -1394,591 +8105,2591 @@ static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
                            " when MSI-X is enabled");
             /* should be ignored, fall through for now */
         }
-        n->bar.intms &= ~(data & 0xffffffff);
-        n->bar.intmc = n->bar.intms;
-        trace_nvme_mmio_intm_clr(data & 0xffffffff,
-                                 n->bar.intmc);
-        nvme_irq_check(n);
-        break;
-    case 0x14:  /* CC */
-        trace_nvme_mmio_cfg(data & 0xffffffff);
-        /* Windows first sends data, then sends enable bit */
-        if (!NVME_CC_EN(data) && !NVME_CC_EN(n->bar.cc) &&
-            !NVME_CC_SHN(data) && !NVME_CC_SHN(n->bar.cc))
-        {
-            n->bar.cc = data;
+        n->bar.intms &= ~(data & 0xffffffff);
+        n->bar.intmc = n->bar.intms;
+        trace_nvme_mmio_intm_clr(data & 0xffffffff,
+                                 n->bar.intmc);
+        nvme_irq_check(n);
+        break;
+    case 0x14:  /* CC */
+        trace_nvme_mmio_cfg(data & 0xffffffff);
+        /* Windows first sends data, then sends enable bit */
+        if (!NVME_CC_EN(data) && !NVME_CC_EN(n->bar.cc) &&
+            !NVME_CC_SHN(data) && !NVME_CC_SHN(n->bar.cc))
+        {
+            n->bar.cc = data;
+        }
+
+        if (NVME_CC_EN(data) && !NVME_CC_EN(n->bar.cc)) {
+            n->bar.cc = data;
+            if (unlikely(nvme_start_ctrl(n))) {
+                trace_nvme_err_startfail();
+                n->bar.csts = NVME_CSTS_FAILED;
+            } else {
+                trace_nvme_mmio_start_success();
+                n->bar.csts = NVME_CSTS_READY;
+            }
+        } else if (!NVME_CC_EN(data) && NVME_CC_EN(n->bar.cc)) {
+            trace_nvme_mmio_stopped();
+            nvme_clear_ctrl(n);
+            n->bar.csts &= ~NVME_CSTS_READY;
+        }
+        if (NVME_CC_SHN(data) && !(NVME_CC_SHN(n->bar.cc))) {
+            trace_nvme_mmio_shutdown_set();
+            nvme_clear_ctrl(n);
+            n->bar.cc = data;
+            n->bar.csts |= NVME_CSTS_SHST_COMPLETE;
+
+            nvme_smart_inc_num_power_cycle( n ); // record as "Power Cycle"
+            nvme_smart_save(n); // save SMART data at shutdown event
+            if (n->pmrdev) {
+                nvme_pmr_flush(n);
+            }
+        } else if (!NVME_CC_SHN(data) && NVME_CC_SHN(n->bar.cc)) {
+            trace_nvme_mmio_shutdown_cleared();
+            n->bar.csts &= ~NVME_CSTS_SHST_COMPLETE;
+            n->bar.cc = data;
+        }
+        break;
+    case 0x1C:  /* CSTS */
+        if (data & (1 << 4)) {
+            NVME_GUEST_ERR(nvme_ub_mmiowr_ssreset_w1c_unsupported,
+                           "attempted to W1C CSTS.NSSRO"
+                           " but CAP.NSSRS is zero (not supported)");
+        } else if (data != 0) {
+            NVME_GUEST_ERR(nvme_ub_mmiowr_ro_csts,
+                           "attempted to set a read only bit"
+                           " of controller status");
+        }
+        break;
+    case 0x20:  /* NSSR */
+        if (data == 0x4E564D65) {
+            trace_nvme_ub_mmiowr_ssreset_unsupported();
+        } else {
+            /* The spec says that writes of other values have no effect */
+            return;
+        }
+        break;
+    case 0x24:  /* AQA */
+        n->bar.aqa = data & 0xffffffff;
+        trace_nvme_mmio_aqattr(data & 0xffffffff);
+        break;
+    case 0x28:  /* ASQ */
+        n->bar.asq = data;
+        trace_nvme_mmio_asqaddr(data);
+        break;
+    case 0x2c:  /* ASQ hi */
+        n->bar.asq |= data << 32;
+        trace_nvme_mmio_asqaddr_hi(data, n->bar.asq);
+        break;
+    case 0x30:  /* ACQ */
+        trace_nvme_mmio_acqaddr(data);
+        n->bar.acq = data;
+        break;
+    case 0x34:  /* ACQ hi */
+        n->bar.acq |= data << 32;
+        trace_nvme_mmio_acqaddr_hi(data, n->bar.acq);
+        break;
+    case 0x38:  /* CMBLOC */
+        NVME_GUEST_ERR(nvme_ub_mmiowr_cmbloc_reserved,
+                       "invalid write to reserved CMBLOC"
+                       " when CMBSZ is zero, ignored");
+        return;
+    case 0x3C:  /* CMBSZ */
+        NVME_GUEST_ERR(nvme_ub_mmiowr_cmbsz_readonly,
+                       "invalid write to read only CMBSZ, ignored");
+        return;
+    case 0xE04: /* PMRCTL */
+        if (n->pmrdev) {
+            nvme_pmr_set_enabled(n, NVME_PMRCTL_EN(data));
+            return;
+        }
+        /* fall through */
+    case 0xE00: /* PMRCAP */
+    case 0xE08: /* PMRSTS */
+    case 0xE0C: /* PMREBS */
+    case 0xE10: /* PMRSWTP */
+    case 0xE14: /* PMRMSCL */
+    case 0xE18: /* PMRMSCU */
+        /* CMSS is zero, so PMRMSC is read only as well */
+        NVME_GUEST_ERR(nvme_ub_mmiowr_invalid,
+                       "invalid write to read only PMR register,"
+                       " offset=0x%"PRIx64", data=%"PRIx64"",
+                       offset, data);
+        return;
+    default:
+        NVME_GUEST_ERR(nvme_ub_mmiowr_invalid,
+                       "invalid MMIO write,"
+                       " offset=0x%"PRIx64", data=%"PRIx64"",
+                       offset, data);
+        break;
+    }
+}
+
+static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+    uint8_t *ptr = (uint8_t *)&n->bar;
+    uint64_t val = 0;
+
+    if (unlikely(addr & (sizeof(uint32_t) - 1))) {
+        NVME_GUEST_ERR(nvme_ub_mmiord_misaligned32,
+                       "MMIO read not 32-bit aligned,"
+                       " offset=0x%"PRIx64"", addr);
+        /* should RAZ, fall through for now */
+    } else if (unlikely(size < sizeof(uint32_t))) {
+        NVME_GUEST_ERR(nvme_ub_mmiord_toosmall,
+                       "MMIO read smaller than 32-bits,"
+                       " offset=0x%"PRIx64"", addr);
+        /* should RAZ, fall through for now */
+    }
+
+    if (addr == offsetof(NvmeBar, pmrsts) && n->pmrdev &&
+        (NVME_PMRCAP_PMRWBM(n->bar.pmrcap) & NVME_PMRCAP_PMRWBM_RD_PMRSTS)) {
+        nvme_pmr_flush(n);
+    }
+
+    if (addr < sizeof(n->bar)) {
+        memcpy(&val, ptr + addr, size);
+    } else {
+        NVME_GUEST_ERR(nvme_ub_mmiord_invalid_ofs,
+                       "MMIO read beyond last register,"
+                       " offset=0x%"PRIx64", returning 0", addr);
+    }
+
+    return val;
+}
+
+static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
+{
+    uint32_t qid;
+
+    if (unlikely(addr & ((1 << 2) - 1))) {
+        NVME_GUEST_ERR(nvme_ub_db_wr_misaligned,
+                       "doorbell write not 32-bit aligned,"
+                       " offset=0x%"PRIx64", ignoring", addr);
+        return;
+    }
+
+    if (((addr - 0x1000) >> 2) & 1) {
+        /* Completion queue doorbell write */
+
+        uint16_t new_head = val & 0xffff;
+        int start_sqs;
+        NvmeCQueue *cq;
+
+        qid = (addr - (0x1000 + (1 << 2))) >> 3;
+        if (unlikely(nvme_check_cqid(n, qid))) {
+            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_cq,
+                           "completion queue doorbell write"
+                           " for nonexistent queue,"
+                           " sqid=%"PRIu32", ignoring", qid);
+            nvme_log_error(n, qid, 0xffff, NVME_INVALID_QID, 0, 0);
+            nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
+                               NVME_AER_INFO_ERR_INVALID_SQ,
+                               NVME_LOG_ERROR_INFO);
+            return;
+        }
+
+        cq = n->cq[qid];
+        if (unlikely(new_head >= cq->size)) {
+            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_cqhead,
+                           "completion queue doorbell write value"
+                           " beyond queue size, sqid=%"PRIu32","
+                           " new_head=%"PRIu16", ignoring",
+                           qid, new_head);
+            nvme_log_error(n, qid, 0xffff, NVME_INVALID_FIELD, 0, 0);
+            nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
+                               NVME_AER_INFO_ERR_INVALID_DB,
+                               NVME_LOG_ERROR_INFO);
+            return;
+        }
+
+        start_sqs = nvme_cq_full(cq) ? 1 : 0;
+        cq->head = new_head;
+        if (start_sqs) {
+            NvmeSQueue *sq;
+            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            }
+            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+
+        if (cq->tail == cq->head) {
+            nvme_irq_deassert(n, cq);
+        }
+    } else {
+        /* Submission queue doorbell write */
+
+        uint16_t new_tail = val & 0xffff;
+        NvmeSQueue *sq;
+
+        qid = (addr - 0x1000) >> 3;
+        if (unlikely(nvme_check_sqid(n, qid))) {
+            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_sq,
+                           "submission queue doorbell write"
+                           " for nonexistent queue,"
+                           " sqid=%"PRIu32", ignoring", qid);
+            nvme_log_error(n, qid, 0xffff, NVME_INVALID_QID, 0, 0);
+            nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
+                               NVME_AER_INFO_ERR_INVALID_SQ,
+                               NVME_LOG_ERROR_INFO);
+            return;
+        }
+
+        sq = n->sq[qid];
+        if (unlikely(new_tail >= sq->size)) {
+            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_sqtail,
+                           "submission queue doorbell write value"
+                           " beyond queue size, sqid=%"PRIu32","
+                           " new_tail=%"PRIu16", ignoring",
+                           qid, new_tail);
+            nvme_log_error(n, qid, 0xffff, NVME_INVALID_FIELD, 0, 0);
+            nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
+                               NVME_AER_INFO_ERR_INVALID_DB,
+                               NVME_LOG_ERROR_INFO);
+            return;
+        }
+
+        sq->tail = new_tail;
+        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+}
+
+static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
+    unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+    if (addr < sizeof(n->bar)) {
+        nvme_write_bar(n, addr, data, size);
+    } else if (addr >= 0x1000) {
+        nvme_process_db(n, addr, data);
+    }
+}
+
+static const MemoryRegionOps nvme_mmio_ops = {
+    .read = nvme_mmio_read,
+    .write = nvme_mmio_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 2,
+        .max_access_size = 8,
+    },
+};
+
+static void nvme_realize_error_info_log(NvmeCtrl *_ctrl)
+{
+    NvmeErrorLog *elog = _ctrl->error_info;
+
+    // followings are just temporary...
+    for ( int i = 0; i < NVME_NUM_ERROR_LOG; i++ ) {
+        elog->error_count  = cpu_to_le64( 0 );
+        elog->sqid         = cpu_to_le16( 0xFFFF );
+        elog->cid          = cpu_to_le16( 0xFFFF );
+        elog->status_field = cpu_to_le16( 0 );
+        elog->param_error_location = cpu_to_le16( 0 );
+        elog->lba          = cpu_to_le64( 0 );
+        elog->nsid         = cpu_to_le32( 0 );
+        elog->vs           = 0;
+        elog->cmd_specific_info    = cpu_to_le64( 0 );
+	elog++;
+    }
+}
+
+static void nvme_realize_smart_log(NvmeCtrl *_ctrl)
+{
+    NvmeSmartLog *log = &(_ctrl->smart);
+
+    nvme_smart_load(_ctrl);
+
+    // followings are just temporary...?
+    log->temperature[0] = ( cpu_to_le16( 273 + 30 ) & 0xFF );
+    log->temperature[1] = ( ( cpu_to_le16( 273 + 30 ) >> 8 ) & 0xFF );
+    log->available_spare = 100;
+    log->available_spare_threshold = 10;
+    log->temperature_sensor[0] = cpu_to_le16( 273 + 30 );
+}
+
+static void nvme_realize_fw_slot_info_log(NvmeCtrl *_ctrl)
+{
+    NvmeFwSlotInfoLog *log = &(_ctrl->fw_slot_info);
+
+    memset( log, 0, sizeof(NvmeFwSlotInfoLog) ); // clear
+    log->afi = 1; // firmware in slot 1 is running (active slot number)
+
+    // only slot 1 has valid firmware revision
+    strpadcpy((char *)(log->frs1), sizeof(log->frs1), "1.0", ' ');
+}
+
+static void nvme_realize_bg_logs(NvmeCtrl *_ctrl)
+{
+    int i;
+
+    _ctrl->sanitize_log.sprog = cpu_to_le16( 0xFFFF ); // no sanitize in progress
+    for ( i = 0; i < NVME_DST_NUM_RESULTS; i++ ) {
+        _ctrl->self_test_log.result[i].dsts = NVME_DST_RES_UNUSED;
+    }
+}
+
+static void nvme_realize_id_ctrl(NvmeCtrl *_ctrl, uint8_t *_pci_conf)
+{
+    NvmeIdCtrl *id = &_ctrl->id_ctrl;
+
+    // PCI Vendor ID (VID)
+    id->vid = cpu_to_le16(pci_get_word(_pci_conf + PCI_VENDOR_ID));
+
+    // PCI Subsystem Vendor ID (SSVID)
+    id->ssvid = cpu_to_le16(pci_get_word(_pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
+
+    // Serial Number (SN)
+    strpadcpy((char *)id->sn, sizeof(id->sn), _ctrl->serial, ' ');
+
+    // Model Number (MN)
+    strpadcpy((char *)id->mn, sizeof(id->mn), "QEMU NVMe Ctrl", ' ');
+
+    // Firmware Revision (FR)
+    strpadcpy((char *)id->fr, sizeof(id->fr), "1.0", ' ');
+
+    // Recommended Arbitration Burst (RAB)
+    id->rab = 6;
+
+    // IEEE OUI Identifier (IEEE)
+    id->ieee[0] = 0x00;
+    id->ieee[1] = 0x02;
+    id->ieee[2] = 0xb3;
+
+    // Controller Multi-Path I/O and Namespace Sharing Capabilities (CMIC)
+    id->cmic = _ctrl->subsys ? NVME_CMIC_MULTI_CTRL | NVME_CMIC_ANA : 0;
+
+    // Maximum Data Transfer Size (MDTS), in units of the minimum page size
+    if (_ctrl->wcache.size) {
+        // every write fits into the cache
+        id->mdts = ctz32(_ctrl->wcache.max_xfer >>
+                         (12 + NVME_CAP_MPSMIN(_ctrl->bar.cap)));
+    } else {
+        id->mdts = 0; // no restrictions
+    }
+
+    // Controller ID (CNTLID)
+    id->cntlid = cpu_to_le16(_ctrl->cntlid);
+
+    // Version (VER)
+    id->ver = cpu_to_le32(0x00010300);
+
+    // RTD3 Resume Latency (RTD3R)
+    id->rtd3r = 1000;
+
+    // RTD3 Entry Latency (RTD3E)
+    id->rtd3e = 1000;
+
+    // Optional Asynchronous Events Supported (OAES)
+    id->oaes = cpu_to_le32( NVME_AEC_NS_ATTR |
+                            ( _ctrl->subsys ? NVME_AEC_ANA_CHANGE : 0 ) |
+                            ( _ctrl->plm.supported ? NVME_AEC_PLM_EVENT : 0 ) );
+
+    // Controller Attributes (CTRATT), FDP and NVM Sets come with one endurance group
+    id->ctratt = cpu_to_le32(
+        ( _ctrl->placement.fdp_nruh ? NVME_CTRATT_ENDGRPS | NVME_CTRATT_FDPS : 0 ) |
+        ( _ctrl->plm.supported ? NVME_CTRATT_ENDGRPS | NVME_CTRATT_NVMSETS |
+                                 NVME_CTRATT_PLM : 0 ) );
+
+    // Optional Admin Command Support (OACS)
+    id->oacs = cpu_to_le16( NVME_OACS_FORMAT | NVME_OACS_SELF_TEST | NVME_OACS_DIRECTIVES |
+                            ( _ctrl->sriov.max_vfs ? NVME_OACS_VIRT_MGMT : 0 ) );
+
+    // Abort Command Limit (ACL), 0's based
+    id->acl = 3;
+
+    // Asynchronous Event Request Limit (AERL), 0's based
+    id->aerl = NVME_AERL;
+
+    // Firmware Updates (FRMW)
+    //  - controller requires a reset to activate downloaded firmware
+    //  - number of firmware slot is seven
+    //  - the first firmware slot (slot 1) is read/write
+    id->frmw = 7 << 1;
+
+    // Log Page Attributes (LPA)
+    //  - Telemetry supported (only header)
+    //  - Command Effects log page is supported
+    //  - SMART log page is not per namespace basis
+    id->lpa = NVME_LPA_CSE | NVME_LPA_TELEMETRY;
+
+    // Error Log Page Entries (ELPE)
+    id->elpe = (NVME_NUM_ERROR_LOG - 1);
+
+    // Number of Power States Support (NPSS)
+    id->npss = 0;
+
+    // Admin Vendor Specific Command Configuration (AVSCC)
+    id->avscc = 0;
+
+    // Autonomous Power State Transition Attributes (APSTA)
+    id->apsta = 0;
+
+    // Warning Composite Temperature Threshold (WCTEMP)
+    id->wctemp = 363; // 90 degrees Celcius
+
+    // Critical Composite Temperature Threshold (CCTEMP)
+    id->cctemp = 373; // 100 degrees Celcius
+
+    // Maximum Time for Firmware Activation (MTFA)
+    id->mtfa = 0;
+
+    // Host Memory Buffer Preferred Size (HMPRE), room for the L2P table
+    id->hmpre = cpu_to_le32( _ctrl->nand.channels ? _ctrl->nand.nr_map_pages : 0 );
+
+    // Host Memory Buffer Minimum Size (HMMIN)
+    id->hmmin = id->hmpre;
+
+    // Total NVM Capacity (TNVMCAP)
+    id->tnvmcap[0] = 0;
+    id->tnvmcap[1] = 0;
+
+    // Unallocated NVM Capacity (UNVMCAP)
+    id->unvmcap[0] = 0;
+    id->unvmcap[1] = 0;
+
+    // Replay Protected Memory Block Support (RPMBS)
+    id->rpmbs = 0;
+
+    // Extended Device Self-test Time (EDSTT) is set once the namespaces are,
+    // see nvme_realize_ctrl()
+
+    // Device Self-test Options (DSTO): one self-test at a time
+    id->dsto = 1;
+
+    // Sanitize Capabilities (SANICAP): Block Erase and Overwrite
+    id->sanicap = cpu_to_le32( NVME_SANICAP_BES | NVME_SANICAP_OWS );
+
+    // NVM Set Identifier Maximum (NSETIDMAX)
+    id->nsetidmax = cpu_to_le16( _ctrl->plm.supported ? 1 : 0 );
+
+    // Endurance Group Identifier Maximum (ENDGIDMAX)
+    id->endgidmax = cpu_to_le16( _ctrl->placement.fdp_nruh || _ctrl->plm.supported ? 1 : 0 );
+
+    if ( _ctrl->subsys ) {
+        // ANA Transition Time (ANATT), in seconds
+        id->anatt = 10;
+
+        // ANA Capabilities (ANACAP): optimized and non-optimized states, static ANAGRPID
+        id->anacap = ( 1 << 0 ) | ( 1 << 1 ) | ( 1 << 6 );
+
+        // ANA Group Identifier Maximum (ANAGRPMAX), one group per namespace
+        id->anagrpmax = cpu_to_le32( _ctrl->num_namespaces );
+
+        // Number of ANA Group Identifiers (NANAGRPID)
+        id->nanagrpid = cpu_to_le32( _ctrl->num_namespaces );
+
+        // Maximum Number of Allowed Namespaces (MNAN)
+        id->mnan = cpu_to_le32( _ctrl->num_namespaces );
+    }
+
+    // Submission Queue Entry Size (SQES)
+    id->sqes = (0x6 << 4) | 0x6;
+
+    // Completion Queue Entry Size (CQES)
+    id->cqes = (0x4 << 4) | 0x4;
+
+    // Number of Namespaces (NN)
+    id->nn = cpu_to_le32(_ctrl->num_namespaces);
+
+    // Optional NVM Command Support (ONCS)
+    id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS | NVME_ONCS_TIMESTAMP | NVME_ONCS_DSM |
+                           NVME_ONCS_COPY | NVME_ONCS_COMPARE);
+
+    // Fused Operation Support (FUSES)
+    id->fuses = cpu_to_le16(NVME_FUSES_COMPARE_WRITE);
+
+    // Format NVM Attributes (FNA)
+    id->fna = 0;
+
+    // Volatile Write Cache (VWC)
+    if (_ctrl->wcache.size || blk_enable_write_cache(_ctrl->conf.blk)) {
+        id->vwc = 1;
+    }
+
+    // Atomic Write Unit Normal (AWUN, 0's based), in 4 KiB LBAs so that it
+    // holds for every format; namespaces report theirs in NAWUN
+    if (_ctrl->atomic_size) {
+        id->awun = cpu_to_le16((_ctrl->atomic_size >> 12) - 1);
+    }
+
+    // Atomic Write Unit Power Fail (AWUPF, 0's based), as AWUN
+    id->awupf = id->awun;
+
+    // NVM Vendor Specific Command Configuration (NVSCC)
+    id->nvscc = 0;
+
+    // Atomic Compare Write Unit (ACWU, 0's based): a pair of any size
+    id->acwu = cpu_to_le16(0xffff);
+
+    // Optional Copy Formats Supported (OCFS)
+    id->ocfs = cpu_to_le16(NVME_OCFS_COPY_FMT_0);
+
+    // SGL Support (SGLS)
+    id->sgls = 0;
+
+    // NVM Subsystem NVMe Qualified Name (SUBNQN)
+    snprintf( (char *)id->subnqn, sizeof(id->subnqn), "nqn.2019-08.org.qemu:%s",
+              _ctrl->subsys && _ctrl->subsys->nqn ? _ctrl->subsys->nqn : _ctrl->serial );
+
+    // Power State Descriptors
+    id->psd[0].mp    = cpu_to_le16(0x9c4);
+    id->psd[0].enlat = cpu_to_le32(0x10);
+    id->psd[0].exlat = cpu_to_le32(0x4);
+}
+
+static void nvme_zoned_load(NvmeCtrl *n, NvmeNamespace *ns)
+{
+    const uint8_t data_shift =
+        ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    size_t len = ns->num_zones * sizeof(NvmeZoneDescr);
+    NvmeZoneMetaHdr hdr;
+    NvmeZoneDescr *d;
+    uint32_t i;
+    bool valid;
+
+    for (i = 0; i < ns->num_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+
+        zone->zs = NVME_ZONE_STATE_EMPTY;
+        zone->zslba = (uint64_t)i * ns->zone_size;
+        zone->zcap = ns->zone_size;
+        zone->wp = zone->zslba;
+    }
+
+    valid = blk_pread(n->conf.blk, ns->zone_meta_offset, &hdr,
+                      sizeof(hdr)) >= 0 &&
+            le64_to_cpu(hdr.magic) == NVME_ZONE_META_MAGIC &&
+            le32_to_cpu(hdr.num_zones) == ns->num_zones &&
+            le64_to_cpu(hdr.zone_size) == ns->zone_size &&
+            hdr.lbads == data_shift;
+    if (!valid) {
+        qemu_printf("[NVME] [ZNS] no zone metadata found, all zones empty\n");
+        nvme_zone_write_hdr(n, ns);
+        nvme_zone_save_all(n, ns);
+        return;
+    }
+
+    d = g_malloc(len);
+    if (blk_pread(n->conf.blk, ns->zone_meta_offset + NVME_ZONE_META_HDR_SIZE,
+                  d, len) < 0) {
+        qemu_printf("[NVME] [ZNS] failed to read zone metadata\n");
+        g_free(d);
+        return;
+    }
+    for (i = 0; i < ns->num_zones; i++) {
+        NvmeZone *zone = &ns->zones[i];
+        uint8_t zs = d[i].zs >> 4;
+        uint64_t wp = le64_to_cpu(d[i].wp);
+
+        if (wp < zone->zslba || wp > zone->zslba + zone->zcap) {
+            continue;
+        }
+        zone->wp = wp;
+
+        /* open zones do not survive a power cycle */
+        if (zs == NVME_ZONE_STATE_IMP_OPEN || zs == NVME_ZONE_STATE_EXP_OPEN) {
+            zs = NVME_ZONE_STATE_CLOSED;
+        }
+        nvme_zone_set_state(ns, zone, zs);
+    }
+    g_free(d);
+}
+
+static int nvme_init_zoned(NvmeCtrl *n, NvmeNamespace *ns, Error **errp)
+{
+    const uint8_t data_shift =
+        ns->id_ns.lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds;
+    NvmeIdNsZoned *id_ns_z = &ns->id_ns_zoned;
+    uint64_t zone_bytes = n->zone_size_bs;
+    uint64_t meta_bytes;
+    uint32_t i;
+
+    if (!zone_bytes || zone_bytes & ((1 << data_shift) - 1) ||
+        zone_bytes > INT_MAX) {
+        error_setg(errp, "zone_size must be a non-zero multiple of the"
+                   " LBA size and smaller than 2 GiB");
+        return -1;
+    }
+
+    /* carve the zone metadata region off the end of the namespace */
+    ns->num_zones = n->ns_size / zone_bytes;
+    meta_bytes = QEMU_ALIGN_UP(NVME_ZONE_META_HDR_SIZE +
+                               ns->num_zones * sizeof(NvmeZoneDescr),
+                               4 * KiB);
+    if (n->ns_size < meta_bytes) {
+        error_setg(errp, "backing image too small for a zoned namespace");
+        return -1;
+    }
+    ns->num_zones = (n->ns_size - meta_bytes) / zone_bytes;
+    if (!ns->num_zones) {
+        error_setg(errp, "backing image smaller than one zone");
+        return -1;
+    }
+
+    ns->zoned = true;
+    ns->zone_size = zone_bytes >> data_shift;
+    ns->zone_meta_offset = (ns - n->namespaces) * n->ns_size +
+                           n->ns_size - meta_bytes;
+    ns->zones = g_new0(NvmeZone, ns->num_zones);
+    QTAILQ_INIT(&ns->imp_open_zones);
+
+    ns->id_ns.ncap = ns->id_ns.nuse = ns->id_ns.nsze =
+        cpu_to_le64((uint64_t)ns->num_zones * ns->zone_size);
+
+    // Maximum Active/Open Resources (0's based, all 1's means no limit)
+    id_ns_z->mar = cpu_to_le32(n->max_active_zones ?
+                               n->max_active_zones - 1 : 0xffffffff);
+    id_ns_z->mor = cpu_to_le32(n->max_open_zones ?
+                               n->max_open_zones - 1 : 0xffffffff);
+    for (i = 0; i <= ns->id_ns.nlbaf; i++) {
+        id_ns_z->lbafe[i].zsze = cpu_to_le64(zone_bytes >>
+                                             ns->id_ns.lbaf[i].ds);
+    }
+
+    nvme_zoned_load(n, ns);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int opcode;
+} nvme_lat_opcodes[] = {
+    { "all",          -1 },
+    { "flush",        NVME_CMD_FLUSH },
+    { "write",        NVME_CMD_WRITE },
+    { "read",         NVME_CMD_READ },
+    { "compare",      NVME_CMD_COMPARE },
+    { "write_zeroes", NVME_CMD_WRITE_ZEROS },
+    { "dsm",          NVME_CMD_DSM },
+    { "copy",         NVME_CMD_COPY },
+    { "zone_append",  NVME_CMD_ZONE_APPEND },
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+} nvme_lat_params[] = {
+    { "fixed_us",  offsetof(NvmeLatRule, fixed_us) },
+    { "mean_us",   offsetof(NvmeLatRule, mean_us) },
+    { "stddev_us", offsetof(NvmeLatRule, stddev_us) },
+    { "mu",        offsetof(NvmeLatRule, mu) },
+    { "sigma",     offsetof(NvmeLatRule, sigma) },
+    { "scale_us",  offsetof(NvmeLatRule, scale_us) },
+    { "alpha",     offsetof(NvmeLatRule, alpha) },
+};
+
+static int nvme_parse_lat_param(NvmeLatRule *r, const char *key,
+                                const char *val, Error **errp)
+{
+    uint64_t mbps;
+    double d;
+    char *end;
+    int i;
+
+    if (!strcmp(key, "dist")) {
+        if (!strcmp(val, "normal")) {
+            r->dist = NVME_LAT_DIST_NORMAL;
+        } else if (!strcmp(val, "lognormal")) {
+            r->dist = NVME_LAT_DIST_LOGNORMAL;
+        } else if (!strcmp(val, "pareto")) {
+            r->dist = NVME_LAT_DIST_PARETO;
+        } else {
+            error_setg(errp, "latency profile: unknown distribution '%s'",
+                       val);
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(key, "bw_mbps")) {
+        if (qemu_strtou64(val, NULL, 0, &mbps) || mbps > UINT32_MAX) {
+            goto invalid;
+        }
+        r->bw_bps = mbps * 1000 * 1000;
+        return 0;
+    }
+    if (!strcmp(key, "stall_period_ms")) {
+        if (qemu_strtoui(val, NULL, 0, &r->stall_period_ms)) {
+            goto invalid;
+        }
+        return 0;
+    }
+    if (!strcmp(key, "stall_ms")) {
+        if (qemu_strtoui(val, NULL, 0, &r->stall_ms)) {
+            goto invalid;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(nvme_lat_params); i++) {
+        if (strcmp(key, nvme_lat_params[i].name)) {
+            continue;
+        }
+        d = g_ascii_strtod(val, &end);
+        if (end == val || *end || !isfinite(d)) {
+            goto invalid;
+        }
+        *(double *)((uint8_t *)r + nvme_lat_params[i].offset) = d;
+        return 0;
+    }
+
+    error_setg(errp, "latency profile: unknown parameter '%s'", key);
+    return -1;
+
+invalid:
+    error_setg(errp, "latency profile: invalid value '%s' for %s", val, key);
+    return -1;
+}
+
+/* <opcode>[@<nsid>]:<key>=<value>[,<key>=<value>...] */
+static int nvme_parse_lat_rule(NvmeLatRule *r, char *rule, Error **errp)
+{
+    char *params = strchr(rule, ':');
+    char *nsid = strchr(rule, '@');
+    char **kv;
+    int i, ret = 0;
+
+    if (!params) {
+        error_setg(errp, "latency profile: rule '%s' has no parameters", rule);
+        return -1;
+    }
+    *params++ = '\0';
+    if (nsid && nsid < params) {
+        *nsid++ = '\0';
+        if (qemu_strtoui(nsid, NULL, 0, &r->nsid) || !r->nsid) {
+            error_setg(errp, "latency profile: invalid namespace '%s'", nsid);
+            return -1;
+        }
+    }
+
+    r->opcode = -2;
+    for (i = 0; i < ARRAY_SIZE(nvme_lat_opcodes); i++) {
+        if (!strcmp(rule, nvme_lat_opcodes[i].name)) {
+            r->opcode = nvme_lat_opcodes[i].opcode;
+        }
+    }
+    if (r->opcode == -2 &&
+        (qemu_strtoi(rule, NULL, 0, &r->opcode) ||
+         r->opcode < 0 || r->opcode > 0xff)) {
+        error_setg(errp, "latency profile: unknown opcode '%s'", rule);
+        return -1;
+    }
+
+    kv = g_strsplit(params, ",", 0);
+    for (i = 0; kv[i] && !ret; i++) {
+        char *val = strchr(kv[i], '=');
+
+        if (!val) {
+            error_setg(errp, "latency profile: '%s' is not key=value", kv[i]);
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+        ret = nvme_parse_lat_param(r, kv[i], val, errp);
+    }
+    g_strfreev(kv);
+    if (ret) {
+        return ret;
+    }
+
+    if ((r->dist == NVME_LAT_DIST_PARETO &&
+         (r->alpha <= 0 || r->scale_us <= 0)) ||
+        (r->dist == NVME_LAT_DIST_NORMAL && r->stddev_us < 0) ||
+        (r->dist == NVME_LAT_DIST_LOGNORMAL && r->sigma < 0)) {
+        error_setg(errp, "latency profile: invalid distribution parameters");
+        return -1;
+    }
+    if (r->stall_ms > r->stall_period_ms) {
+        error_setg(errp, "latency profile: stall_ms exceeds stall_period_ms");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int nvme_parse_lat_profile(const char *str, NvmeLatRule **rules,
+                                  uint32_t *nr_rules, Error **errp)
+{
+    char **list = g_strsplit(str, ";", 0);
+    NvmeLatRule *r = g_new0(NvmeLatRule, g_strv_length(list));
+    uint32_t i, nr = 0;
+
+    for (i = 0; list[i]; i++) {
+        char *rule = g_strstrip(list[i]);
+
+        if (!*rule) {
+            continue;
+        }
+        if (nvme_parse_lat_rule(&r[nr], rule, errp)) {
+            g_strfreev(list);
+            g_free(r);
+            return -1;
+        }
+        nr++;
+    }
+    g_strfreev(list);
+
+    if (!nr) {
+        g_free(r);
+        r = NULL;
+    }
+    *rules = r;
+    *nr_rules = nr;
+    return 0;
+}
+
+static int nvme_init_wcache(NvmeCtrl *n, Error **errp)
+{
+    NvmeWCache *wc = &n->wcache;
+
+    if (wc->size < 64 * KiB) {
+        error_setg(errp, "wcache_size must be at least 64 KiB");
+        return -1;
+    }
+
+    wc->max_pages = MIN(wc->size / NVME_WCACHE_PAGE_SIZE, UINT32_MAX);
+    wc->max_xfer = MIN(pow2floor(wc->size / 4), 32 * MiB);
+    wc->enabled = true;
+    wc->pages = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                      nvme_wcache_free_page);
+    wc->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_wcache_timer_cb, n);
+    QTAILQ_INIT(&wc->lru);
+    QTAILQ_INIT(&wc->dirty);
+    QTAILQ_INIT(&wc->ops);
+    QTAILQ_INIT(&wc->waiting);
+    QTAILQ_INIT(&wc->flushes);
+
+    return 0;
+}
+
+static int nvme_init_nand(NvmeCtrl *n, uint64_t size, Error **errp)
+{
+    NvmeNand *nand = &n->nand;
+    uint64_t blocks;
+    uint32_t i, j;
+
+    if (!nand->dies || !nand->planes || !nand->pages_per_block ||
+        !nand->pe_cycles) {
+        error_setg(errp, "nand_dies, nand_planes, nand_pages_per_block and"
+                   " nand_pe_cycles must be non-zero");
+        return -1;
+    }
+    if (nand->page_size < BDRV_SECTOR_SIZE || !is_power_of_2(nand->page_size)) {
+        error_setg(errp, "nand_page_size must be a power of two of at least"
+                   " 512 bytes");
+        return -1;
+    }
+
+    nand->nr_planes = nand->channels * nand->dies * nand->planes;
+    nand->nr_lpns = DIV_ROUND_UP(size, nand->page_size);
+
+    /*
+     * spread the over-provisioned space evenly, plus a GC reserve per plane,
+     * which PLM enlarges, and a block for every further placement handle to
+     * keep open
+     */
+    blocks = DIV_ROUND_UP(nand->nr_lpns * (100 + nand->op_pct) / 100,
+                          nand->pages_per_block);
+    nand->blocks_per_plane = DIV_ROUND_UP(blocks, nand->nr_planes) +
+                             nvme_nand_gc_low(n) + n->placement.nr_handles - 1;
+    nand->nr_ppns = (uint64_t)nand->nr_planes * nand->blocks_per_plane *
+                    nand->pages_per_block;
+    if (nand->nr_ppns >= NVME_NAND_UNMAPPED) {
+        error_setg(errp, "NAND geometry too large, increase nand_page_size");
+        return -1;
+    }
+
+    nand->nr_map_pages = DIV_ROUND_UP(nand->nr_lpns, NVME_NAND_L2P_PER_PAGE);
+    if (nand->map_cache_size) {
+        if (nand->map_cache_size < NVME_NAND_MAP_PAGE_SIZE) {
+            error_setg(errp, "nand_map_cache must be at least 4 KiB");
+            return -1;
+        }
+        /* a cache that holds the whole table is no cache */
+        if (nand->map_cache_size / NVME_NAND_MAP_PAGE_SIZE <
+            nand->nr_map_pages) {
+            nand->nr_map_slots = nand->map_cache_size /
+                                 NVME_NAND_MAP_PAGE_SIZE;
+        }
+    }
+    nand->map_slot = g_new(uint32_t, nand->nr_map_pages);
+    memset(nand->map_slot, 0xff, nand->nr_map_pages * sizeof(uint32_t));
+    nand->map_cache = g_new0(NvmeNandMapSlot, nand->nr_map_slots);
+    for (i = 0; i < nand->nr_map_slots; i++) {
+        nand->map_cache[i].page = NVME_NAND_UNMAPPED;
+    }
+
+    nand->l2p = g_new(uint32_t, nand->nr_lpns);
+    nand->p2l = g_new(uint32_t, nand->nr_ppns);
+    memset(nand->l2p, 0xff, nand->nr_lpns * sizeof(uint32_t));
+    memset(nand->p2l, 0xff, nand->nr_ppns * sizeof(uint32_t));
+    nand->blocks = g_new0(NvmeNandBlock,
+                          nand->nr_planes * nand->blocks_per_plane);
+    nand->plane = g_new0(NvmeNandPlane, nand->nr_planes);
+    nand->chan_avail_ns = g_new0(int64_t, nand->channels);
+
+    for (i = 0; i < nand->nr_planes; i++) {
+        NvmeNandPlane *plane = &nand->plane[i];
+
+        memset(plane->active_blk, 0xff, sizeof(plane->active_blk));
+        plane->free_blks = g_new(uint32_t, nand->blocks_per_plane);
+        /* hand out the lowest block numbers first */
+        for (j = nand->blocks_per_plane; j > 0; j--) {
+            plane->free_blks[plane->nr_free++] =
+                i * nand->blocks_per_plane + j - 1;
+        }
+    }
+
+    return 0;
+}
+
+static int nvme_init_placement(NvmeCtrl *n, Error **errp)
+{
+    NvmePlacement *pl = &n->placement;
+
+    if (pl->streams && pl->fdp_nruh) {
+        error_setg(errp, "streams and fdp_nruh can't be used together");
+        return -1;
+    }
+    if (pl->streams >= NVME_PLACEMENT_HANDLES) {
+        error_setg(errp, "streams must be less than %d",
+                   NVME_PLACEMENT_HANDLES);
+        return -1;
+    }
+    if (pl->fdp_nruh > NVME_PLACEMENT_HANDLES) {
+        error_setg(errp, "fdp_nruh can't exceed %d", NVME_PLACEMENT_HANDLES);
+        return -1;
+    }
+    if (pl->fdp_nruh && !n->nand.channels) {
+        error_setg(errp, "fdp_nruh needs the NAND model, set nand_channels");
+        return -1;
+    }
+
+    /* stream handles are numbered from 1 */
+    pl->nr_handles = MAX(MAX(pl->streams + 1, pl->fdp_nruh), 1);
+    if (pl->streams) {
+        pl->ns = g_new0(NvmeNsStreams, n->num_namespaces);
+    }
+
+    return 0;
+}
+
+static void nvme_free_nand(NvmeCtrl *n)
+{
+    NvmeNand *nand = &n->nand;
+    uint32_t i;
+
+    for (i = 0; nand->plane && i < nand->nr_planes; i++) {
+        g_free(nand->plane[i].free_blks);
+    }
+    g_free(nand->plane);
+    g_free(nand->blocks);
+    g_free(nand->l2p);
+    g_free(nand->p2l);
+    g_free(nand->chan_avail_ns);
+    g_free(nand->map_slot);
+    g_free(nand->map_cache);
+}
+
+/*
+ * Take a free CNTLID in the subsystem. Every controller but the first
+ * shares the drive and namespaces of the controllers already there.
+ */
+static int nvme_subsys_attach(NvmeCtrl *n, Error **errp)
+{
+    NvmeSubsys *subsys = n->subsys;
+    NvmeCtrl *p = NULL;
+    int i, cntlid = -1;
+
+    /* these keep per-controller state about the shared data */
+    if (n->wcache.size || n->ra.size || n->nand.channels) {
+        error_setg(errp, "wcache_size, ra_size and nand_channels can't be"
+                   " used with subsys");
+        return -1;
+    }
+
+    for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+        if (!subsys->ctrls[i]) {
+            cntlid = cntlid < 0 ? i : cntlid;
+        } else if (!p) {
+            p = subsys->ctrls[i];
+        }
+    }
+    if (cntlid < 0) {
+        error_setg(errp, "subsystem already has %d controllers",
+                   NVME_SUBSYS_MAX_CTRLS);
+        return -1;
+    }
+
+    if (p) {
+        if (n->conf.blk) {
+            error_setg(errp, "the subsystem already has a drive, only its"
+                       " first controller takes one");
+            return -1;
+        }
+        /* hosts identify the subsystem by serial on NVMe < 1.2.1 */
+        if (n->serial && strcmp(n->serial, p->serial)) {
+            error_setg(errp, "serial must match the other controllers of"
+                       " the subsystem");
+            return -1;
+        }
+        if (!n->serial) {
+            n->serial = g_strdup(p->serial);
+        }
+        n->conf.blk = p->conf.blk;
+        blk_ref(n->conf.blk);
+        n->namespaces = subsys->namespaces;
+        /* the namespaces are set up by the first controller */
+        n->lbaf = p->lbaf;
+        n->pi = p->pi;
+        n->pil = p->pil;
+        n->placement.streams = p->placement.streams;
+        n->placement.fdp_nruh = p->placement.fdp_nruh;
+        n->zoned = p->zoned;
+        n->zone_size_bs = p->zone_size_bs;
+        n->max_open_zones = p->max_open_zones;
+        n->max_active_zones = p->max_active_zones;
+        n->atomic_size = p->atomic_size;
+        n->ns_attached = true;
+    }
+
+    n->cntlid = cntlid;
+    subsys->ctrls[cntlid] = n;
+    return 0;
+}
+
+static void nvme_subsys_detach(NvmeCtrl *n)
+{
+    NvmeSubsys *subsys = n->subsys;
+    uint32_t i;
+
+    subsys->ctrls[n->cntlid] = NULL;
+    if (n->ns_attached) {
+        /* not ours, so keep it away from the drive property's release */
+        blk_unref(n->conf.blk);
+        n->conf.blk = NULL;
+    }
+
+    for (i = 0; i < NVME_SUBSYS_MAX_CTRLS; i++) {
+        if (subsys->ctrls[i]) {
+            return;
+        }
+    }
+    for (i = 0; subsys->namespaces && i < n->num_namespaces; i++) {
+        g_free(subsys->namespaces[i].zones);
+    }
+    g_free(subsys->namespaces);
+    subsys->namespaces = NULL;
+}
+
+static int nvme_init_sriov(NvmeCtrl *n, Error **errp)
+{
+    NvmeSriov *s = &n->sriov;
+
+    if (!n->subsys) {
+        error_setg(errp, "sriov_max_vfs needs subsys, the VFs share its"
+                   " namespaces");
+        return -1;
+    }
+    if (s->max_vfs >= NVME_SUBSYS_MAX_CTRLS) {
+        error_setg(errp, "sriov_max_vfs must be less than %d",
+                   NVME_SUBSYS_MAX_CTRLS);
+        return -1;
+    }
+    if (s->vq_flexible < 2 * s->max_vfs || s->vi_flexible < s->max_vfs) {
+        error_setg(errp, "sriov_vq_flexible must be at least 2 and"
+                   " sriov_vi_flexible at least 1 per VF");
+        return -1;
+    }
+
+    if (!s->max_vq_per_vf) {
+        s->max_vq_per_vf = s->vq_flexible;
+    }
+    if (!s->max_vi_per_vf) {
+        s->max_vi_per_vf = s->vi_flexible;
+    }
+    if (s->max_vq_per_vf < 2 || s->max_vq_per_vf > s->vq_flexible) {
+        error_setg(errp, "sriov_max_vq_per_vf must be between 2 and"
+                   " sriov_vq_flexible");
+        return -1;
+    }
+    if (!s->max_vi_per_vf || s->max_vi_per_vf > s->vi_flexible ||
+        s->max_vi_per_vf > PCI_MSIX_FLAGS_QSIZE + 1) {
+        error_setg(errp, "sriov_max_vi_per_vf must be between 1 and"
+                   " sriov_vi_flexible, and at most %d",
+                   PCI_MSIX_FLAGS_QSIZE + 1);
+        return -1;
+    }
+
+    s->vfs = g_new0(NvmeCtrl *, s->max_vfs);
+    return 0;
+}
+
+/*
+ * Take a free VF number of the primary named by pf and join its subsystem.
+ * The VF is sized for the most the primary may ever assign to it, and
+ * starts offline without any resources.
+ */
+static int nvme_sriov_vf_attach(NvmeCtrl *n, Error **errp)
+{
+    NvmeCtrl *pf = n->pf;
+    int i;
+
+    if (!DEVICE(pf)->realized || !pf->sriov.max_vfs) {
+        error_setg(errp, "pf must be a realized nvme with sriov_max_vfs set");
+        return -1;
+    }
+    if (n->sriov.max_vfs) {
+        error_setg(errp, "a VF can't have VFs of its own");
+        return -1;
+    }
+    if (n->subsys && n->subsys != pf->subsys) {
+        error_setg(errp, "a VF is always in the subsystem of its pf");
+        return -1;
+    }
+
+    for (i = 0; i < pf->sriov.max_vfs && pf->sriov.vfs[i]; i++) {
+    }
+    if (i == pf->sriov.max_vfs) {
+        error_setg(errp, "pf already has %u VFs", pf->sriov.max_vfs);
+        return -1;
+    }
+
+    if (!n->subsys) {
+        /* the link property drops this reference on release */
+        object_ref(OBJECT(pf->subsys));
+        n->subsys = pf->subsys;
+    }
+    pf->sriov.vfs[i] = n;
+    n->num_queues = pf->sriov.max_vq_per_vf;
+    n->sec.vfn = i + 1;
+    n->sec.nvq = n->sec.nvi = 0;
+    n->sec.online = false;
+    return 0;
+}
+
+static void nvme_sriov_vf_detach(NvmeCtrl *n)
+{
+    if (n->sec.vfn) {
+        n->pf->sriov.vfs[n->sec.vfn - 1] = NULL;
+        n->sec.vfn = 0;
+    }
+}
+
+static void nvme_realize_ctrl(PCIDevice *pci_dev, Error **errp)
+{
+    NvmeCtrl *n = NVME(pci_dev);
+
+    int i;
+    int64_t bs_size;
+    uint8_t *pci_conf;
+
+    if (!n->num_queues) {
+        error_setg(errp, "num_queues can't be zero");
+        return;
+    }
+
+    if (!n->conf.blk) {
+        error_setg(errp, "drive property not set");
+        return;
+    }
+
+    bs_size = blk_getlength(n->conf.blk);
+    if (bs_size < 0) {
+        error_setg(errp, "could not get backing file size");
+        return;
+    }
+
+    if (!n->serial) {
+        error_setg(errp, "serial property not set");
+        return;
+    }
+
+    if (n->max_open_zones > n->max_active_zones && n->max_active_zones) {
+        error_setg(errp, "max_open_zones can't exceed max_active_zones");
+        return;
+    }
+
+    if (n->lbaf >= NVME_NUM_LBAF) {
+        error_setg(errp, "lbaf must be less than %d", NVME_NUM_LBAF);
+        return;
+    }
+    if (n->lbaf >= NVME_LBAF_512_MD8 && n->zoned) {
+        error_setg(errp, "zoned namespaces have no metadata, lbaf must be"
+                   " 0 or 1");
+        return;
+    }
+    if (n->pi > DPS_TYPE_3 || (n->pi && n->lbaf < NVME_LBAF_512_MD8)) {
+        error_setg(errp, "pi must be 1, 2 or 3, with lbaf 2 or 3");
+        return;
+    }
+
+    if (n->sriov.max_vfs && nvme_init_sriov(n, errp)) {
+        return;
+    }
+    blkconf_blocksizes(&n->conf);
+    if (!n->ns_attached &&
+        !blkconf_apply_backend_options(&n->conf, blk_is_read_only(n->conf.blk),
+                                       false, errp)) {
+        return;
+    }
+
+    pci_conf = pci_dev->config;
+    pci_conf[PCI_INTERRUPT_PIN] = 1;
+    pci_config_set_prog_interface(pci_dev->config, 0x2);
+    pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
+    pcie_endpoint_cap_init(pci_dev, 0x80);
+
+    n->num_namespaces = 1;
+    n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
+    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
+    if (n->ns_size <= NVME_FMT_HDR_SIZE) {
+        error_setg(errp, "backing image too small");
+        return;
+    }
+    n->ns_size -= NVME_FMT_HDR_SIZE;
+
+    if (n->atomic_size) {
+        if (n->atomic_size % (4 * KiB) ||
+            n->atomic_size > NVME_ATOMIC_MAX_SIZE) {
+            error_setg(errp, "atomic_size must be a multiple of 4 KiB of at"
+                       " most 1 MiB");
+            return;
+        }
+        /* write-back from the cache would tear atomic writes */
+        if (n->wcache.size) {
+            error_setg(errp, "atomic_size and wcache_size can't be combined");
+            return;
+        }
+        n->journal_size = NVME_JOURNAL_SLOTS *
+                          (NVME_JOURNAL_HDR_SIZE + n->atomic_size);
+        if (n->ns_size <= n->journal_size) {
+            error_setg(errp, "backing image too small for the journal");
+            return;
         }
+        n->ns_size -= n->journal_size;
+    }
 
-        if (NVME_CC_EN(data) && !NVME_CC_EN(n->bar.cc)) {
-            n->bar.cc = data;
-            if (unlikely(nvme_start_ctrl(n))) {
-                trace_nvme_err_startfail();
-                n->bar.csts = NVME_CSTS_FAILED;
-            } else {
-                trace_nvme_mmio_start_success();
-                n->bar.csts = NVME_CSTS_READY;
-            }
-        } else if (!NVME_CC_EN(data) && NVME_CC_EN(n->bar.cc)) {
-            trace_nvme_mmio_stopped();
-            nvme_clear_ctrl(n);
-            n->bar.csts &= ~NVME_CSTS_READY;
+    if (n->wcache.size && nvme_init_wcache(n, errp)) {
+        return;
+    }
+
+    if (n->ra.size) {
+        if (n->ra.size < 2 * NVME_RA_SEG_SIZE) {
+            error_setg(errp, "ra_size must be at least 256 KiB");
+            return;
         }
-        if (NVME_CC_SHN(data) && !(NVME_CC_SHN(n->bar.cc))) {
-            trace_nvme_mmio_shutdown_set();
-            nvme_clear_ctrl(n);
-            n->bar.cc = data;
-            n->bar.csts |= NVME_CSTS_SHST_COMPLETE;
+        n->ra.dev_size = bs_size;
+        n->ra.max_segs = MIN(n->ra.size / NVME_RA_SEG_SIZE, UINT32_MAX);
+        n->ra.max_depth = MAX(MIN(n->ra.max_segs / 2, 32), 1);
+        n->ra.segs = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                           nvme_ra_free_seg);
+        QTAILQ_INIT(&n->ra.lru);
+    }
 
-            nvme_smart_inc_num_power_cycle( n ); // record as "Power Cycle"
-            nvme_smart_save(n); // save SMART data at shutdown event
-        } else if (!NVME_CC_SHN(data) && NVME_CC_SHN(n->bar.cc)) {
-            trace_nvme_mmio_shutdown_cleared();
-            n->bar.csts &= ~NVME_CSTS_SHST_COMPLETE;
-            n->bar.cc = data;
+    if (nvme_init_placement(n, errp)) {
+        return;
+    }
+
+    if (n->plm.supported && !n->nand.channels) {
+        error_setg(errp, "plm needs the NAND model, set nand_channels");
+        return;
+    }
+
+    if (n->nand.channels && nvme_init_nand(n, bs_size, errp)) {
+        nvme_free_nand(n);
+        return;
+    }
+
+    if (!n->ns_attached) {
+        n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
+        if (n->subsys) {
+            n->subsys->namespaces = n->namespaces;
         }
-        break;
-    case 0x1C:  /* CSTS */
-        if (data & (1 << 4)) {
-            NVME_GUEST_ERR(nvme_ub_mmiowr_ssreset_w1c_unsupported,
-                           "attempted to W1C CSTS.NSSRO"
-                           " but CAP.NSSRS is zero (not supported)");
-        } else if (data != 0) {
-            NVME_GUEST_ERR(nvme_ub_mmiowr_ro_csts,
-                           "attempted to set a read only bit"
-                           " of controller status");
+    }
+    n->sq = g_new0(NvmeSQueue *, n->num_queues);
+    n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_delay_timer_cb, n);
+    n->bg.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_bg_step, n);
+    if (n->plm.supported) {
+        n->plm.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_plm_timer_cb, n);
+    }
+    QTAILQ_INIT(&n->delayed_reqs);
+    n->merge.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_merge_timer_cb, n);
+    QTAILQ_INIT(&n->merge.reqs);
+    QSIMPLEQ_INIT(&n->aer_queue);
+    n->lat_rng = n->lat_seed ? n->lat_seed : 1;
+
+    memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
+                          "nvme", n->reg_size);
+    pci_register_bar(pci_dev, 0,
+        PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
+        &n->iomem);
+    msix_init_exclusive_bar(pci_dev, n->pf ? n->pf->sriov.max_vi_per_vf :
+                            n->num_queues, 4, NULL);
+
+    /* before Identify, which derives MDTS from MPSMIN */
+    n->bar.cap = 0;
+    NVME_CAP_SET_MQES(n->bar.cap, 0x7ff);
+    NVME_CAP_SET_CQR(n->bar.cap, 1);
+    NVME_CAP_SET_TO(n->bar.cap, 0xf);
+    NVME_CAP_SET_CSS(n->bar.cap, (n->zoned ? NVME_CAP_CSS_NVM |
+                     NVME_CAP_CSS_CSI : NVME_CAP_CSS_NVM));
+    NVME_CAP_SET_MPSMAX(n->bar.cap, 4);
+
+    nvme_realize_id_ctrl(n, pci_conf);
+    nvme_realize_smart_log(n);
+    n->temp_thresh_hi = n->id_ctrl.wctemp;
+    nvme_smart_check_temp(n);
+    nvme_realize_error_info_log(n);
+    nvme_realize_fw_slot_info_log(n);
+    nvme_realize_bg_logs(n);
+
+    n->bar.vs = 0x00010200;
+    n->bar.intmc = n->bar.intms = 0;
+
+    if (n->pmrdev) {
+        uint64_t pmr_size;
+
+        if (n->cmb_size_mb || n->cmb_memdev) {
+            error_setg(errp, "pmrdev and a CMB both need BAR2, use only one");
+            return;
         }
-        break;
-    case 0x20:  /* NSSR */
-        if (data == 0x4E564D65) {
-            trace_nvme_ub_mmiowr_ssreset_unsupported();
+        if (host_memory_backend_is_mapped(n->pmrdev)) {
+            error_setg(errp, "can't use already busy memdev: %s",
+                       object_get_canonical_path_component(
+                           OBJECT(n->pmrdev)));
+            return;
+        }
+        if (!object_property_get_bool(OBJECT(n->pmrdev), "share", NULL)) {
+            error_setg(errp, "pmrdev must be a shared mapping (share=on)");
+            return;
+        }
+        pmr_size = memory_region_size(
+            host_memory_backend_get_memory(n->pmrdev));
+        if (pmr_size < 4 * KiB || !is_power_of_2(pmr_size)) {
+            error_setg(errp, "pmrdev size must be a power of two of at"
+                       " least 4 KiB");
+            return;
+        }
+    }
+
+    if (n->cmb_memdev) {
+        uint64_t cmb_size;
+
+        if (host_memory_backend_is_mapped(n->cmb_memdev)) {
+            error_setg(errp, "can't use already busy memdev: %s",
+                       object_get_canonical_path_component(
+                           OBJECT(n->cmb_memdev)));
+            return;
+        }
+        cmb_size = memory_region_size(
+            host_memory_backend_get_memory(n->cmb_memdev));
+        if (cmb_size < MiB || !is_power_of_2(cmb_size)) {
+            error_setg(errp, "cmb_memdev size must be a power of two of at"
+                       " least 1 MiB");
+            return;
+        }
+        n->cmb_size_mb = cmb_size / MiB;
+    }
+
+    if (n->cmb_size_mb) {
+
+        NVME_CMBLOC_SET_BIR(n->bar.cmbloc, 2);
+        NVME_CMBLOC_SET_OFST(n->bar.cmbloc, 0);
+
+        NVME_CMBSZ_SET_SQS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_CQS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_LISTS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_RDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_WDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_SZU(n->bar.cmbsz, 2); /* MBs */
+        NVME_CMBSZ_SET_SZ(n->bar.cmbsz, n->cmb_size_mb);
+
+        n->cmbloc = n->bar.cmbloc;
+        n->cmbsz = n->bar.cmbsz;
+
+        /* plain RAM, so guest accesses to the CMB do not trap */
+        if (n->cmb_memdev) {
+            n->cmb_mr = host_memory_backend_get_memory(n->cmb_memdev);
+            host_memory_backend_set_mapped(n->cmb_memdev, true);
+            vmstate_register_ram(n->cmb_mr, DEVICE(n));
         } else {
-            /* The spec says that writes of other values have no effect */
+            Error *local_err = NULL;
+
+            memory_region_init_ram(&n->ctrl_mem, OBJECT(n), "nvme-cmb",
+                                   NVME_CMBSZ_GETSIZE(n->bar.cmbsz),
+                                   &local_err);
+            if (local_err) {
+                error_propagate(errp, local_err);
+                return;
+            }
+            n->cmb_mr = &n->ctrl_mem;
+        }
+        n->cmbuf = memory_region_get_ram_ptr(n->cmb_mr);
+        pci_register_bar(pci_dev, NVME_CMBLOC_BIR(n->bar.cmbloc),
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, n->cmb_mr);
+
+    } else if (n->pmrdev) {
+        MemoryRegion *pmr_mr = host_memory_backend_get_memory(n->pmrdev);
+
+        NVME_CAP_SET_PMRS(n->bar.cap, 1);
+
+        NVME_PMRCAP_SET_RDS(n->bar.pmrcap, 0);
+        NVME_PMRCAP_SET_WDS(n->bar.pmrcap, 0);
+        NVME_PMRCAP_SET_BIR(n->bar.pmrcap, 2);
+        NVME_PMRCAP_SET_PMRTU(n->bar.pmrcap, 0); /* 500 ms units */
+        NVME_PMRCAP_SET_PMRWBM(n->bar.pmrcap, NVME_PMRCAP_PMRWBM_RD_PMRSTS);
+        NVME_PMRCAP_SET_PMRTO(n->bar.pmrcap, 1);
+        NVME_PMRCAP_SET_CMSS(n->bar.pmrcap, 0);
+
+        host_memory_backend_set_mapped(n->pmrdev, true);
+        vmstate_register_ram(pmr_mr, DEVICE(n));
+        pci_register_bar(pci_dev, NVME_PMRCAP_BIR(n->bar.pmrcap),
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, pmr_mr);
+
+        /* the guest has to enable it through PMRCTL first */
+        nvme_pmr_set_enabled(n, false);
+    }
+
+    for (i = 0; i < n->num_namespaces && !n->ns_attached; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+        NvmeIdNs *id_ns = &ns->id_ns;
+        ns->lock_root = NULL;
+        QTAILQ_INIT(&ns->lock_waiting);
+        QTAILQ_INIT(&ns->flush_waiters);
+        QTAILQ_INIT(&ns->flush_next);
+        QTAILQ_INIT(&ns->zone_flushes);
+        ns->zone_dirty_lo = UINT32_MAX;
+        ns->zone_dirty_hi = 0;
+        ns->zone_sync_inflight = false;
+        ns->journal_offset = n->num_namespaces * n->ns_size +
+                             i * n->journal_size;
+        qemu_co_queue_init(&ns->journal_waiters);
+        id_ns->nsfeat = 0;
+        id_ns->nlbaf = NVME_NUM_LBAF - 1;
+        id_ns->mc = NVME_ID_NS_MC_SEPARATE_MD;
+        id_ns->dpc = NVME_ID_NS_DPC_PI_TYPE_1 | NVME_ID_NS_DPC_PI_TYPE_2 |
+                     NVME_ID_NS_DPC_PI_TYPE_3 | NVME_ID_NS_DPC_PI_FIRST |
+                     NVME_ID_NS_DPC_PI_LAST;
+        id_ns->dps = nvme_dps(n);
+        /*
+         * A write smaller than a NAND page still programs all of it, and
+         * metadata costs a second write.
+         */
+        id_ns->lbaf[NVME_LBAF_512].ds = BDRV_SECTOR_BITS;
+        id_ns->lbaf[NVME_LBAF_512].rp = NVME_LBAF_RP_GOOD;
+        id_ns->lbaf[NVME_LBAF_4K].ds = 12;
+        id_ns->lbaf[NVME_LBAF_4K].rp = NVME_LBAF_RP_BEST;
+        id_ns->lbaf[NVME_LBAF_512_MD8].ds = BDRV_SECTOR_BITS;
+        id_ns->lbaf[NVME_LBAF_512_MD8].ms = cpu_to_le16(8);
+        id_ns->lbaf[NVME_LBAF_512_MD8].rp = NVME_LBAF_RP_DEGRADED;
+        id_ns->lbaf[NVME_LBAF_4K_MD64].ds = 12;
+        id_ns->lbaf[NVME_LBAF_4K_MD64].ms = cpu_to_le16(64);
+        id_ns->lbaf[NVME_LBAF_4K_MD64].rp = NVME_LBAF_RP_BETTER;
+        nvme_fmt_load(n, ns);
+        id_ns->mssrl = cpu_to_le16(NVME_COPY_MSSRL);
+        id_ns->mcl = cpu_to_le32(NVME_COPY_MCL);
+        id_ns->msrc = NVME_COPY_MSRC - 1;
+
+        if (n->subsys) {
+            id_ns->nmic = 1; /* shared */
+            id_ns->anagrpid = cpu_to_le32(i + 1);
+        }
+        if (n->placement.fdp_nruh || n->plm.supported) {
+            id_ns->endgid = cpu_to_le16(1);
+        }
+        if (n->plm.supported) {
+            id_ns->nvmsetid = cpu_to_le16(1);
+        }
+
+        if (n->zoned && nvme_init_zoned(n, ns, errp)) {
             return;
         }
-        break;
-    case 0x24:  /* AQA */
-        n->bar.aqa = data & 0xffffffff;
-        trace_nvme_mmio_aqattr(data & 0xffffffff);
-        break;
-    case 0x28:  /* ASQ */
-        n->bar.asq = data;
-        trace_nvme_mmio_asqaddr(data);
-        break;
-    case 0x2c:  /* ASQ hi */
-        n->bar.asq |= data << 32;
-        trace_nvme_mmio_asqaddr_hi(data, n->bar.asq);
-        break;
-    case 0x30:  /* ACQ */
-        trace_nvme_mmio_acqaddr(data);
-        n->bar.acq = data;
-        break;
-    case 0x34:  /* ACQ hi */
-        n->bar.acq |= data << 32;
-        trace_nvme_mmio_acqaddr_hi(data, n->bar.acq);
-        break;
-    case 0x38:  /* CMBLOC */
-        NVME_GUEST_ERR(nvme_ub_mmiowr_cmbloc_reserved,
-                       "invalid write to reserved CMBLOC"
-                       " when CMBSZ is zero, ignored");
+        if (n->atomic_size) {
+            nvme_journal_replay(n, ns);
+        }
+    }
+
+    /* Extended Device Self-test Time, in minutes; it depends on NSZE */
+    n->id_ctrl.edstt = cpu_to_le16(DIV_ROUND_UP(nvme_bg_pass_secs(n), 60));
+}
+
+static void nvme_realize(PCIDevice *pci_dev, Error **errp)
+{
+    NvmeCtrl *n = NVME(pci_dev);
+    Error *local_err = NULL;
+
+    if (n->pf && nvme_sriov_vf_attach(n, errp)) {
         return;
-    case 0x3C:  /* CMBSZ */
-        NVME_GUEST_ERR(nvme_ub_mmiowr_cmbsz_readonly,
-                       "invalid write to read only CMBSZ, ignored");
+    }
+    if (n->subsys && nvme_subsys_attach(n, errp)) {
+        nvme_sriov_vf_detach(n);
         return;
-    default:
-        NVME_GUEST_ERR(nvme_ub_mmiowr_invalid,
-                       "invalid MMIO write,"
-                       " offset=0x%"PRIx64", data=%"PRIx64"",
-                       offset, data);
-        break;
+    }
+
+    nvme_realize_ctrl(pci_dev, &local_err);
+    if (local_err) {
+        if (n->subsys) {
+            nvme_subsys_detach(n);
+        }
+        nvme_sriov_vf_detach(n);
+        error_propagate(errp, local_err);
     }
 }
 
-static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
+static void nvme_exit(PCIDevice *pci_dev)
 {
-    NvmeCtrl *n = (NvmeCtrl *)opaque;
-    uint8_t *ptr = (uint8_t *)&n->bar;
-    uint64_t val = 0;
+    NvmeCtrl *n = NVME(pci_dev);
+    int i;
 
-    if (unlikely(addr & (sizeof(uint32_t) - 1))) {
-        NVME_GUEST_ERR(nvme_ub_mmiord_misaligned32,
-                       "MMIO read not 32-bit aligned,"
-                       " offset=0x%"PRIx64"", addr);
-        /* should RAZ, fall through for now */
-    } else if (unlikely(size < sizeof(uint32_t))) {
-        NVME_GUEST_ERR(nvme_ub_mmiord_toosmall,
-                       "MMIO read smaller than 32-bits,"
-                       " offset=0x%"PRIx64"", addr);
-        /* should RAZ, fall through for now */
+    nvme_clear_ctrl(n);
+    nvme_sriov_vf_detach(n);
+    for (i = 0; i < n->sriov.max_vfs && n->sriov.vfs; i++) {
+        /* VFs left behind keep running on what they were assigned */
+        if (n->sriov.vfs[i]) {
+            n->sriov.vfs[i]->sec.vfn = 0;
+        }
+    }
+    g_free(n->sriov.vfs);
+    if (n->subsys) {
+        nvme_subsys_detach(n);
+    } else {
+        for (i = 0; i < n->num_namespaces; i++) {
+            g_free(n->namespaces[i].zones);
+        }
+        g_free(n->namespaces);
+    }
+    g_free(n->cq);
+    g_free(n->sq);
+    timer_free(n->delay_timer);
+    timer_free(n->merge.timer);
+    timer_del(n->bg.timer);
+    timer_free(n->bg.timer);
+    g_free(n->bg.buf);
+    if (n->plm.supported) {
+        timer_free(n->plm.timer);
+    }
+    nvme_free_nand(n);
+    g_free(n->placement.ns);
+    if (n->wcache.size) {
+        timer_free(n->wcache.timer);
+        g_hash_table_destroy(n->wcache.pages);
+    }
+    if (n->ra.size) {
+        g_hash_table_destroy(n->ra.segs);
+    }
+    g_free(n->lat_rules);
+    g_free(n->lat_profile);
+
+    if (n->pmrdev) {
+        nvme_pmr_flush(n);
+        vmstate_unregister_ram(host_memory_backend_get_memory(n->pmrdev),
+                               DEVICE(n));
+        host_memory_backend_set_mapped(n->pmrdev, false);
+    }
+    if (n->cmb_size_mb) {
+        vmstate_unregister_ram(n->cmb_mr, DEVICE(n));
+        if (n->cmb_memdev) {
+            host_memory_backend_set_mapped(n->cmb_memdev, false);
+        }
+    }
+    msix_uninit_exclusive_bar(pci_dev);
+}
+
+static Property nvme_props[] = {
+    DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
+    DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
+    DEFINE_PROP_LINK("cmb_memdev", NvmeCtrl, cmb_memdev, TYPE_MEMORY_BACKEND,
+                     HostMemoryBackend *),
+    DEFINE_PROP_LINK("pmrdev", NvmeCtrl, pmrdev, TYPE_MEMORY_BACKEND,
+                     HostMemoryBackend *),
+    DEFINE_PROP_LINK("subsys", NvmeCtrl, subsys, TYPE_NVME_SUBSYS,
+                     NvmeSubsys *),
+    DEFINE_PROP_LINK("pf", NvmeCtrl, pf, TYPE_NVME, NvmeCtrl *),
+    DEFINE_PROP_UINT16("sriov_max_vfs", NvmeCtrl, sriov.max_vfs, 0),
+    DEFINE_PROP_UINT16("sriov_vq_flexible", NvmeCtrl, sriov.vq_flexible, 0),
+    DEFINE_PROP_UINT16("sriov_vi_flexible", NvmeCtrl, sriov.vi_flexible, 0),
+    DEFINE_PROP_UINT16("sriov_max_vq_per_vf", NvmeCtrl, sriov.max_vq_per_vf,
+                       0),
+    DEFINE_PROP_UINT16("sriov_max_vi_per_vf", NvmeCtrl, sriov.max_vi_per_vf,
+                       0),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_UINT8("lbaf", NvmeCtrl, lbaf, NVME_LBAF_512),
+    DEFINE_PROP_UINT8("pi", NvmeCtrl, pi, DPS_TYPE_NONE),
+    DEFINE_PROP_BOOL("pil", NvmeCtrl, pil, false),
+    DEFINE_PROP_BOOL("zoned", NvmeCtrl, zoned, false),
+    DEFINE_PROP_SIZE("zone_size", NvmeCtrl, zone_size_bs, 128 * MiB),
+    DEFINE_PROP_UINT32("max_open_zones", NvmeCtrl, max_open_zones, 0),
+    DEFINE_PROP_UINT32("max_active_zones", NvmeCtrl, max_active_zones, 0),
+    DEFINE_PROP_UINT32("nand_channels", NvmeCtrl, nand.channels, 0),
+    DEFINE_PROP_UINT32("nand_dies", NvmeCtrl, nand.dies, 4),
+    DEFINE_PROP_UINT32("nand_planes", NvmeCtrl, nand.planes, 2),
+    DEFINE_PROP_UINT32("nand_pages_per_block", NvmeCtrl, nand.pages_per_block,
+                       256),
+    DEFINE_PROP_UINT32("nand_page_size", NvmeCtrl, nand.page_size, 4 * KiB),
+    DEFINE_PROP_UINT32("nand_op_pct", NvmeCtrl, nand.op_pct, 7),
+    DEFINE_PROP_UINT32("nand_read_lat_us", NvmeCtrl, nand.read_lat_us, 50),
+    DEFINE_PROP_UINT32("nand_prog_lat_us", NvmeCtrl, nand.prog_lat_us, 500),
+    DEFINE_PROP_UINT32("nand_erase_lat_us", NvmeCtrl, nand.erase_lat_us, 3000),
+    DEFINE_PROP_UINT32("nand_xfer_lat_us", NvmeCtrl, nand.xfer_lat_us, 10),
+    DEFINE_PROP_UINT32("nand_pe_cycles", NvmeCtrl, nand.pe_cycles, 3000),
+    DEFINE_PROP_SIZE("nand_map_cache", NvmeCtrl, nand.map_cache_size, 0),
+    DEFINE_PROP_UINT16("streams", NvmeCtrl, placement.streams, 0),
+    DEFINE_PROP_UINT16("fdp_nruh", NvmeCtrl, placement.fdp_nruh, 0),
+    DEFINE_PROP_BOOL("plm", NvmeCtrl, plm.supported, false),
+    DEFINE_PROP_UINT64("lat_seed", NvmeCtrl, lat_seed, 1),
+    DEFINE_PROP_SIZE("wcache_size", NvmeCtrl, wcache.size, 0),
+    DEFINE_PROP_SIZE("ra_size", NvmeCtrl, ra.size, 0),
+    DEFINE_PROP_SIZE("atomic_size", NvmeCtrl, atomic_size, 0),
+    DEFINE_PROP_UINT32("merge_window_us", NvmeCtrl, merge.window_us, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+/*
+ * Queue state is not a flat array, so it is serialized by hand: CQs first,
+ * then SQs together with the commands still outstanding on them, then the
+ * completions that were queued but not yet posted to the guest. Outstanding
+ * commands are not drained on the source; the destination re-issues them
+ * from the saved SQ entries once the VM runs again.
+ */
+static int nvme_put_queues(QEMUFile *f, void *pv, size_t size,
+                           const VMStateField *field, QJSON *vmdesc)
+{
+    NvmeCtrl *n = pv;
+    NvmeRequest *req;
+    uint32_t i, nr;
+
+    qemu_put_be32(f, n->num_queues);
+
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeCQueue *cq = n->cq[i];
+
+        qemu_put_byte(f, cq != NULL);
+        if (!cq) {
+            continue;
+        }
+        qemu_put_be64(f, cq->dma_addr);
+        qemu_put_be32(f, cq->size);
+        qemu_put_be32(f, cq->vector);
+        qemu_put_be16(f, cq->irq_enabled);
+        qemu_put_be32(f, cq->head);
+        qemu_put_be32(f, cq->tail);
+        qemu_put_byte(f, cq->phase);
+    }
+
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+
+        qemu_put_byte(f, sq != NULL);
+        if (!sq) {
+            continue;
+        }
+        qemu_put_be64(f, sq->dma_addr);
+        qemu_put_be32(f, sq->size);
+        qemu_put_be16(f, sq->cqid);
+        qemu_put_be32(f, sq->head);
+        qemu_put_be32(f, sq->tail);
+
+        nr = 0;
+        QTAILQ_FOREACH(req, &sq->replay_list, entry) {
+            nr++;
+        }
+        QTAILQ_FOREACH(req, &sq->out_req_list, entry) {
+            nr++;
+        }
+        qemu_put_be32(f, nr);
+        QTAILQ_FOREACH(req, &sq->replay_list, entry) {
+            qemu_put_buffer(f, (uint8_t *)&req->cmd, sizeof(req->cmd));
+        }
+        QTAILQ_FOREACH(req, &sq->out_req_list, entry) {
+            qemu_put_buffer(f, (uint8_t *)&req->cmd, sizeof(req->cmd));
+        }
     }
 
-    if (addr < sizeof(n->bar)) {
-        memcpy(&val, ptr + addr, size);
-    } else {
-        NVME_GUEST_ERR(nvme_ub_mmiord_invalid_ofs,
-                       "MMIO read beyond last register,"
-                       " offset=0x%"PRIx64", returning 0", addr);
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeCQueue *cq = n->cq[i];
+
+        if (!cq) {
+            continue;
+        }
+        nr = 0;
+        QTAILQ_FOREACH(req, &cq->req_list, entry) {
+            nr++;
+        }
+        qemu_put_be32(f, nr);
+        QTAILQ_FOREACH(req, &cq->req_list, entry) {
+            qemu_put_be16(f, req->sq->sqid);
+            qemu_put_be16(f, req->status);
+            qemu_put_buffer(f, (uint8_t *)&req->cqe, sizeof(req->cqe));
+        }
     }
 
-    return val;
+    return 0;
 }
 
-static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
+static int nvme_get_queues(QEMUFile *f, void *pv, size_t size,
+                           const VMStateField *field)
 {
-    uint32_t qid;
+    NvmeCtrl *n = pv;
+    NvmeRequest *req;
+    uint32_t i, nr;
 
-    if (unlikely(addr & ((1 << 2) - 1))) {
-        NVME_GUEST_ERR(nvme_ub_db_wr_misaligned,
-                       "doorbell write not 32-bit aligned,"
-                       " offset=0x%"PRIx64", ignoring", addr);
-        return;
+    if (qemu_get_be32(f) != n->num_queues) {
+        error_report("nvme: num_queues does not match the migration source");
+        return -EINVAL;
     }
 
-    if (((addr - 0x1000) >> 2) & 1) {
-        /* Completion queue doorbell write */
-
-        uint16_t new_head = val & 0xffff;
-        int start_sqs;
+    for (i = 0; i < n->num_queues; i++) {
         NvmeCQueue *cq;
+        uint64_t dma_addr;
+        uint32_t qsize, vector;
+        uint16_t irq_enabled;
 
-        qid = (addr - (0x1000 + (1 << 2))) >> 3;
-        if (unlikely(nvme_check_cqid(n, qid))) {
-            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_cq,
-                           "completion queue doorbell write"
-                           " for nonexistent queue,"
-                           " sqid=%"PRIu32", ignoring", qid);
-            return;
-        }
-
-        cq = n->cq[qid];
-        if (unlikely(new_head >= cq->size)) {
-            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_cqhead,
-                           "completion queue doorbell write value"
-                           " beyond queue size, sqid=%"PRIu32","
-                           " new_head=%"PRIu16", ignoring",
-                           qid, new_head);
-            return;
+        if (!qemu_get_byte(f)) {
+            continue;
         }
-
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        dma_addr = qemu_get_be64(f);
+        qsize = qemu_get_be32(f);
+        vector = qemu_get_be32(f);
+        irq_enabled = qemu_get_be16(f);
+        if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap) + 1 ||
+                     vector > n->num_queues)) {
+            return -EINVAL;
         }
 
-        if (cq->tail == cq->head) {
-            nvme_irq_deassert(n, cq);
+        cq = i ? g_malloc0(sizeof(*cq)) : &n->admin_cq;
+        nvme_init_cq(cq, n, dma_addr, i, vector, qsize, irq_enabled);
+        cq->head = qemu_get_be32(f);
+        cq->tail = qemu_get_be32(f);
+        cq->phase = qemu_get_byte(f);
+        if (unlikely(cq->head >= cq->size || cq->tail >= cq->size)) {
+            return -EINVAL;
         }
-    } else {
-        /* Submission queue doorbell write */
+    }
 
-        uint16_t new_tail = val & 0xffff;
+    for (i = 0; i < n->num_queues; i++) {
         NvmeSQueue *sq;
+        uint64_t dma_addr;
+        uint32_t qsize;
+        uint16_t cqid;
 
-        qid = (addr - 0x1000) >> 3;
-        if (unlikely(nvme_check_sqid(n, qid))) {
-            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_sq,
-                           "submission queue doorbell write"
-                           " for nonexistent queue,"
-                           " sqid=%"PRIu32", ignoring", qid);
-            return;
+        if (!qemu_get_byte(f)) {
+            continue;
+        }
+        dma_addr = qemu_get_be64(f);
+        qsize = qemu_get_be32(f);
+        cqid = qemu_get_be16(f);
+        if (unlikely(!qsize || qsize > NVME_CAP_MQES(n->bar.cap) + 1 ||
+                     nvme_check_cqid(n, cqid))) {
+            return -EINVAL;
         }
 
-        sq = n->sq[qid];
-        if (unlikely(new_tail >= sq->size)) {
-            NVME_GUEST_ERR(nvme_ub_db_wr_invalid_sqtail,
-                           "submission queue doorbell write value"
-                           " beyond queue size, sqid=%"PRIu32","
-                           " new_tail=%"PRIu16", ignoring",
-                           qid, new_tail);
-            return;
+        sq = i ? g_malloc0(sizeof(*sq)) : &n->admin_sq;
+        nvme_init_sq(sq, n, dma_addr, i, cqid, qsize);
+        sq->head = qemu_get_be32(f);
+        sq->tail = qemu_get_be32(f);
+        if (unlikely(sq->head >= sq->size || sq->tail >= sq->size)) {
+            return -EINVAL;
         }
 
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        nr = qemu_get_be32(f);
+        if (unlikely(nr > sq->size)) {
+            return -EINVAL;
+        }
+        while (nr--) {
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            qemu_get_buffer(f, (uint8_t *)&req->cmd, sizeof(req->cmd));
+            QTAILQ_INSERT_TAIL(&sq->replay_list, req, entry);
+        }
     }
-}
 
-static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
-    unsigned size)
-{
-    NvmeCtrl *n = (NvmeCtrl *)opaque;
-    if (addr < sizeof(n->bar)) {
-        nvme_write_bar(n, addr, data, size);
-    } else if (addr >= 0x1000) {
-        nvme_process_db(n, addr, data);
-    }
-}
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeCQueue *cq = n->cq[i];
 
-static const MemoryRegionOps nvme_mmio_ops = {
-    .read = nvme_mmio_read,
-    .write = nvme_mmio_write,
-    .endianness = DEVICE_LITTLE_ENDIAN,
-    .impl = {
-        .min_access_size = 2,
-        .max_access_size = 8,
-    },
-};
+        if (!cq) {
+            continue;
+        }
+        nr = qemu_get_be32(f);
+        while (nr--) {
+            uint16_t sqid = qemu_get_be16(f);
 
-static void nvme_cmb_write(void *opaque, hwaddr addr, uint64_t data,
-    unsigned size)
-{
-    NvmeCtrl *n = (NvmeCtrl *)opaque;
-    stn_le_p(&n->cmbuf[addr], size, data);
-}
+            if (unlikely(nvme_check_sqid(n, sqid) ||
+                         QTAILQ_EMPTY(&n->sq[sqid]->req_list))) {
+                return -EINVAL;
+            }
+            req = QTAILQ_FIRST(&n->sq[sqid]->req_list);
+            QTAILQ_REMOVE(&n->sq[sqid]->req_list, req, entry);
+            req->status = qemu_get_be16(f);
+            qemu_get_buffer(f, (uint8_t *)&req->cqe, sizeof(req->cqe));
+            QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
+        }
+    }
 
-static uint64_t nvme_cmb_read(void *opaque, hwaddr addr, unsigned size)
-{
-    NvmeCtrl *n = (NvmeCtrl *)opaque;
-    return ldn_le_p(&n->cmbuf[addr], size);
+    return qemu_file_get_error(f);
 }
 
-static const MemoryRegionOps nvme_cmb_ops = {
-    .read = nvme_cmb_read,
-    .write = nvme_cmb_write,
-    .endianness = DEVICE_LITTLE_ENDIAN,
-    .impl = {
-        .min_access_size = 1,
-        .max_access_size = 8,
-    },
+static const VMStateInfo vmstate_info_nvme_queues = {
+    .name = "nvme queues",
+    .get  = nvme_get_queues,
+    .put  = nvme_put_queues,
 };
 
-static void nvme_realize_error_info_log(NvmeCtrl *_ctrl)
+static int nvme_put_format(QEMUFile *f, void *pv, size_t size,
+                           const VMStateField *field, QJSON *vmdesc)
 {
-    NvmeErrorLog *elog = _ctrl->error_info;
-
-    // followings are just temporary...
-    for ( int i = 0; i < NVME_NUM_ERROR_LOG; i++ ) {
-        elog->error_count  = cpu_to_le64( 0 );
-        elog->sqid         = cpu_to_le16( 0xFFFF );
-        elog->cid          = cpu_to_le16( 0xFFFF );
-        elog->status_field = cpu_to_le16( 0 );
-        elog->param_error_location = cpu_to_le16( 0 );
-        elog->lba          = cpu_to_le64( 0 );
-        elog->nsid         = cpu_to_le32( 0 );
-        elog->vs           = 0;
-        elog->cmd_specific_info    = cpu_to_le64( 0 );
-	elog++;
-    }
-}
+    NvmeCtrl *n = pv;
+    uint32_t i;
 
-static void nvme_realize_smart_log(NvmeCtrl *_ctrl)
-{
-    NvmeSmartLog *log = &(_ctrl->smart);
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeIdNs *id_ns = &n->namespaces[i].id_ns;
 
-    nvme_smart_load(_ctrl);
+        qemu_put_byte(f, NVME_ID_NS_FLBAS_INDEX(id_ns->flbas));
+        qemu_put_byte(f, id_ns->dps);
+    }
 
-    // followings are just temporary...?
-    log->temperature[0] = ( cpu_to_le16( 273 + 30 ) & 0xFF );
-    log->temperature[1] = ( ( cpu_to_le16( 273 + 30 ) >> 8 ) & 0xFF );
-    log->available_spare = 100;
-    log->available_spare_threshold = 10;
-    log->temperature_sensor[0] = cpu_to_le16( 273 + 30 );
+    return 0;
 }
 
-static void nvme_realize_fw_slot_info_log(NvmeCtrl *_ctrl)
+static int nvme_get_format(QEMUFile *f, void *pv, size_t size,
+                           const VMStateField *field)
 {
-    NvmeFwSlotInfoLog *log = &(_ctrl->fw_slot_info);
+    NvmeCtrl *n = pv;
+    uint32_t i;
 
-    memset( log, 0, sizeof(NvmeFwSlotInfoLog) ); // clear
-    log->afi = 1; // firmware in slot 1 is running (active slot number)
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
+        uint8_t lbaf = qemu_get_byte(f);
+        uint8_t dps = qemu_get_byte(f);
 
-    // only slot 1 has valid firmware revision
-    strpadcpy((char *)(log->frs1), sizeof(log->frs1), "1.0", ' ');
+        if (unlikely(lbaf > ns->id_ns.nlbaf ||
+                     (dps & DPS_TYPE_MASK) > DPS_TYPE_3)) {
+            return -EINVAL;
+        }
+        if (!n->ns_attached) {
+            if (lbaf != NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)) {
+                nvme_ns_set_lbaf(n, ns, lbaf);
+            }
+            ns->id_ns.dps = dps;
+        }
+    }
+
+    return qemu_file_get_error(f);
 }
 
-static void nvme_realize_id_ctrl(NvmeCtrl *_ctrl, uint8_t *_pci_conf)
-{
-    NvmeIdCtrl *id = &_ctrl->id_ctrl;
+static const VMStateInfo vmstate_info_nvme_format = {
+    .name = "nvme format",
+    .get  = nvme_get_format,
+    .put  = nvme_put_format,
+};
 
-    // PCI Vendor ID (VID)
-    id->vid = cpu_to_le16(pci_get_word(_pci_conf + PCI_VENDOR_ID));
+static int nvme_put_zones(QEMUFile *f, void *pv, size_t size,
+                          const VMStateField *field, QJSON *vmdesc)
+{
+    NvmeCtrl *n = pv;
+    uint32_t i, j;
 
-    // PCI Subsystem Vendor ID (SSVID)
-    id->ssvid = cpu_to_le16(pci_get_word(_pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
 
-    // Serial Number (SN)
-    strpadcpy((char *)id->sn, sizeof(id->sn), _ctrl->serial, ' ');
+        for (j = 0; ns->zoned && j < ns->num_zones; j++) {
+            qemu_put_byte(f, ns->zones[j].zs);
+            qemu_put_be64(f, ns->zones[j].wp);
+        }
+    }
 
-    // Model Number (MN)
-    strpadcpy((char *)id->mn, sizeof(id->mn), "QEMU NVMe Ctrl", ' ');
+    return 0;
+}
 
-    // Firmware Revision (FR)
-    strpadcpy((char *)id->fr, sizeof(id->fr), "1.0", ' ');
+static int nvme_get_zones(QEMUFile *f, void *pv, size_t size,
+                          const VMStateField *field)
+{
+    NvmeCtrl *n = pv;
+    uint32_t i, j;
 
-    // Recommended Arbitration Burst (RAB)
-    id->rab = 6;
+    for (i = 0; i < n->num_namespaces; i++) {
+        NvmeNamespace *ns = &n->namespaces[i];
 
-    // IEEE OUI Identifier (IEEE)
-    id->ieee[0] = 0x00;
-    id->ieee[1] = 0x02;
-    id->ieee[2] = 0xb3;
+        if (!ns->zoned) {
+            continue;
+        }
+        ns->nr_open_zones = ns->nr_active_zones = 0;
+        QTAILQ_INIT(&ns->imp_open_zones);
+        for (j = 0; j < ns->num_zones; j++) {
+            NvmeZone *zone = &ns->zones[j];
+            uint8_t zs = qemu_get_byte(f);
+
+            zone->wp = qemu_get_be64(f);
+            if (unlikely(zone->wp < zone->zslba ||
+                         zone->wp > zone->zslba + zone->zcap)) {
+                return -EINVAL;
+            }
+            zone->zs = NVME_ZONE_STATE_EMPTY;
+            nvme_zone_set_state(ns, zone, zs);
+        }
+    }
 
-    // Controller Multi-Path I/O and Namespace Sharing Capabilities (CMIC)
-    id->cmic = 0;
+    return qemu_file_get_error(f);
+}
 
-    // Maximum Data Transfer Size (MDTS)
-    id->mdts = 0; // no restrictions
+static const VMStateInfo vmstate_info_nvme_zones = {
+    .name = "nvme zones",
+    .get  = nvme_get_zones,
+    .put  = nvme_put_zones,
+};
 
-    // Controller ID (CNTLID)
-    id->cntlid = 0;
+static bool nvme_zoned_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    // Version (VER)
-    id->ver = cpu_to_le32(0x00010300);
+    return n->zoned;
+}
 
-    // RTD3 Resume Latency (RTD3R)
-    id->rtd3r = 1000;
+static const VMStateDescription nvme_vmstate_zoned = {
+    .name = "nvme/zoned",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_zoned_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "zones",
+            .info         = &vmstate_info_nvme_zones,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    // RTD3 Entry Latency (RTD3E)
-    id->rtd3e = 1000;
+static bool nvme_format_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    // Optional Asynchronous Events Supported (OAES)
-    id->oaes = 0;
+    return n->ns_changed || (!n->ns_attached &&
+        (NVME_ID_NS_FLBAS_INDEX(n->namespaces[0].id_ns.flbas) != n->lbaf ||
+         n->namespaces[0].id_ns.dps != nvme_dps(n)));
+}
 
-    // Optional Admin Command Support (OACS)
-    id->oacs = 0;
+/* a namespace Format switched away from lbaf and pi; ahead of zones */
+static const VMStateDescription nvme_vmstate_format = {
+    .name = "nvme/format",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_format_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "format",
+            .info         = &vmstate_info_nvme_format,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_BOOL(ns_changed, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    // Abort Command Limit (ACL)
-    id->acl = 0;
+/*
+ * The FTL is migrated as the per-block counters plus the L2P table; the
+ * reverse map, free lists and active blocks are rebuilt from them.
+ */
+static int nvme_put_nand(QEMUFile *f, void *pv, size_t size,
+                         const VMStateField *field, QJSON *vmdesc)
+{
+    NvmeNand *nand = &((NvmeCtrl *)pv)->nand;
+    uint64_t i;
+
+    qemu_put_be64(f, nand->host_pages_written);
+    qemu_put_be64(f, nand->nand_pages_written);
+    qemu_put_be64(f, nand->gc_pages_moved);
+    qemu_put_be64(f, nand->gc_blocks_erased);
+    qemu_put_be64(f, nand->total_erase_count);
+    qemu_put_be32(f, nand->next_stripe);
+    for (i = 0; i < (uint64_t)nand->nr_planes * nand->blocks_per_plane; i++) {
+        qemu_put_be32(f, nand->blocks[i].wp);
+        qemu_put_be32(f, nand->blocks[i].erase_count);
+    }
+    for (i = 0; i < nand->nr_lpns; i++) {
+        qemu_put_be32(f, nvme_nand_get_l2p(nand, i));
+    }
 
-    // Asynchronous Event Request Limit (AERL)
-    id->aerl = 0;
+    return 0;
+}
 
-    // Firmware Updates (FRMW)
-    //  - controller requires a reset to activate downloaded firmware
-    //  - number of firmware slot is seven
-    //  - the first firmware slot (slot 1) is read/write
-    id->frmw = 7 << 1;
+static int nvme_get_nand(QEMUFile *f, void *pv, size_t size,
+                         const VMStateField *field)
+{
+    NvmeNand *nand = &((NvmeCtrl *)pv)->nand;
+    uint64_t nr_blocks = (uint64_t)nand->nr_planes * nand->blocks_per_plane;
+    uint64_t i;
+
+    nand->host_pages_written = qemu_get_be64(f);
+    nand->nand_pages_written = qemu_get_be64(f);
+    nand->gc_pages_moved = qemu_get_be64(f);
+    nand->gc_blocks_erased = qemu_get_be64(f);
+    nand->total_erase_count = qemu_get_be64(f);
+    nand->next_stripe = qemu_get_be32(f);
+    for (i = 0; i < nr_blocks; i++) {
+        nand->blocks[i].wp = qemu_get_be32(f);
+        nand->blocks[i].erase_count = qemu_get_be32(f);
+        nand->blocks[i].valid = 0;
+        if (unlikely(nand->blocks[i].wp > nand->pages_per_block)) {
+            return -EINVAL;
+        }
+    }
 
-    // Log Page Attributes (LPA)
-    //  - Telemetry supported (only header)
-    //  - Command Effects log page is supported
-    //  - SMART log page is not per namespace basis
-    id->lpa = NVME_LPA_CSE | NVME_LPA_TELEMETRY;
+    memset(nand->p2l, 0xff, nand->nr_ppns * sizeof(uint32_t));
+    for (i = 0; i < nand->nr_lpns; i++) {
+        uint32_t ppn = qemu_get_be32(f);
 
-    // Error Log Page Entries (ELPE)
-    id->elpe = (NVME_NUM_ERROR_LOG - 1);
+        nand->l2p[i] = ppn;
+        if (ppn == NVME_NAND_UNMAPPED) {
+            continue;
+        }
+        if (unlikely(ppn >= nand->nr_ppns ||
+                     nand->p2l[ppn] != NVME_NAND_UNMAPPED)) {
+            return -EINVAL;
+        }
+        nand->p2l[ppn] = i;
+        nand->blocks[ppn / nand->pages_per_block].valid++;
+    }
 
-    // Number of Power States Support (NPSS)
-    id->npss = 0;
+    for (i = 0; i < nand->nr_planes; i++) {
+        NvmeNandPlane *plane = &nand->plane[i];
+        uint32_t blk = i * nand->blocks_per_plane;
+        uint32_t j;
+
+        plane->nr_free = 0;
+        memset(plane->active_blk, 0xff, sizeof(plane->active_blk));
+        plane->next_avail_ns = 0;
+        for (j = blk + nand->blocks_per_plane; j > blk; j--) {
+            NvmeNandBlock *b = &nand->blocks[j - 1];
+
+            if (!b->wp) {
+                plane->free_blks[plane->nr_free++] = j - 1;
+            } else if (b->wp < nand->pages_per_block) {
+                plane->active_blk[0] = j - 1;
+            }
+        }
+    }
+    memset(nand->chan_avail_ns, 0, nand->channels * sizeof(int64_t));
 
-    // Admin Vendor Specific Command Configuration (AVSCC)
-    id->avscc = 0;
+    return qemu_file_get_error(f);
+}
 
-    // Autonomous Power State Transition Attributes (APSTA)
-    id->apsta = 0;
+static const VMStateInfo vmstate_info_nvme_nand = {
+    .name = "nvme nand",
+    .get  = nvme_get_nand,
+    .put  = nvme_put_nand,
+};
 
-    // Warning Composite Temperature Threshold (WCTEMP)
-    id->wctemp = 363; // 90 degrees Celcius
+static bool nvme_nand_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    // Critical Composite Temperature Threshold (CCTEMP)
-    id->cctemp = 373; // 100 degrees Celcius
+    return n->nand.channels;
+}
 
-    // Maximum Time for Firmware Activation (MTFA)
-    id->mtfa = 0;
+static const VMStateDescription nvme_vmstate_nand = {
+    .name = "nvme/nand",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_nand_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "ftl",
+            .info         = &vmstate_info_nvme_nand,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    // Host Memory Buffer Preferred Size (HMPRE)
-    id->hmpre = 0;
+/*
+ * Open streams, byte counters and, with the NAND model, which handle every
+ * block belongs to; the open blocks the FTL subsection guessed at are
+ * replaced by the handles' own.
+ */
+static int nvme_put_placement(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field, QJSON *vmdesc)
+{
+    NvmeCtrl *n = pv;
+    NvmePlacement *pl = &n->placement;
+    NvmeNand *nand = &n->nand;
+    uint64_t i;
+    uint32_t j;
+
+    for (i = 0; i < pl->nr_handles; i++) {
+        qemu_put_be32(f, pl->stream_nsid[i]);
+        qemu_put_be16(f, pl->stream_id[i]);
+        qemu_put_be64(f, pl->host_bytes[i]);
+        qemu_put_be64(f, nand->ruh_pages_written[i]);
+    }
+    for (i = 0; pl->streams && i < n->num_namespaces; i++) {
+        qemu_put_byte(f, pl->ns[i].enabled);
+        qemu_put_be16(f, pl->ns[i].nsa);
+    }
+    if (!nand->channels) {
+        return 0;
+    }
+    for (i = 0; i < (uint64_t)nand->nr_planes * nand->blocks_per_plane; i++) {
+        qemu_put_byte(f, nand->blocks[i].ruh);
+    }
+    for (i = 0; i < nand->nr_planes; i++) {
+        for (j = 0; j < pl->nr_handles; j++) {
+            qemu_put_be32(f, nand->plane[i].active_blk[j]);
+        }
+    }
 
-    // Host Memory Buffer Minimum Size (HMMIN)
-    id->hmmin = 0;
+    return 0;
+}
 
-    // Total NVM Capacity (TNVMCAP)
-    id->tnvmcap[0] = 0;
-    id->tnvmcap[1] = 0;
+static int nvme_get_placement(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field)
+{
+    NvmeCtrl *n = pv;
+    NvmePlacement *pl = &n->placement;
+    NvmeNand *nand = &n->nand;
+    uint64_t i;
+    uint32_t j;
+
+    pl->nr_allocated = 0;
+    for (i = 0; i < pl->nr_handles; i++) {
+        pl->stream_nsid[i] = qemu_get_be32(f);
+        pl->stream_id[i] = qemu_get_be16(f);
+        pl->host_bytes[i] = qemu_get_be64(f);
+        nand->ruh_pages_written[i] = qemu_get_be64(f);
+        if (unlikely(pl->stream_nsid[i] > n->num_namespaces ||
+                     (pl->stream_nsid[i] && (!i || i > pl->streams)))) {
+            return -EINVAL;
+        }
+    }
+    for (i = 0; pl->streams && i < n->num_namespaces; i++) {
+        pl->ns[i].enabled = qemu_get_byte(f);
+        pl->ns[i].nsa = qemu_get_be16(f);
+        pl->nr_allocated += pl->ns[i].nsa;
+    }
+    if (unlikely(pl->nr_allocated > pl->streams)) {
+        return -EINVAL;
+    }
+    if (!nand->channels) {
+        return qemu_file_get_error(f);
+    }
+    for (i = 0; i < (uint64_t)nand->nr_planes * nand->blocks_per_plane; i++) {
+        nand->blocks[i].ruh = qemu_get_byte(f);
+        if (unlikely(nand->blocks[i].ruh >= pl->nr_handles)) {
+            return -EINVAL;
+        }
+    }
+    for (i = 0; i < nand->nr_planes; i++) {
+        NvmeNandPlane *plane = &nand->plane[i];
+        uint32_t first = i * nand->blocks_per_plane;
+
+        for (j = 0; j < pl->nr_handles; j++) {
+            uint32_t blk = qemu_get_be32(f);
+
+            /* an open block must be in the plane, and not be free */
+            if (unlikely(blk != NVME_NAND_UNMAPPED &&
+                         (blk < first || blk >= first + nand->blocks_per_plane ||
+                          !nand->blocks[blk].wp))) {
+                return -EINVAL;
+            }
+            plane->active_blk[j] = blk;
+        }
+    }
 
-    // Unallocated NVM Capacity (UNVMCAP)
-    id->unvmcap[0] = 0;
-    id->unvmcap[1] = 0;
+    return qemu_file_get_error(f);
+}
 
-    // Replay Protected Memory Block Support (RPMBS)
-    id->rpmbs = 0;
+static const VMStateInfo vmstate_info_nvme_placement = {
+    .name = "nvme placement",
+    .get  = nvme_get_placement,
+    .put  = nvme_put_placement,
+};
 
-    // Submission Queue Entry Size (SQES)
-    id->sqes = (0x6 << 4) | 0x6;
+static bool nvme_placement_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    // Completion Queue Entry Size (CQES)
-    id->cqes = (0x4 << 4) | 0x4;
+    return n->placement.nr_handles > 1;
+}
 
-    // Number of Namespaces (NN)
-    id->nn = cpu_to_le32(_ctrl->num_namespaces);
+static const VMStateDescription nvme_vmstate_placement = {
+    .name = "nvme/placement",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_placement_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "placement",
+            .info         = &vmstate_info_nvme_placement,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    // Optional NVM Command Support (ONCS)
-    id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS | NVME_ONCS_TIMESTAMP | NVME_ONCS_DSM);
+static bool nvme_wcache_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    // Fused Operation Support (FUSES)
-    id->fuses = 0;
+    return n->wcache.size;
+}
 
-    // Format NVM Attributes (FNA)
-    id->fna = 0;
+static const VMStateDescription nvme_vmstate_wcache = {
+    .name = "nvme/wcache",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_wcache_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(wcache.enabled, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    // Volatile Write Cache (VWC)
-    if (blk_enable_write_cache(_ctrl->conf.blk)) {
-        id->vwc = 1;
+/*
+ * The buffer itself is guest RAM and migrates as such; only its
+ * descriptor list is sent, and the destination maps it again. This
+ * subsection has to follow nvme/nand, which restores the L2P table.
+ */
+static int nvme_put_hmb(QEMUFile *f, void *pv, size_t size,
+                        const VMStateField *field, QJSON *vmdesc)
+{
+    NvmeHmb *hmb = &((NvmeCtrl *)pv)->hmb;
+    uint32_t i;
+
+    qemu_put_be32(f, hmb->hsize);
+    qemu_put_be64(f, hmb->list_addr);
+    qemu_put_be32(f, hmb->nr_descrs);
+    for (i = 0; i < hmb->nr_descrs; i++) {
+        qemu_put_be64(f, le64_to_cpu(hmb->descrs[i].badd));
+        qemu_put_be32(f, le32_to_cpu(hmb->descrs[i].bsize));
     }
 
-    // Atomic Write Unit Normal (AWUN)
-    id->awun = 0;
+    return 0;
+}
 
-    // Atomic Write Unit Power Fail (AWUPF)
-    id->awupf = 0;
+static int nvme_get_hmb(QEMUFile *f, void *pv, size_t size,
+                        const VMStateField *field)
+{
+    NvmeCtrl *n = pv;
+    NvmeHmb *hmb = &n->hmb;
+    uint32_t i;
+
+    hmb->hsize = qemu_get_be32(f);
+    hmb->list_addr = qemu_get_be64(f);
+    hmb->nr_descrs = qemu_get_be32(f);
+    if (unlikely(!n->nand.channels || !hmb->nr_descrs ||
+                 hmb->nr_descrs > NVME_HMB_MAX_DESCRS)) {
+        return -EINVAL;
+    }
+    hmb->descrs = g_new0(NvmeHmbDescr, hmb->nr_descrs);
+    for (i = 0; i < hmb->nr_descrs; i++) {
+        hmb->descrs[i].badd = cpu_to_le64(qemu_get_be64(f));
+        hmb->descrs[i].bsize = cpu_to_le32(qemu_get_be32(f));
+    }
 
-    // NVM Vendor Specific Command Configuration (NVSCC)
-    id->nvscc = 0;
+    if (nvme_hmb_map(n)) {
+        return -EINVAL;
+    }
+    hmb->enabled = true;
 
-    // Atomic Compare Write Unit (ACWU)
-    id->acwu = 0;
+    return 0;
+}
 
-    // SGL Support (SGLS)
-    id->sgls = 0;
+static const VMStateInfo vmstate_info_nvme_hmb = {
+    .name = "nvme_hmb",
+    .get  = nvme_get_hmb,
+    .put  = nvme_put_hmb,
+};
 
-    // Power State Descriptors
-    id->psd[0].mp    = cpu_to_le16(0x9c4);
-    id->psd[0].enlat = cpu_to_le32(0x10);
-    id->psd[0].exlat = cpu_to_le32(0x4);
+static bool nvme_hmb_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    return n->hmb.enabled;
 }
 
-static void nvme_realize(PCIDevice *pci_dev, Error **errp)
+static const VMStateDescription nvme_vmstate_hmb = {
+    .name = "nvme/hmb",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_hmb_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "hmb",
+            .info         = &vmstate_info_nvme_hmb,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static bool nvme_pmr_needed(void *opaque)
 {
-    NvmeCtrl *n = NVME(pci_dev);
+    NvmeCtrl *n = opaque;
 
-    int i;
-    int64_t bs_size;
-    uint8_t *pci_conf;
+    return n->pmrdev;
+}
 
-    if (!n->num_queues) {
-        error_setg(errp, "num_queues can't be zero");
-        return;
-    }
+static int nvme_pmr_post_load(void *opaque, int version_id)
+{
+    NvmeCtrl *n = opaque;
 
-    if (!n->conf.blk) {
-        error_setg(errp, "drive property not set");
-        return;
-    }
+    nvme_pmr_set_enabled(n, NVME_PMRCTL_EN(n->bar.pmrctl));
+    return 0;
+}
 
-    bs_size = blk_getlength(n->conf.blk);
-    if (bs_size < 0) {
-        error_setg(errp, "could not get backing file size");
-        return;
-    }
+static const VMStateDescription nvme_vmstate_pmr = {
+    .name = "nvme/pmr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_pmr_needed,
+    .post_load = nvme_pmr_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(bar.pmrctl, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    if (!n->serial) {
-        error_setg(errp, "serial property not set");
-        return;
-    }
-    blkconf_blocksizes(&n->conf);
-    if (!blkconf_apply_backend_options(&n->conf, blk_is_read_only(n->conf.blk),
-                                       false, errp)) {
-        return;
-    }
+static bool nvme_sriov_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    pci_conf = pci_dev->config;
-    pci_conf[PCI_INTERRUPT_PIN] = 1;
-    pci_config_set_prog_interface(pci_dev->config, 0x2);
-    pci_config_set_class(pci_dev->config, PCI_CLASS_STORAGE_EXPRESS);
-    pcie_endpoint_cap_init(pci_dev, 0x80);
+    return n->pf;
+}
 
-    n->num_namespaces = 1;
-    n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
-    n->ns_size = bs_size / (uint64_t)n->num_namespaces;
+/* the primary's pools are recomputed from what its VFs hold */
+static const VMStateDescription nvme_vmstate_sriov = {
+    .name = "nvme/sriov",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_sriov_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(sec.nvq, NvmeCtrl),
+        VMSTATE_UINT16(sec.nvi, NvmeCtrl),
+        VMSTATE_BOOL(sec.online, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
-    n->sq = g_new0(NvmeSQueue *, n->num_queues);
-    n->cq = g_new0(NvmeCQueue *, n->num_queues);
+static bool nvme_aer_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
-                          "nvme", n->reg_size);
-    pci_register_bar(pci_dev, 0,
-        PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
-        &n->iomem);
-    msix_init_exclusive_bar(pci_dev, n->num_queues, 4, NULL);
+    return n->aer_cfg || n->ana_chgcnt || n->temp_thresh_low ||
+           n->temp_thresh_hi != n->id_ctrl.wctemp;
+}
 
-    nvme_realize_id_ctrl(n, pci_conf);
-    nvme_realize_smart_log(n);
-    nvme_realize_error_info_log(n);
-    nvme_realize_fw_slot_info_log(n);
+/*
+ * Outstanding AERs are re-issued from the SQ like other commands; events
+ * not reported yet are lost.
+ */
+static const VMStateDescription nvme_vmstate_aer = {
+    .name = "nvme/aer",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_aer_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(aer_cfg, NvmeCtrl),
+        VMSTATE_UINT16(temp_thresh_hi, NvmeCtrl),
+        VMSTATE_UINT16(temp_thresh_low, NvmeCtrl),
+        VMSTATE_UINT64(ana_chgcnt, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-    n->bar.cap = 0;
-    NVME_CAP_SET_MQES(n->bar.cap, 0x7ff);
-    NVME_CAP_SET_CQR(n->bar.cap, 1);
-    NVME_CAP_SET_TO(n->bar.cap, 0xf);
-    NVME_CAP_SET_CSS(n->bar.cap, 1);
-    NVME_CAP_SET_MPSMAX(n->bar.cap, 4);
+static bool nvme_plm_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-    n->bar.vs = 0x00010200;
-    n->bar.intmc = n->bar.intms = 0;
+    return n->plm.enabled || n->plm.ee || n->plm.aggregate;
+}
 
-    if (n->cmb_size_mb) {
+/* the DTWIN keeps running on the virtual clock, which migrates with it */
+static const VMStateDescription nvme_vmstate_plm = {
+    .name = "nvme/plm",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_plm_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(plm.enabled, NvmeCtrl),
+        VMSTATE_UINT8(plm.window, NvmeCtrl),
+        VMSTATE_BOOL(plm.excursion, NvmeCtrl),
+        VMSTATE_BOOL(plm.aggregate, NvmeCtrl),
+        VMSTATE_UINT16(plm.ee, NvmeCtrl),
+        VMSTATE_UINT16(plm.evt, NvmeCtrl),
+        VMSTATE_UINT16(plm.warned, NvmeCtrl),
+        VMSTATE_UINT64(plm.dtwinrt, NvmeCtrl),
+        VMSTATE_UINT64(plm.dtwinwt, NvmeCtrl),
+        VMSTATE_UINT64(plm.dtwintt, NvmeCtrl),
+        VMSTATE_INT64(plm.dtwin_start_ns, NvmeCtrl),
+        VMSTATE_UINT64(plm.reads, NvmeCtrl),
+        VMSTATE_UINT64(plm.writes, NvmeCtrl),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-        NVME_CMBLOC_SET_BIR(n->bar.cmbloc, 2);
-        NVME_CMBLOC_SET_OFST(n->bar.cmbloc, 0);
+static bool nvme_bg_needed(void *opaque)
+{
+    NvmeCtrl *n = opaque;
 
-        NVME_CMBSZ_SET_SQS(n->bar.cmbsz, 1);
-        NVME_CMBSZ_SET_CQS(n->bar.cmbsz, 0);
-        NVME_CMBSZ_SET_LISTS(n->bar.cmbsz, 0);
-        NVME_CMBSZ_SET_RDS(n->bar.cmbsz, 1);
-        NVME_CMBSZ_SET_WDS(n->bar.cmbsz, 1);
-        NVME_CMBSZ_SET_SZU(n->bar.cmbsz, 2); /* MBs */
-        NVME_CMBSZ_SET_SZ(n->bar.cmbsz, n->cmb_size_mb);
+    return n->bg.type != NVME_BG_NONE || n->bg.sanitize_failed ||
+           n->sanitize_log.sstat || n->self_test_log.result[0].dsts !=
+                                    NVME_DST_RES_UNUSED;
+}
 
-        n->cmbloc = n->bar.cmbloc;
-        n->cmbsz = n->bar.cmbsz;
+/*
+ * A Sanitize or self-test carries on at the destination from the chunk it
+ * was at. A Format is dropped: its command is replayed and starts it anew.
+ */
+static const VMStateDescription nvme_vmstate_bg = {
+    .name = "nvme/bg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nvme_bg_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(bg.type, NvmeCtrl),
+        VMSTATE_UINT8(bg.phase, NvmeCtrl),
+        VMSTATE_UINT8(bg.pass, NvmeCtrl),
+        VMSTATE_UINT8(bg.passes, NvmeCtrl),
+        VMSTATE_UINT32(bg.cdw10, NvmeCtrl),
+        VMSTATE_UINT32(bg.pattern, NvmeCtrl),
+        VMSTATE_UINT32(bg.nsid, NvmeCtrl),
+        VMSTATE_UINT64(bg.pos, NvmeCtrl),
+        VMSTATE_UINT64(bg.end, NvmeCtrl),
+        VMSTATE_BOOL(bg.sanitize_failed, NvmeCtrl),
+        VMSTATE_BUFFER_UNSAFE(sanitize_log, NvmeCtrl, 0,
+                              sizeof(NvmeSanitizeLog)),
+        VMSTATE_BUFFER_UNSAFE(self_test_log, NvmeCtrl, 0,
+                              sizeof(NvmeSelfTestLog)),
+        VMSTATE_END_OF_LIST()
+    },
+};
 
-        n->cmbuf = g_malloc0(NVME_CMBSZ_GETSIZE(n->bar.cmbsz));
-        memory_region_init_io(&n->ctrl_mem, OBJECT(n), &nvme_cmb_ops, n,
-                              "nvme-cmb", NVME_CMBSZ_GETSIZE(n->bar.cmbsz));
-        pci_register_bar(pci_dev, NVME_CMBLOC_BIR(n->bar.cmbloc),
-            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
-            PCI_BASE_ADDRESS_MEM_PREFETCH, &n->ctrl_mem);
+/*
+ * Cache contents are not migrated, they are written back instead. Held
+ * completions are posted early: their I/O is done, and left on out_req_list
+ * they would be replayed on the destination.
+ */
+static int nvme_pre_save(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    uint32_t i;
 
+    if (n->wcache.size) {
+        nvme_wcache_writeback_sync(n);
+        /* let waiters make progress should the VM resume here */
+        timer_mod(n->wcache.timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
     }
-
-    for (i = 0; i < n->num_namespaces; i++) {
-        NvmeNamespace *ns = &n->namespaces[i];
-        NvmeIdNs *id_ns = &ns->id_ns;
-        id_ns->nsfeat = 0;
-        id_ns->nlbaf = 0;
-        id_ns->flbas = 0;
-        id_ns->mc = 0;
-        id_ns->dpc = 0;
-        id_ns->dps = 0;
-        id_ns->lbaf[0].ds = BDRV_SECTOR_BITS;
-        id_ns->ncap  = id_ns->nuse = id_ns->nsze =
-            cpu_to_le64(n->ns_size >>
-                id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
+    for (i = 0; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_flush_delayed_reqs(n, n->sq[i]);
+        }
     }
+
+    return 0;
 }
 
-static void nvme_exit(PCIDevice *pci_dev)
+static int nvme_post_load(void *opaque, int version_id)
 {
-    NvmeCtrl *n = NVME(pci_dev);
+    NvmeCtrl *n = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int i;
 
-    nvme_clear_ctrl(n);
-    g_free(n->namespaces);
-    g_free(n->cq);
-    g_free(n->sq);
+    if (NVME_CC_EN(n->bar.cc)) {
+        nvme_init_ctrl_params(n);
+    }
 
-    if (n->cmb_size_mb) {
-        g_free(n->cmbuf);
+    /* virtual clock timers only fire once the destination VM is running */
+    for (i = 0; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq && (!nvme_sq_empty(sq) || !QTAILQ_EMPTY(&sq->replay_list))) {
+            timer_mod(sq->timer, now + 500);
+        }
+        if (cq && !QTAILQ_EMPTY(&cq->req_list)) {
+            timer_mod(cq->timer, now + 500);
+        }
+    }
+    if (nvme_plm_window(n) == NVME_PLM_WINDOW_DTWIN) {
+        nvme_plm_arm(n);
+    }
+    if (n->bg.type == NVME_BG_FORMAT) {
+        n->bg.type = NVME_BG_NONE;
+    } else if (n->bg.type != NVME_BG_NONE) {
+        if (n->bg.phase == NVME_BG_OVERWRITE) {
+            n->bg.buf = g_malloc(NVME_BG_CHUNK);
+            nvme_bg_fill(n);
+        } else if (n->bg.type == NVME_BG_SELF_TEST && n->bg.nsid) {
+            n->bg.buf = g_malloc(NVME_BG_CHUNK);
+        }
+        timer_mod(n->bg.timer, now);
     }
-    msix_uninit_exclusive_bar(pci_dev);
-}
 
-static Property nvme_props[] = {
-    DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
-    DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
-    DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
-    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
-    DEFINE_PROP_END_OF_LIST(),
-};
+    return 0;
+}
 
 static const VMStateDescription nvme_vmstate = {
     .name = "nvme",
-    .unmigratable = 1,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = nvme_pre_save,
+    .post_load = nvme_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj, NvmeCtrl),
+        VMSTATE_MSIX(parent_obj, NvmeCtrl),
+        VMSTATE_UINT64(bar.cap, NvmeCtrl),
+        VMSTATE_UINT32(bar.vs, NvmeCtrl),
+        VMSTATE_UINT32(bar.intms, NvmeCtrl),
+        VMSTATE_UINT32(bar.intmc, NvmeCtrl),
+        VMSTATE_UINT32(bar.cc, NvmeCtrl),
+        VMSTATE_UINT32(bar.csts, NvmeCtrl),
+        VMSTATE_UINT32(bar.nssrc, NvmeCtrl),
+        VMSTATE_UINT32(bar.aqa, NvmeCtrl),
+        VMSTATE_UINT64(bar.asq, NvmeCtrl),
+        VMSTATE_UINT64(bar.acq, NvmeCtrl),
+        VMSTATE_UINT32(bar.cmbloc, NvmeCtrl),
+        VMSTATE_UINT32(bar.cmbsz, NvmeCtrl),
+        VMSTATE_UINT64(irq_status, NvmeCtrl),
+        VMSTATE_UINT64(host_timestamp, NvmeCtrl),
+        VMSTATE_UINT64(timestamp_set_qemu_clock_ms, NvmeCtrl),
+        VMSTATE_BUFFER_UNSAFE(smart, NvmeCtrl, 0, sizeof(NvmeSmartLog)),
+        VMSTATE_BUFFER_UNSAFE(error_info, NvmeCtrl, 0,
+                              sizeof(NvmeErrorLog) * NVME_NUM_ERROR_LOG),
+        VMSTATE_BUFFER_UNSAFE(fw_slot_info, NvmeCtrl, 0,
+                              sizeof(NvmeFwSlotInfoLog)),
+        {
+            .name         = "queues",
+            .info         = &vmstate_info_nvme_queues,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &nvme_vmstate_format,
+        &nvme_vmstate_zoned,
+        &nvme_vmstate_nand,
+        &nvme_vmstate_placement,
+        &nvme_vmstate_hmb,
+        &nvme_vmstate_wcache,
+        &nvme_vmstate_pmr,
+        &nvme_vmstate_sriov,
+        &nvme_vmstate_aer,
+        &nvme_vmstate_plm,
+        &nvme_vmstate_bg,
+        NULL
+    },
 };
 
 static void nvme_class_init(ObjectClass *oc, void *data)
@@ -1986,6 +10697,8 @@ static void nvme_class_init(ObjectClass *oc, void *data)
     DeviceClass *dc = DEVICE_CLASS(oc);
     PCIDeviceClass *pc = PCI_DEVICE_CLASS(oc);
 
+    nvme_crc16_t10_init();
+
     pc->realize = nvme_realize;
     pc->exit = nvme_exit;
     pc->class_id = PCI_CLASS_STORAGE_EXPRESS;
@@ -1999,6 +10712,57 @@ static void nvme_class_init(ObjectClass *oc, void *data)
     dc->vmsd = &nvme_vmstate;
 }
 
+static char *nvme_get_lat_profile(Object *obj, Error **errp)
+{
+    NvmeCtrl *n = NVME(obj);
+
+    return g_strdup(n->lat_profile ? n->lat_profile : "");
+}
+
+/* also reachable at runtime through qom-set */
+static void nvme_set_lat_profile(Object *obj, const char *value, Error **errp)
+{
+    NvmeCtrl *n = NVME(obj);
+    NvmeLatRule *rules;
+    uint32_t nr_rules;
+
+    if (nvme_parse_lat_profile(value, &rules, &nr_rules, errp)) {
+        return;
+    }
+
+    g_free(n->lat_rules);
+    g_free(n->lat_profile);
+    n->lat_rules = rules;
+    n->nr_lat_rules = nr_rules;
+    n->lat_profile = g_strdup(value);
+    n->lat_rng = n->lat_seed ? n->lat_seed : 1;
+}
+
+static bool nvme_get_ana_optimized(Object *obj, Error **errp)
+{
+    return NVME(obj)->ana_optimized;
+}
+
+/* changing it on a running controller (qom-set) is an ANA change */
+static void nvme_set_ana_optimized(Object *obj, bool value, Error **errp)
+{
+    NvmeCtrl *n = NVME(obj);
+
+    if (n->ana_optimized == value) {
+        return;
+    }
+    n->ana_optimized = value;
+    if (!DEVICE(obj)->realized || !n->subsys) {
+        return;
+    }
+
+    n->ana_chgcnt++;
+    if (n->aer_cfg & NVME_AEC_ANA_CHANGE) {
+        nvme_enqueue_event(n, NVME_AER_TYPE_NOTICE,
+                           NVME_AER_INFO_NOTICE_ANA_CHANGE, NVME_LOG_ANA);
+    }
+}
+
 static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
@@ -2006,6 +10770,11 @@ static void nvme_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
+    object_property_add_str(obj, "latency_profile", nvme_get_lat_profile,
+                            nvme_set_lat_profile, &error_abort);
+    s->ana_optimized = true;
+    object_property_add_bool(obj, "ana_optimized", nvme_get_ana_optimized,
+                             nvme_set_ana_optimized, &error_abort);
 }
 
 static const TypeInfo nvme_info = {
@@ -2020,9 +10789,31 @@ static const TypeInfo nvme_info = {
     },
 };
 
+static Property nvme_subsys_props[] = {
+    DEFINE_PROP_STRING("nqn", NvmeSubsys, nqn),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void nvme_subsys_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->desc = "Virtual NVM Subsystem";
+    dc->props = nvme_subsys_props;
+}
+
+static const TypeInfo nvme_subsys_info = {
+    .name          = TYPE_NVME_SUBSYS,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(NvmeSubsys),
+    .class_init    = nvme_subsys_class_init,
+};
+
 static void nvme_register_types(void)
 {
     type_register_static(&nvme_info);
+    type_register_static(&nvme_subsys_info);
 }
 
 type_init(nvme_register_types)
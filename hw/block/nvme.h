@@ -7,16 +7,47 @@ typedef struct NvmeAsyncEvent {
     NvmeAerResult result;
 } NvmeAsyncEvent;
 
+#define NVME_AERL               3   /* 0's based, as reported in Identify */
+#define NVME_MAX_AER_QUEUED     64
+
 typedef struct NvmeRequest {
     struct NvmeSQueue       *sq;
     BlockAIOCB              *aiocb;
     uint16_t                status;
     bool                    has_sg;
+    int64_t                 expire_ns;      /* earliest completion time */
+    bool                    delayed;        /* on delayed_reqs until then */
+    uint8_t                 ruh;            /* placement handle of a write */
+    uint64_t                wc_offset;      /* byte range of a request that */
+    uint32_t                wc_len;         /* waits for a device cache */
+    uint64_t                wc_seq;         /* flush waiting for write-back */
+    uint64_t                lock_slba;      /* LBA range the command holds */
+    uint64_t                lock_nlb;       /* while in flight, 0 for none */
+    bool                    lock_excl;
+    bool                    locked;
+    struct NvmeRequest      *lock_left;     /* in the treap of held ranges */
+    struct NvmeRequest      *lock_right;
+    uint32_t                lock_prio;
+    uint64_t                lock_max;       /* greatest end in the subtree */
+    uint64_t                lock_max_excl;  /* of the exclusive ranges */
+    struct NvmeRequest      *fused;         /* other half of a fused pair */
+    bool                    journaled;      /* atomic write, see nvme_journal */
+    bool                    merged;         /* issued with its neighbours */
+    uint8_t                 *md;            /* metadata, see nvme_rw_md_aio */
+    int64_t                 md_offset;
+    size_t                  md_len;         /* 0 without metadata */
     NvmeCqe                 cqe;
+    NvmeCmd                 cmd;
     BlockAcctCookie         acct;
     QEMUSGList              qsg;
     QEMUIOVector            iov;
+    QEMUIOVector            md_iov;
     QTAILQ_ENTRY(NvmeRequest)entry;
+    QTAILQ_ENTRY(NvmeRequest)delay_entry;
+    QTAILQ_ENTRY(NvmeRequest)wc_entry;
+    QTAILQ_ENTRY(NvmeRequest)lock_entry;
+    QTAILQ_ENTRY(NvmeRequest)merge_entry;
+    QTAILQ_ENTRY(NvmeRequest)flush_entry;
 } NvmeRequest;
 
 typedef struct NvmeSQueue {
@@ -31,6 +62,9 @@ typedef struct NvmeSQueue {
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
+    QTAILQ_HEAD(, NvmeRequest) replay_list;
+    GHashTable  *cids;          /* requests in flight, by CID */
+    NvmeRequest *fused;         /* Compare waiting for the Write fused to it */
     QTAILQ_ENTRY(NvmeSQueue) entry;
 } NvmeSQueue;
 
@@ -49,18 +83,465 @@ typedef struct NvmeCQueue {
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
 
+typedef struct NvmeZone {
+    uint8_t     zs;
+    uint64_t    zslba;
+    uint64_t    zcap;
+    uint64_t    wp;
+    QTAILQ_ENTRY(NvmeZone) entry;
+} NvmeZone;
+
+/*
+ * Zone state of a zoned namespace is kept in a metadata region at the end
+ * of the backing image: this header, followed by one NvmeZoneDescr per zone.
+ */
+#define NVME_ZONE_META_MAGIC    0x31534e5a454d564eULL /* "NVMEZNS1" */
+#define NVME_ZONE_META_HDR_SIZE 4096
+
+typedef struct NvmeZoneMetaHdr {
+    uint64_t    magic;
+    uint32_t    num_zones;
+    uint8_t     lbads;
+    uint8_t     rsvd13[3];
+    uint64_t    zone_size;
+} NvmeZoneMetaHdr;
+
+/*
+ * Writes of up to atomic_size bytes go through a journal at the end of the
+ * backing image, so that a crash can't tear them. Each namespace has
+ * NVME_JOURNAL_SLOTS slots of this header followed by the data; a slot
+ * whose CRC matches is written again when the device comes up.
+ */
+#define NVME_JOURNAL_MAGIC      0x314e524a454d564eULL /* "NVMEJRN1" */
+#define NVME_JOURNAL_HDR_SIZE   4096
+#define NVME_JOURNAL_SLOTS      8
+
+typedef struct NvmeJournalHdr {
+    uint64_t    magic;
+    uint64_t    offset;         /* where the data goes, in bytes */
+    uint32_t    len;
+    uint32_t    crc;            /* CRC32C of the data */
+} NvmeJournalHdr;
+
+/*
+ * The LBA format and PI type Format NVM last chose for a namespace, in a
+ * header at the very end of the backing image so that they outlive the
+ * device. A namespace without one starts out in lbaf and pi.
+ */
+#define NVME_FMT_MAGIC          0x31544d46454d564eULL /* "NVMEFMT1" */
+#define NVME_FMT_HDR_SIZE       4096
+
+typedef struct NvmeFmtHdr {
+    uint64_t    magic;
+    uint8_t     flbas;
+    uint8_t     dps;
+    uint8_t     rsvd10[6];
+} NvmeFmtHdr;
+
+#define NVME_RA_STREAMS 8
+
+/* a sequential reader detected within a namespace */
+typedef struct NvmeRaStream {
+    uint64_t    next;           /* byte offset the stream continues at */
+    uint64_t    ra_end;         /* read-ahead has been issued up to here */
+    uint64_t    last_use;
+    uint32_t    run;            /* sequential reads so far */
+    uint32_t    depth;          /* read-ahead window, in segments */
+    uint32_t    hits;
+    uint32_t    misses;
+    uint32_t    wasted;         /* segments evicted without being read */
+} NvmeRaStream;
+
+/* LBA formats every namespace offers, selected with the lbaf property */
+enum NvmeLbafIndex {
+    NVME_LBAF_512       = 0,
+    NVME_LBAF_4K        = 1,
+    NVME_LBAF_512_MD8   = 2,    /* with 8 bytes of metadata per LBA */
+    NVME_LBAF_4K_MD64   = 3,    /* with 64 */
+    NVME_NUM_LBAF,
+};
+
 typedef struct NvmeNamespace {
     NvmeIdNs        id_ns;
+    NvmeIdNsZoned   id_ns_zoned;
+
+    bool            zoned;
+    uint32_t        num_zones;
+    uint64_t        zone_size;          /* in LBAs */
+    uint64_t        zone_meta_offset;   /* in bytes */
+    uint64_t        md_offset;          /* of the metadata of LBA 0, bytes */
+    uint32_t        nr_open_zones;
+    uint32_t        nr_active_zones;
+    NvmeZone        *zones;
+    QTAILQ_HEAD(, NvmeZone) imp_open_zones;
+    uint32_t        zone_dirty_lo;      /* descriptors not written back, */
+    uint32_t        zone_dirty_hi;      /* none if lo > hi */
+    bool            zone_sync_inflight;
+    QTAILQ_HEAD(, NvmeRequest) zone_flushes;    /* waiting for them */
+    NvmeRaStream    ra_streams[NVME_RA_STREAMS];
+    NvmeRequest     *lock_root;         /* LBA ranges in use, a treap */
+    QTAILQ_HEAD(, NvmeRequest) lock_waiting;    /* in arrival order */
+    uint32_t        lock_seq;
+    uint64_t        journal_offset;     /* in bytes */
+    uint32_t        journal_busy;       /* slots in use, one bit each */
+    CoQueue         journal_waiters;
+    uint64_t        flush_gen;          /* bumped as writes complete */
+    uint64_t        flush_started;      /* flush_gen when it was issued */
+    bool            flush_inflight;
+    QTAILQ_HEAD(, NvmeRequest) flush_waiters;   /* of the flush in flight */
+    QTAILQ_HEAD(, NvmeRequest) flush_next;
 } NvmeNamespace;
 
+/* placement handles, handle 0 takes the writes that carry no directive */
+#define NVME_PLACEMENT_HANDLES  16
+
+typedef struct NvmeNandBlock {
+    uint32_t    valid;          /* number of valid pages */
+    uint32_t    wp;             /* next page to program */
+    uint32_t    erase_count;
+    uint32_t    ruh;            /* placement handle it was opened for */
+} NvmeNandBlock;
+
+typedef struct NvmeNandPlane {
+    int64_t     next_avail_ns;
+    uint32_t    active_blk[NVME_PLACEMENT_HANDLES];
+    uint32_t    nr_free;
+    uint32_t    *free_blks;
+} NvmeNandPlane;
+
+#define NVME_NAND_UNMAPPED  UINT32_MAX
+
+/* the L2P table is cached and placed in the HMB in 4 KiB pages */
+#define NVME_NAND_MAP_PAGE_SIZE     4096
+#define NVME_NAND_L2P_PER_PAGE      (NVME_NAND_MAP_PAGE_SIZE / sizeof(uint32_t))
+
+typedef struct NvmeNandMapSlot {
+    uint32_t    page;           /* L2P table page, or NVME_NAND_UNMAPPED */
+    bool        ref;
+    bool        dirty;
+} NvmeNandMapSlot;
+
+/*
+ * Optional NAND timing model with a page-mapping FTL. It is enabled by
+ * setting nand_channels; I/O completions are then held back until the
+ * simulated flash operations they caused have finished.
+ */
+typedef struct NvmeNand {
+    /* geometry and timing, set by properties */
+    uint32_t    channels;
+    uint32_t    dies;           /* per channel */
+    uint32_t    planes;         /* per die */
+    uint32_t    pages_per_block;
+    uint32_t    page_size;
+    uint32_t    op_pct;         /* over-provisioning in percent */
+    uint32_t    read_lat_us;
+    uint32_t    prog_lat_us;
+    uint32_t    erase_lat_us;
+    uint32_t    xfer_lat_us;    /* per page, channel bus */
+    uint32_t    pe_cycles;
+    uint64_t    map_cache_size; /* 0: the whole L2P table is in device DRAM */
+
+    /* FTL state */
+    uint32_t    nr_planes;
+    uint32_t    blocks_per_plane;
+    uint64_t    nr_lpns;
+    uint64_t    nr_ppns;
+    uint32_t    *l2p;
+    uint32_t    *p2l;
+    NvmeNandBlock *blocks;
+    NvmeNandPlane *plane;
+    int64_t     *chan_avail_ns;
+    uint32_t    next_stripe;
+
+    /* L2P table pages in the Host Memory Buffer, replacing l2p if set */
+    uint32_t    **l2p_pages;
+    dma_addr_t  *l2p_addrs;
+
+    /* mapping cache of a DRAM-less device, CLOCK replacement */
+    uint32_t    nr_map_pages;
+    uint32_t    nr_map_slots;
+    uint32_t    map_hand;
+    uint32_t    *map_slot;      /* table page -> slot, or NVME_NAND_UNMAPPED */
+    NvmeNandMapSlot *map_cache;
+
+    /* statistics, reported in the vendor log page */
+    uint64_t    host_pages_written;
+    uint64_t    nand_pages_written;
+    uint64_t    gc_pages_moved;
+    uint64_t    gc_blocks_erased;
+    uint64_t    total_erase_count;
+    uint64_t    map_cache_misses;
+    uint64_t    ruh_pages_written[NVME_PLACEMENT_HANDLES];
+} NvmeNand;
+
+/* Host Memory Buffer, as set up by Set Features (0Dh) */
+typedef struct NvmeHmb {
+    bool        enabled;
+    uint32_t    hsize;          /* in memory page size units */
+    uint64_t    list_addr;
+    uint32_t    nr_descrs;
+    NvmeHmbDescr *descrs;
+    void        **maps;         /* host mapping of each descriptor */
+    dma_addr_t  *map_lens;
+} NvmeHmb;
+
+typedef enum NvmeLatDist {
+    NVME_LAT_DIST_NONE,
+    NVME_LAT_DIST_NORMAL,
+    NVME_LAT_DIST_LOGNORMAL,
+    NVME_LAT_DIST_PARETO,
+} NvmeLatDist;
+
+/*
+ * One rule of the latency injection profile. Rules are matched against the
+ * opcode and namespace of completed I/O commands in the order given.
+ */
+typedef struct NvmeLatRule {
+    int         opcode;         /* -1 matches any opcode */
+    uint32_t    nsid;           /* 0 matches any namespace */
+    double      fixed_us;
+    NvmeLatDist dist;
+    double      mean_us;        /* normal */
+    double      stddev_us;
+    double      mu;             /* lognormal, parameters of ln(us) */
+    double      sigma;
+    double      scale_us;       /* pareto */
+    double      alpha;
+    uint64_t    bw_bps;         /* 0 means no bandwidth cap */
+    uint32_t    stall_period_ms;
+    uint32_t    stall_ms;
+    int64_t     bw_avail_ns;    /* when the capped link is free again */
+} NvmeLatRule;
+
+#define NVME_WCACHE_PAGE_SIZE   4096
+#define NVME_WCACHE_SECTORS     (NVME_WCACHE_PAGE_SIZE >> BDRV_SECTOR_BITS)
+
+typedef struct NvmeWCachePage {
+    uint64_t    index;          /* byte offset / NVME_WCACHE_PAGE_SIZE */
+    uint64_t    seq;            /* write sequence when it became dirty */
+    uint8_t     valid;          /* sectors holding data, one bit each */
+    uint8_t     dirty;          /* sectors not yet written back */
+    uint8_t     ruh;            /* placement handle of the last write */
+    uint16_t    wb;             /* write-backs in flight */
+    uint32_t    refs;           /* reads in flight */
+    uint8_t     *data;
+    QTAILQ_ENTRY(NvmeWCachePage) lru_entry;
+    QTAILQ_ENTRY(NvmeWCachePage) dirty_entry;
+} NvmeWCachePage;
+
+/*
+ * Volatile write-back cache. Writes complete once copied into cache pages;
+ * dirty pages are written back oldest first, each write-back extended into
+ * the longest run of contiguous dirty sectors. Clean pages are evicted in
+ * LRU order when room is needed.
+ */
+typedef struct NvmeWCache {
+    uint64_t    size;           /* property, 0 disables the cache */
+    bool        enabled;        /* Volatile Write Cache feature */
+    bool        idle;           /* no writes lately, write everything back */
+    bool        err;            /* a write-back failed since the last flush */
+    uint32_t    max_pages;
+    uint32_t    nr_pages;
+    uint32_t    nr_dirty;
+    uint32_t    nr_ops;
+    uint32_t    max_xfer;       /* MDTS in bytes */
+    uint64_t    seq;
+    GHashTable  *pages;
+    QEMUTimer   *timer;
+    QTAILQ_HEAD(, NvmeWCachePage) lru;
+    QTAILQ_HEAD(, NvmeWCachePage) dirty;
+    QTAILQ_HEAD(, NvmeWCacheOp) ops;
+    QTAILQ_HEAD(, NvmeRequest) waiting;
+    QTAILQ_HEAD(, NvmeRequest) flushes;
+} NvmeWCache;
+
+#define NVME_RA_SEG_SIZE    (128 * KiB)
+
+typedef struct NvmeRaSeg {
+    struct NvmeCtrl *ctrl;
+    uint64_t    index;          /* byte offset / NVME_RA_SEG_SIZE */
+    uint32_t    len;
+    bool        ready;
+    bool        stale;          /* overwritten while being read */
+    bool        used;
+    NvmeRaStream *stream;       /* for feedback on the read-ahead depth */
+    uint8_t     *data;
+    QEMUIOVector iov;
+    QTAILQ_HEAD(, NvmeRequest) waiters;
+    QTAILQ_ENTRY(NvmeRaSeg) lru_entry;
+} NvmeRaSeg;
+
+/*
+ * Read-ahead cache. Ready segments are kept in LRU order; segments still
+ * being read are only in the hash table, with reads waiting for them.
+ */
+typedef struct NvmeRaCache {
+    uint64_t    size;           /* property, 0 disables read-ahead */
+    uint64_t    dev_size;
+    uint32_t    max_segs;
+    uint32_t    nr_segs;
+    uint32_t    max_depth;
+    uint64_t    clock;
+    GHashTable  *segs;
+    QTAILQ_HEAD(, NvmeRaSeg) lru;
+} NvmeRaCache;
+
+/*
+ * Merge window. Reads or writes that continue each other wait here for up
+ * to window_us, and are then issued as one request.
+ */
+typedef struct NvmeMerge {
+    uint32_t    window_us;      /* property, 0 disables merging */
+    QEMUTimer   *timer;
+    QTAILQ_HEAD(, NvmeRequest) reqs;
+    uint32_t    nr_reqs;
+    uint32_t    nsid;
+    bool        is_write;
+    uint64_t    offset;         /* in bytes */
+    uint64_t    len;
+    int         nsg;
+} NvmeMerge;
+
+/* Streams directive state of one namespace */
+typedef struct NvmeNsStreams {
+    bool        enabled;
+    uint16_t    nsa;            /* streams allocated to the namespace */
+} NvmeNsStreams;
+
+/*
+ * Write placement. Open streams of the Streams directive, or the reclaim
+ * unit handles of Flexible Data Placement, each map to a placement handle;
+ * with the NAND model every handle programs its own open blocks, so data
+ * with different lifetimes does not share erase blocks.
+ */
+typedef struct NvmePlacement {
+    uint16_t    streams;        /* property, MSL; 0 disables Streams */
+    uint16_t    fdp_nruh;       /* property, 0 disables FDP */
+    uint16_t    nr_handles;
+    uint16_t    nr_allocated;   /* streams allocated to namespaces */
+    NvmeNsStreams *ns;          /* indexed by NSID - 1 */
+    uint32_t    stream_nsid[NVME_PLACEMENT_HANDLES];  /* 0: handle is free */
+    uint16_t    stream_id[NVME_PLACEMENT_HANDLES];
+    uint64_t    host_bytes[NVME_PLACEMENT_HANDLES];
+} NvmePlacement;
+
+/*
+ * Predictable Latency Mode of NVM Set 1, the set holding the namespace.
+ * In a Deterministic Window garbage collection only keeps the normal NAND
+ * reserve and the write cache only destages when it has to; the work
+ * deferred is caught up with in the Non-Deterministic Window.
+ */
+typedef struct NvmePlm {
+    bool        supported;      /* property */
+    bool        enabled;        /* Predictable Latency Enable */
+    uint8_t     window;         /* NVME_PLM_WINDOW_DTWIN or _NDWIN */
+    bool        excursion;      /* GC had to run in the current DTWIN */
+    bool        aggregate;      /* set is in the event aggregate log */
+    uint16_t    ee;             /* Enable Event */
+    uint16_t    evt;            /* events since log 0Ah was last read */
+    uint16_t    warned;         /* warnings raised in the current DTWIN */
+    uint64_t    dtwinrt;        /* the host's warning thresholds */
+    uint64_t    dtwinwt;
+    uint64_t    dtwintt;
+    int64_t     dtwin_start_ns;
+    uint64_t    reads;          /* 4 KiB reads in the current DTWIN */
+    uint64_t    writes;         /* NAND pages written in the current DTWIN */
+    QEMUTimer   *timer;         /* ends the DTWIN */
+} NvmePlm;
+
+enum NvmeBgJobType {
+    NVME_BG_NONE,
+    NVME_BG_FORMAT,
+    NVME_BG_SANITIZE,
+    NVME_BG_SELF_TEST,
+};
+
+enum NvmeBgPhase {
+    NVME_BG_DISCARD,            /* deallocate the namespace */
+    NVME_BG_ZERO,               /* write zeroes */
+    NVME_BG_OVERWRITE,          /* write the overwrite pattern */
+    NVME_BG_MAP_CHECK,          /* self-test: L2P and P2L agree */
+    NVME_BG_VERIFY,             /* self-test: read the namespace */
+};
+
+/*
+ * A long-running admin operation: Format NVM, Sanitize or Device Self-test.
+ * It works through the namespace a chunk at a time from a timer, so that it
+ * is rate-limited against host I/O and a reset only has to wait for the
+ * chunk in flight. There is one job at a time.
+ */
+typedef struct NvmeBgJob {
+    uint8_t     type;
+    uint8_t     phase;
+    uint8_t     pass;           /* overwrite pass, 0's based */
+    uint8_t     passes;
+    uint32_t    cdw10;          /* of the command that started the job */
+    uint32_t    pattern;        /* Overwrite Pattern */
+    uint32_t    nsid;           /* self-test: 0 if no namespace is tested */
+    uint64_t    pos;            /* bytes done in this phase, LPNs in a check */
+    uint64_t    end;
+    uint64_t    len;            /* of the chunk in flight */
+    int64_t     next_ns;        /* earliest start of the next chunk */
+    bool        sanitize_failed;    /* in Sanitize failure mode */
+    bool        lbaf_changed;   /* Format switched LBA format or PI type */
+    NvmeRequest *req;           /* Format NVM, completed when the job is */
+    BlockAIOCB  *aiocb;
+    uint8_t     *buf;
+    QEMUIOVector iov;
+    QEMUTimer   *timer;
+} NvmeBgJob;
+
 #define TYPE_NVME "nvme"
 #define NVME(obj) \
         OBJECT_CHECK(NvmeCtrl, (obj), TYPE_NVME)
 
+#define TYPE_NVME_SUBSYS "nvme-subsys"
+#define NVME_SUBSYS(obj) \
+        OBJECT_CHECK(NvmeSubsys, (obj), TYPE_NVME_SUBSYS)
+
+#define NVME_SUBSYS_MAX_CTRLS   32
+
+/*
+ * An NVM subsystem joined by several controllers. The first controller to
+ * join brings the drive, and the namespaces on it are shared by all of them;
+ * the namespaces are freed when the last controller leaves.
+ */
+typedef struct NvmeSubsys {
+    DeviceState     parent_obj;
+    char            *nqn;
+    struct NvmeCtrl *ctrls[NVME_SUBSYS_MAX_CTRLS];  /* indexed by CNTLID */
+    NvmeNamespace   *namespaces;
+} NvmeSubsys;
+
+/*
+ * A primary controller's pools of flexible queue (VQ) and interrupt (VI)
+ * resources, which it hands out to its secondary controllers (VFs) with
+ * Virtualization Management. Its own num_queues are private resources.
+ */
+typedef struct NvmeSriov {
+    uint16_t        max_vfs;
+    uint16_t        vq_flexible;
+    uint16_t        vi_flexible;
+    uint16_t        max_vq_per_vf;
+    uint16_t        max_vi_per_vf;
+    struct NvmeCtrl **vfs;      /* indexed by VF number - 1 */
+} NvmeSriov;
+
+/* resources a VF got from its primary; admin queue and vector included */
+typedef struct NvmeSecCtrl {
+    uint16_t    vfn;            /* 0 once detached from the primary */
+    uint16_t    nvq;
+    uint16_t    nvi;
+    bool        online;
+} NvmeSecCtrl;
+
 typedef struct NvmeCtrl {
     PCIDevice    parent_obj;
     MemoryRegion iomem;
     MemoryRegion ctrl_mem;
+    MemoryRegion *cmb_mr;       /* ctrl_mem, or the region of cmb_memdev */
+    HostMemoryBackend *cmb_memdev;
+    HostMemoryBackend *pmrdev;
     NvmeBar      bar;
     BlockConf    conf;
 
@@ -81,17 +562,62 @@ typedef struct NvmeCtrl {
     uint64_t    irq_status;
     uint64_t    host_timestamp;                 /* Timestamp sent by the host */
     uint64_t    timestamp_set_qemu_clock_ms;    /* QEMU clock time */
+    uint8_t     lbaf;           /* LBA format the namespaces start out in */
+    uint8_t     pi;             /* and their protection information type */
+    bool        pil;            /* PI in the first 8 bytes of the metadata */
+    bool        zoned;
+    uint64_t    zone_size_bs;
+    uint32_t    max_open_zones;
+    uint32_t    max_active_zones;
 
     char            *serial;
+    NvmeSubsys      *subsys;
+    uint16_t        cntlid;
+    bool            ns_attached;    /* namespaces belong to another controller */
+    bool            ana_optimized;
+    struct NvmeCtrl *pf;            /* primary controller of a VF */
+    NvmeSriov       sriov;
+    NvmeSecCtrl     sec;
     NvmeNamespace   *namespaces;
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
+    NvmeIdCtrlZoned id_ctrl_zoned;
     NvmeSmartLog    smart;
     NvmeFwSlotInfoLog fw_slot_info;
+    NvmeSanitizeLog sanitize_log;
+    NvmeSelfTestLog self_test_log;
     NvmeErrorLog    error_info[NVME_NUM_ERROR_LOG];
+    uint16_t        temp_thresh_hi;
+    uint16_t        temp_thresh_low;
+    uint32_t        aer_cfg;        /* Asynchronous Event Configuration */
+    uint8_t         aer_mask;       /* types reported, log page not read yet */
+    uint8_t         outstanding_aers;
+    uint32_t        aer_queued;
+    NvmeRequest     *aer_reqs[NVME_AERL + 1];
+    QSIMPLEQ_HEAD(, NvmeAsyncEvent) aer_queue;
+    uint64_t        ana_chgcnt;
+    bool            ns_changed;     /* Changed Namespace List not read yet */
+    bool            copy_bounce;    /* the backend can't offload a Copy */
+    uint64_t        atomic_size;    /* AWUN and AWUPF, in bytes */
+    uint64_t        journal_size;   /* per namespace, in bytes */
+    NvmeNand        nand;
+    NvmePlacement   placement;
+    NvmePlm         plm;
+    NvmeBgJob       bg;
+    NvmeHmb         hmb;
+    NvmeWCache      wcache;
+    NvmeRaCache     ra;
+    NvmeMerge       merge;
+    QEMUTimer       *delay_timer;
+    QTAILQ_HEAD(, NvmeRequest) delayed_reqs;
+    char            *lat_profile;
+    NvmeLatRule     *lat_rules;
+    uint32_t        nr_lat_rules;
+    uint64_t        lat_seed;
+    uint64_t        lat_rng;
 } NvmeCtrl;
 
 #endif /* HW_NVME_H */
@@ -15,6 +15,14 @@ typedef struct NvmeBar {
     uint64_t    acq;
     uint32_t    cmbloc;
     uint32_t    cmbsz;
+    uint8_t     rsvd64[3520];
+    uint32_t    pmrcap;
+    uint32_t    pmrctl;
+    uint32_t    pmrsts;
+    uint32_t    pmrebs;
+    uint32_t    pmrswtp;
+    uint32_t    pmrmscl;
+    uint32_t    pmrmscu;
 } NvmeBar;
 
 enum NvmeCapShift {
@@ -27,6 +35,7 @@ enum NvmeCapShift {
     CAP_CSS_SHIFT      = 37,
     CAP_MPSMIN_SHIFT   = 48,
     CAP_MPSMAX_SHIFT   = 52,
+    CAP_PMRS_SHIFT     = 56,
 };
 
 enum NvmeCapMask {
@@ -39,6 +48,7 @@ enum NvmeCapMask {
     CAP_CSS_MASK       = 0xff,
     CAP_MPSMIN_MASK    = 0xf,
     CAP_MPSMAX_MASK    = 0xf,
+    CAP_PMRS_MASK      = 0x1,
 };
 
 #define NVME_CAP_MQES(cap)  (((cap) >> CAP_MQES_SHIFT)   & CAP_MQES_MASK)
@@ -50,6 +60,7 @@ enum NvmeCapMask {
 #define NVME_CAP_CSS(cap)   (((cap) >> CAP_CSS_SHIFT)    & CAP_CSS_MASK)
 #define NVME_CAP_MPSMIN(cap)(((cap) >> CAP_MPSMIN_SHIFT) & CAP_MPSMIN_MASK)
 #define NVME_CAP_MPSMAX(cap)(((cap) >> CAP_MPSMAX_SHIFT) & CAP_MPSMAX_MASK)
+#define NVME_CAP_PMRS(cap)  (((cap) >> CAP_PMRS_SHIFT)   & CAP_PMRS_MASK)
 
 #define NVME_CAP_SET_MQES(cap, val)   (cap |= (uint64_t)(val & CAP_MQES_MASK)  \
                                                            << CAP_MQES_SHIFT)
@@ -69,6 +80,13 @@ enum NvmeCapMask {
                                                            << CAP_MPSMIN_SHIFT)
 #define NVME_CAP_SET_MPSMAX(cap, val) (cap |= (uint64_t)(val & CAP_MPSMAX_MASK)\
                                                             << CAP_MPSMAX_SHIFT)
+#define NVME_CAP_SET_PMRS(cap, val)   (cap |= (uint64_t)(val & CAP_PMRS_MASK)  \
+                                                           << CAP_PMRS_SHIFT)
+
+enum NvmeCapCss {
+    NVME_CAP_CSS_NVM        = 1 << 0,
+    NVME_CAP_CSS_CSI        = 1 << 6,
+};
 
 enum NvmeCcShift {
     CC_EN_SHIFT     = 0,
@@ -205,6 +223,97 @@ enum NvmeCmbszMask {
 #define NVME_CMBSZ_GETSIZE(cmbsz) \
     (NVME_CMBSZ_SZ(cmbsz) * (1 << (12 + 4 * NVME_CMBSZ_SZU(cmbsz))))
 
+enum NvmePmrcapShift {
+    PMRCAP_RDS_SHIFT    = 3,
+    PMRCAP_WDS_SHIFT    = 4,
+    PMRCAP_BIR_SHIFT    = 5,
+    PMRCAP_PMRTU_SHIFT  = 8,
+    PMRCAP_PMRWBM_SHIFT = 10,
+    PMRCAP_PMRTO_SHIFT  = 16,
+    PMRCAP_CMSS_SHIFT   = 24,
+};
+
+enum NvmePmrcapMask {
+    PMRCAP_RDS_MASK    = 0x1,
+    PMRCAP_WDS_MASK    = 0x1,
+    PMRCAP_BIR_MASK    = 0x7,
+    PMRCAP_PMRTU_MASK  = 0x3,
+    PMRCAP_PMRWBM_MASK = 0xf,
+    PMRCAP_PMRTO_MASK  = 0xff,
+    PMRCAP_CMSS_MASK   = 0x1,
+};
+
+/* PMRWBM: a read of PMRSTS makes prior writes to the PMR persistent */
+#define NVME_PMRCAP_PMRWBM_RD_PMRSTS 0x2
+
+#define NVME_PMRCAP_RDS(pmrcap)    \
+    ((pmrcap >> PMRCAP_RDS_SHIFT)    & PMRCAP_RDS_MASK)
+#define NVME_PMRCAP_WDS(pmrcap)    \
+    ((pmrcap >> PMRCAP_WDS_SHIFT)    & PMRCAP_WDS_MASK)
+#define NVME_PMRCAP_BIR(pmrcap)    \
+    ((pmrcap >> PMRCAP_BIR_SHIFT)    & PMRCAP_BIR_MASK)
+#define NVME_PMRCAP_PMRTU(pmrcap)  \
+    ((pmrcap >> PMRCAP_PMRTU_SHIFT)  & PMRCAP_PMRTU_MASK)
+#define NVME_PMRCAP_PMRWBM(pmrcap) \
+    ((pmrcap >> PMRCAP_PMRWBM_SHIFT) & PMRCAP_PMRWBM_MASK)
+#define NVME_PMRCAP_PMRTO(pmrcap)  \
+    ((pmrcap >> PMRCAP_PMRTO_SHIFT)  & PMRCAP_PMRTO_MASK)
+#define NVME_PMRCAP_CMSS(pmrcap)   \
+    ((pmrcap >> PMRCAP_CMSS_SHIFT)   & PMRCAP_CMSS_MASK)
+
+#define NVME_PMRCAP_SET_RDS(pmrcap, val)    \
+    (pmrcap |= (uint64_t)(val & PMRCAP_RDS_MASK) << PMRCAP_RDS_SHIFT)
+#define NVME_PMRCAP_SET_WDS(pmrcap, val)    \
+    (pmrcap |= (uint64_t)(val & PMRCAP_WDS_MASK) << PMRCAP_WDS_SHIFT)
+#define NVME_PMRCAP_SET_BIR(pmrcap, val)    \
+    (pmrcap |= (uint64_t)(val & PMRCAP_BIR_MASK) << PMRCAP_BIR_SHIFT)
+#define NVME_PMRCAP_SET_PMRTU(pmrcap, val)  \
+    (pmrcap |= (uint64_t)(val & PMRCAP_PMRTU_MASK) << PMRCAP_PMRTU_SHIFT)
+#define NVME_PMRCAP_SET_PMRWBM(pmrcap, val) \
+    (pmrcap |= (uint64_t)(val & PMRCAP_PMRWBM_MASK) << PMRCAP_PMRWBM_SHIFT)
+#define NVME_PMRCAP_SET_PMRTO(pmrcap, val)  \
+    (pmrcap |= (uint64_t)(val & PMRCAP_PMRTO_MASK) << PMRCAP_PMRTO_SHIFT)
+#define NVME_PMRCAP_SET_CMSS(pmrcap, val)   \
+    (pmrcap |= (uint64_t)(val & PMRCAP_CMSS_MASK) << PMRCAP_CMSS_SHIFT)
+
+enum NvmePmrctlShift {
+    PMRCTL_EN_SHIFT   = 0,
+};
+
+enum NvmePmrctlMask {
+    PMRCTL_EN_MASK   = 0x1,
+};
+
+#define NVME_PMRCTL_EN(pmrctl)  ((pmrctl >> PMRCTL_EN_SHIFT)   & PMRCTL_EN_MASK)
+
+enum NvmePmrstsShift {
+    PMRSTS_ERR_SHIFT  = 0,
+    PMRSTS_NRDY_SHIFT = 8,
+    PMRSTS_HSTS_SHIFT = 9,
+    PMRSTS_CBAI_SHIFT = 12,
+};
+
+enum NvmePmrstsMask {
+    PMRSTS_ERR_MASK  = 0xff,
+    PMRSTS_NRDY_MASK = 0x1,
+    PMRSTS_HSTS_MASK = 0x7,
+    PMRSTS_CBAI_MASK = 0x1,
+};
+
+#define NVME_PMRSTS_ERR(pmrsts)  ((pmrsts >> PMRSTS_ERR_SHIFT)  & \
+                                  PMRSTS_ERR_MASK)
+#define NVME_PMRSTS_NRDY(pmrsts) ((pmrsts >> PMRSTS_NRDY_SHIFT) & \
+                                  PMRSTS_NRDY_MASK)
+#define NVME_PMRSTS_HSTS(pmrsts) ((pmrsts >> PMRSTS_HSTS_SHIFT) & \
+                                  PMRSTS_HSTS_MASK)
+#define NVME_PMRSTS_CBAI(pmrsts) ((pmrsts >> PMRSTS_CBAI_SHIFT) & \
+                                  PMRSTS_CBAI_MASK)
+
+#define NVME_PMRSTS_SET_NRDY(pmrsts, val) \
+    (pmrsts |= (uint64_t)(val & PMRSTS_NRDY_MASK) << PMRSTS_NRDY_SHIFT)
+
+#define NVME_NSID_BROADCAST 0xffffffff
+
 typedef struct NvmeCmd {
     uint8_t     opcode;
     uint8_t     fuse;
@@ -222,6 +331,13 @@ typedef struct NvmeCmd {
     uint32_t    cdw15;
 } NvmeCmd;
 
+enum NvmeCmdFuse {
+    NVME_FUSE_FIRST     = 1,
+    NVME_FUSE_SECOND    = 2,
+};
+
+#define NVME_CMD_FUSE(fuse)     ((fuse) & 0x3)
+
 enum NvmeAdminCommands {
     NVME_ADM_CMD_DELETE_SQ      = 0x00,
     NVME_ADM_CMD_CREATE_SQ      = 0x01,
@@ -236,10 +352,15 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_NS_MGMT        = 0x0d,
     NVME_ADM_CMD_ACTIVATE_FW    = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW    = 0x11,
+    NVME_ADM_CMD_DEV_SELF_TEST  = 0x14,
     NVME_ADM_CMD_NS_ATTACH      = 0x15,
+    NVME_ADM_CMD_DIRECTIVE_SEND = 0x19,
+    NVME_ADM_CMD_DIRECTIVE_RECV = 0x1a,
+    NVME_ADM_CMD_VIRT_MNGMT     = 0x1c,
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
+    NVME_ADM_CMD_SANITIZE       = 0x84,
 };
 
 enum NvmeIoCommands {
@@ -254,6 +375,10 @@ enum NvmeIoCommands {
     NVME_CMD_RESV_REPORT        = 0x0e,
     NVME_CMD_RESV_ACQUIRE       = 0x11,
     NVME_CMD_RESV_RELEASE       = 0x15,
+    NVME_CMD_COPY               = 0x19,
+    NVME_CMD_ZONE_MGMT_SEND     = 0x79,
+    NVME_CMD_ZONE_MGMT_RECV     = 0x7a,
+    NVME_CMD_ZONE_APPEND        = 0x7d,
 };
 
 typedef struct NvmeDeleteQ {
@@ -317,9 +442,42 @@ typedef struct NvmeIdentify {
     uint64_t    prp1;
     uint64_t    prp2;
     uint32_t    cns;
-    uint32_t    rsvd11[5];
+    uint16_t    nvmsetid;
+    uint8_t     rsvd11;
+    uint8_t     csi;
+    uint32_t    rsvd12[4];
 } NvmeIdentify;
 
+enum NvmeIdCns {
+    NVME_ID_CNS_NS              = 0x00,
+    NVME_ID_CNS_CTRL            = 0x01,
+    NVME_ID_CNS_NS_ACTIVE_LIST  = 0x02,
+    NVME_ID_CNS_NS_DESCR_LIST   = 0x03,
+    NVME_ID_CNS_NVM_SET_LIST    = 0x04,
+    NVME_ID_CNS_CS_NS           = 0x05,
+    NVME_ID_CNS_CS_CTRL         = 0x06,
+    NVME_ID_CNS_PRIMARY_CTRL_CAP    = 0x14,
+    NVME_ID_CNS_SECONDARY_CTRL_LIST = 0x15,
+};
+
+enum NvmeCsi {
+    NVME_CSI_NVM                = 0x00,
+    NVME_CSI_ZONED              = 0x02,
+};
+
+typedef struct NvmeIdNsDescr {
+    uint8_t     nidt;
+    uint8_t     nidl;
+    uint8_t     rsvd2[2];
+} NvmeIdNsDescr;
+
+enum NvmeIdNsDescrType {
+    NVME_NIDT_EUI64             = 0x01,
+    NVME_NIDT_NGUID             = 0x02,
+    NVME_NIDT_UUID              = 0x03,
+    NVME_NIDT_CSI               = 0x04,
+};
+
 typedef struct NvmeRwCmd {
     uint8_t     opcode;
     uint8_t     flags;
@@ -360,8 +518,146 @@ enum {
     NVME_RW_PRINFO_PRCHK_GUARD  = 1 << 12,
     NVME_RW_PRINFO_PRCHK_APP    = 1 << 11,
     NVME_RW_PRINFO_PRCHK_REF    = 1 << 10,
+    NVME_RW_PRINFO_PRCHK_MASK   = 7 << 10,
 };
 
+/* Directive Type and Directive Specific of Write, in CDW12 and CDW13 */
+#define NVME_RW_DTYPE(control)  (((control) >> 4) & 0xf)
+#define NVME_RW_DSPEC(dsmgmt)   ((dsmgmt) >> 16)
+
+enum NvmeDirectiveTypes {
+    NVME_DIRECTIVE_IDENTIFY         = 0x0,
+    NVME_DIRECTIVE_STREAMS          = 0x1,
+    NVME_DIRECTIVE_DATA_PLACEMENT   = 0x2,
+};
+
+enum NvmeDirectiveOperations {
+    NVME_DIR_SND_ID_OP_ENABLE       = 0x1,
+    NVME_DIR_SND_ST_OP_REL_ID       = 0x1,
+    NVME_DIR_SND_ST_OP_REL_RSC      = 0x2,
+    NVME_DIR_RCV_ID_OP_PARAM        = 0x1,
+    NVME_DIR_RCV_ST_OP_PARAM        = 0x1,
+    NVME_DIR_RCV_ST_OP_STATUS       = 0x2,
+    NVME_DIR_RCV_ST_OP_RESOURCE     = 0x3,
+};
+
+/* CDW11 of Directive Send and Directive Receive */
+#define NVME_DIR_DOPER(dw11)    ((dw11) & 0xff)
+#define NVME_DIR_DTYPE(dw11)    (((dw11) >> 8) & 0xff)
+#define NVME_DIR_DSPEC(dw11)    ((dw11) >> 16)
+
+/* CDW12 of Enable Directive */
+#define NVME_DIR_ENDIR(dw12)    ((dw12) & 0x1)
+#define NVME_DIR_TDTYPE(dw12)   (((dw12) >> 8) & 0xff)
+
+typedef struct NvmeDirectiveIdentify {
+    uint8_t     supported[32];
+    uint8_t     enabled[32];
+    uint8_t     persistent[32];
+    uint8_t     rsvd96[4000];
+} NvmeDirectiveIdentify;
+
+typedef struct NvmeStreamsParams {
+    uint16_t    msl;
+    uint16_t    nssa;
+    uint16_t    nsso;
+    uint8_t     nssc;
+    uint8_t     rsvd7[9];
+    uint32_t    sws;
+    uint16_t    sgs;
+    uint16_t    nsa;
+    uint16_t    nso;
+    uint8_t     rsvd26[6];
+} NvmeStreamsParams;
+
+typedef struct NvmeZoneSendCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint32_t    rsvd2[4];
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    slba;
+    uint32_t    rsvd12;
+    uint8_t     zsa;
+    uint8_t     zsflags;
+    uint8_t     rsvd13[2];
+    uint32_t    rsvd14[2];
+} NvmeZoneSendCmd;
+
+enum NvmeZoneSendAction {
+    NVME_ZONE_ACTION_CLOSE      = 0x01,
+    NVME_ZONE_ACTION_FINISH     = 0x02,
+    NVME_ZONE_ACTION_OPEN       = 0x03,
+    NVME_ZONE_ACTION_RESET      = 0x04,
+    NVME_ZONE_ACTION_OFFLINE    = 0x05,
+};
+
+#define NVME_ZONE_SEND_SELECT_ALL(zsflags) ((zsflags) & 0x1)
+
+typedef struct NvmeZoneRecvCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint32_t    rsvd2[4];
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    slba;
+    uint32_t    numd;
+    uint8_t     zra;
+    uint8_t     zrasf;
+    uint8_t     pr;
+    uint8_t     rsvd13;
+    uint32_t    rsvd14[2];
+} NvmeZoneRecvCmd;
+
+enum NvmeZoneRecvAction {
+    NVME_ZONE_REPORT            = 0x00,
+};
+
+enum NvmeZoneReportFilter {
+    NVME_ZONE_REPORT_ALL        = 0x00,
+    NVME_ZONE_REPORT_EMPTY      = 0x01,
+    NVME_ZONE_REPORT_IMP_OPEN   = 0x02,
+    NVME_ZONE_REPORT_EXP_OPEN   = 0x03,
+    NVME_ZONE_REPORT_CLOSED     = 0x04,
+    NVME_ZONE_REPORT_FULL       = 0x05,
+    NVME_ZONE_REPORT_READ_ONLY  = 0x06,
+    NVME_ZONE_REPORT_OFFLINE    = 0x07,
+};
+
+enum NvmeZoneType {
+    NVME_ZONE_TYPE_SEQ_WRITE    = 0x02,
+};
+
+enum NvmeZoneState {
+    NVME_ZONE_STATE_EMPTY       = 0x01,
+    NVME_ZONE_STATE_IMP_OPEN    = 0x02,
+    NVME_ZONE_STATE_EXP_OPEN    = 0x03,
+    NVME_ZONE_STATE_CLOSED      = 0x04,
+    NVME_ZONE_STATE_READ_ONLY   = 0x0d,
+    NVME_ZONE_STATE_FULL        = 0x0e,
+    NVME_ZONE_STATE_OFFLINE     = 0x0f,
+};
+
+typedef struct NvmeZoneDescr {
+    uint8_t     zt;
+    uint8_t     zs;     // [7:4] Zone State
+    uint8_t     za;
+    uint8_t     rsvd3[5];
+    uint64_t    zcap;
+    uint64_t    zslba;
+    uint64_t    wp;
+    uint8_t     rsvd32[32];
+} NvmeZoneDescr;
+
+typedef struct NvmeZoneReportHdr {
+    uint64_t    nr_zones;
+    uint8_t     rsvd8[56];
+} NvmeZoneReportHdr;
+
 typedef struct NvmeDsmCmd {
     uint8_t     opcode;
     uint8_t     flags;
@@ -387,11 +683,54 @@ typedef struct NvmeDsmRange {
     uint64_t    slba;
 } NvmeDsmRange;
 
+enum NvmeDsmCattr {
+    NVME_DSM_CATTR_AF_MASK  = 0xf,
+    NVME_DSM_CATTR_SR       = 1 << 8,   /* sequential read range */
+    NVME_DSM_CATTR_SW       = 1 << 9,   /* sequential write range */
+    NVME_DSM_CATTR_WP       = 1 << 10,  /* write prepare */
+};
+
 #define NVME_NUM_MAX_DSM_RANGES (256)
 
+/* control, dsmgmt and the tags are laid out as in NvmeRwCmd */
+typedef struct NvmeCopyCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2;
+    uint64_t    rsvd4;
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    sdlba;
+    uint8_t     nr;
+    uint8_t     format;
+    uint16_t    control;
+    uint32_t    dsmgmt;
+    uint32_t    reftag;
+    uint16_t    apptag;
+    uint16_t    appmask;
+} NvmeCopyCmd;
+
+#define NVME_COPY_DESFMT(format)    ((format) & 0xf)
+/* PRINFOR, shifted to match NVME_RW_PRINFO_* */
+#define NVME_COPY_PRINFOR(format)   (((format) >> 4) << 10)
+
+typedef struct NvmeCopySourceRange {
+    uint8_t     rsvd0[8];
+    uint64_t    slba;
+    uint16_t    nlb;
+    uint8_t     rsvd18[2];
+    uint32_t    reftag;
+    uint16_t    apptag;
+    uint16_t    appmask;
+    uint8_t     rsvd28[4];
+} NvmeCopySourceRange;
+
 enum NvmeAsyncEventRequest {
     NVME_AER_TYPE_ERROR                     = 0,
     NVME_AER_TYPE_SMART                     = 1,
+    NVME_AER_TYPE_NOTICE                    = 2,
     NVME_AER_TYPE_IO_SPECIFIC               = 6,
     NVME_AER_TYPE_VENDOR_SPECIFIC           = 7,
     NVME_AER_INFO_ERR_INVALID_SQ            = 0,
@@ -403,6 +742,27 @@ enum NvmeAsyncEventRequest {
     NVME_AER_INFO_SMART_RELIABILITY         = 0,
     NVME_AER_INFO_SMART_TEMP_THRESH         = 1,
     NVME_AER_INFO_SMART_SPARE_THRESH        = 2,
+    NVME_AER_INFO_NOTICE_NS_ATTR            = 0,
+    NVME_AER_INFO_NOTICE_ANA_CHANGE         = 3,
+    NVME_AER_INFO_NOTICE_PLM_EVENT          = 4,
+    NVME_AER_INFO_IO_SANITIZE_COMPLETED     = 1,
+};
+
+/* Asynchronous Event Configuration (feature 0Bh) and OAES */
+enum NvmeAsyncEventConfig {
+    NVME_AEC_SMART_MASK     = 0xff,     /* one bit per critical warning */
+    NVME_AEC_NS_ATTR        = 1 << 8,
+    NVME_AEC_ANA_CHANGE     = 1 << 11,
+    NVME_AEC_PLM_EVENT      = 1 << 12,
+};
+
+#define NVME_TEMP_TMPTH(dw11)   ((dw11) & 0xffff)
+#define NVME_TEMP_TMPSEL(dw11)  (((dw11) >> 16) & 0xf)
+#define NVME_TEMP_THSEL(dw11)   (((dw11) >> 20) & 0x3)
+
+enum NvmeTempThsel {
+    NVME_TEMP_THSEL_OVER    = 0,
+    NVME_TEMP_THSEL_UNDER   = 1,
 };
 
 typedef struct NvmeAerResult {
@@ -435,10 +795,13 @@ enum NvmeStatusCodes {
     NVME_CMD_ABORT_MISSING_FUSE = 0x000a,
     NVME_INVALID_NSID           = 0x000b,
     NVME_CMD_SEQ_ERROR          = 0x000c,
+    NVME_SANITIZE_FAILED        = 0x001c,
+    NVME_SANITIZE_IN_PROGRESS   = 0x001d,
     NVME_LBA_RANGE              = 0x0080,
     NVME_CAP_EXCEEDED           = 0x0081,
     NVME_NS_NOT_READY           = 0x0082,
     NVME_NS_RESV_CONFLICT       = 0x0083,
+    NVME_FORMAT_IN_PROGRESS     = 0x0084,
     NVME_INVALID_CQID           = 0x0100,
     NVME_INVALID_QID            = 0x0101,
     NVME_MAX_QSIZE_EXCEEDED     = 0x0102,
@@ -455,9 +818,24 @@ enum NvmeStatusCodes {
     NVME_FID_NOT_SAVEABLE       = 0x010d,
     NVME_FID_NOT_NSID_SPEC      = 0x010f,
     NVME_FW_REQ_SUSYSTEM_RESET  = 0x0110,
+    NVME_DST_IN_PROGRESS        = 0x011d,
+    NVME_INVALID_CTRL_ID        = 0x011f,
+    NVME_INVALID_SEC_CTRL_STATE = 0x0120,
+    NVME_INVALID_NUM_RESOURCES  = 0x0121,
+    NVME_INVALID_RESOURCE_ID    = 0x0122,
+    NVME_STREAM_RSC_ALLOC_FAIL  = 0x017f,
     NVME_CONFLICTING_ATTRS      = 0x0180,
     NVME_INVALID_PROT_INFO      = 0x0181,
     NVME_WRITE_TO_RO            = 0x0182,
+    NVME_CMD_SIZE_LIMIT         = 0x0183,
+    NVME_ZONE_BOUNDARY_ERROR    = 0x01b8,
+    NVME_ZONE_FULL              = 0x01b9,
+    NVME_ZONE_READ_ONLY         = 0x01ba,
+    NVME_ZONE_OFFLINE           = 0x01bb,
+    NVME_ZONE_INVALID_WRITE     = 0x01bc,
+    NVME_ZONE_TOO_MANY_ACTIVE   = 0x01bd,
+    NVME_ZONE_TOO_MANY_OPEN     = 0x01be,
+    NVME_ZONE_INVAL_TRANSITION  = 0x01bf,
     NVME_WRITE_FAULT            = 0x0280,
     NVME_UNRECOVERED_READ       = 0x0281,
     NVME_E2E_GUARD_ERROR        = 0x0282,
@@ -480,7 +858,7 @@ typedef struct NvmeGetLogPageCmd {
     uint64_t    prp1;
     uint64_t    prp2;
     uint8_t     lid;   // CDW10[ 7: 0]
-    uint8_t     res2;  // CDW10[15: 8]
+    uint8_t     res2;  // CDW10[15: 8], LSP in [11:8] and RAE in bit 15
     uint16_t    numd;  // CDW10[27:16]
     uint32_t    cdw11;
     uint32_t    cdw12;
@@ -569,6 +947,320 @@ typedef struct DeviceInternalStatusData {
     uint8_t     StatusData;
 } DeviceInternalStatusData;
 
+typedef struct NvmeNandLog {
+    uint64_t    host_pages_written;
+    uint64_t    nand_pages_written;
+    uint64_t    gc_pages_moved;
+    uint64_t    gc_blocks_erased;
+    uint64_t    total_erase_count;
+    uint64_t    free_blocks;
+    uint32_t    waf_milli;   // write amplification factor x 1000
+    uint32_t    max_erase_count;
+    uint64_t    map_cache_misses;
+    uint8_t     rsvd64[448];
+} NvmeNandLog;
+
+typedef struct NvmePlacementLogEntry {
+    uint64_t    host_bytes_written;
+    uint64_t    media_bytes_written;  // including GC relocations
+    uint8_t     rsvd16[16];
+} NvmePlacementLogEntry;
+
+// one entry per placement handle, unused handles read as zero
+typedef struct NvmePlacementLog {
+    NvmePlacementLogEntry   handle[16];
+} NvmePlacementLog;
+
+enum NvmeFdpAttributes {
+    NVME_FDPA_RGIF_MASK = 0xf,
+    NVME_FDPA_VWC       = 1 << 6,
+    NVME_FDPA_VALID     = 1 << 7,
+};
+
+typedef struct NvmeFdpConfsHdr {
+    uint16_t    numfdpc;    // 0's based
+    uint8_t     version;
+    uint8_t     rsvd3;
+    uint32_t    sze;
+    uint8_t     rsvd8[8];
+} NvmeFdpConfsHdr;
+
+typedef struct NvmeFdpDescrHdr {
+    uint16_t    dsze;
+    uint8_t     fdpa;
+    uint8_t     vss;
+    uint32_t    nrg;
+    uint16_t    nruh;
+    uint16_t    maxpids;
+    uint32_t    nnss;
+    uint64_t    runs;
+    uint32_t    erutl;
+    uint8_t     rsvd28[36];
+} NvmeFdpDescrHdr;
+
+enum NvmeRuhType {
+    NVME_RUHT_INITIALLY_ISOLATED    = 1,
+    NVME_RUHT_PERSISTENTLY_ISOLATED = 2,
+};
+
+typedef struct NvmeRuhDescr {
+    uint8_t     ruht;
+    uint8_t     rsvd1[3];
+} NvmeRuhDescr;
+
+enum NvmeRuhAttributes {
+    NVME_RUHA_UNUSED    = 0,
+    NVME_RUHA_HOST      = 1,
+    NVME_RUHA_CTRL      = 2,
+};
+
+typedef struct NvmeRuhuLogHdr {
+    uint16_t    nruh;
+    uint8_t     rsvd2[6];
+} NvmeRuhuLogHdr;
+
+typedef struct NvmeRuhuDescr {
+    uint8_t     ruha;
+    uint8_t     rsvd1[7];
+} NvmeRuhuDescr;
+
+typedef struct NvmeFdpStatsLog {
+    uint64_t    hbmw[2];
+    uint64_t    mbmw[2];
+    uint64_t    mbe[2];
+    uint8_t     rsvd48[16];
+} NvmeFdpStatsLog;
+
+/* Predictable Latency Per NVM Set log page (0Ah) */
+typedef struct NvmePlmLog {
+    uint8_t     status;     /* the window the set is in, 0 if PLM is off */
+    uint8_t     rsvd1;
+    uint16_t    evt;        /* Event Type */
+    uint8_t     rsvd4[28];
+    uint64_t    dtwinrt;    /* DTWIN Reads Typical, 4 KiB reads */
+    uint64_t    dtwinwt;    /* DTWIN Writes Typical, Optimal Write Size units */
+    uint64_t    dtwintm;    /* DTWIN Time Maximum, ms */
+    uint64_t    ndwintmh;   /* NDWIN Time Minimum High, ms */
+    uint64_t    ndwintml;   /* NDWIN Time Minimum Low, ms */
+    uint8_t     rsvd72[56];
+    uint64_t    dtwinre;    /* DTWIN Reads Estimate */
+    uint64_t    dtwinwe;    /* DTWIN Writes Estimate */
+    uint64_t    dtwinte;    /* DTWIN Time Estimate */
+    uint8_t     rsvd152[360];
+} NvmePlmLog;
+
+/* Format NVM, CDW10 */
+#define NVME_FORMAT_LBAF(dw10)  ((dw10) & 0xf)
+#define NVME_FORMAT_MSET(dw10)  (((dw10) >> 4) & 0x1)
+#define NVME_FORMAT_PI(dw10)    (((dw10) >> 5) & 0x7)
+#define NVME_FORMAT_PIL(dw10)   (((dw10) >> 8) & 0x1)
+#define NVME_FORMAT_SES(dw10)   (((dw10) >> 9) & 0x7)
+
+enum NvmeFormatSes {
+    NVME_FORMAT_SES_NONE        = 0,
+    NVME_FORMAT_SES_USER_DATA   = 1,
+    NVME_FORMAT_SES_CRYPTO      = 2,
+};
+
+/* Sanitize, CDW10; CDW11 is the Overwrite Pattern */
+#define NVME_SANITIZE_SANACT(dw10)  ((dw10) & 0x7)
+#define NVME_SANITIZE_AUSE(dw10)    (((dw10) >> 3) & 0x1)
+#define NVME_SANITIZE_OWPASS(dw10)  (((dw10) >> 4) & 0xf)
+#define NVME_SANITIZE_OIPBP(dw10)   (((dw10) >> 8) & 0x1)
+#define NVME_SANITIZE_NDAS(dw10)    (((dw10) >> 9) & 0x1)
+
+enum NvmeSanitizeAction {
+    NVME_SANACT_EXIT_FAILURE    = 1,
+    NVME_SANACT_BLOCK_ERASE     = 2,
+    NVME_SANACT_OVERWRITE       = 3,
+    NVME_SANACT_CRYPTO_ERASE    = 4,
+};
+
+/* Sanitize Status log page (81h) */
+typedef struct NvmeSanitizeLog {
+    uint16_t    sprog;      /* Sanitize Progress, in 1/65536 */
+    uint16_t    sstat;      /* Sanitize Status */
+    uint32_t    scdw10;     /* CDW10 of the most recent Sanitize */
+    uint32_t    eto;        /* Estimated Time For Overwrite, seconds */
+    uint32_t    etbe;       /* Estimated Time For Block Erase */
+    uint32_t    etce;       /* Estimated Time For Crypto Erase */
+    uint32_t    etond;      /* the same with No-Deallocate After Sanitize */
+    uint32_t    etbend;
+    uint32_t    etcend;
+    uint8_t     rsvd32[480];
+} NvmeSanitizeLog;
+
+enum NvmeSanitizeStatus {
+    NVME_SSTAT_NEVER            = 0,
+    NVME_SSTAT_DONE             = 1,
+    NVME_SSTAT_IN_PROGRESS      = 2,
+    NVME_SSTAT_FAILED           = 3,
+    NVME_SSTAT_DONE_NDI         = 4,
+    NVME_SSTAT_STATUS_MASK      = 0x7,
+    NVME_SSTAT_OWPASS_SHIFT     = 3,
+    NVME_SSTAT_GDE              = 1 << 8,   /* Global Data Erased */
+};
+
+/* Device Self-test, CDW10 */
+#define NVME_DST_STC(dw10)  ((dw10) & 0xf)
+
+enum NvmeDstCode {
+    NVME_DST_SHORT      = 0x1,
+    NVME_DST_EXTENDED   = 0x2,
+    NVME_DST_ABORT      = 0xf,
+};
+
+enum NvmeDstResult {
+    NVME_DST_RES_OK             = 0x0,
+    NVME_DST_RES_ABORT_CMD      = 0x1,
+    NVME_DST_RES_ABORT_RESET    = 0x2,
+    NVME_DST_RES_ABORT_NS       = 0x3,
+    NVME_DST_RES_ABORT_FORMAT   = 0x4,
+    NVME_DST_RES_FATAL          = 0x5,
+    NVME_DST_RES_SEG_FAIL_UNK   = 0x6,
+    NVME_DST_RES_SEG_FAIL       = 0x7,
+    NVME_DST_RES_ABORT_UNK      = 0x8,
+    NVME_DST_RES_ABORT_SANITIZE = 0x9,
+    NVME_DST_RES_UNUSED         = 0xf,
+};
+
+enum NvmeDstValidDiag {
+    NVME_DST_VDI_NSID   = 1 << 0,
+    NVME_DST_VDI_FLBA   = 1 << 1,
+    NVME_DST_VDI_SCT    = 1 << 2,
+    NVME_DST_VDI_SC     = 1 << 3,
+};
+
+typedef struct QEMU_PACKED NvmeSelfTestResult {
+    uint8_t     dsts;       /* Self-test Code in 7:4, Result in 3:0 */
+    uint8_t     seg;        /* Segment Number of the failure */
+    uint8_t     vdi;        /* Valid Diagnostic Information */
+    uint8_t     rsvd3;
+    uint64_t    poh;        /* Power On Hours */
+    uint32_t    nsid;
+    uint64_t    flba;       /* Failing LBA */
+    uint8_t     sct;
+    uint8_t     sc;
+    uint8_t     vs[2];
+} NvmeSelfTestResult;
+
+#define NVME_DST_NUM_RESULTS    20
+
+/* Device Self-test log page (06h) */
+typedef struct NvmeSelfTestLog {
+    uint8_t     csto;       /* Current Device Self-Test Operation */
+    uint8_t     cstc;       /* Current Device Self-Test Completion, percent */
+    uint8_t     rsvd2[2];
+    NvmeSelfTestResult result[NVME_DST_NUM_RESULTS];  /* newest first */
+} NvmeSelfTestLog;
+
+enum NvmeCmic {
+    NVME_CMIC_MULTI_PORT    = 1 << 0,
+    NVME_CMIC_MULTI_CTRL    = 1 << 1,
+    NVME_CMIC_ANA           = 1 << 3,
+};
+
+enum NvmeAnaState {
+    NVME_ANA_OPTIMIZED          = 0x1,
+    NVME_ANA_NON_OPTIMIZED      = 0x2,
+    NVME_ANA_INACCESSIBLE       = 0x3,
+    NVME_ANA_PERSISTENT_LOSS    = 0x4,
+    NVME_ANA_CHANGE             = 0xf,
+};
+
+#define NVME_CHANGED_NSLIST_MAX 1024
+
+typedef struct NvmeChangedNsList {
+    uint32_t    nsid[NVME_CHANGED_NSLIST_MAX];
+} NvmeChangedNsList;
+
+typedef struct NvmeAnaLogHdr {
+    uint64_t    chgcnt;
+    uint16_t    ngrps;
+    uint8_t     rsvd10[6];
+} NvmeAnaLogHdr;
+
+typedef struct NvmeAnaGroupDescr {
+    uint32_t    grpid;
+    uint32_t    nnsids;
+    uint64_t    chgcnt;
+    uint8_t     state;
+    uint8_t     rsvd17[15];
+    uint32_t    nsids[];
+} NvmeAnaGroupDescr;
+
+enum NvmeVirtMngmtAction {
+    NVME_VIRT_MNGMT_ACTION_PRM_ALLOC    = 0x1,
+    NVME_VIRT_MNGMT_ACTION_SEC_OFFLINE  = 0x7,
+    NVME_VIRT_MNGMT_ACTION_SEC_ASSIGN   = 0x8,
+    NVME_VIRT_MNGMT_ACTION_SEC_ONLINE   = 0x9,
+};
+
+enum NvmeVirtResourceType {
+    NVME_VIRT_RES_QUEUE     = 0x0,
+    NVME_VIRT_RES_INTERRUPT = 0x1,
+};
+
+enum NvmePriCtrlCapCrt {
+    NVME_CRT_VQ = 1 << 0,
+    NVME_CRT_VI = 1 << 1,
+};
+
+typedef struct NvmePriCtrlCap {
+    uint16_t    cntlid;
+    uint16_t    portid;
+    uint8_t     crt;
+    uint8_t     rsvd5[27];
+    uint32_t    vqfrt;
+    uint32_t    vqrfa;
+    uint16_t    vqrfap;
+    uint16_t    vqprt;
+    uint16_t    vqfrsm;
+    uint16_t    vqgran;
+    uint8_t     rsvd48[16];
+    uint32_t    vifrt;
+    uint32_t    virfa;
+    uint16_t    virfap;
+    uint16_t    viprt;
+    uint16_t    vifrsm;
+    uint16_t    vigran;
+    uint8_t     rsvd80[4016];
+} NvmePriCtrlCap;
+
+typedef struct NvmeSecCtrlEntry {
+    uint16_t    scid;
+    uint16_t    pcid;
+    uint8_t     scs;
+    uint8_t     rsvd5[3];
+    uint16_t    vfn;
+    uint16_t    nvq;
+    uint16_t    nvi;
+    uint8_t     rsvd14[18];
+} NvmeSecCtrlEntry;
+
+typedef struct NvmeSecCtrlList {
+    uint8_t             numcntl;
+    uint8_t             rsvd1[31];
+    NvmeSecCtrlEntry    sec[127];
+} NvmeSecCtrlList;
+
+typedef struct NvmeNvmSetAttr {
+    uint16_t    nvmsetid;
+    uint16_t    endgid;
+    uint8_t     rsvd4[4];
+    uint32_t    rr4kt;      /* Random 4 KiB Read Typical, in 100 ns units */
+    uint32_t    ows;        /* Optimal Write Size, in bytes */
+    uint64_t    tnvmsetcap[2];
+    uint64_t    unvmsetcap[2];
+    uint8_t     rsvd48[80];
+} NvmeNvmSetAttr;
+
+typedef struct NvmeNvmSetList {
+    uint8_t         nid;
+    uint8_t         rsvd1[127];
+    NvmeNvmSetAttr  entry[31];
+} NvmeNvmSetList;
+
 enum NvmeSmartWarn {
     NVME_SMART_SPARE                  = 1 << 0,
     NVME_SMART_TEMPERATURE            = 1 << 1,
@@ -581,9 +1273,20 @@ enum LogIdentifier {
     NVME_LOG_ERROR_INFO     = 0x01,
     NVME_LOG_SMART_INFO     = 0x02,
     NVME_LOG_FW_SLOT_INFO   = 0x03,
+    NVME_LOG_CHANGED_NSLIST = 0x04,
     NVME_LOG_CSE_INFO       = 0x05,
+    NVME_LOG_SELF_TEST      = 0x06,
     NVME_LOG_TELEMETRY_HOST = 0x07,
     NVME_LOG_TELEMETRY_CTLR = 0x08,
+    NVME_LOG_PLM_PER_SET    = 0x0A,
+    NVME_LOG_PLM_EVENT_AGG  = 0x0B,
+    NVME_LOG_ANA            = 0x0C,
+    NVME_LOG_FDP_CONFS      = 0x20,
+    NVME_LOG_FDP_RUH_USAGE  = 0x21,
+    NVME_LOG_FDP_STATS      = 0x22,
+    NVME_LOG_SANITIZE       = 0x81,
+    NVME_LOG_VENDOR_NAND    = 0xC0,
+    NVME_LOG_VENDOR_PLACEMENT = 0xC1,
 };
 
 typedef struct NvmePSD {
@@ -633,7 +1336,8 @@ typedef struct NvmeIdCtrl {
     uint32_t    rtd3r;
     uint32_t    rtd3e;
     uint32_t    oaes;
-    uint8_t     rsvd239[144];
+    uint32_t    ctratt;
+    uint8_t     rsvd100[140];
     uint8_t     rsvd255[16];
     uint16_t    oacs;
     uint8_t     acl;
@@ -652,7 +1356,24 @@ typedef struct NvmeIdCtrl {
     uint64_t    tnvmcap[2];
     uint64_t    unvmcap[2];
     uint32_t    rpmbs;
-    uint8_t     rsvd511[196];
+    uint16_t    edstt;
+    uint8_t     dsto;
+    uint8_t     fwug;
+    uint16_t    kas;
+    uint16_t    hctma;
+    uint16_t    mntmt;
+    uint16_t    mxtmt;
+    uint32_t    sanicap;
+    uint32_t    hmminds;
+    uint16_t    hmmaxd;
+    uint16_t    nsetidmax;
+    uint16_t    endgidmax;
+    uint8_t     anatt;
+    uint8_t     anacap;
+    uint32_t    anagrpmax;
+    uint32_t    nanagrpid;
+    uint32_t    pels;
+    uint8_t     rsvd511[156];
     uint8_t     sqes;
     uint8_t     cqes;
     uint16_t    rsvd515;
@@ -666,10 +1387,13 @@ typedef struct NvmeIdCtrl {
     uint8_t     nvscc;
     uint8_t     rsvd531;
     uint16_t    acwu;
-    uint8_t     rsvd535[2];
+    uint16_t    ocfs;
     uint32_t    sgls;
-    uint8_t     rsvd703[164];
-    uint8_t     rsvd2047[1344];
+    uint32_t    mnan;
+    uint8_t     rsvd703[160];
+    uint8_t     rsvd767[64];
+    uint8_t     subnqn[256];
+    uint8_t     rsvd2047[1024];
     NvmePSD     psd[32];
     uint8_t     vs[1024];
 } NvmeIdCtrl;
@@ -678,6 +1402,22 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_SECURITY  = 1 << 0,
     NVME_OACS_FORMAT    = 1 << 1,
     NVME_OACS_FW        = 1 << 2,
+    NVME_OACS_SELF_TEST = 1 << 4,
+    NVME_OACS_DIRECTIVES = 1 << 5,
+    NVME_OACS_VIRT_MGMT = 1 << 7,
+};
+
+enum NvmeIdCtrlSanicap {
+    NVME_SANICAP_CES    = 1 << 0,   /* Crypto Erase */
+    NVME_SANICAP_BES    = 1 << 1,   /* Block Erase */
+    NVME_SANICAP_OWS    = 1 << 2,   /* Overwrite */
+};
+
+enum NvmeIdCtrlCtratt {
+    NVME_CTRATT_NVMSETS = 1 << 2,
+    NVME_CTRATT_ENDGRPS = 1 << 4,
+    NVME_CTRATT_PLM     = 1 << 5,
+    NVME_CTRATT_FDPS    = 1 << 19,
 };
 
 enum NvmeIdCtrlLpa {
@@ -695,6 +1435,15 @@ enum NvmeIdCtrlOncs {
     NVME_ONCS_FEATURES      = 1 << 4,
     NVME_ONCS_RESRVATIONS   = 1 << 5,
     NVME_ONCS_TIMESTAMP     = 1 << 6,
+    NVME_ONCS_COPY          = 1 << 8,
+};
+
+enum NvmeIdCtrlFuses {
+    NVME_FUSES_COMPARE_WRITE = 1 << 0,
+};
+
+enum NvmeIdCtrlOcfs {
+    NVME_OCFS_COPY_FMT_0    = 1 << 0,
 };
 
 #define NVME_CTRL_SQES_MIN(sqes) ((sqes) & 0xf)
@@ -736,10 +1485,62 @@ enum NvmeFeatureIds {
     NVME_INTERRUPT_VECTOR_CONF      = 0x9,
     NVME_WRITE_ATOMICITY            = 0xa,
     NVME_ASYNCHRONOUS_EVENT_CONF    = 0xb,
+    NVME_HOST_MEMORY_BUFFER         = 0xd,
     NVME_TIMESTAMP                  = 0xe,
+    NVME_PLM_CONFIG                 = 0x13,
+    NVME_PLM_WINDOW                 = 0x14,
+    NVME_FDP_MODE                   = 0x1d,
     NVME_SOFTWARE_PROGRESS_MARKER   = 0x80
 };
 
+enum NvmeHmbFlags {
+    NVME_HMB_EHM    = 1 << 0,   /* Enable Host Memory */
+    NVME_HMB_MR     = 1 << 1,   /* Memory Return */
+};
+
+typedef struct NvmeHmbDescr {
+    uint64_t    badd;
+    uint32_t    bsize;      /* in memory page size units */
+    uint32_t    rsvd12;
+} NvmeHmbDescr;
+
+typedef struct NvmeHmbAttr {
+    uint32_t    hsize;
+    uint32_t    hmdlal;
+    uint32_t    hmdlau;
+    uint32_t    hmdlec;
+    uint8_t     rsvd16[4080];
+} NvmeHmbAttr;
+
+/* Predictable Latency Mode Config (13h) data */
+typedef struct NvmePlmConfig {
+    uint16_t    ee;         /* Enable Event, NvmePlmEvents */
+    uint8_t     rsvd2[30];
+    uint64_t    dtwinrt;    /* DTWIN Reads Threshold */
+    uint64_t    dtwinwt;    /* DTWIN Writes Threshold */
+    uint64_t    dtwintt;    /* DTWIN Time Threshold */
+    uint8_t     rsvd56[456];
+} NvmePlmConfig;
+
+#define NVME_PLM_NVMSETID(dw11) ((dw11) & 0xffff)
+#define NVME_PLM_LPE(dw12)      ((dw12) & 0x1)
+#define NVME_PLM_WSS(dw12)      ((dw12) & 0x7)
+
+/* Window Select of feature 14h, and the Status of log page 0Ah */
+enum NvmePlmWindow {
+    NVME_PLM_WINDOW_DTWIN   = 1,
+    NVME_PLM_WINDOW_NDWIN   = 2,
+};
+
+/* Enable Event of feature 13h, and the Event Type of log page 0Ah */
+enum NvmePlmEvents {
+    NVME_PLM_EVT_DTWIN_READS    = 1 << 0,   /* estimates fell below */
+    NVME_PLM_EVT_DTWIN_WRITES   = 1 << 1,   /* the host's thresholds */
+    NVME_PLM_EVT_DTWIN_TIME     = 1 << 2,
+    NVME_PLM_EVT_EXCEEDED       = 1 << 14,  /* autonomous transitions */
+    NVME_PLM_EVT_EXCURSION      = 1 << 15,  /* to the NDWIN */
+};
+
 typedef struct NvmeRangeType {
     uint8_t     type;
     uint8_t     attributes;
@@ -756,6 +1557,14 @@ typedef struct NvmeLBAF {
     uint8_t     rp;
 } NvmeLBAF;
 
+/* Relative Performance of an LBA format */
+enum NvmeLbafRp {
+    NVME_LBAF_RP_BEST       = 0,
+    NVME_LBAF_RP_BETTER     = 1,
+    NVME_LBAF_RP_GOOD       = 2,
+    NVME_LBAF_RP_DEGRADED   = 3,
+};
+
 typedef struct NvmeIdNs {
     uint64_t    nsze;
     uint64_t    ncap;
@@ -778,7 +1587,20 @@ typedef struct NvmeIdNs {
     uint16_t    nabspf;
     uint8_t     rsvd47[2];
     uint64_t    nvmcap[2];
-    uint8_t     rsvd103[40];
+    uint16_t    npwg;
+    uint16_t    npwa;
+    uint16_t    npdg;
+    uint16_t    npda;
+    uint16_t    nows;
+    uint16_t    mssrl;
+    uint32_t    mcl;
+    uint8_t     msrc;
+    uint8_t     rsvd81[11];
+    uint32_t    anagrpid;
+    uint8_t     rsvd98[3];
+    uint8_t     nsattr;
+    uint16_t    nvmsetid;
+    uint16_t    endgid;
     uint8_t     nguid[16];
     uint8_t     eui64[8];
     NvmeLBAF    lbaf[16];
@@ -798,6 +1620,30 @@ typedef struct NvmeIdNs {
 #define NVME_ID_NS_DPC_TYPE_1(dpc)          ((dpc & 0x1))
 #define NVME_ID_NS_DPC_TYPE_MASK            0x7
 
+typedef struct NvmeZoneLBAF {
+    uint64_t    zsze;
+    uint8_t     zdes;
+    uint8_t     rsvd9[7];
+} NvmeZoneLBAF;
+
+typedef struct NvmeIdNsZoned {
+    uint16_t    zoc;
+    uint16_t    ozcs;
+    uint32_t    mar;
+    uint32_t    mor;
+    uint32_t    rrl;
+    uint32_t    frl;
+    uint8_t     rsvd20[2796];
+    NvmeZoneLBAF lbafe[16];
+    uint8_t     rsvd3072[768];
+    uint8_t     vs[256];
+} NvmeIdNsZoned;
+
+typedef struct NvmeIdCtrlZoned {
+    uint8_t     zasl;
+    uint8_t     rsvd1[4095];
+} NvmeIdCtrlZoned;
+
 enum NvmeIdNsDps {
     DPS_TYPE_NONE   = 0,
     DPS_TYPE_1      = 1,
@@ -807,6 +1653,31 @@ enum NvmeIdNsDps {
     DPS_FIRST_EIGHT = 8,
 };
 
+enum NvmeIdNsNsfeat {
+    NVME_ID_NS_NSFEAT_THIN_PROV = 1 << 0,
+    NVME_ID_NS_NSFEAT_NSABP     = 1 << 1,
+};
+
+enum NvmeIdNsMc {
+    NVME_ID_NS_MC_EXTENDED_LBA  = 1 << 0,
+    NVME_ID_NS_MC_SEPARATE_MD   = 1 << 1,
+};
+
+enum NvmeIdNsDpc {
+    NVME_ID_NS_DPC_PI_TYPE_1    = 1 << 0,
+    NVME_ID_NS_DPC_PI_TYPE_2    = 1 << 1,
+    NVME_ID_NS_DPC_PI_TYPE_3    = 1 << 2,
+    NVME_ID_NS_DPC_PI_FIRST     = 1 << 3,
+    NVME_ID_NS_DPC_PI_LAST      = 1 << 4,
+};
+
+/* Protection Information, in the first or last 8 bytes of the metadata */
+typedef struct NvmeDifTuple {
+    uint16_t    guard;      /* CRC16 T10-DIF, big endian like the tags */
+    uint16_t    apptag;
+    uint32_t    reftag;
+} NvmeDifTuple;
+
 #define NVME_CED_SZ_BYTE (4096)
 #define NVME_CED_NUM_ADM_CMD (256)
 #define NVME_CED_NUM_IO_CMD (256)
@@ -839,7 +1710,7 @@ enum NvmeCedMask {
 #define NVME_CED_SET_NIC   (1 << NVME_CED_NIC_SHIFT)
 #define NVME_CED_SET_CCC   (1 << NVME_CED_CCC_SHIFT)
 #define NVME_CED_SET_CSE_LIMIT_SAME_NS  (NVME_CSD_CSE_LIMIT_SAME_NS << NVME_CED_CSE_SHIFT)
-#define NVME_CED_SET_CSE_LIMIT_ALL_NS   (NVME_CSD_CSE_LIMIT_ALL_NS << NVME_CED_NCC_SHIFT)
+#define NVME_CED_SET_CSE_LIMIT_ALL_NS   (NVME_CSD_CSE_LIMIT_ALL_NS << NVME_CED_CSE_SHIFT)
 
 typedef struct NvmeSecurityRecvCmd {
     uint8_t     opcode;
@@ -863,9 +1734,25 @@ typedef struct NvmeSecurityRecvCmd {
 
 static inline void _nvme_check_size(void)
 {
+    QEMU_BUILD_BUG_ON(offsetof(NvmeBar, pmrcap) != 0xe00);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeHmbDescr) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeChangedNsList) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeDifTuple) != 8);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeAnaLogHdr) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeAnaGroupDescr) != 32);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, anagrpmax) != 344);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, subnqn) != 768);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, ocfs) != 534);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdNs, mcl) != 76);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdNs, anagrpid) != 92);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeHmbAttr) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmePriCtrlCap) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSecCtrlEntry) != 32);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSecCtrlList) != 4096);
     QEMU_BUILD_BUG_ON(sizeof(NvmeAerResult) != 4);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCqe) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDsmRange) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCopySourceRange) != 32);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCmd) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeGetLogPageCmd) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDeleteQ) != 64);
@@ -874,13 +1761,41 @@ static inline void _nvme_check_size(void)
     QEMU_BUILD_BUG_ON(sizeof(NvmeIdentify) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeRwCmd) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDsmCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeCopyCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneSendCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneRecvCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneDescr) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeZoneReportHdr) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeRangeType) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeErrorLog) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeFwSlotInfoLog) != 512);
     QEMU_BUILD_BUG_ON(sizeof(NvmeSmartLog) != 512);
     QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrl) != 4096);
     QEMU_BUILD_BUG_ON(sizeof(NvmeIdNs) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdNsZoned) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeIdCtrlZoned) != 4096);
     QEMU_BUILD_BUG_ON(sizeof(NvmePSD) != 32);
     QEMU_BUILD_BUG_ON(sizeof(NvmeTelemetryLogHeader) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeNandLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmePlacementLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeDirectiveIdentify) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeStreamsParams) != 32);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeFdpConfsHdr) != 16);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeFdpDescrHdr) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeRuhDescr) != 4);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeRuhuLogHdr) != 8);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeRuhuDescr) != 8);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeFdpStatsLog) != 64);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, ctratt) != 96);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, nsetidmax) != 338);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdNs, nvmsetid) != 100);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeNvmSetAttr) != 128);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeNvmSetList) != 4096);
+    QEMU_BUILD_BUG_ON(sizeof(NvmePlmConfig) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmePlmLog) != 512);
+    QEMU_BUILD_BUG_ON(offsetof(NvmeIdCtrl, sanicap) != 328);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSanitizeLog) != 512);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSelfTestResult) != 28);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSelfTestLog) != 564);
 }
 #endif